@@ -0,0 +1,177 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#ifndef MOOON_NET_ASYNC_HTTP_H
+#define MOOON_NET_ASYNC_HTTP_H
+#include "mooon/net/epoller.h"
+#include <functional>
+#include <set>
+#include <vector>
+#if MOOON_HAVE_CURL==1
+NET_NAMESPACE_BEGIN
+
+/***
+  * 异步HTTP请求
+  */
+struct AsyncHttpRequest
+{
+    std::string url;
+    std::string method;                // 为空时，有body则为POST，否则为GET
+    std::vector<std::string> headers;  // 如“Content-Type: application/json”
+    std::string body;
+    uint32_t timeout_milliseconds;     // 整个请求的超时，为0表示使用CAsyncHttpClient的默认值
+
+    AsyncHttpRequest(): timeout_milliseconds(0) {}
+};
+
+/***
+  * 异步HTTP响应
+  */
+struct AsyncHttpResponse
+{
+    int errcode;           // CURLcode，为0表示成功，非0时response_code无效
+    std::string errmsg;
+    int response_code;     // HTTP状态码，如200
+    std::string header;
+    std::string body;
+    uint32_t elapsed_milliseconds; // 从提交到完成的毫秒数，含排队时间
+    void* user_data;       // 提交时指定的用户数据
+
+    AsyncHttpResponse(): errcode(0), response_code(0), elapsed_milliseconds(0), user_data(NULL) {}
+};
+
+// 请求完成时在run_once()中被回调，可在回调中提交新的请求
+typedef std::function<void (AsyncHttpResponse& response)> AsyncHttpCallback;
+
+class CCurlSocket;
+struct AsyncHttpTransfer;
+
+/***
+  * 基于curl multi接口的异步HTTP客户端，curl的SOCKET注册在一个CEpoller中，
+  * 一个线程即可同时进行上万个请求：
+  * 1) 所有请求共享multi句柄的连接缓存和DNS缓存，完成的连接被后续请求复用；
+  * 2) libcurl支持HTTP/2时，https请求协商使用HTTP/2，并等待已有连接确认是否可多路复用（CURLOPT_PIPEWAIT），
+  *    同一主机的大量请求复用少量连接，每个连接上同时有多个流；
+  * 3) easy句柄在请求完成后被回收复用。
+  *
+  * 非线程安全，所有方法须在同一线程中调用，
+  * 使用前须在创建线程之前调用一次sys::CCurlWrapper::global_init()。
+  *
+  * 使用示例：
+  * net::CAsyncHttpClient client;
+  * client.set_max_host_connections(64);
+  * client.create(10000);
+  * client.async_get("http://127.0.0.1/hook", on_response);
+  * while (client.get_request_count() > 0)
+  *     client.run_once(100);
+  */
+class CAsyncHttpClient
+{
+    friend class CCurlSocket;
+
+public:
+    CAsyncHttpClient();
+    ~CAsyncHttpClient();
+
+    /** 以下设置须在create()之前调用 */
+    void set_connect_timeout_milliseconds(uint32_t milliseconds) { _connect_timeout_milliseconds = milliseconds; }
+    void set_timeout_milliseconds(uint32_t milliseconds) { _timeout_milliseconds = milliseconds; }
+
+    /** 同一主机的最大连接数，为0表示不限，超出的请求在curl内部排队，默认为0 */
+    void set_max_host_connections(uint32_t max_host_connections) { _max_host_connections = max_host_connections; }
+
+    /** 所有主机的最大连接数，为0表示不限，默认为0 */
+    void set_max_total_connections(uint32_t max_total_connections) { _max_total_connections = max_total_connections; }
+
+    /** 连接缓存中最多保留的空闲连接数，默认为1024 */
+    void set_max_idle_connections(uint32_t max_idle_connections) { _max_idle_connections = max_idle_connections; }
+
+    /** DNS解析结果的缓存秒数，默认为60 */
+    void set_dns_cache_seconds(uint32_t seconds) { _dns_cache_seconds = seconds; }
+
+    /** 是否启用HTTP/2（libcurl不支持时忽略），默认为true */
+    void enable_http2(bool enabled) { _http2 = enabled; }
+
+    /** 是否不校验服务端证书，相当于curl命令的“-k” */
+    void enable_insecure(bool enabled) { _insecure = enabled; }
+
+    /***
+      * 创建Epoll和curl multi句柄
+      * @epoll_size: 建议性Epoll大小，即预计的并发连接数
+      * @exception: 出错抛出CSyscallException或CException异常
+      */
+    void create(uint32_t epoll_size);
+
+    /** 取消所有未完成的请求，以CURLE_ABORTED_BY_CALLBACK回调 */
+    void destroy();
+
+    /***
+      * 提交一个异步请求，完成（成功、出错或超时）时回调callback，回调总是发生在run_once()中
+      * @user_data: 通过AsyncHttpResponse::user_data传回
+      * @exception: 出错抛出CException异常
+      */
+    void async_request(const AsyncHttpRequest& request, const AsyncHttpCallback& callback, void* user_data=NULL);
+    void async_get(const std::string& url, const AsyncHttpCallback& callback, void* user_data=NULL);
+    void async_post(const std::string& url, const std::string& data, const AsyncHttpCallback& callback, void* user_data=NULL);
+
+    /***
+      * 运行一轮事件循环
+      * @milliseconds: 无事件时最长等待的毫秒数，curl的定时器更早到期时提前返回
+      * @return: 本轮完成的请求个数
+      * @exception: 如果出错，抛出CSyscallException异常
+      */
+    int run_once(uint32_t milliseconds);
+
+    /** 得到未完成的请求个数 */
+    uint32_t get_request_count() const { return static_cast<uint32_t>(_transfers.size()); }
+
+    /** 得到当前打开的SOCKET个数 */
+    uint32_t get_socket_count() const { return _num_sockets; }
+
+private:
+    static int on_socket(void* easy, int fd, int what, void* userp, void* socketp);
+    static int on_timer(void* multi, long timeout_milliseconds, void* userp);
+    void socket_action(int fd, int event_bitmask);
+    void check_completed();
+    void* get_easy();
+    void release_transfer(AsyncHttpTransfer* transfer);
+
+private:
+    uint32_t _connect_timeout_milliseconds;
+    uint32_t _timeout_milliseconds;
+    uint32_t _max_host_connections;
+    uint32_t _max_total_connections;
+    uint32_t _max_idle_connections;
+    uint32_t _dns_cache_seconds;
+    bool _http2;
+    bool _insecure;
+
+private:
+    CEpoller _epoller;
+    void* _multi;
+    std::set<AsyncHttpTransfer*> _transfers; // 未完成的请求
+    std::vector<void*> _idle_easies;     // 回收的easy句柄
+    std::vector<CCurlSocket*> _closed_sockets; // curl已不再使用的SOCKET，在本轮事件处理完后删除
+    int64_t _timer_milliseconds;         // curl定时器到期的时间，为-1表示无定时器
+    uint32_t _num_sockets;
+    int _num_completed; // 本轮run_once()完成的请求个数
+};
+
+NET_NAMESPACE_END
+#endif // MOOON_HAVE_CURL
+#endif // MOOON_NET_ASYNC_HTTP_H
@@ -0,0 +1,160 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#ifndef MOOON_NET_ASYNC_MYSQL_H
+#define MOOON_NET_ASYNC_MYSQL_H
+#include "mooon/net/epoller.h"
+#include "mooon/sys/simple_db.h"
+#include <list>
+#include <map>
+#if MOOON_HAVE_MYSQL==1
+NET_NAMESPACE_BEGIN
+
+/***
+  * 异步查询的错误码，接在CDBConnectionPool的错误码之后，其它为MySQL的错误码
+  */
+enum
+{
+    ASYNC_MYSQL_ERROR_TIMEOUT = 102, // 超过了查询的期限
+    ASYNC_MYSQL_ERROR_CANCELED = 103 // 未完成时CAsyncMySQLClient被销毁
+};
+
+/***
+  * 异步查询的结果
+  */
+struct AsyncMySQLResult
+{
+    int errcode;            // 为0表示成功
+    std::string errmsg;
+    uint64_t affected_rows; // 非查询语句影响的行数
+    uint64_t insert_id;
+    sys::DBTable db_table;  // 查询语句的结果
+    uint32_t elapsed_milliseconds; // 从提交到完成的毫秒数，含排队时间
+
+    AsyncMySQLResult(): errcode(0), affected_rows(0), insert_id(0), elapsed_milliseconds(0) {}
+};
+
+// 查询完成时在run_once()中被回调，可在回调中提交新的查询
+typedef std::function<void (AsyncMySQLResult& result)> AsyncMySQLCallback;
+
+class CAsyncMySQLConnection;
+struct AsyncMySQLQuery;
+
+/***
+  * 基于MySQL非阻塞API（mysql_real_query_start和mysql_real_query_cont等）的异步客户端，
+  * 所有连接的SOCKET注册在一个CEpoller中，一个线程即可同时执行大量查询，
+  * 同一连接上同时只能有一个查询，因此并发数取决于连接数，未能立即执行的查询按提交顺序排队。
+  *
+  * 非线程安全，所有方法须在同一线程中调用。
+  * 非阻塞API由MariaDB的客户端库（Connector/C或MariaDB自带的libmysqlclient）提供，
+  * 使用Oracle MySQL的客户端库时create()抛出错误码为DB_NOT_SUPPORTED的CDBException异常。
+  *
+  * 查询超过期限时立即以ASYNC_MYSQL_ERROR_TIMEOUT回调，如果查询已发送到MySQL，
+  * 则关闭所在连接（MySQL在发现连接断开后才中止查询）并重新建立。
+  *
+  * 使用示例：
+  * net::CAsyncMySQLClient client;
+  * client.set_host("127.0.0.1", 3306);
+  * client.set_user("root", "");
+  * client.set_db_name("test");
+  * client.create(200);
+  * client.async_query(on_result, 500, "SELECT f_name FROM t_user WHERE f_id=%d", 2015);
+  * // 字符串值须先以sys::CMySQLConnection::escape_string()转义
+  * while (client.get_query_count() > 0)
+  *     client.run_once(100);
+  */
+class CAsyncMySQLClient
+{
+    friend class CAsyncMySQLConnection;
+
+public:
+    CAsyncMySQLClient();
+    ~CAsyncMySQLClient();
+
+    /** 以下设置须在create()之前调用，参见DBConnection中的同名方法 */
+    void set_host(const std::string& db_ip, uint16_t db_port) { _db_ip = db_ip; _db_port = db_port; }
+    void set_db_name(const std::string& db_name) { _db_name = db_name; }
+    void set_user(const std::string& db_user, const std::string& db_password) { _db_user = db_user; _db_password = db_password; }
+    void set_charset(const std::string& charset) { _charset = charset; }
+    void set_connect_timeout_seconds(int timeout_seconds) { _connect_timeout_seconds = timeout_seconds; }
+    void set_null_value(const std::string& null_value) { _null_value = null_value; }
+
+    /** 连接断开或建连失败后，再次建连前等待的毫秒数，默认为1000 */
+    void set_reconnect_interval_milliseconds(uint32_t milliseconds) { _reconnect_interval_milliseconds = milliseconds; }
+
+    /***
+      * 创建Epoll，并以非阻塞方式开始建立连接，建连在run_once()中完成
+      * @num_connections: 连接数，也即同时执行的最大查询数
+      * @exception: 出错抛出CSyscallException或CDBException异常
+      */
+    void create(uint32_t num_connections);
+
+    /** 关闭所有连接，未完成的查询以ASYNC_MYSQL_ERROR_CANCELED回调 */
+    void destroy();
+
+    /***
+      * 提交一个异步查询，查询结束（成功、出错或超时）时回调callback，回调总是发生在run_once()中
+      * @timeout_milliseconds: 查询的期限，含排队时间，为0表示不限
+      */
+    void async_query(const AsyncMySQLCallback& callback, uint32_t timeout_milliseconds, const char* format, ...) __attribute__((format(printf, 4, 5)));
+    void async_query(const AsyncMySQLCallback& callback, uint32_t timeout_milliseconds, const std::string& sql);
+
+    /***
+      * 运行一轮事件循环，驱动建连和查询，并处理超时
+      * @milliseconds: 无事件时最长等待的毫秒数，有更早的期限时提前返回
+      * @return: 本轮完成的查询个数
+      * @exception: 如果出错，抛出CSyscallException异常
+      */
+    int run_once(uint32_t milliseconds);
+
+    /** 得到未完成的查询个数，包括排队的和执行中的 */
+    uint32_t get_query_count() const { return _num_queries; }
+
+    /** 得到已建立的连接个数 */
+    uint32_t get_established_count() const;
+
+private:
+    void dispatch(uint64_t now_milliseconds);
+    void expire(uint64_t now_milliseconds);
+    void complete(AsyncMySQLQuery* query, AsyncMySQLResult& result, uint64_t now_milliseconds);
+    uint32_t get_wait_milliseconds(uint32_t milliseconds, uint64_t now_milliseconds) const;
+    void update_events(CAsyncMySQLConnection* connection);
+
+private:
+    std::string _db_ip;
+    uint16_t _db_port;
+    std::string _db_name;
+    std::string _db_user;
+    std::string _db_password;
+    std::string _charset;
+    int _connect_timeout_seconds;
+    std::string _null_value;
+    uint32_t _reconnect_interval_milliseconds;
+
+private:
+    CEpoller _epoller;
+    std::vector<CAsyncMySQLConnection*> _connections;
+    std::map<CEpollable*, CAsyncMySQLConnection*> _epollables; // 用来识别Epoll返回的对象
+    std::list<AsyncMySQLQuery*> _pending_queries; // 等待空闲连接的查询
+    uint32_t _num_queries;
+    int _num_completed; // 本轮run_once()完成的查询个数
+};
+
+NET_NAMESPACE_END
+#endif // MOOON_HAVE_MYSQL
+#endif // MOOON_NET_ASYNC_MYSQL_H
@@ -104,6 +104,57 @@ void set_nonblock(int fd, bool yes);
   */
 void set_nodelay(int fd, bool yes);
 
+/***
+  * 预定义的SOCKET选项组合
+  */
+typedef enum
+{
+    socket_profile_low_latency = 0, /** 低延迟：TCP_NODELAY、TCP_QUICKACK、SO_BUSY_POLL和较小的TCP_NOTSENT_LOWAT */
+    socket_profile_bulk        = 1, /** 大吞吐：保留Nagle算法，收发缓冲区仍由内核自动调整 */
+    socket_profile_long_idle   = 2  /** 长空闲：开启保活探测，并设置TCP_USER_TIMEOUT以及时发现死连接 */
+}socket_profile_t;
+
+/***
+  * SOCKET选项集合，值为-1的选项不设置（保持系统默认值）
+  */
+typedef struct socket_options_t
+{
+    int nodelay;                /** TCP_NODELAY，0或1 */
+    int quickack;               /** TCP_QUICKACK，0或1，注意内核会自动重置它，不是永久生效的 */
+    int busy_poll_microseconds; /** SO_BUSY_POLL，调大需要CAP_NET_ADMIN权限 */
+    int notsent_lowat;          /** TCP_NOTSENT_LOWAT，发送缓冲区中未发送数据的低水位字节数 */
+    // 设置SO_SNDBUF或SO_RCVBUF后，内核不再自动调整该缓冲区（上限为tcp_wmem和tcp_rmem的最大值），
+    // 在高带宽时延积的链路上固定值可能反而更小，只在明确知道带宽时延积时设置
+    int send_buffer_size;       /** SO_SNDBUF */
+    int receive_buffer_size;    /** SO_RCVBUF */
+    int keepalive;              /** SO_KEEPALIVE，0或1 */
+    int keepidle_seconds;       /** TCP_KEEPIDLE */
+    int keepintvl_seconds;      /** TCP_KEEPINTVL */
+    int keepcnt;                /** TCP_KEEPCNT */
+    int user_timeout_milliseconds; /** TCP_USER_TIMEOUT */
+
+    socket_options_t();
+}socket_options_t;
+
+/***
+  * 得到预定义组合对应的选项集合
+  */
+socket_options_t get_socket_profile_options(socket_profile_t profile);
+
+/***
+  * 一次性设置多个SOCKET选项
+  * 内核或权限不支持的选项（ENOPROTOOPT、EOPNOTSUPP和EPERM）被跳过，
+  * 如非TCP的SOCKET不支持TCP_NODELAY，非root用户不能调大SO_BUSY_POLL
+  * @return: 返回被跳过的选项个数
+  * @exception: 如果发生其它错误，则抛出CSyscallException异常
+  */
+int set_socket_options(int fd, const socket_options_t& options);
+
+/***
+  * 设置预定义的选项组合，等同于set_socket_options(fd, get_socket_profile_options(profile))
+  */
+int set_socket_profile(int fd, socket_profile_t profile);
+
 /** 关闭指定的句柄
   */
 void close_fd(int fd) throw ();
@@ -186,6 +237,20 @@ public:
       */
 	void set_nodelay(bool yes);
 
+    /***
+      * 一次性设置多个SOCKET选项，请参见全局函数set_socket_options
+      * @return: 返回被跳过的选项个数
+      * @exception: 如果发生错误，则抛出CSyscallException异常
+      */
+    int set_socket_options(const socket_options_t& options);
+
+    /***
+      * 设置预定义的选项组合，如连接建立后调用set_socket_profile(net::socket_profile_low_latency)
+      * @return: 返回被跳过的选项个数
+      * @exception: 如果发生错误，则抛出CSyscallException异常
+      */
+    int set_socket_profile(socket_profile_t profile);
+
     /** 得到socket错误代码 */
     int get_socket_error_code();
 
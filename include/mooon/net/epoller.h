@@ -96,6 +96,11 @@ public:
       */
     void wakeup();
 
+    /***
+      * 判断是否为CEpoller内部使用的可Epoll对象（如唤醒用的感应器）
+      */
+    bool is_internal(const CEpollable* epollable) const { return epollable == &_sensor; }
+
 private:
     int _epfd;
     CSensor _sensor;
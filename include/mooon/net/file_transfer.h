@@ -0,0 +1,188 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#ifndef MOOON_NET_FILE_TRANSFER_H
+#define MOOON_NET_FILE_TRANSFER_H
+#include "mooon/net/epoller.h"
+#include <list>
+#include <map>
+NET_NAMESPACE_BEGIN
+
+class CFileTransfer;
+
+/***
+  * 文件传输观察者，在事件循环线程中被回调
+  */
+class CALLBACK_INTERFACE IFileTransferObserver
+{
+public:
+    /** 空虚拟析构函数，以屏蔽编译器告警 */
+    virtual ~IFileTransferObserver() {}
+
+    /** 每完成一段传输后被回调，可通过get_transferred()和get_size()得到进度 */
+    virtual void on_progress(CFileTransfer* transfer) {}
+
+    /***
+      * 传输结束时被回调，之后CFileTransferEngine不再引用transfer，可在回调中delete它
+      * @errcode: 为0表示成功，否则为出错的错误码，如ECONNRESET表示对端提前关闭了连接
+      */
+    virtual void on_finish(CFileTransfer* transfer, int errcode) = 0;
+};
+
+/***
+  * 传输方向
+  */
+typedef enum
+{
+    file_transfer_send    = 0, /** 文件到SOCKET，使用sendfile */
+    file_transfer_receive = 1  /** SOCKET到文件，经管道使用splice */
+}file_transfer_direction_t;
+
+/***
+  * 一个非阻塞的文件传输，由CFileTransferEngine驱动，
+  * 不拥有SOCKET和文件句柄，析构时不会关闭它们，
+  * 比CTcpWaiter::full_send_file和CTcpWaiter::full_map_tofile适合大文件和大量并发
+  */
+class CFileTransfer: public CEpollable
+{
+    friend class CFileTransferEngine;
+
+public:
+    /***
+      * @direction: 传输方向
+      * @sock_fd: 已连接的SOCKET句柄，如CTcpWaiter::get_fd()，加入引擎时会被设置为非阻塞
+      * @file_fd: 打开的文件句柄，发送时要求可读，接收时要求可写
+      * @offset: 文件偏移位置
+      * @size: 需要传输的字节数
+      * @rate_limit: 限速（字节/秒），为0表示不限速
+      * @exception: 接收时创建管道出错，则抛出CSyscallException异常
+      */
+    CFileTransfer(file_transfer_direction_t direction, int sock_fd, int file_fd, off_t offset, uint64_t size, uint64_t rate_limit=0);
+    ~CFileTransfer();
+
+    file_transfer_direction_t get_direction() const { return _direction; }
+    int get_file_fd() const { return _file_fd; }
+    off_t get_offset() const { return _offset; }
+    uint64_t get_size() const { return _size; }
+    uint64_t get_transferred() const { return _transferred; }
+    bool is_finished() const { return _finished; }
+    int get_errcode() const { return _errcode; }
+
+    /** 得到或修改限速（字节/秒），为0表示不限速，传输中修改立即生效 */
+    uint64_t get_rate_limit() const { return _rate_limit; }
+    void set_rate_limit(uint64_t rate_limit) { _rate_limit = rate_limit; }
+
+    /** 设置观察者，可以为NULL */
+    void set_observer(IFileTransferObserver* observer) { _observer = observer; }
+
+    /** 用户数据，引擎不使用 */
+    void* get_user_data() const { return _user_data; }
+    void set_user_data(void* user_data) { _user_data = user_data; }
+
+private:
+    virtual epoll_event_t handle_epoll_event(void* input_ptr, uint32_t events, void* ouput_ptr);
+
+    // 得到当前可传输的字节数，受限速影响，返回0表示需要暂停
+    uint64_t get_allowance(uint64_t now_microseconds);
+    // 限速时，得到需要暂停的微秒数
+    uint64_t get_pause_microseconds() const;
+    void consume(uint64_t bytes);
+    void finish(int errcode);
+
+    epoll_event_t do_send(uint64_t allowance);
+    epoll_event_t do_receive(uint64_t allowance);
+
+private:
+    file_transfer_direction_t _direction;
+    int _file_fd;
+    int _pipefd[2]; // 仅接收时使用
+    size_t _pipe_bytes; // 已进入管道但未写入文件的字节数
+    off_t _offset;
+    uint64_t _size;
+    uint64_t _transferred;
+    uint64_t _rate_limit;
+    double _tokens;
+    uint64_t _last_refill_microseconds;
+    uint64_t _resume_microseconds; // 限速暂停后恢复的时间点
+    uint64_t _added_round; // 加入引擎时所在的事件轮次
+    bool _finished;
+    int _errcode;
+    IFileTransferObserver* _observer;
+    void* _user_data;
+};
+
+/***
+  * 文件传输引擎，在一个Epoll循环中同时驱动大量CFileTransfer，
+  * 非线程安全，add、remove和run_once须在同一线程中调用
+  *
+  * 使用示例：
+  * net::CFileTransferEngine engine;
+  * engine.create(10000);
+  * engine.add(new net::CFileTransfer(net::file_transfer_send, waiter.get_fd(), file_fd, 0, file_size, SIZE_10M));
+  * while (engine.get_transfer_count() > 0)
+  *     engine.run_once(1000);
+  */
+class CFileTransferEngine
+{
+public:
+    CFileTransferEngine();
+    ~CFileTransferEngine();
+
+    /***
+      * @epoll_size: 建议性Epoll大小，即预计的并发传输数
+      * @exception: 如果出错，抛出CSyscallException异常
+      */
+    void create(uint32_t epoll_size);
+
+    /** 取消所有未完成的传输，并以ECANCELED回调on_finish */
+    void destroy();
+
+    /***
+      * 加入一个传输，transfer的生命周期由调用者管理，须在on_finish之后才可删除
+      * @exception: 如果出错，抛出CSyscallException异常
+      */
+    void add(CFileTransfer* transfer);
+
+    /** 取消一个未完成的传输，会以ECANCELED回调on_finish */
+    void remove(CFileTransfer* transfer);
+
+    /***
+      * 运行一轮事件循环，处理就绪的传输和到期的限速暂停
+      * @milliseconds: 无事件时最长等待的毫秒数
+      * @return: 本轮处理的传输个数
+      * @exception: 如果出错，抛出CSyscallException异常
+      */
+    int run_once(uint32_t milliseconds);
+
+    /** 得到未完成的传输个数 */
+    uint32_t get_transfer_count() const { return static_cast<uint32_t>(_transfers.size()); }
+
+private:
+    void resume_transfers(uint64_t now_microseconds);
+    void finish_transfer(CFileTransfer* transfer, int errcode);
+    void register_transfer(CFileTransfer* transfer);
+
+private:
+    CEpoller _epoller;
+    std::map<CEpollable*, CFileTransfer*> _transfers; // 以基类指针为键，用来识别Epoll返回的对象
+    std::list<CFileTransfer*> _paused_transfers; // 限速暂停的传输，不在Epoll中
+    uint64_t _round; // 事件轮次，用来识别在回调中新加入、地址和已删除传输相同的传输
+};
+
+NET_NAMESPACE_END
+#endif // MOOON_NET_FILE_TRANSFER_H
@@ -5,6 +5,11 @@
 #include <mooon/net/config.h>
 #include <mooon/utils/scoped_ptr.h>
 #include <librdkafka/rdkafkacpp.h>
+#include <map>
+extern "C" {
+struct rd_kafka_message_s;
+struct rd_kafka_queue_s;
+}
 NET_NAMESPACE_BEGIN
 
 class DefEventImpl;
@@ -25,6 +30,49 @@ struct MessageInfo
     ~MessageInfo();
 };
 
+// 消息视图，不复制消息数据和key，直接指向librdkafka的消息，
+// 只在所属的CKafkaBatch被clear或析构之前有效
+struct KafkaMessageView
+{
+    const char* payload;
+    size_t len;
+    const char* key; // 没有key时为NULL
+    size_t key_len;
+    int32_t partition;
+    int64_t offset;
+    int64_t timestamp;
+};
+
+// 一批消费到的消息，持有librdkafka的消息，clear或析构时释放，
+// 同一个CKafkaBatch可重复用于consume_batch，以复用内部数组，非线程安全
+class CKafkaBatch
+{
+    friend class CKafkaConsumer;
+
+public:
+    CKafkaBatch();
+    ~CKafkaBatch();
+
+    // 释放所有消息，之前取得的KafkaMessageView均失效
+    void clear();
+
+    int size() const { return static_cast<int>(_views.size()); }
+    bool empty() const { return _views.empty(); }
+    const KafkaMessageView& operator [](int index) const { return _views[index]; }
+
+    // 取得本批中各分区待提交的offset（分区内最大offset加一），
+    // 第一个值（first）为分区ID，第二个值（second）为offset
+    void get_commit_offsets(std::map<int32_t, int64_t>* offsets) const;
+
+private:
+    CKafkaBatch(const CKafkaBatch&);
+    CKafkaBatch& operator =(const CKafkaBatch&);
+
+private:
+    std::vector<struct rd_kafka_message_s*> _messages;
+    std::vector<KafkaMessageView> _views;
+};
+
 // 注：一个CKafkaConsumer实例只能消费一个topic，
 // 被消息的topic由init成员函数指定。
 //
@@ -82,6 +130,21 @@ public:
     bool consume(std::string* log, int timeout_ms=1000, struct MessageInfo* mi=NULL, bool* timeout=NULL, bool* empty=NULL);
     int consume_batch(int batch_size, std::vector<std::string>* logs, int timeout_ms=1000, struct MessageInfo* mi=NULL, bool* timeout=NULL, bool* empty=NULL);
 
+    // 零拷贝批量消费，使用librdkafka的队列批量接口，一次调用取得最多batch_size条消息，
+    // 不为消息数据分配内存，消息数据通过batch[i]访问，batch会先被clear。
+    // 出错和分区EOF等事件不放入batch，只记录日志。
+    // 返回batch中的消息数，为0时如果timeout不为NULL，则*timeout表示是否为超时，出错返回-1，batch_size不大于0时直接返回0
+    int consume_batch(int batch_size, CKafkaBatch* batch, int timeout_ms=1000, bool* timeout=NULL);
+
+    // 提交batch中各分区的offset，一般用于enable_auto_commit为false时
+    // 返回RdKafka::ERR_NO_ERROR表示成功，其它出错
+    int sync_commit(const CKafkaBatch& batch);
+    int async_commit(const CKafkaBatch& batch);
+
+    // 提交CKafkaBatch::get_commit_offsets取得的offset，不必持有CKafkaBatch中的消息
+    int sync_commit(const std::map<int32_t, int64_t>& offsets);
+    int async_commit(const std::map<int32_t, int64_t>& offsets);
+
     // 同步阻塞提交
     // 返回RdKafka::ERR_NO_ERROR表示成功，其它出错
     int sync_commit();
@@ -97,6 +160,10 @@ public:
     // 取得所有关联的分区，成功返回值为 0
     int assignment(std::vector<RdKafka::TopicPartition*>* partitions);
 
+    // 暂停和恢复拉取所有关联的分区，暂停期间仍须调用consume以处理再平衡等回调，成功返回值为 0
+    int pause_partitions();
+    int resume_partitions();
+
     // 取得订阅的所有主题，成功返回值为 0
     int subscription(std::vector<std::string>* topics);
 
@@ -112,6 +179,10 @@ public:
     // 取得 brokers 列表
     std::string get_broker_list(std::string* errmsg=NULL) const;
 
+private:
+    int commit_offsets(const std::map<int32_t, int64_t>& offsets, bool async);
+    void destroy_queue();
+
 private:
     int _consumed_mode;
     std::string _brokers_str;
@@ -132,6 +203,7 @@ private:
 
 private:
     std::string _auto_offset_reset;
+    struct rd_kafka_queue_s* _queue; // 零拷贝批量消费使用的消费者队列，在第一次使用时取得
 };
 
 NET_NAMESPACE_END
@@ -0,0 +1,183 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#ifndef MOOON_NET_KAFKA_PARALLEL_CONSUMER_H
+#define MOOON_NET_KAFKA_PARALLEL_CONSUMER_H
+#if MOOON_HAVE_LIBRDKAFKA==1 // 宏MOOON_HAVE_LIBRDKAFKA的值须为1
+#include <mooon/net/kafka_consumer.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+NET_NAMESPACE_BEGIN
+
+// 分区offset跟踪器，非线程安全
+//
+// 记录各分区已分发但未处理完成的offset，
+// 可提交的水位为最小的未完成offset（没有未完成的时为已分发的最大offset加一），
+// 即只提交连续完成的部分，未完成的消息在重启或再平衡后会被重新消费，但已完成的不会被重复提交。
+class CKafkaOffsetTracker
+{
+public:
+    void dispatch(int32_t partition, int64_t offset);
+    void complete(int32_t partition, int64_t offset);
+
+    // 取得各分区可提交的offset（水位），
+    // only_changed为true时只取得上次mark_committed之后有变化的分区
+    void get_commit_offsets(std::map<int32_t, int64_t>* offsets, bool only_changed) const;
+    void mark_committed(const std::map<int32_t, int64_t>& offsets);
+
+    // 未完成的消息总数
+    size_t get_inflight_count() const;
+    void clear();
+
+private:
+    struct PartitionState
+    {
+        std::set<int64_t> inflight; // 已分发未完成的offset
+        int64_t next_offset; // 已分发的最大offset加一
+        int64_t committed; // 最近一次提交的offset
+
+        PartitionState(): next_offset(-1), committed(-1) {}
+        int64_t watermark() const { return inflight.empty()? next_offset: *inflight.begin(); }
+    };
+    std::map<int32_t, PartitionState> _partitions;
+};
+
+// 消息处理器，在工作线程中被回调，
+// 同一分区的消息总是按offset顺序在同一个工作线程中被回调，不同分区的消息可能被并行回调
+class IKafkaMessageHandler
+{
+public:
+    virtual ~IKafkaMessageHandler() {}
+
+    // handle返回（或抛出异常）即认为消息已处理完成，需要重试的由handle自行重试，
+    // message只在handle期间有效
+    virtual void handle(int worker_index, const KafkaMessageView& message) = 0;
+};
+
+// 分区并行的Kafka消费者，
+// 一个拉取线程以批量方式消费，按分区将消息分发到多个工作线程（分区号对工作线程数取模），
+// 以保持分区内的顺序，并定时异步提交各分区连续完成的offset（不使用自动提交）。
+//
+// 再平衡撤销分区时，先等待所有已分发的消息处理完成并同步提交，再释放分区，
+// 这样新的消费者从已完成的位置开始消费，不会重复消费已处理的消息。
+//
+// 使用示例：
+// CKafkaParallelConsumer consumer(&handler);
+// if (consumer.init(brokers, topic, group, 8) && consumer.start())
+// {
+//     ...
+//     consumer.stop();
+//     consumer.wait();
+// }
+class CKafkaParallelConsumer
+{
+    friend class ParallelRebalanceImpl;
+
+public:
+    // handler由调用者负责销毁
+    CKafkaParallelConsumer(IKafkaMessageHandler* handler);
+    ~CKafkaParallelConsumer();
+
+    // 同CKafkaConsumer::set_auto_offset_reset，需在init之前调用
+    void set_auto_offset_reset(const std::string& str);
+
+    // num_workers 工作线程数
+    // batch_size 单次拉取的最大消息数
+    // commit_interval_ms 异步提交的间隔毫秒数
+    // max_inflight 已分发未完成的最大消息数，达到时暂停拉取所有分区，降到一半以下时恢复，
+    //              暂停期间拉取线程仍继续调用consume，以免超过max.poll.interval.ms被踢出消费组
+    bool init(const std::string& brokers, const std::string& topic, const std::string& group,
+              int num_workers, int batch_size=1000, int commit_interval_ms=1000, int max_inflight=100000);
+
+    // 订阅topic并启动拉取线程和工作线程
+    bool start();
+
+    // 通知所有线程退出，wait返回前会处理完已分发的消息并同步提交
+    void stop();
+    void wait();
+
+    // 统计值，可定时取出作为监控指标
+    uint64_t get_consumed_number() const { return _consumed_number; }
+    uint64_t get_handled_number() const { return _handled_number; }
+    uint64_t get_commit_number() const { return _commit_number; }
+    size_t get_inflight_count() const;
+
+private:
+    struct Task
+    {
+        std::shared_ptr<CKafkaBatch> batch; // 本批所有任务均完成后，librdkafka的消息才被释放
+        int index;
+    };
+
+    struct Worker
+    {
+        std::mutex lock;
+        std::condition_variable cond;
+        std::deque<Task> tasks;
+        std::thread thread;
+    };
+
+private:
+    void poll_run();
+    void worker_run(int index);
+    void dispatch(const std::shared_ptr<CKafkaBatch>& batch);
+    void complete(int32_t partition, int64_t offset);
+    // consumer不为空时，直接用它同步提交
+    void commit(bool sync, RdKafka::KafkaConsumer* consumer=NULL);
+    void wait_drained();
+    void flow_control(); // 按未完成的消息数暂停或恢复分区
+
+    // 由再平衡回调在拉取线程中调用
+    void on_assign(RdKafka::KafkaConsumer* consumer, std::vector<RdKafka::TopicPartition*>& partitions);
+    void on_revoke(RdKafka::KafkaConsumer* consumer);
+
+private:
+    IKafkaMessageHandler* _handler;
+    std::string _topic;
+    int _batch_size;
+    int _commit_interval_ms;
+    int _max_inflight;
+    std::string _auto_offset_reset;
+    std::shared_ptr<CKafkaConsumer> _consumer;
+
+private:
+    std::atomic<bool> _stop;
+    std::atomic<bool> _workers_stop; // 拉取线程退出后才通知工作线程退出，保证已分发的消息均被处理
+    std::thread _poll_thread;
+    bool _paused; // 只在拉取线程中访问
+    std::vector<std::shared_ptr<Worker>> _workers;
+
+private:
+    mutable std::mutex _lock; // 保护_tracker
+    std::condition_variable _drained; // 完成消息时通知，退出和再平衡时等待
+    CKafkaOffsetTracker _tracker;
+
+private:
+    std::atomic<uint64_t> _consumed_number;
+    std::atomic<uint64_t> _handled_number;
+    std::atomic<uint64_t> _commit_number;
+};
+
+NET_NAMESPACE_END
+#endif // MOOON_HAVE_LIBRDKAFKA
+#endif // MOOON_NET_KAFKA_PARALLEL_CONSUMER_H
@@ -0,0 +1,74 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+// Kafka的流水线源和目标，配合sys::CPipeline使用，
+// 如：Kafka->Kafka、Kafka->文件、文件->Kafka等
+#ifndef MOOON_NET_KAFKA_PIPELINE_H
+#define MOOON_NET_KAFKA_PIPELINE_H
+#if MOOON_HAVE_LIBRDKAFKA==1 // 宏MOOON_HAVE_LIBRDKAFKA的值须为1
+#include <mooon/net/kafka_consumer.h>
+#include <mooon/net/kafka_producer.h>
+#include <mooon/sys/pipeline.h>
+NET_NAMESPACE_BEGIN
+
+// 以CKafkaConsumer为源，consumer须已init并subscribe_topic，且enable.auto.commit为false，
+// 批次被写出后，按顺序异步提交该批次各分区的offset，实现至少一次（at-least-once），
+// 未确认的批次在停止或崩溃后会被重新消费。
+// 已取出未确认的批次会持有librdkafka的消息，其内存受CPipeline::set_max_inflight限制。
+class CKafkaPipelineSource: public sys::IPipelineSource
+{
+public:
+    // consumer由调用者负责销毁，只能被本对象使用（只在源线程中被调用）
+    CKafkaPipelineSource(CKafkaConsumer* consumer, int timeout_ms=1000);
+
+    virtual int fetch(int max_count, sys::PipelineBatch* batch);
+    virtual void ack(sys::PipelineBatch* batch);
+    virtual void discard(sys::PipelineBatch* batch);
+
+private:
+    CKafkaConsumer* _consumer;
+    int _timeout_ms;
+    CKafkaBatch _kafka_batch; // 复用，消息数据复制到PipelineBatch后即释放
+};
+
+// 以CKafkaProducer为目标，使用零拷贝的produce_batch，
+// 一批消息全部收到成功的递送报告后，write才返回true，源才会提交它们的offset，实现至少一次；
+// 递送失败的消息放回batch->messages，write返回false，由CPipeline按退避重试。
+// 每次write最多等待flush_timeout_ms毫秒的递送报告，超时返回false，下次write继续等待，
+// 因为每批都要等待递送完成，应配置多个目标（各自一个producer）以并行发送。
+class CKafkaPipelineSink: public sys::IPipelineSink
+{
+public:
+    // producer由调用者负责销毁，只能被本对象使用（只在所属的写线程中被调用），
+    // 且须在本对象之前flush，因为未递送的消息引用本对象
+    CKafkaPipelineSink(CKafkaProducer* producer, const std::string& key=std::string(""), int flush_timeout_ms=1000);
+
+    virtual bool write(sys::PipelineBatch* batch);
+    virtual void flush();
+
+private:
+    CKafkaProducer* _producer;
+    std::string _key;
+    int _flush_timeout_ms;
+    uint64_t _sequence; // 正在写的批次
+    KafkaDeliveryTracker _tracker; // 正在写的批次的递送结果
+};
+
+NET_NAMESPACE_END
+#endif // MOOON_HAVE_LIBRDKAFKA
+#endif // MOOON_NET_KAFKA_PIPELINE_H
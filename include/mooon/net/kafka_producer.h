@@ -12,6 +12,28 @@ class DefDeliveryReportImpl;
 class DefEventImpl;
 class DefPartitionerImpl;
 
+// 零拷贝消息缓冲区的释放器，
+// 消息递送成功或失败（如超时）后，在调用timed_poll或flush的线程中被回调，之后librdkafka不再访问buffer，
+// 适用于内存池分配的消息，如将buffer归还给内存池
+class IKafkaBufferReleaser
+{
+public:
+    virtual ~IKafkaBufferReleaser() {}
+    virtual void release(char* buffer, size_t buffer_size, void* user_data) = 0;
+};
+
+// 一组零拷贝消息的递送结果，由produce_batch的tracker参数登记，
+// 在递送报告回调（timed_poll或flush）中更新，须在登记的消息全部递送报告之后才能销毁
+struct KafkaDeliveryTracker
+{
+    int pending; // 未收到递送报告的消息数
+    int failed;  // 递送失败的消息数
+    int errcode; // 最近一次递送失败的错误码
+    std::vector<std::string> failed_logs; // 递送失败的消息，可重新produce
+
+    KafkaDeliveryTracker(): pending(0), failed(0), errcode(0) {}
+};
+
 // 非线程安全
 // 一个CKafkaProducer只能处理一个topic
 class CKafkaProducer
@@ -22,6 +44,8 @@ public:
     // 如果dr_cb为空，则使用DefDeliveryReportImpl作为DeliveryReportCb，每个消息递送成功或失败（如超时）均会调用一次dr_cb，
     // 如果event_cb为空，则使用DefEventImpl作为EventCb，
     // 如果partitioner_cb为空，则使用DefPartitionerImpl作为PartitionerCb。
+    //
+    // dr_cb中看到的msg_opaque为CKafkaProducer内部使用，不能修改它。
     CKafkaProducer(RdKafka::DeliveryReportCb* dr_cb=NULL, RdKafka::EventCb* event_cb=NULL, RdKafka::PartitionerCb* partitioner_cb=NULL);
     bool init(const std::string& brokers_str, const std::string& topic_str, std::string* errmsg=NULL);
 
@@ -46,6 +70,34 @@ public:
     // 返回实际数，为0表示一个也没有
     int produce_batch(const std::string& key, const std::vector<std::string>& logs, int32_t partition=RdKafka::Topic::PARTITION_UA, int* errcode=NULL, std::string* errmsg=NULL);
 
+    // 以下为零拷贝版本，librdkafka直接引用消息数据，不使用RK_MSG_COPY复制，
+    // 消息数据在递送报告回调（dr_cb）之后才被释放，所以：
+    // 1) 须定时调用timed_poll，否则已发送消息的内存不会被释放
+    // 2) 析构前须调用flush等待所有消息递送完成，否则未递送的消息内存不会被释放
+    // key仍会被librdkafka复制，通常它很小。
+
+    // 接管log，成功时log被移走（变为空），失败时log保持原样，可用于重试
+    bool produce(const std::string& key, std::string&& log, int32_t partition=RdKafka::Topic::PARTITION_UA, int* errcode=NULL, std::string* errmsg=NULL);
+
+    // 从logs的头部开始逐个接管，入队成功的从logs中删除，
+    // 出错时停止，logs中余下的为未入队的，如队列满时可在timed_poll后对余下的重试：
+    // while (!logs.empty())
+    // {
+    //     producer.produce_batch(key, &logs, RdKafka::Topic::PARTITION_UA, &errcode);
+    //     if (errcode != RdKafka::ERR__QUEUE_FULL) break;
+    //     producer.timed_poll(100);
+    // }
+    // 返回实际入队数，为0表示一个也没有
+    int produce_batch(const std::string& key, std::vector<std::string>* logs, int32_t partition=RdKafka::Topic::PARTITION_UA, int* errcode=NULL, std::string* errmsg=NULL);
+
+    // 同上，入队的消息登记到tracker，递送报告后更新tracker，失败的消息被移到tracker->failed_logs，
+    // 当tracker->pending为0时，入队的消息都已有递送结果，用于实现至少一次
+    int produce_batch(const std::string& key, std::vector<std::string>* logs, KafkaDeliveryTracker* tracker, int32_t partition=RdKafka::Topic::PARTITION_UA, int* errcode=NULL, std::string* errmsg=NULL);
+
+    // buffer由调用者分配（如来自内存池），成功时递送报告后调用releaser->release(buffer, buffer_size, user_data)，
+    // 失败时不调用releaser，buffer仍由调用者负责
+    bool produce(const std::string& key, char* buffer, size_t buffer_size, IKafkaBufferReleaser* releaser, void* user_data=NULL, int32_t partition=RdKafka::Topic::PARTITION_UA, int* errcode=NULL, std::string* errmsg=NULL);
+
     // librdkafka要求定时调用timed_poll，
     // 否则事件不会被回调，消息会被积压（发送队列满，但因为没调用poll，即使数据已发送出去，然而发送队列的状态值没有改变）。
     // 返回回调的次数（RdKafka::DeliveryCb、RdKafka::EventCb）。
@@ -56,6 +108,11 @@ public:
     // 会触发回调
     int flush(int timeout_ms);
 
+private:
+    // 以不复制方式入队，msg_opaque在递送报告回调中释放
+    RdKafka::ErrorCode produce_nocopy(const std::string& key, const char* data, size_t data_size, int32_t partition, void* msg_opaque);
+    void set_error(RdKafka::ErrorCode errcode_, int* errcode, std::string* errmsg) const;
+
 private:
     std::string _brokers_str;
     std::string _topic_str;
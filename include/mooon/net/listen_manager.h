@@ -19,6 +19,7 @@
 #ifndef MOOON_NET_LISTEN_MANAGER_H
 #define MOOON_NET_LISTEN_MANAGER_H
 #include "mooon/net/ip_address.h"
+#include "mooon/sys/utils.h"
 NET_NAMESPACE_BEGIN
 
 /***
@@ -30,6 +31,8 @@ class CListenManager
 public:
     CListenManager()
         :_listener_count(0)
+        ,_listeners_per_address(1)
+        ,_cpu_steering(false)
         ,_listener_array(NULL)
     {
     }
@@ -52,11 +55,12 @@ public:
     }
 
     /***
-      * 启动在所有IP和端口对上的监听
-      * @exception: 如果出错，则抛出CSyscallException异常
+      * 启动在所有IP和端口对上的监听，再次create前须先destroy
+      * @exception: 如果出错，则抛出CSyscallException异常，已create时错误码为EALREADY
       */
     void create(bool nonblock=true)
     {
+        check_not_created();
         _listener_array = new ListenClass[_ip_port_array.size()];
 
         for (ip_port_pair_array_t::size_type i=0; i<_ip_port_array.size(); ++i)
@@ -74,6 +78,64 @@ public:
         }
     }
 
+    /***
+      * 以SO_REUSEPORT方式在每个IP和端口对上创建listeners_per_address个监听者，
+      * 通常每个反应器（reactor）线程一个，各自在自己的CEpoller中监控，连接由内核分散到各监听者，
+      * 第i个IP和端口对上的第j个监听者为get_listener(i, j)
+      * @listeners_per_address: 每个IP和端口对上的监听者个数，为0时取CPU个数
+      * @nonblock: 是否为非阻塞监听者，非阻塞时配合CListener::accept_all排空accept队列
+      * @cpu_steering: 是否按CPU分发连接，要求第j个反应器线程绑定在第j个CPU上，
+      *                内核不支持时自动退化为内核默认的哈希分发，可通过is_cpu_steering()判断是否生效
+      * @exception: 如果出错，则抛出CSyscallException异常，已create时错误码为EALREADY
+      */
+    void create_reuseport(uint16_t listeners_per_address, bool nonblock=true, bool cpu_steering=false)
+    {
+        check_not_created();
+        const uint16_t cpu_number = sys::CUtils::get_cpu_number();
+        if (0 == listeners_per_address)
+            listeners_per_address = (cpu_number > 0)? cpu_number: 1;
+
+        _listeners_per_address = listeners_per_address;
+        _cpu_steering = cpu_steering;
+        _listener_array = new ListenClass[_ip_port_array.size() * listeners_per_address];
+
+        for (ip_port_pair_array_t::size_type i=0; i<_ip_port_array.size(); ++i)
+        {
+            for (uint16_t j=0; j<listeners_per_address; ++j)
+            {
+                ListenClass& listener = _listener_array[i*listeners_per_address + j];
+
+                try
+                {
+                    listener.listen(_ip_port_array[i].first, _ip_port_array[i].second, nonblock, false, true);
+                    ++_listener_count;
+                }
+                catch (...)
+                {
+                    destroy();
+                    throw;
+                }
+
+                if (_cpu_steering)
+                {
+                    try
+                    {
+                        listener.set_incoming_cpu((cpu_number > 0)? j % cpu_number: j);
+
+                        // 组内所有监听者都加入后再挂载，只需挂载一次
+                        if (j == listeners_per_address-1)
+                            listener.attach_reuseport_cpu_bpf(listeners_per_address);
+                    }
+                    catch (sys::CSyscallException&)
+                    {
+                        // 不支持时退化为内核默认的哈希分发
+                        _cpu_steering = false;
+                    }
+                }
+            }
+        }
+    }
+
     /***
       * 销毁和关闭在所有端口上的监听
       * 不会抛出任何异常
@@ -89,6 +151,8 @@ public:
 
         delete []_listener_array;
         _listener_array = NULL;
+        _listeners_per_address = 1;
+        _cpu_steering = false;
     }
 
     /** 得到监听者个数 */
@@ -96,9 +160,31 @@ public:
 
     /** 得到指向监听者对象数组指针 */
     ListenClass* get_listener_array() const { return _listener_array; }
-    
+
+    /** 得到每个IP和端口对上的监听者个数，只有create_reuseport时才可能大于1 */
+    uint16_t get_listeners_per_address() const { return _listeners_per_address; }
+
+    /** 得到第address_index个IP和端口对上的第index个监听者 */
+    ListenClass* get_listener(uint16_t address_index, uint16_t index) const
+    {
+        return &_listener_array[address_index*_listeners_per_address + index];
+    }
+
+    /** 按CPU分发连接是否生效 */
+    bool is_cpu_steering() const { return _cpu_steering; }
+
+private:
+    // 重复create会丢失已有的监听者数组
+    void check_not_created() const
+    {
+        if (_listener_array != NULL)
+            THROW_SYSCALL_EXCEPTION("listeners already created", EALREADY, "create");
+    }
+
 private:
     uint16_t _listener_count;
+    uint16_t _listeners_per_address;
+    bool _cpu_steering;
     ListenClass* _listener_array;
     ip_port_pair_array_t _ip_port_array;
 };
@@ -20,8 +20,19 @@
 #define MOOON_NET_LISTENER_H
 #include "mooon/net/ip_node.h"
 #include "mooon/net/epollable.h"
+#include <vector>
 NET_NAMESPACE_BEGIN
 
+/***
+  * 一个已接受的连接
+  */
+typedef struct accepted_connection_t
+{
+    int fd;               /** 新的SOCKET句柄 */
+    ip_address_t peer_ip; /** 对端的IP地址 */
+    uint16_t peer_port;   /** 对端端口号，和accept()的一致 */
+}accepted_connection_t;
+
 /***
   * TCP服务端监听者类
   * 用于启动在某端口上的监听和接受连接请求
@@ -54,6 +65,41 @@ public:
       * @exception: 如果发生错误，则抛出CSyscallException异常
       */
     int accept(ip_address_t& peer_ip, uint16_t& peer_port);
+
+    /***
+      * 以accept4方式接受连接请求，新SOCKET句柄直接带有flags指定的标志，省去之后的fcntl调用
+      * @flags: SOCK_NONBLOCK和SOCK_CLOEXEC的组合
+      * @return: 新的SOCKET句柄，非阻塞模式下如果没有连接请求，则返回-1
+      * @exception: 如果发生错误，则抛出CSyscallException异常
+      */
+    int accept4(ip_address_t& peer_ip, uint16_t& peer_port, int flags=SOCK_NONBLOCK|SOCK_CLOEXEC);
+
+    /***
+      * 循环调用accept4，直到accept队列为空或者已接受max_count个连接，
+      * 用于非阻塞监听者在一次可读事件中排空accept队列，以应对连接风暴
+      * @connections: 用来存储新接受的连接，新接受的追加到尾部
+      * @max_count: 一次最多接受的连接数，避免长时间占用线程
+      * @return: 本次新接受的连接数
+      * @exception: 如果发生错误，则抛出CSyscallException异常，已接受的连接仍保留在connections中
+      */
+    int accept_all(std::vector<accepted_connection_t>* connections, int max_count=1024, int flags=SOCK_NONBLOCK|SOCK_CLOEXEC);
+
+    /***
+      * 设置SO_INCOMING_CPU，当同一端口有多个SO_REUSEPORT监听者时，
+      * 内核优先将连接交给与软中断所在CPU相同的监听者，需要内核4.4及以上版本
+      * @cpu: CPU编号，通常为处理该监听者的线程所绑定的CPU
+      * @exception: 如果发生错误或不支持，则抛出CSyscallException异常
+      */
+    void set_incoming_cpu(int cpu);
+
+    /***
+      * 为SO_REUSEPORT组挂载按CPU分发连接的BPF程序（SO_ATTACH_REUSEPORT_CBPF），
+      * 连接交给组内第“CPU编号 % group_size”个监听者（按listen的先后顺序），
+      * 只需在组内任意一个监听者上调用一次，需要内核4.5及以上版本
+      * @group_size: 组内监听者个数
+      * @exception: 如果发生错误或不支持，则抛出CSyscallException异常
+      */
+    void attach_reuseport_cpu_bpf(uint16_t group_size);
     
     /** 得到监听的IP地址 */
     const ip_address_t& get_listen_ip() const throw () { return _ip; }
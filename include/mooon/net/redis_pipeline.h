@@ -0,0 +1,121 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+// Redis队列（List）的流水线源和目标，配合sys::CPipeline使用，
+// 依赖r3c（https://github.com/eyjian/r3c），和thrift_helper.h一样只有头文件，
+// 使用者自行链接r3c和hiredis，libmooon本身不依赖它们
+#ifndef MOOON_NET_REDIS_PIPELINE_H
+#define MOOON_NET_REDIS_PIPELINE_H
+#include <mooon/net/config.h>
+#include <mooon/sys/log.h>
+#include <mooon/sys/pipeline.h>
+#include <r3c/r3c.h>
+NET_NAMESPACE_BEGIN
+
+// 以Redis队列为源，左进右出（RPOP），
+// RPOP即从Redis中删除，所以不能像Kafka那样在写出后才确认，
+// 停止时超时未写出的批次会被RPUSH回队列的右端（出队端），保持原来的顺序，
+// 但进程崩溃时已取出未写出的会丢失。
+class CRedisListSource: public sys::IPipelineSource
+{
+public:
+    // redis由调用者负责销毁，只能被本对象使用（只在源线程中被调用）
+    CRedisListSource(r3c::CRedisClient* redis, const std::string& key)
+        : _redis(redis), _key(key)
+    {
+    }
+
+    virtual int fetch(int max_count, sys::PipelineBatch* batch)
+    {
+        r3c::Node node;
+
+        try
+        {
+            if (max_count > 1)
+                return _redis->rpop(_key, &batch->messages, max_count, &node);
+
+            batch->messages.resize(1);
+            if (_redis->rpop(_key, &batch->messages[0], &node))
+                return 1;
+            batch->messages.clear();
+            return 0;
+        }
+        catch (r3c::CRedisException& ex)
+        {
+            MYLOG_ERROR("Redis rpop by %s failed: %s.\n", r3c::node2string(node).c_str(), ex.str().c_str());
+            batch->messages.clear();
+            return -1;
+        }
+    }
+
+    virtual void discard(sys::PipelineBatch* batch)
+    {
+        r3c::Node node;
+
+        try
+        {
+            // messages[0]是最早出队的，须最后RPUSH，才能回到最右端
+            std::vector<std::string> values(batch->messages.rbegin(), batch->messages.rend());
+            if (!values.empty())
+                _redis->rpush(_key, values, &node);
+        }
+        catch (r3c::CRedisException& ex)
+        {
+            MYLOG_ERROR("Redis rpush %d by %s failed: %s.\n", static_cast<int>(batch->messages.size()), r3c::node2string(node).c_str(), ex.str().c_str());
+        }
+    }
+
+private:
+    r3c::CRedisClient* _redis;
+    std::string _key;
+};
+
+// 以Redis队列为目标，左进右出（LPUSH），每批一次LPUSH
+class CRedisListSink: public sys::IPipelineSink
+{
+public:
+    // redis由调用者负责销毁，只能被本对象使用（只在所属的写线程中被调用）
+    CRedisListSink(r3c::CRedisClient* redis, const std::string& key)
+        : _redis(redis), _key(key)
+    {
+    }
+
+    virtual bool write(sys::PipelineBatch* batch)
+    {
+        r3c::Node node;
+
+        try
+        {
+            if (!batch->messages.empty())
+                _redis->lpush(_key, batch->messages, &node);
+            return true;
+        }
+        catch (r3c::CRedisException& ex)
+        {
+            MYLOG_ERROR("Redis lpush by %s failed: %s.\n", r3c::node2string(node).c_str(), ex.str().c_str());
+            return false;
+        }
+    }
+
+private:
+    r3c::CRedisClient* _redis;
+    std::string _key;
+};
+
+NET_NAMESPACE_END
+#endif // MOOON_NET_REDIS_PIPELINE_H
@@ -0,0 +1,190 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#ifndef MOOON_NET_TCP_INFO_SAMPLER_H
+#define MOOON_NET_TCP_INFO_SAMPLER_H
+#include "mooon/net/epollable.h"
+#include "mooon/sys/atomic.h"
+#include "mooon/sys/event.h"
+#include "mooon/sys/lock.h"
+#include "mooon/sys/thread_engine.h"
+#include <set>
+#include <vector>
+NET_NAMESPACE_BEGIN
+
+/***
+  * 一条连接的TCP_INFO采样结果，时间单位均为微秒
+  */
+typedef struct tcp_info_sample_t
+{
+    int fd;
+    std::string peer;        /** 对端地址，格式为ip:port */
+    uint8_t state;           /** TCP状态，如TCP_ESTABLISHED */
+    uint8_t ca_state;        /** 拥塞控制状态 */
+    uint8_t retransmits;     /** 当前未确认数据的重传次数 */
+    uint32_t rto;            /** 重传超时 */
+    uint32_t rtt;            /** 平滑后的往返时间 */
+    uint32_t rttvar;         /** 往返时间的偏差 */
+    uint32_t rcv_rtt;        /** 接收方向估算的往返时间 */
+    uint32_t snd_mss;
+    uint32_t snd_cwnd;       /** 拥塞窗口，单位为MSS个数 */
+    uint32_t snd_ssthresh;
+    uint32_t unacked;        /** 已发送未确认的分节数 */
+    uint32_t lost;
+    uint32_t total_retrans;  /** 连接建立以来的总重传次数 */
+
+    tcp_info_sample_t();
+}tcp_info_sample_t;
+
+/***
+  * 读取指定SOCKET的TCP_INFO
+  * @exception: 如果发生错误，则抛出CSyscallException异常
+  */
+void get_tcp_info(int fd, tcp_info_sample_t* sample);
+
+/***
+  * 转换成单行的“名:值”格式，和各工具输出的统计格式一致，可直接写入统计日志，如：
+  * peer:127.0.0.1:2016,fd:5,state:1,rtt:35,rttvar:17,rto:201000,cwnd:10,retrans:0,total_retrans:0,...
+  */
+std::string to_string(const tcp_info_sample_t& sample);
+
+/***
+  * CTcpInfoSampler的汇总统计，时间单位均为微秒，
+  * 除rounds和各max_*为自上次取统计以来的累计外，其它为最近一轮采样的值
+  */
+struct TcpInfoMetrics
+{
+    uint32_t rounds;          // 采样轮数
+    uint32_t connections;     // 最近一轮采样成功的连接数
+    uint32_t avg_rtt;
+    uint32_t max_rtt;
+    std::string max_rtt_peer; // max_rtt对应的对端，用来发现慢的对端
+    uint32_t max_rttvar;
+    uint32_t retransmitting;  // 最近一轮中有未确认数据在重传的连接数
+    uint32_t unacked;         // 最近一轮各连接已发送未确认分节数之和
+    uint32_t lost;
+    uint64_t total_retrans;   // 最近一轮各连接总重传次数之和
+
+    TcpInfoMetrics()
+        : rounds(0), connections(0), avg_rtt(0), max_rtt(0), max_rttvar(0),
+          retransmitting(0), unacked(0), lost(0), total_retrans(0)
+    {
+    }
+};
+
+/***
+  * 转换成单行的“名:值”格式，可直接写入统计日志，如：
+  * rounds:6,connections:120,avg_rtt:350,max_rtt:20310,max_rtt_peer:10.0.0.8:2016,max_rttvar:9800,retransmitting:1,unacked:3,lost:0,total_retrans:17
+  */
+std::string to_string(const TcpInfoMetrics& metrics);
+
+/***
+  * 采样观察者，在采样线程中被回调
+  */
+class CALLBACK_INTERFACE ITcpInfoObserver
+{
+public:
+    /** 空虚拟析构函数，以屏蔽编译器告警 */
+    virtual ~ITcpInfoObserver() {}
+
+    /** 每轮采样完成后被回调，samples包含本轮所有采样成功的连接 */
+    virtual void on_tcp_info(const std::vector<tcp_info_sample_t>& samples) = 0;
+};
+
+/***
+  * TCP_INFO采样器，周期性地读取所有登记连接的TCP_INFO，用于发现传输层慢的对端
+  * 线程安全，add和remove可在任意线程中调用，
+  * 但须保证CEpollable对象在remove之后才被删除或关闭
+  *
+  * 每轮采样结果汇总到TcpInfoMetrics，可定时通过get_metrics()输出到统计日志：
+  * net::TcpInfoMetrics metrics;
+  * sampler.get_metrics(&metrics);
+  * metrics_logger->log_raw("%s\n", net::to_string(metrics).c_str());
+  *
+  * 需要逐条连接的明细时，可提供观察者：
+  * class CMetricsObserver: public net::ITcpInfoObserver
+  * {
+  *     virtual void on_tcp_info(const std::vector<net::tcp_info_sample_t>& samples)
+  *     {
+  *         for (size_t i=0; i<samples.size(); ++i)
+  *             metrics_logger->log_raw("%s\n", net::to_string(samples[i]).c_str());
+  *     }
+  * };
+  *
+  * net::CTcpInfoSampler sampler;
+  * sampler.start(10000, &observer);
+  * sampler.add(waiter);
+  * ...
+  * sampler.remove(waiter);
+  * sampler.stop();
+  * sampler.wait();
+  */
+class CTcpInfoSampler
+{
+public:
+    CTcpInfoSampler();
+    ~CTcpInfoSampler();
+
+    /** 登记需要采样的连接，不增加引用计数 */
+    void add(CEpollable* epollable);
+
+    /** 取消登记，返回后不会再访问epollable */
+    void remove(CEpollable* epollable);
+
+    /** 得到登记的连接数 */
+    size_t get_count() const;
+
+    /***
+      * 立即对所有登记的连接采样一次，已关闭或非TCP的连接被跳过
+      * @return: 采样成功的连接数
+      */
+    size_t sample(std::vector<tcp_info_sample_t>* samples);
+
+    /***
+      * 启动采样线程
+      * @interval_milliseconds: 采样间隔毫秒数
+      * @observer: 每轮采样结果的接收者，为NULL时只汇总到get_metrics()
+      * @return: 成功返回true，否则返回false
+      */
+    bool start(uint32_t interval_milliseconds, ITcpInfoObserver* observer);
+    void stop(); // 同一对象在stop后不能重复使用
+    void wait();
+
+    /***
+      * 得到采样线程的汇总统计
+      * @reset: 是否清零rounds和各max_*
+      */
+    void get_metrics(TcpInfoMetrics* metrics, bool reset=true);
+
+private:
+    void run();
+    void update_metrics(const std::vector<tcp_info_sample_t>& samples);
+
+private:
+    mutable sys::CLock _lock;
+    sys::CEvent _event;
+    sys::CAtomic<bool> _stop;
+    std::set<CEpollable*> _epollables;
+    TcpInfoMetrics _metrics;
+    uint32_t _interval_milliseconds;
+    ITcpInfoObserver* _observer;
+    sys::CThreadEngine* _engine;
+};
+
+NET_NAMESPACE_END
+#endif // MOOON_NET_TCP_INFO_SAMPLER_H
@@ -0,0 +1,735 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+// 和thrift_helper.h一样只有头文件，使用者自行链接thrift，libmooon本身不依赖它
+#ifndef MOOON_NET_THRIFT_CLIENT_POOL_H
+#define MOOON_NET_THRIFT_CLIENT_POOL_H
+#include <mooon/net/thrift_helper.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <random>
+#include <thread>
+NET_NAMESPACE_BEGIN
+
+/***
+  * 选择服务端的方式
+  */
+enum thrift_balance_t
+{
+    thrift_balance_least_inflight = 0, // 正在进行的调用数最少者
+    thrift_balance_p2c            = 1  // 随机选两个，取“(正在进行的调用数+1)*平均延迟”较小者
+};
+
+/***
+  * CThriftClientPool的统计
+  */
+struct ThriftClientPoolMetrics
+{
+    uint64_t borrow_count;
+    uint64_t borrow_waits;      // 因无空闲连接而等待的次数
+    uint64_t borrow_timeouts;
+    uint64_t error_count;       // 以出错归还的次数
+    uint64_t ejections;         // 服务端被摘除的次数
+    uint64_t reconnects;        // 连接成功的次数，含start()时的
+    uint64_t reconnect_failures;
+    uint32_t idle_clients;
+    uint32_t inflight_clients;
+    uint32_t broken_clients;    // 等待后台重连的连接数
+    uint32_t ejected_servers;   // 当前被摘除的服务端数
+
+    ThriftClientPoolMetrics()
+        : borrow_count(0), borrow_waits(0), borrow_timeouts(0), error_count(0),
+          ejections(0), reconnects(0), reconnect_failures(0),
+          idle_clients(0), inflight_clients(0), broken_clients(0), ejected_servers(0)
+    {
+    }
+};
+
+/***
+  * 线程安全的thrift客户端池，
+  * 每个服务端预建一组CThriftClientHelper（每个即一个连接），多个线程借用和归还，
+  * 避免多个线程共用一个CThriftClientHelper时互相排队（队头阻塞）：
+  * 1) 借用时按thrift_balance_t在有空闲连接的服务端中选择；
+  * 2) 连续出错次数达到阈值，或平均延迟超过所有服务端延迟中位数的指定倍数时，摘除该服务端，
+  *    摘除时长随被摘除次数增长，最多摘除一半的服务端，摘除期满后自动恢复，
+  *    没有未被摘除的服务端可用时，仍会使用被摘除的；
+  * 3) 以出错归还的连接被关闭，由后台线程定时重连，借用线程不会因建连而阻塞。
+  *
+  * 和CThriftClientHelper的多服务端构造函数（TSocketPool）不同，
+  * TSocketPool只在连接时选择服务端，且只在连接失败时切换。
+  *
+  * 使用示例：
+  * std::vector<std::pair<std::string, int> > servers;
+  * servers.push_back(std::make_pair("127.0.0.1", 9090));
+  * servers.push_back(std::make_pair("127.0.0.2", 9090));
+  * mooon::net::CThriftClientPool<ExampleServiceClient> client_pool(servers, 8);
+  * client_pool.start();
+  *
+  * // 在任意线程中
+  * try
+  * {
+  *     mooon::net::CThriftClientLease<ExampleServiceClient> client(&client_pool, 1000);
+  *     client.call([](ExampleServiceClient* c) { c->foo(); });
+  * }
+  * catch (apache::thrift::transport::TTransportException& ex)
+  * {
+  *     // 借用超时也抛出TTransportException，类型为NOT_OPEN
+  *     MYLOG_ERROR("thrift transport exception: (%d)%s\n", ex.getType(), ex.what());
+  * }
+  */
+template <class ThriftClient,
+          class Protocol=apache::thrift::protocol::TBinaryProtocol,
+          class Transport=apache::thrift::transport::TFramedTransport>
+class CThriftClientPool
+{
+public:
+    typedef CThriftClientHelper<ThriftClient, Protocol, Transport> ClientHelper;
+
+    // 借出的连接
+    struct PooledClient
+    {
+        ClientHelper* helper;
+        uint32_t server_index;
+        std::chrono::steady_clock::time_point borrow_time;
+    };
+
+public:
+    // servers 服务端列表
+    // connections_per_server 每个服务端的连接数
+    CThriftClientPool(const std::vector<std::pair<std::string, int> >& servers,
+                      int connections_per_server=4,
+                      int connect_timeout_milliseconds=2000,
+                      int receive_timeout_milliseconds=2000,
+                      int send_timeout_milliseconds=2000);
+    ~CThriftClientPool();
+
+    // 以下设置须在start()之前调用
+    void set_balance(thrift_balance_t balance) { _balance = balance; }
+    // 连续出错多少次摘除，为0表示不按出错摘除，默认为5
+    void set_eject_errors(uint32_t consecutive_errors) { _eject_errors = consecutive_errors; }
+    // 平均延迟超过中位数的多少倍摘除，为0表示不按延迟摘除，默认为3，
+    // 服务端至少完成min_samples次调用后才参与比较
+    void set_eject_latency_factor(double factor, uint32_t min_samples=100) { _eject_latency_factor = factor; _eject_min_samples = min_samples; }
+    // 首次摘除的时长，之后每次摘除增加一倍，最多8倍，默认为10000毫秒
+    void set_eject_milliseconds(uint32_t milliseconds) { _eject_milliseconds = milliseconds; }
+    // 后台重连的间隔，默认为1000毫秒
+    void set_reconnect_milliseconds(uint32_t milliseconds) { _reconnect_milliseconds = milliseconds; }
+
+    // 建立连接并启动后台重连线程，
+    // 连接失败的留给后台重连，一个服务端连接失败后不再尝试它的其它连接，以免启动时等待过久
+    // 出错时抛出apache::thrift::TException异常（如线程创建失败）
+    void start();
+    // 停止后台线程并关闭所有连接，须在所有借出的连接归还之后调用
+    void stop();
+
+    // 借一个已连接的连接，无空闲连接时最多等待timeout_milliseconds，
+    // 超时抛出apache::thrift::transport::TTransportException异常，类型为NOT_OPEN
+    PooledClient* borrow(uint32_t timeout_milliseconds);
+
+    // 归还连接
+    // error 调用是否出错，出错的调用计入服务端的连续出错次数
+    // broken 连接是否已不可用（如发生了TTransportException），为true时关闭连接并交由后台重连
+    void pay_back(PooledClient* client, bool error, bool broken);
+
+    // 取得统计
+    // reset 是否清零计数，可定时调用作为监控指标
+    void get_metrics(ThriftClientPoolMetrics* metrics, bool reset=true);
+
+    uint32_t get_server_count() const { return static_cast<uint32_t>(_servers.size()); }
+
+private:
+    struct Server
+    {
+        std::string host;
+        int port;
+        std::vector<ClientHelper*> clients;  // 全部连接
+        std::vector<PooledClient*> idle;     // 已连接且空闲
+        std::vector<ClientHelper*> broken;   // 等待重连
+        uint32_t inflight;
+        uint32_t consecutive_errors;
+        uint32_t consecutive_successes;
+        uint32_t samples;                    // 参与延迟比较的调用数
+        uint32_t ejections;                  // 连续被摘除的次数，决定摘除时长
+        double latency_microseconds;         // 延迟的指数加权移动平均
+        std::chrono::steady_clock::time_point ejected_until;
+        bool ejected;
+    };
+
+    int select_server(const std::chrono::steady_clock::time_point& now);
+    bool is_available(Server* server, const std::chrono::steady_clock::time_point& now, bool include_ejected);
+    void update_server(Server* server, uint64_t latency_microseconds, bool error, const std::chrono::steady_clock::time_point& now);
+    bool is_latency_outlier(const Server* server) const;
+    void eject_server(Server* server, const char* reason, const std::chrono::steady_clock::time_point& now);
+    void run();
+    void reconnect();
+
+private:
+    std::vector<Server*> _servers;
+    thrift_balance_t _balance;
+    uint32_t _eject_errors;
+    double _eject_latency_factor;
+    uint32_t _eject_min_samples;
+    uint32_t _eject_milliseconds;
+    uint32_t _reconnect_milliseconds;
+    std::minstd_rand _random;
+
+private:
+    std::mutex _lock;
+    std::condition_variable _idle_cond;  // 有连接被归还或重连成功
+    std::condition_variable _stop_cond;
+    bool _stop;
+    std::thread _reconnect_thread;
+    ThriftClientPoolMetrics _metrics;
+};
+
+// 正在传播的异常个数，C++17之前（严格模式下）没有std::uncaught_exceptions()，
+// 只能以std::uncaught_exception()近似，这时在析构函数中借用的连接会被误判
+inline int thrift_uncaught_exceptions()
+{
+#if defined(__cpp_lib_uncaught_exceptions)
+    return std::uncaught_exceptions();
+#else
+    return std::uncaught_exception()? 1: 0;
+#endif // __cpp_lib_uncaught_exceptions
+}
+
+/***
+  * 借用CThriftClientPool中连接的RAII辅助类，析构时归还。
+  * 通过call()调用时，TTransportException使连接不可用，其它异常（如IDL中定义的异常）只计为出错；
+  * 直接通过“->”调用时，析构时如果有在构造之后抛出的异常正在传播，则计为出错，
+  * 但只有连接已被关闭时才视为不可用，因为此时无法知道异常的类型。
+  */
+template <class ThriftClient,
+          class Protocol=apache::thrift::protocol::TBinaryProtocol,
+          class Transport=apache::thrift::transport::TFramedTransport>
+class CThriftClientLease
+{
+public:
+    typedef CThriftClientPool<ThriftClient, Protocol, Transport> ClientPool;
+
+    CThriftClientLease(ClientPool* client_pool, uint32_t timeout_milliseconds)
+        : _client_pool(client_pool), _client(client_pool->borrow(timeout_milliseconds)),
+          _uncaught_exceptions(thrift_uncaught_exceptions()), _error(false), _broken(false)
+    {
+    }
+
+    ~CThriftClientLease()
+    {
+        // 只看构造之后抛出的异常，租约本身可能在另一个异常的栈回退中创建
+        if ((_client != NULL) && (thrift_uncaught_exceptions() > _uncaught_exceptions))
+        {
+            _error = true;
+            if (!_client->helper->is_connected())
+                _broken = true;
+        }
+        release();
+    }
+
+    ThriftClient* get() { return _client->helper->get(); }
+    ThriftClient* operator ->() { return get(); }
+    std::string str() const { return _client->helper->str(); }
+
+    // 以function(ThriftClient*)调用，并按异常类型设置出错状态后再抛出，如：
+    // lease.call([](ExampleServiceClient* client) { client->foo(); });
+    template <class Function>
+    auto call(Function function) -> decltype(function(static_cast<ThriftClient*>(NULL)))
+    {
+        try
+        {
+            return function(get());
+        }
+        catch (apache::thrift::transport::TTransportException&)
+        {
+            // 无法确定连接上是否还有未读完的响应
+            set_broken();
+            throw;
+        }
+        catch (...)
+        {
+            set_error();
+            throw;
+        }
+    }
+
+    // 调用出错但连接仍可用，如服务端返回了IDL中定义的异常后仍需计入出错时
+    void set_error() { _error = true; }
+    // 连接已不可用，如捕获到TTransportException异常后
+    void set_broken() { _error = _broken = true; }
+
+    // 提前归还
+    void release()
+    {
+        if (_client != NULL)
+        {
+            _client_pool->pay_back(_client, _error, _broken);
+            _client = NULL;
+        }
+    }
+
+private:
+    CThriftClientLease(const CThriftClientLease&);
+    CThriftClientLease& operator =(const CThriftClientLease&);
+
+private:
+    ClientPool* _client_pool;
+    typename ClientPool::PooledClient* _client;
+    int _uncaught_exceptions; // 构造时正在传播的异常个数
+    bool _error;
+    bool _broken;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+template <class ThriftClient, class Protocol, class Transport>
+CThriftClientPool<ThriftClient, Protocol, Transport>::CThriftClientPool(
+        const std::vector<std::pair<std::string, int> >& servers,
+        int connections_per_server,
+        int connect_timeout_milliseconds,
+        int receive_timeout_milliseconds,
+        int send_timeout_milliseconds)
+        : _balance(thrift_balance_p2c), _eject_errors(5), _eject_latency_factor(3.0), _eject_min_samples(100),
+          _eject_milliseconds(10000), _reconnect_milliseconds(1000),
+          _random(static_cast<std::minstd_rand::result_type>(std::chrono::steady_clock::now().time_since_epoch().count())),
+          _stop(false)
+{
+    for (std::vector<std::pair<std::string, int> >::size_type i=0; i<servers.size(); ++i)
+    {
+        Server* server = new Server;
+        server->host = servers[i].first;
+        server->port = servers[i].second;
+        server->inflight = 0;
+        server->consecutive_errors = 0;
+        server->consecutive_successes = 0;
+        server->samples = 0;
+        server->ejections = 0;
+        server->latency_microseconds = 0;
+        server->ejected = false;
+
+        for (int j=0; j<connections_per_server; ++j)
+        {
+            ClientHelper* helper = new ClientHelper(
+                    server->host, static_cast<uint16_t>(server->port),
+                    connect_timeout_milliseconds, receive_timeout_milliseconds, send_timeout_milliseconds);
+            server->clients.push_back(helper);
+            server->broken.push_back(helper);
+        }
+
+        _servers.push_back(server);
+    }
+}
+
+template <class ThriftClient, class Protocol, class Transport>
+CThriftClientPool<ThriftClient, Protocol, Transport>::~CThriftClientPool()
+{
+    stop();
+
+    for (typename std::vector<Server*>::size_type i=0; i<_servers.size(); ++i)
+    {
+        Server* server = _servers[i];
+
+        for (typename std::vector<PooledClient*>::size_type j=0; j<server->idle.size(); ++j)
+            delete server->idle[j];
+        for (typename std::vector<ClientHelper*>::size_type j=0; j<server->clients.size(); ++j)
+            delete server->clients[j];
+        delete server;
+    }
+    _servers.clear();
+}
+
+template <class ThriftClient, class Protocol, class Transport>
+void CThriftClientPool<ThriftClient, Protocol, Transport>::start()
+{
+    _stop = false;
+    reconnect();
+
+    try
+    {
+        _reconnect_thread = std::thread(&CThriftClientPool::run, this);
+    }
+    catch (std::system_error& ex)
+    {
+        throw apache::thrift::TException(ex.what());
+    }
+}
+
+template <class ThriftClient, class Protocol, class Transport>
+void CThriftClientPool<ThriftClient, Protocol, Transport>::stop()
+{
+    if (_reconnect_thread.joinable())
+    {
+        {
+            std::unique_lock<std::mutex> lock(_lock);
+            _stop = true;
+            _stop_cond.notify_one();
+        }
+        _reconnect_thread.join();
+    }
+
+    std::unique_lock<std::mutex> lock(_lock);
+    for (typename std::vector<Server*>::size_type i=0; i<_servers.size(); ++i)
+    {
+        Server* server = _servers[i];
+
+        for (typename std::vector<PooledClient*>::size_type j=0; j<server->idle.size(); ++j)
+        {
+            ClientHelper* helper = server->idle[j]->helper;
+
+            try
+            {
+                helper->close();
+            }
+            catch (apache::thrift::TException& ex)
+            {
+                MYLOG_WARN("Close %s failed: %s\n", helper->str().c_str(), ex.what());
+            }
+
+            server->broken.push_back(helper);
+            delete server->idle[j];
+        }
+        server->idle.clear();
+    }
+}
+
+template <class ThriftClient, class Protocol, class Transport>
+typename CThriftClientPool<ThriftClient, Protocol, Transport>::PooledClient*
+CThriftClientPool<ThriftClient, Protocol, Transport>::borrow(uint32_t timeout_milliseconds)
+{
+    const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_milliseconds);
+    std::unique_lock<std::mutex> lock(_lock);
+    bool waited = false;
+
+    ++_metrics.borrow_count;
+    while (true)
+    {
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        const int index = select_server(now);
+
+        if (index != -1)
+        {
+            Server* server = _servers[index];
+            PooledClient* client = server->idle.back();
+
+            server->idle.pop_back();
+            ++server->inflight;
+            client->borrow_time = now;
+            return client;
+        }
+
+        if (!waited)
+        {
+            waited = true;
+            ++_metrics.borrow_waits;
+        }
+        if (std::cv_status::timeout == _idle_cond.wait_until(lock, deadline))
+        {
+            // 超时前最后一刻可能恰好有连接归还
+            if (-1 == select_server(std::chrono::steady_clock::now()))
+            {
+                ++_metrics.borrow_timeouts;
+                throw apache::thrift::transport::TTransportException(
+                        apache::thrift::transport::TTransportException::NOT_OPEN,
+                        utils::CStringUtils::format_string("no available thrift client in %u milliseconds", timeout_milliseconds));
+            }
+        }
+    }
+}
+
+template <class ThriftClient, class Protocol, class Transport>
+void CThriftClientPool<ThriftClient, Protocol, Transport>::pay_back(PooledClient* client, bool error, bool broken)
+{
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    const uint64_t latency_microseconds = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(now-client->borrow_time).count());
+    ClientHelper* helper = client->helper;
+
+    // 在锁外关闭，close可能阻塞
+    if (broken)
+    {
+        try
+        {
+            helper->close();
+        }
+        catch (apache::thrift::TException& ex)
+        {
+            MYLOG_WARN("Close %s failed: %s\n", helper->str().c_str(), ex.what());
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(_lock);
+    Server* server = _servers[client->server_index];
+
+    --server->inflight;
+    if (error)
+        ++_metrics.error_count;
+    update_server(server, latency_microseconds, error, now);
+
+    if (broken)
+    {
+        server->broken.push_back(helper);
+        delete client;
+    }
+    else
+    {
+        server->idle.push_back(client);
+        _idle_cond.notify_one();
+    }
+}
+
+template <class ThriftClient, class Protocol, class Transport>
+void CThriftClientPool<ThriftClient, Protocol, Transport>::get_metrics(ThriftClientPoolMetrics* metrics, bool reset)
+{
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(_lock);
+
+    *metrics = _metrics;
+    for (typename std::vector<Server*>::size_type i=0; i<_servers.size(); ++i)
+    {
+        const Server* server = _servers[i];
+
+        metrics->idle_clients += static_cast<uint32_t>(server->idle.size());
+        metrics->inflight_clients += server->inflight;
+        metrics->broken_clients += static_cast<uint32_t>(server->broken.size());
+        if (server->ejected && (now < server->ejected_until))
+            ++metrics->ejected_servers;
+    }
+    if (reset)
+        _metrics = ThriftClientPoolMetrics();
+}
+
+// 在_lock下调用，返回-1表示没有可用的服务端
+template <class ThriftClient, class Protocol, class Transport>
+int CThriftClientPool<ThriftClient, Protocol, Transport>::select_server(const std::chrono::steady_clock::time_point& now)
+{
+    std::vector<int> candidates;
+
+    for (int round=0; round<2 && candidates.empty(); ++round)
+    {
+        // 第二轮包括被摘除的，即所有未被摘除的都没有可用连接时
+        for (typename std::vector<Server*>::size_type i=0; i<_servers.size(); ++i)
+        {
+            if (is_available(_servers[i], now, round > 0))
+                candidates.push_back(static_cast<int>(i));
+        }
+    }
+    if (candidates.empty())
+        return -1;
+    if (1 == candidates.size())
+        return candidates[0];
+
+    if (thrift_balance_p2c == _balance)
+    {
+        // 在不同的两个中选择
+        const std::vector<int>::size_type i = _random() % candidates.size();
+        std::vector<int>::size_type j = _random() % (candidates.size()-1);
+        if (j >= i)
+            ++j;
+        const int first = candidates[i];
+        const int second = candidates[j];
+
+        // 尚无延迟数据的按1微秒计，以便新恢复的服务端能得到调用
+        const Server* first_server = _servers[first];
+        const Server* second_server = _servers[second];
+        const double first_score = (first_server->inflight+1) * std::max(first_server->latency_microseconds, 1.0);
+        const double second_score = (second_server->inflight+1) * std::max(second_server->latency_microseconds, 1.0);
+        return (first_score <= second_score)? first: second;
+    }
+    else
+    {
+        // 从随机位置开始，使正在进行的调用数相同的服务端轮流被选中
+        const std::vector<int>::size_type start = _random() % candidates.size();
+        int index = candidates[start];
+
+        for (std::vector<int>::size_type i=1; i<candidates.size(); ++i)
+        {
+            const int candidate = candidates[(start+i) % candidates.size()];
+            if (_servers[candidate]->inflight < _servers[index]->inflight)
+                index = candidate;
+        }
+
+        return index;
+    }
+}
+
+template <class ThriftClient, class Protocol, class Transport>
+bool CThriftClientPool<ThriftClient, Protocol, Transport>::is_available(Server* server, const std::chrono::steady_clock::time_point& now, bool include_ejected)
+{
+    if (server->ejected && (now >= server->ejected_until))
+    {
+        // 摘除期满，重新开始统计
+        MYLOG_INFO("thrift://%s:%d is back after ejection\n", server->host.c_str(), server->port);
+        server->ejected = false;
+        server->consecutive_errors = 0;
+        server->consecutive_successes = 0;
+        server->samples = 0;
+        server->latency_microseconds = 0;
+    }
+
+    return !server->idle.empty() && (include_ejected || !server->ejected);
+}
+
+template <class ThriftClient, class Protocol, class Transport>
+void CThriftClientPool<ThriftClient, Protocol, Transport>::update_server(Server* server, uint64_t latency_microseconds, bool error, const std::chrono::steady_clock::time_point& now)
+{
+    if (error)
+    {
+        server->consecutive_successes = 0;
+        ++server->consecutive_errors;
+        if ((_eject_errors > 0) && (server->consecutive_errors >= _eject_errors))
+            eject_server(server, "consecutive errors", now);
+        return;
+    }
+
+    // 延迟只统计成功的调用，出错（如连接被拒绝）的延迟通常很小，会拉低平均值
+    if (0 == server->samples)
+        server->latency_microseconds = static_cast<double>(latency_microseconds);
+    else
+        server->latency_microseconds = server->latency_microseconds*0.9 + static_cast<double>(latency_microseconds)*0.1;
+    ++server->samples;
+    server->consecutive_errors = 0;
+
+    // 恢复后持续正常，则不再因之前的摘除而加长摘除时长
+    if (++server->consecutive_successes >= _eject_min_samples)
+        server->ejections = 0;
+
+    // 每16次调用比较一次，以减少锁内的计算
+    if ((0 == server->samples % 16) && is_latency_outlier(server))
+        eject_server(server, "high latency", now);
+}
+
+template <class ThriftClient, class Protocol, class Transport>
+bool CThriftClientPool<ThriftClient, Protocol, Transport>::is_latency_outlier(const Server* server) const
+{
+    std::vector<double> latencies;
+
+    if ((_eject_latency_factor <= 0) || server->ejected || (server->samples < _eject_min_samples))
+        return false;
+    for (typename std::vector<Server*>::size_type i=0; i<_servers.size(); ++i)
+    {
+        if (!_servers[i]->ejected && (_servers[i]->samples >= _eject_min_samples))
+            latencies.push_back(_servers[i]->latency_microseconds);
+    }
+
+    // 至少要有3个服务端参与，中位数才有意义
+    if (latencies.size() < 3)
+        return false;
+    std::nth_element(latencies.begin(), latencies.begin()+latencies.size()/2, latencies.end());
+    return server->latency_microseconds > latencies[latencies.size()/2] * _eject_latency_factor;
+}
+
+template <class ThriftClient, class Protocol, class Transport>
+void CThriftClientPool<ThriftClient, Protocol, Transport>::eject_server(Server* server, const char* reason, const std::chrono::steady_clock::time_point& now)
+{
+    uint32_t num_ejected = 0;
+
+    if (server->ejected)
+        return;
+    for (typename std::vector<Server*>::size_type i=0; i<_servers.size(); ++i)
+    {
+        if (_servers[i]->ejected)
+            ++num_ejected;
+    }
+
+    // 最多摘除一半，以免故障扩散时剩余的服务端被压垮，或全部被摘除
+    if ((num_ejected+1) * 2 > _servers.size())
+    {
+        MYLOG_WARN("thrift://%s:%d not ejected (%s) because %u of %u servers are ejected\n",
+                   server->host.c_str(), server->port, reason, num_ejected, static_cast<uint32_t>(_servers.size()));
+        return;
+    }
+
+    const uint32_t factor = std::min<uint32_t>(1U << std::min<uint32_t>(server->ejections, 3), 8);
+    const uint32_t eject_milliseconds = _eject_milliseconds * factor;
+
+    server->ejected = true;
+    server->ejected_until = now + std::chrono::milliseconds(eject_milliseconds);
+    ++server->ejections;
+    ++_metrics.ejections;
+    MYLOG_WARN("thrift://%s:%d ejected for %u milliseconds: %s (errors: %u, latency: %.0fus)\n",
+               server->host.c_str(), server->port, eject_milliseconds, reason,
+               server->consecutive_errors, server->latency_microseconds);
+}
+
+template <class ThriftClient, class Protocol, class Transport>
+void CThriftClientPool<ThriftClient, Protocol, Transport>::run()
+{
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(_lock);
+            if (_stop)
+                break;
+            (void)_stop_cond.wait_for(lock, std::chrono::milliseconds(_reconnect_milliseconds));
+            if (_stop)
+                break;
+        }
+
+        reconnect();
+    }
+}
+
+template <class ThriftClient, class Protocol, class Transport>
+void CThriftClientPool<ThriftClient, Protocol, Transport>::reconnect()
+{
+    for (typename std::vector<Server*>::size_type i=0; i<_servers.size(); ++i)
+    {
+        Server* server = _servers[i];
+        std::vector<ClientHelper*> broken;
+
+        {
+            std::unique_lock<std::mutex> lock(_lock);
+            broken.swap(server->broken);
+        }
+
+        // 在锁外连接，一个连接失败后不再尝试同一服务端的其它连接
+        typename std::vector<ClientHelper*>::size_type j = 0;
+        for (; j<broken.size(); ++j)
+        {
+            ClientHelper* helper = broken[j];
+
+            try
+            {
+                helper->connect();
+            }
+            catch (apache::thrift::TException& ex)
+            {
+                MYLOG_ERROR("Connect %s failed: %s\n", helper->str().c_str(), ex.what());
+                break;
+            }
+
+            PooledClient* client = new PooledClient;
+            client->helper = helper;
+            client->server_index = static_cast<uint32_t>(i);
+
+            std::unique_lock<std::mutex> lock(_lock);
+            server->idle.push_back(client);
+            ++_metrics.reconnects;
+            _idle_cond.notify_one();
+        }
+
+        if (j < broken.size())
+        {
+            std::unique_lock<std::mutex> lock(_lock);
+            ++_metrics.reconnect_failures;
+            server->broken.insert(server->broken.end(), broken.begin()+j, broken.end());
+        }
+    }
+}
+
+NET_NAMESPACE_END
+#endif // MOOON_NET_THRIFT_CLIENT_POOL_H
@@ -27,6 +27,7 @@
 #ifndef MOOON_NET_THRIFT_HELPER_H
 #define MOOON_NET_THRIFT_HELPER_H
 #include <mooon/net/config.h>
+#include <mooon/net/thrift_metrics.h>
 #include <mooon/sys/log.h>
 #include <mooon/utils/string_utils.h>
 #include <mooon/utils/scoped_ptr.h>
@@ -144,7 +145,7 @@ public:
     void close();
 
     apache::thrift::transport::TSocket* get_socket() { return _socket.get(); }
-    const apache::thrift::transport::TSocket get_socket() const { return _socket.get(); }
+    const apache::thrift::transport::TSocket* get_socket() const { return _socket.get(); }
     ThriftClient* get() { return _client.get(); }
     ThriftClient* get() const { return _client.get(); }
     ThriftClient* operator ->() { return get(); }
@@ -203,6 +204,12 @@ private:
 // TDebugProtocolFactory
 //
 // 只支持TNonblockingServer一种Server
+//
+// 默认按方法统计调用数、排队和处理时间（见thrift_metrics.h），可定时调用get_metrics()输出到监控：
+// mooon::net::ThriftServerMetrics metrics;
+// _thrift_server.get_metrics(&metrics);
+// for (size_t i=0; i<metrics.methods.size(); ++i)
+//     MYLOG_INFO("%s calls:%" PRIu64", p99:%" PRIu64"us\n", metrics.methods[i].name.c_str(), metrics.methods[i].calls, metrics.methods[i].process_microseconds.get_percentile(99.0));
 template <class ThriftHandler,
           class ServiceProcessor,
           class ProtocolFactory=apache::thrift::protocol::TBinaryProtocolFactory>
@@ -210,10 +217,12 @@ class CThriftServerHelper
 {
 public:
     // set_log_function 是否设置写日志函数，默认设置为debug级别日志
+    // enable_metrics 是否按方法统计调用（见thrift_metrics.h），通过get_metrics()取得，
+    //                processor_event_handler被串接在统计之后
     CThriftServerHelper(
             boost::shared_ptr<apache::thrift::server::TServerEventHandler> server_event_handler=boost::shared_ptr<apache::thrift::server::TServerEventHandler>(),
             boost::shared_ptr<apache::thrift::TProcessorEventHandler> processor_event_handler=boost::shared_ptr<apache::thrift::TProcessorEventHandler>(),
-            bool set_log_function=true);
+            bool set_log_function=true, bool enable_metrics=true);
 
     // 启动rpc服务，请注意该调用是同步阻塞的，所以需放最后调用
     // port thrift服务端的监听端口号
@@ -271,12 +280,17 @@ public:
         return _server_event_handler;
     }
 
+    // 取得各方法的调用统计，以及ThreadManager的排队数和空闲线程数，
+    // 未启用统计时只有后两者
+    // reset 是否清零调用数、出错数和直方图，可定时调用作为监控指标
+    void get_metrics(ThriftServerMetrics* metrics, bool reset=true);
+
 private:
     // 被构造函数调用
     void init1(
             boost::shared_ptr<apache::thrift::server::TServerEventHandler> server_event_handler,
             boost::shared_ptr<apache::thrift::TProcessorEventHandler> processor_event_handler,
-            bool set_log_function);
+            bool set_log_function, bool enable_metrics);
     // 被serve函数调用
     void init2(
             const std::string &ip,
@@ -289,6 +303,8 @@ private:
     boost::shared_ptr<apache::thrift::server::TServerEventHandler> _server_event_handler;
     boost::shared_ptr<ThriftHandler> _handler;
     boost::shared_ptr<apache::thrift::TProcessor> _processor;
+    // 按方法的调用统计，未启用时为空
+    boost::shared_ptr<CThriftMetricsEventHandler> _metrics_handler;
     // Constructs input and output protocol objects given transports.
     boost::shared_ptr<apache::thrift::protocol::TProtocolFactory> _protocol_factory;
     // This class manages a pool of threads.
@@ -449,9 +465,9 @@ template <class ThriftHandler, class ServiceProcessor, class ProtocolFactory>
 CThriftServerHelper<ThriftHandler, ServiceProcessor, ProtocolFactory>::CThriftServerHelper(
         boost::shared_ptr<apache::thrift::server::TServerEventHandler> server_event_handler,
         boost::shared_ptr<apache::thrift::TProcessorEventHandler> processor_event_handler,
-        bool set_log_function)
+        bool set_log_function, bool enable_metrics)
 {
-    init1(server_event_handler, processor_event_handler, set_log_function);
+    init1(server_event_handler, processor_event_handler, set_log_function, enable_metrics);
 }
 
 template <class ThriftHandler, class ServiceProcessor, class ProtocolFactory>
@@ -536,12 +552,33 @@ void CThriftServerHelper<ThriftHandler, ServiceProcessor, ProtocolFactory>::stop
         _thread_manager->stop();
 }
 
+template <class ThriftHandler, class ServiceProcessor, class ProtocolFactory>
+void CThriftServerHelper<ThriftHandler, ServiceProcessor, ProtocolFactory>::get_metrics(ThriftServerMetrics* metrics, bool reset)
+{
+    if (_metrics_handler.get() != NULL)
+        _metrics_handler->get_metrics(&metrics->methods, reset);
+    else
+        metrics->methods.clear();
+
+    // serve()之前_thread_manager为空
+    if (_thread_manager.get() != NULL)
+    {
+        metrics->pending_tasks = static_cast<uint32_t>(_thread_manager->pendingTaskCount());
+        metrics->idle_workers = static_cast<uint32_t>(_thread_manager->idleWorkerCount());
+    }
+    else
+    {
+        metrics->pending_tasks = 0;
+        metrics->idle_workers = 0;
+    }
+}
+
 // 被构造函数调用
 template <class ThriftHandler, class ServiceProcessor, class ProtocolFactory>
 void CThriftServerHelper<ThriftHandler, ServiceProcessor, ProtocolFactory>::init1(
         boost::shared_ptr<apache::thrift::server::TServerEventHandler> server_event_handler,
         boost::shared_ptr<apache::thrift::TProcessorEventHandler> processor_event_handler,
-        bool set_log_function)
+        bool set_log_function, bool enable_metrics)
 {
     if (set_log_function)
         set_thrift_debug_log_function();
@@ -549,8 +586,16 @@ void CThriftServerHelper<ThriftHandler, ServiceProcessor, ProtocolFactory>::init
         _server_event_handler = server_event_handler;
     _handler.reset(new ThriftHandler);
     _processor.reset(new ServiceProcessor(_handler));
-    if (processor_event_handler.get() != NULL)
+    if (enable_metrics)
+    {
+        // Processor只能有一个事件处理器，processor_event_handler被串接在统计之后
+        _metrics_handler.reset(new CThriftMetricsEventHandler(processor_event_handler));
+        _processor->setEventHandler(_metrics_handler);
+    }
+    else if (processor_event_handler.get() != NULL)
+    {
         _processor->setEventHandler(processor_event_handler);
+    }
 
     // ProtocolFactory默认为apache::thrift::protocol::TBinaryProtocolFactory
     _protocol_factory.reset(new ProtocolFactory());
@@ -565,6 +610,9 @@ void CThriftServerHelper<ThriftHandler, ServiceProcessor, ProtocolFactory>::init
         uint16_t num_io_threads)
 {
     _thread_manager = apache::thrift::server::ThreadManager::newSimpleThreadManager(num_worker_threads);
+    // 包装后可得到请求在队列中等待的时间
+    if (_metrics_handler.get() != NULL)
+        _thread_manager.reset(new CThriftTimedThreadManager(_thread_manager));
     _thread_factory.reset(new apache::thrift::concurrency::PosixThreadFactory());
 
     _thread_manager->threadFactory(_thread_factory);
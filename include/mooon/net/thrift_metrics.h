@@ -0,0 +1,449 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+// thrift服务端按方法的调用统计，被thrift_helper.h中的CThriftServerHelper使用，
+// 和thrift_helper.h一样只有头文件，使用者自行链接thrift，libmooon本身不依赖它
+#ifndef MOOON_NET_THRIFT_METRICS_H
+#define MOOON_NET_THRIFT_METRICS_H
+#include <mooon/net/config.h>
+#include <mooon/utils/latency_histogram.h>
+#include <boost/shared_ptr.hpp>
+#include <thrift/concurrency/ThreadManager.h>
+#include <thrift/TProcessor.h>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+NET_NAMESPACE_BEGIN
+
+/***
+  * 一个方法的调用统计
+  */
+struct ThriftMethodMetrics
+{
+    std::string name;       // 如“ExampleService.foo”
+    uint64_t calls;         // 完成的调用数
+    uint64_t errors;        // 处理函数抛出异常的调用数
+    uint32_t inflight;      // 正在处理的调用数，不受reset影响
+    utils::CLatencyHistogram queue_wait_microseconds; // 在ThreadManager队列中等待的微秒数，不经过队列的调用不记录
+    utils::CLatencyHistogram process_microseconds;    // 从开始处理（含解码）到处理完（含编码）的微秒数
+
+    ThriftMethodMetrics()
+        : calls(0), errors(0), inflight(0)
+    {
+    }
+};
+
+/***
+  * 服务端的统计
+  */
+struct ThriftServerMetrics
+{
+    uint32_t pending_tasks;  // ThreadManager队列中等待的请求数
+    uint32_t idle_workers;   // 空闲的工作线程数
+    std::vector<ThriftMethodMetrics> methods; // 按方法名排序
+
+    ThriftServerMetrics()
+        : pending_tasks(0), idle_workers(0)
+    {
+    }
+};
+
+// 当前线程正在执行的任务进入队列的时间，由CThriftTimedRunnable设置，
+// 为epoch（默认值）表示当前任务未经过队列
+inline std::chrono::steady_clock::time_point& thrift_task_enqueue_time()
+{
+    static thread_local std::chrono::steady_clock::time_point enqueue_time;
+    return enqueue_time;
+}
+
+/***
+  * 记录任务进入队列的时间
+  */
+class CThriftTimedRunnable: public apache::thrift::concurrency::Runnable
+{
+public:
+    CThriftTimedRunnable(boost::shared_ptr<apache::thrift::concurrency::Runnable> task)
+        : _task(task), _enqueue_time(std::chrono::steady_clock::now())
+    {
+    }
+
+    virtual void run()
+    {
+        thrift_task_enqueue_time() = _enqueue_time;
+        _task->run();
+        thrift_task_enqueue_time() = std::chrono::steady_clock::time_point();
+    }
+
+    boost::shared_ptr<apache::thrift::concurrency::Runnable> get_task() const { return _task; }
+
+private:
+    boost::shared_ptr<apache::thrift::concurrency::Runnable> _task;
+    std::chrono::steady_clock::time_point _enqueue_time;
+};
+
+/***
+  * 包装一个ThreadManager，加入的任务被CThriftTimedRunnable包装，
+  * 以便CThriftMetricsEventHandler得到请求在队列中等待的时间，其它操作原样转发。
+  * 因为任务被包装，remove()只能删除未包装的任务，TNonblockingServer不使用它。
+  */
+class CThriftTimedThreadManager: public apache::thrift::concurrency::ThreadManager
+{
+public:
+    typedef apache::thrift::concurrency::Runnable Runnable;
+    typedef apache::thrift::concurrency::ThreadFactory ThreadFactory;
+
+    CThriftTimedThreadManager(boost::shared_ptr<apache::thrift::concurrency::ThreadManager> thread_manager)
+        : _thread_manager(thread_manager)
+    {
+    }
+
+    virtual void start() { _thread_manager->start(); }
+    virtual void stop() { _thread_manager->stop(); }
+    virtual void join() { _thread_manager->join(); }
+    virtual STATE state() const { return _thread_manager->state(); }
+    virtual boost::shared_ptr<ThreadFactory> threadFactory() const { return _thread_manager->threadFactory(); }
+    virtual void threadFactory(boost::shared_ptr<ThreadFactory> value) { _thread_manager->threadFactory(value); }
+    virtual void addWorker(size_t value=1) { _thread_manager->addWorker(value); }
+    virtual void removeWorker(size_t value=1) { _thread_manager->removeWorker(value); }
+    virtual size_t idleWorkerCount() const { return _thread_manager->idleWorkerCount(); }
+    virtual size_t workerCount() const { return _thread_manager->workerCount(); }
+    virtual size_t pendingTaskCount() const { return _thread_manager->pendingTaskCount(); }
+    virtual size_t totalTaskCount() const { return _thread_manager->totalTaskCount(); }
+    virtual size_t pendingTaskCountMax() const { return _thread_manager->pendingTaskCountMax(); }
+    virtual size_t expiredTaskCount() { return _thread_manager->expiredTaskCount(); }
+
+    virtual void add(boost::shared_ptr<Runnable> task, int64_t timeout=0LL, int64_t expiration=0LL)
+    {
+        _thread_manager->add(boost::shared_ptr<Runnable>(new CThriftTimedRunnable(task)), timeout, expiration);
+    }
+
+    virtual void remove(boost::shared_ptr<Runnable> task) { _thread_manager->remove(task); }
+
+    virtual boost::shared_ptr<Runnable> removeNextPending()
+    {
+        return unwrap(_thread_manager->removeNextPending());
+    }
+
+    virtual void removeExpiredTasks() { _thread_manager->removeExpiredTasks(); }
+
+    virtual void setExpireCallback(ExpireCallback expire_callback)
+    {
+        // TNonblockingServer的回调将任务转换为它自己的Task类型，须还原
+        _thread_manager->setExpireCallback([expire_callback](boost::shared_ptr<Runnable> task) {
+            expire_callback(unwrap(task));
+        });
+    }
+
+private:
+    static boost::shared_ptr<Runnable> unwrap(const boost::shared_ptr<Runnable>& task)
+    {
+        CThriftTimedRunnable* timed_task = dynamic_cast<CThriftTimedRunnable*>(task.get());
+        return (NULL == timed_task)? task: timed_task->get_task();
+    }
+
+private:
+    boost::shared_ptr<apache::thrift::concurrency::ThreadManager> _thread_manager;
+};
+
+/***
+  * 按方法统计调用数、出错数、正在处理的调用数，以及排队和处理时间的直方图，
+  * 作为Processor的事件处理器（TProcessor::setEventHandler）使用，不需要修改生成的代码和处理函数。
+  *
+  * 为使每次调用的开销在100纳秒以内，统计按线程分开记录（每个线程一把几乎无竞争的锁），
+  * 取统计时才合并，每次调用只取两次时间。
+  * 要求同一调用的getContext和freeContext在同一线程中，同步的Processor均满足。
+  *
+  * 可以串接另一个事件处理器next，各事件在统计之后转发给它。
+  */
+class CThriftMetricsEventHandler: public apache::thrift::TProcessorEventHandler
+{
+public:
+    CThriftMetricsEventHandler(boost::shared_ptr<apache::thrift::TProcessorEventHandler> next=boost::shared_ptr<apache::thrift::TProcessorEventHandler>())
+        : _id(next_id()), _next(next)
+    {
+    }
+
+    ~CThriftMetricsEventHandler()
+    {
+        for (std::vector<ThreadStats*>::size_type i=0; i<_threads.size(); ++i)
+        {
+            ThreadStats* thread_stats = _threads[i];
+            for (std::vector<MethodStats*>::size_type j=0; j<thread_stats->methods.size(); ++j)
+                delete thread_stats->methods[j];
+            delete thread_stats;
+        }
+    }
+
+    virtual void* getContext(const char* fn_name, void* server_context)
+    {
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        ThreadStats* thread_stats = get_thread_stats();
+        Call* call = &thread_stats->call;
+        if (call->method != NULL)
+            call = new Call; // 同一线程中嵌套的调用，不常见
+
+        call->thread_stats = thread_stats;
+        call->method = get_method_stats(thread_stats, fn_name);
+        call->start_time = now;
+        call->next_context = (NULL == _next.get())? NULL: _next->getContext(fn_name, server_context);
+
+        std::chrono::steady_clock::time_point& enqueue_time = thrift_task_enqueue_time();
+        if (enqueue_time != std::chrono::steady_clock::time_point())
+        {
+            call->queue_wait_microseconds = static_cast<int64_t>(std::chrono::duration_cast<std::chrono::microseconds>(now-enqueue_time).count());
+            enqueue_time = std::chrono::steady_clock::time_point(); // 一个任务只计一次
+        }
+        else
+        {
+            call->queue_wait_microseconds = -1;
+        }
+
+        // 只有本线程写，不需要原子的加法
+        call->method->started.store(call->method->started.load(std::memory_order_relaxed)+1, std::memory_order_relaxed);
+        return call;
+    }
+
+    virtual void freeContext(void* ctx, const char* fn_name)
+    {
+        Call* call = static_cast<Call*>(ctx);
+        MethodStats* method = call->method;
+        ThreadStats* thread_stats = call->thread_stats;
+        const uint64_t process_microseconds = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()-call->start_time).count());
+
+        if (_next.get() != NULL)
+            _next->freeContext(call->next_context, fn_name);
+
+        {
+            std::lock_guard<std::mutex> lock(thread_stats->lock);
+            ++method->calls;
+            method->process_microseconds.record(process_microseconds);
+            if (call->queue_wait_microseconds >= 0)
+                method->queue_wait_microseconds.record(static_cast<uint64_t>(call->queue_wait_microseconds));
+        }
+        method->finished.store(method->finished.load(std::memory_order_relaxed)+1, std::memory_order_relaxed);
+
+        if (call == &thread_stats->call)
+            call->method = NULL;
+        else
+            delete call;
+    }
+
+    virtual void preRead(void* ctx, const char* fn_name)
+    {
+        if (_next.get() != NULL)
+            _next->preRead(static_cast<Call*>(ctx)->next_context, fn_name);
+    }
+
+    virtual void postRead(void* ctx, const char* fn_name, uint32_t bytes)
+    {
+        if (_next.get() != NULL)
+            _next->postRead(static_cast<Call*>(ctx)->next_context, fn_name, bytes);
+    }
+
+    virtual void preWrite(void* ctx, const char* fn_name)
+    {
+        if (_next.get() != NULL)
+            _next->preWrite(static_cast<Call*>(ctx)->next_context, fn_name);
+    }
+
+    virtual void postWrite(void* ctx, const char* fn_name, uint32_t bytes)
+    {
+        if (_next.get() != NULL)
+            _next->postWrite(static_cast<Call*>(ctx)->next_context, fn_name, bytes);
+    }
+
+    virtual void asyncComplete(void* ctx, const char* fn_name)
+    {
+        if (_next.get() != NULL)
+            _next->asyncComplete(static_cast<Call*>(ctx)->next_context, fn_name);
+    }
+
+    virtual void handlerError(void* ctx, const char* fn_name)
+    {
+        MethodStats* method = static_cast<Call*>(ctx)->method;
+
+        method->errors.store(method->errors.load(std::memory_order_relaxed)+1, std::memory_order_relaxed);
+        if (_next.get() != NULL)
+            _next->handlerError(static_cast<Call*>(ctx)->next_context, fn_name);
+    }
+
+    /***
+      * 取得各方法的统计，按方法名排序
+      * @reset: 是否清零调用数、出错数和直方图，可定时调用作为监控指标
+      */
+    void get_metrics(std::vector<ThriftMethodMetrics>* metrics, bool reset=true)
+    {
+        std::map<std::string, ThriftMethodMetrics> methods;
+        std::lock_guard<std::mutex> lock(_lock);
+
+        for (std::vector<ThreadStats*>::size_type i=0; i<_threads.size(); ++i)
+        {
+            ThreadStats* thread_stats = _threads[i];
+            std::lock_guard<std::mutex> thread_lock(thread_stats->lock);
+
+            for (std::vector<MethodStats*>::size_type j=0; j<thread_stats->methods.size(); ++j)
+            {
+                // 不同编译单元中同名方法的fn_name可能是不同的指针，按名字合并
+                MethodStats* method = thread_stats->methods[j];
+                ThriftMethodMetrics& method_metrics = methods[method->name];
+                const uint64_t errors = method->errors.load(std::memory_order_relaxed);
+                const uint64_t finished = method->finished.load(std::memory_order_relaxed);
+                const uint64_t started = method->started.load(std::memory_order_relaxed);
+
+                method_metrics.name = method->name;
+                method_metrics.calls += method->calls;
+                method_metrics.errors += errors - method->reported_errors;
+                method_metrics.inflight += static_cast<uint32_t>((started > finished)? started-finished: 0);
+                method_metrics.queue_wait_microseconds.merge(method->queue_wait_microseconds);
+                method_metrics.process_microseconds.merge(method->process_microseconds);
+                if (reset)
+                {
+                    method->calls = 0;
+                    method->reported_errors = errors;
+                    method->queue_wait_microseconds.reset();
+                    method->process_microseconds.reset();
+                }
+            }
+        }
+
+        metrics->clear();
+        metrics->reserve(methods.size());
+        for (std::map<std::string, ThriftMethodMetrics>::iterator iter=methods.begin(); iter!=methods.end(); ++iter)
+            metrics->push_back(iter->second);
+    }
+
+private:
+    struct MethodStats
+    {
+        const char* fn_name;
+        std::string name;
+        uint64_t calls;
+        uint64_t reported_errors; // 上次reset时的errors
+        std::atomic<uint64_t> errors;
+        std::atomic<uint64_t> started;
+        std::atomic<uint64_t> finished;
+        utils::CLatencyHistogram queue_wait_microseconds;
+        utils::CLatencyHistogram process_microseconds;
+
+        MethodStats(const char* fn_name)
+            : fn_name(fn_name), name(fn_name), calls(0), reported_errors(0), errors(0), started(0), finished(0)
+        {
+        }
+    };
+
+    struct ThreadStats;
+    struct Call
+    {
+        ThreadStats* thread_stats;
+        MethodStats* method; // 为NULL表示空闲
+        std::chrono::steady_clock::time_point start_time;
+        int64_t queue_wait_microseconds; // 为-1表示未经过队列
+        void* next_context;
+
+        Call(): thread_stats(NULL), method(NULL), queue_wait_microseconds(-1), next_context(NULL) {}
+    };
+
+    struct ThreadStats
+    {
+        std::thread::id thread_id;
+        std::mutex lock; // 保护各MethodStats的calls和直方图，只和get_metrics竞争
+        std::vector<MethodStats*> methods; // 只有本线程增加，增加时须持有lock，方法数通常不多，顺序查找比std::map快
+        const char* last_fn_name; // 最近一次调用的方法，连续调用同一方法时免查找
+        MethodStats* last_method;
+        Call call; // 同步调用在一个线程中依次进行，复用以免每次分配
+
+        ThreadStats(): last_fn_name(NULL), last_method(NULL) {}
+    };
+
+    // 用id而不是this识别，以免新对象和已删除的对象地址相同
+    static uint64_t next_id()
+    {
+        static std::atomic<uint64_t> id(0);
+        return ++id;
+    }
+
+    ThreadStats* get_thread_stats()
+    {
+        static thread_local uint64_t owner_id = 0;
+        static thread_local ThreadStats* thread_stats = NULL;
+
+        if (owner_id != _id)
+        {
+            const std::thread::id thread_id = std::this_thread::get_id();
+            std::lock_guard<std::mutex> lock(_lock);
+
+            thread_stats = NULL;
+            for (std::vector<ThreadStats*>::size_type i=0; i<_threads.size(); ++i)
+            {
+                if (_threads[i]->thread_id == thread_id)
+                {
+                    thread_stats = _threads[i];
+                    break;
+                }
+            }
+            if (NULL == thread_stats)
+            {
+                thread_stats = new ThreadStats;
+                thread_stats->thread_id = thread_id;
+                _threads.push_back(thread_stats);
+            }
+            owner_id = _id;
+        }
+
+        return thread_stats;
+    }
+
+    MethodStats* get_method_stats(ThreadStats* thread_stats, const char* fn_name)
+    {
+        if (fn_name == thread_stats->last_fn_name)
+            return thread_stats->last_method;
+
+        MethodStats* method = NULL;
+        for (std::vector<MethodStats*>::size_type i=0; i<thread_stats->methods.size(); ++i)
+        {
+            if (thread_stats->methods[i]->fn_name == fn_name)
+            {
+                method = thread_stats->methods[i];
+                break;
+            }
+        }
+        if (NULL == method)
+        {
+            // get_metrics遍历methods时持有thread_stats->lock
+            std::lock_guard<std::mutex> thread_lock(thread_stats->lock);
+            method = new MethodStats(fn_name);
+            thread_stats->methods.push_back(method);
+        }
+
+        thread_stats->last_fn_name = fn_name;
+        thread_stats->last_method = method;
+        return method;
+    }
+
+private:
+    const uint64_t _id;
+    boost::shared_ptr<apache::thrift::TProcessorEventHandler> _next;
+    std::mutex _lock; // 保护_threads
+    std::vector<ThreadStats*> _threads;
+};
+
+NET_NAMESPACE_END
+#endif // MOOON_NET_THRIFT_METRICS_H
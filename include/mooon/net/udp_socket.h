@@ -19,8 +19,91 @@
 #ifndef MOOON_NET_UDP_SOCKET_H
 #define MOOON_NET_UDP_SOCKET_H
 #include "mooon/net/epollable.h"
+#include "mooon/utils/scoped_ptr.h"
 NET_NAMESPACE_BEGIN
 
+/***
+  * 批量收发UDP消息的预分配消息向量，供CUdpSocket::receive_batch和CUdpSocket::send_batch使用，
+  * 构造时一次性分配好mmsghdr、iovec、地址和数据缓冲区，之后的收发不再有任何内存分配。
+  * 非线程安全，每个读线程应当使用自己的CUdpMessageBatch。
+  *
+  * 使用示例（接收）：
+  * net::CUdpMessageBatch batch(64, 1472);
+  * int n = udp_socket.receive_batch(&batch);
+  * for (int i=0; i<n; ++i)
+  *     handle(batch.get_buffer(i), batch.get_length(i), batch.get_addr(i));
+  *
+  * 使用示例（发送）：
+  * batch.clear();
+  * batch.add(data1, size1, to_addr);
+  * batch.add(data2, size2, to_addr);
+  * udp_socket.send_batch(&batch);
+  */
+class CUdpMessageBatch
+{
+    friend class CUdpSocket;
+
+public:
+    /***
+      * @capacity: 最多可容纳的消息个数，即一次recvmmsg或sendmmsg的最大消息数
+      * @message_size: 单个消息的缓冲区大小，如果开启了GRO，应当设置为SIZE_64K
+      */
+    CUdpMessageBatch(unsigned int capacity, size_t message_size);
+
+    unsigned int capacity() const { return _capacity; }
+    size_t message_size() const { return _message_size; }
+
+    /** 当前有效的消息个数，接收后为收到的消息数，发送前为已add的消息数 */
+    unsigned int count() const { return _count; }
+
+    /** 清空已有消息，以便重新add */
+    void clear() { _count = 0; }
+
+    /***
+      * 添加一个待发送的消息，数据被复制到预分配的缓冲区中
+      * @return: 如果已满或size超过message_size，则返回false
+      */
+    bool add(const void* data, size_t size, const struct sockaddr_in& to_addr);
+    bool add(const void* data, size_t size, uint32_t to_ip, uint16_t to_port);
+
+    /** 得到第index个消息的缓冲区，可直接填充后再调用set_length和set_addr，以避免add的复制 */
+    char* get_buffer(unsigned int index) const { return _buffers.get() + index * _message_size; }
+
+    /** 得到第index个消息的数据长度 */
+    size_t get_length(unsigned int index) const;
+
+    /** 得到第index个消息的源地址（接收时）或目标地址（发送时） */
+    const struct sockaddr_in& get_addr(unsigned int index) const { return _addrs[index]; }
+
+    /***
+      * 得到第index个消息的GRO分段大小，
+      * 仅在开启GRO时有意义，返回0表示该消息为单个数据报，
+      * 否则消息由多个大小为返回值的数据报合并而成（最后一个可能更小）
+      */
+    uint16_t get_segment_size(unsigned int index) const;
+
+    /** 直接填充缓冲区后设置第index个消息，index须等于count() */
+    bool set_message(unsigned int index, size_t size, const struct sockaddr_in& to_addr);
+
+private:
+    CUdpMessageBatch(const CUdpMessageBatch&);
+    CUdpMessageBatch& operator =(const CUdpMessageBatch&);
+    void prepare_receive();
+    void prepare_send();
+
+private:
+    unsigned int _capacity;
+    unsigned int _count;
+    size_t _message_size;
+    size_t _control_size;
+    // 构造中途抛出异常时，已分配的由各自析构释放
+    utils::ScopedArray<struct mmsghdr> _msgs;
+    utils::ScopedArray<struct iovec> _iovecs;
+    utils::ScopedArray<struct sockaddr_in> _addrs;
+    utils::ScopedArray<char> _controls;
+    utils::ScopedArray<char> _buffers;
+};
+
 // UDP不分服务端和客户端，
 // 但如果仅做服务端或即做服务端又做客户端时，都必须调用listen()，
 // 仅做客户端使用时，可不必调用listen()
@@ -31,6 +114,10 @@ NET_NAMESPACE_BEGIN
 // UDP首部8字节，所以UDP数据大小为1472，当UDP发送大小1472的数据时，链路层需要分片（Fragment），这样IP层需要重组数据，可能会重组失败导致数据丢失
 //
 // 标准的MTU大小为576（Windows默认为1500），减去IP首部和UDP首部后为548，因此UDP发送的数据大小不超过548是最安全的。
+//
+// 单端口高包量时，可创建多个CUdpSocket，均以reuse_port为true调用listen()监听同一端口，
+// 每个读线程独占一个CUdpSocket和一个CUdpMessageBatch，由内核按四元组哈希将数据报分散到各socket，
+// 再配合receive_batch减少系统调用次数。
 class CUdpSocket: public CEpollable
 {
 public:
@@ -52,6 +139,46 @@ public:
 
     int timed_receive_from(void* buffer, size_t buffer_size, uint32_t* from_ip, uint16_t* from_port, uint32_t milliseconds);
     int timed_receive_from(void* buffer, size_t buffer_size, struct sockaddr_in* from_addr, uint32_t milliseconds);
+
+    /***
+      * 基于recvmmsg一次接收多个消息
+      * @batch: 预分配的消息向量，接收前原有内容被清除
+      * @return: 成功返回接收到的消息个数（同batch->count()），如果返回-1表示为非阻塞模式没有数据可接收
+      * @exception: 出错抛出CSyscallException异常
+      */
+    int receive_batch(CUdpMessageBatch* batch);
+
+    /***
+      * 以超时方式批量接收，超时抛出CSyscallException异常
+      */
+    int timed_receive_batch(CUdpMessageBatch* batch, uint32_t milliseconds);
+
+    /***
+      * 基于sendmmsg一次发送batch中的所有消息
+      * @return: 返回实际发送的消息个数，可能小于batch->count()，如果返回-1表示为非阻塞模式不能继续发送
+      * @exception: 出错抛出CSyscallException异常
+      */
+    int send_batch(CUdpMessageBatch* batch);
+
+    /***
+      * 设置GSO（UDP_SEGMENT）分段大小，之后单次发送的大数据由内核或网卡按segment_size切分成多个数据报，
+      * segment_size为0表示关闭，要求内核4.18及以上版本
+      * @exception: 出错或不支持时抛出CSyscallException异常
+      */
+    void set_gso_segment(uint16_t segment_size);
+
+    /***
+      * 开启或关闭GRO（UDP_GRO），开启后一次接收可能得到多个合并的数据报，
+      * 需通过CUdpMessageBatch::get_segment_size拆分，要求内核5.0及以上版本
+      * @exception: 出错或不支持时抛出CSyscallException异常
+      */
+    void set_gro(bool yes);
+
+    /** 是否开启了GRO */
+    bool is_gro() const { return _gro; }
+
+private:
+    bool _gro;
 };
 
 NET_NAMESPACE_END
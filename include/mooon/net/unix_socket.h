@@ -0,0 +1,158 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#ifndef MOOON_NET_UNIX_SOCKET_H
+#define MOOON_NET_UNIX_SOCKET_H
+#include "mooon/net/epollable.h"
+#include <sys/uio.h>
+NET_NAMESPACE_BEGIN
+
+// 单次send_fds或receive_fds最多可传递的句柄个数
+#define UNIX_SOCKET_FD_MAX 16
+
+/***
+  * Unix域监听者类，和CListener对应，用于同机进程间通信，不经过TCP/IP协议栈
+  *
+  * path为文件系统路径，如：/var/run/xxx.sock，
+  * 如果以“@”开头，则为Linux抽象名字空间（不在文件系统中创建文件，进程退出后自动消失）
+  */
+class CUnixListener: public CEpollable
+{
+public:
+    CUnixListener();
+    ~CUnixListener();
+
+    /***
+      * 启动监听
+      * @path: 监听路径
+      * @type: SOCK_STREAM或SOCK_SEQPACKET，SOCK_SEQPACKET保留消息边界
+      * @nonblock: 是否为非阻塞
+      * @unlink_existing: 是否先删除已存在的文件，通常为上次进程退出时遗留的
+      * @exception: 如果发生错误，则抛出CSyscallException异常
+      */
+    void listen(const std::string& path, int type=SOCK_STREAM, bool nonblock=true, bool unlink_existing=true);
+
+    /***
+      * 接受连接请求，新句柄带有FD_CLOEXEC标志
+      * @nonblock: 新句柄是否为非阻塞的
+      * @return: 新的SOCKET句柄，可关联到CUnixSocket，非阻塞模式下无连接请求时返回-1
+      * @exception: 如果发生错误，则抛出CSyscallException异常
+      */
+    int accept(bool nonblock=true);
+
+    /** 得到监听的路径 */
+    const std::string& get_path() const { return _path; }
+
+    /** 得到SOCKET类型 */
+    int get_type() const { return _type; }
+
+private:
+    virtual void before_close();
+
+private:
+    int _type;
+    std::string _path;
+    pid_t _owner_pid; // 创建监听的进程，只由它删除_path
+};
+
+/***
+  * Unix域连接类，客户端和服务端共用，接口和CTcpClient及CTcpWaiter一致，
+  * 另外支持通过SCM_RIGHTS在进程间传递句柄，
+  * 如监听进程将accept到的TCP连接交给工作进程处理
+  */
+class CUnixSocket: public CEpollable
+{
+public:
+    CUnixSocket();
+    ~CUnixSocket();
+
+    /***
+      * 创建一对已互相连接的CUnixSocket，常用于父子进程或线程间通信
+      * @type: SOCK_STREAM或SOCK_SEQPACKET
+      * @exception: 如果发生错误，则抛出CSyscallException异常
+      */
+    static void socketpair(CUnixSocket& first, CUnixSocket& second, int type=SOCK_STREAM);
+
+    /** 得到字符串格式的身份 */
+    std::string to_string() const;
+
+    /** 得到连接的路径，通过attach或socketpair得到的为空 */
+    const std::string& get_path() const { return _path; }
+
+    /***
+      * 连接到指定路径
+      * @path: 对端CUnixListener监听的路径
+      * @type: SOCK_STREAM或SOCK_SEQPACKET，须和对端一致
+      * @milliseconds: 连接超时毫秒数，Unix域通常立即完成，只在对端accept队列满时等待
+      * @exception: 连接出错或超时，抛出CSyscallException异常
+      */
+    void connect(const std::string& path, int type=SOCK_STREAM, uint32_t milliseconds=1000);
+
+    /***
+      * 关联到一个fd
+      * @fd: CUnixListener::accept的返回值
+      */
+    void attach(int fd);
+
+    /***
+      * 得到对端进程的pid、uid和gid（SO_PEERCRED），可用于鉴权
+      * @exception: 如果发生错误，则抛出CSyscallException异常
+      */
+    void get_peer_credentials(pid_t* pid, uid_t* uid, gid_t* gid) const;
+
+    /** 以下同CTcpWaiter */
+    ssize_t receive(char* buffer, size_t buffer_size);
+    ssize_t send(const char* buffer, size_t buffer_size);
+    ssize_t timed_receive(char* buffer, size_t buffer_size, uint32_t milliseconds);
+    ssize_t timed_send(const char* buffer, size_t buffer_size, uint32_t milliseconds);
+    bool full_receive(char* buffer, size_t& buffer_size);
+    void full_send(const char* buffer, size_t& buffer_size);
+    ssize_t readv(const struct iovec *iov, int iovcnt);
+    ssize_t writev(const struct iovec *iov, int iovcnt);
+
+    /***
+      * 通过SCM_RIGHTS发送句柄，发送成功后本进程仍持有这些句柄，是否关闭由调用者决定
+      * @fds: 需要发送的句柄数组
+      * @fd_count: 句柄个数，不能超过UNIX_SOCKET_FD_MAX
+      * @buffer: 同时发送的数据，至少1字节，为NULL时发送1字节的'\0'
+      * @buffer_size: 数据字节数
+      * @return: 发送的数据字节数，对于非阻塞连接，如果不能继续发送，则返回-1
+      * @exception: 如果发生错误，则抛出CSyscallException异常
+      */
+    ssize_t send_fds(const int* fds, int fd_count, const char* buffer=NULL, size_t buffer_size=0);
+    ssize_t send_fd(int fd, const char* buffer=NULL, size_t buffer_size=0);
+
+    /***
+      * 接收通过SCM_RIGHTS传递过来的句柄，收到的句柄带有FD_CLOEXEC标志
+      * @fds: 用来存储收到的句柄，至少能容纳UNIX_SOCKET_FD_MAX个
+      * @fd_count: 返回收到的句柄个数，没有句柄时为0
+      * @buffer: 接收同时发送的数据
+      * @buffer_size: buffer的字节数，须大于0
+      * @return: 收到的数据字节数，如果对端关闭了连接，则返回0，对于非阻塞连接，如果无数据可接收，则返回-1
+      * @exception: 如果发生错误，则抛出CSyscallException异常
+      */
+    ssize_t receive_fds(int* fds, int* fd_count, char* buffer, size_t buffer_size);
+    ssize_t receive_fd(int* fd, char* buffer, size_t buffer_size);
+
+private:
+    void* _data_channel;
+    std::string _path;
+};
+
+NET_NAMESPACE_END
+#endif // MOOON_NET_UNIX_SOCKET_H
@@ -0,0 +1,187 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+// 自适应批量和指数退避，用于队列搬运类工具（如queue_redis2kafka），
+// 有积压时增大批量以提高吞吐，空闲时减小批量以降低延迟，并以指数退避代替固定时长的休眠
+#ifndef MOOON_SYS_ADAPTIVE_BATCH_H
+#define MOOON_SYS_ADAPTIVE_BATCH_H
+#include "mooon/sys/utils.h"
+#include <stdint.h>
+SYS_NAMESPACE_BEGIN
+
+// 休眠指定毫秒数，但每100毫秒检查一次stop，为true时提前返回，
+// 用于退避时长较长时仍能及时响应退出，stop可为std::atomic<bool>或CAtomic<bool>等
+template <class StopFlag>
+inline void interruptible_millisleep(uint32_t milliseconds, const StopFlag& stop)
+{
+    while ((milliseconds > 0) && !stop)
+    {
+        const uint32_t slice = (milliseconds > 100)? 100: milliseconds;
+        CUtils::millisleep(slice);
+        milliseconds -= slice;
+    }
+}
+
+// 指数退避，每次next返回的毫秒数翻倍，直到max_milliseconds
+class CBackoff
+{
+public:
+    CBackoff(uint32_t min_milliseconds=10, uint32_t max_milliseconds=1000)
+        : _min_milliseconds((0 == min_milliseconds)? 1: min_milliseconds),
+          _max_milliseconds((max_milliseconds < min_milliseconds)? min_milliseconds: max_milliseconds),
+          _milliseconds(0)
+    {
+    }
+
+    // 返回本次应休眠的毫秒数
+    uint32_t next()
+    {
+        if (0 == _milliseconds)
+            _milliseconds = _min_milliseconds;
+        else if (_milliseconds < _max_milliseconds/2)
+            _milliseconds *= 2;
+        else
+            _milliseconds = _max_milliseconds;
+        return _milliseconds;
+    }
+
+    // 成功后调用，下次从min_milliseconds开始
+    void reset()
+    {
+        _milliseconds = 0;
+    }
+
+    // 当前的退避毫秒数，为0表示未在退避中
+    uint32_t current() const
+    {
+        return _milliseconds;
+    }
+
+private:
+    uint32_t _min_milliseconds;
+    uint32_t _max_milliseconds;
+    uint32_t _milliseconds;
+};
+
+// 自适应批量，非线程安全，每个搬运线程一个
+//
+// 使用示例：
+// CAdaptiveBatch adaptive_batch(1, 1000);
+// while (!stop)
+// {
+//     const int n = rpop(adaptive_batch.get_batch(), &logs);
+//     const uint32_t milliseconds = adaptive_batch.on_fetched(n);
+//     if (milliseconds > 0)
+//         interruptible_millisleep(milliseconds, stop);
+//     else if (!push(logs))
+//         interruptible_millisleep(adaptive_batch.on_error(), stop);
+//     else
+//         adaptive_batch.on_success();
+// }
+class CAdaptiveBatch
+{
+public:
+    // min_batch 最小批量，空闲时使用
+    // max_batch 最大批量，积压时逐步增大到它
+    // max_idle_milliseconds 源空时最长的休眠毫秒数
+    // max_error_milliseconds 出错时最长的休眠毫秒数
+    CAdaptiveBatch(int min_batch, int max_batch, uint32_t max_idle_milliseconds=1000, uint32_t max_error_milliseconds=10000)
+        : _min_batch((min_batch < 1)? 1: min_batch),
+          _max_batch((max_batch < _min_batch)? _min_batch: max_batch),
+          _batch(_min_batch),
+          _idle_backoff(1, max_idle_milliseconds),
+          _error_backoff(10, max_error_milliseconds),
+          _total(0)
+    {
+    }
+
+    // 下一次应取的个数
+    int get_batch() const
+    {
+        return _batch;
+    }
+
+    // 实际取到count个后调用，
+    // 返回下一次取之前应休眠的毫秒数，为0表示不用休眠
+    uint32_t on_fetched(int count)
+    {
+        if (count <= 0)
+        {
+            // 源为空，回到最小批量，并逐步拉长休眠时长
+            _batch = _min_batch;
+            return _idle_backoff.next();
+        }
+
+        _idle_backoff.reset();
+        _total += count;
+        if (count >= _batch)
+        {
+            // 取满表示有积压，批量翻倍
+            _batch = (_batch > _max_batch/2)? _max_batch: _batch*2;
+        }
+        else if (count < _batch/2)
+        {
+            // 接近取空，减半以降低延迟
+            _batch = (_batch/2 < _min_batch)? _min_batch: _batch/2;
+        }
+        return 0;
+    }
+
+    // 写目标出错（如Kafka发送队列满、Redis异常）时调用，
+    // 减小批量，并返回重试前应休眠的毫秒数
+    uint32_t on_error()
+    {
+        _batch = (_batch/2 < _min_batch)? _min_batch: _batch/2;
+        return _error_backoff.next();
+    }
+
+    // 写目标成功后调用
+    void on_success()
+    {
+        _error_backoff.reset();
+    }
+
+    // 累计取到的个数
+    uint64_t get_total() const
+    {
+        return _total;
+    }
+
+    // 当前源为空时的退避毫秒数
+    uint32_t get_idle_milliseconds() const
+    {
+        return _idle_backoff.current();
+    }
+
+    // 当前出错时的退避毫秒数
+    uint32_t get_error_milliseconds() const
+    {
+        return _error_backoff.current();
+    }
+
+private:
+    int _min_batch;
+    int _max_batch;
+    int _batch;
+    CBackoff _idle_backoff;
+    CBackoff _error_backoff;
+    uint64_t _total;
+};
+
+SYS_NAMESPACE_END
+#endif // MOOON_SYS_ADAPTIVE_BATCH_H
@@ -1,5 +1,6 @@
 // Writed by yijian (eyjian@qq.com or eyjian@gmail.com)
 #include <mooon/sys/syscall_exception.h>
+#include <functional>
 #include <memory>
 #include <string>
 #include <vector>
@@ -27,6 +28,120 @@ private:
     void* _post;
 };
 
+// 响应包体的接收者，数据由curl分块（通常不超过16KB）交给on_data，
+// 相比先完整地拼接成std::string，大包体可边收边处理，不用反复realloc和复制。
+// on_data等中抛出的异常会中止传输，并在http_get等调用返回前重新抛出。
+class CHttpBodySink
+{
+public:
+    virtual ~CHttpBodySink() {}
+
+    // 如果响应带有Content-Length，则在第一块数据之前被调用，可用来预分配空间
+    virtual void on_content_length(uint64_t content_length) {}
+
+    // 返回false中止传输，http_get等抛出CURLE_WRITE_ERROR异常
+    virtual bool on_data(const char* data, size_t size) = 0;
+
+    // 传输成功后被调用，出错时不调用
+    virtual void on_finish() {}
+};
+
+// 返回false中止传输
+typedef std::function<bool (const char* data, size_t size)> HttpChunkCallback;
+
+// 接收到std::string中，按Content-Length一次预分配，
+// 为防止异常的Content-Length导致分配过多内存，预分配不超过max_reserve_size
+class CHttpStringSink: public CHttpBodySink
+{
+public:
+    CHttpStringSink(std::string* body, size_t max_reserve_size=SIZE_1G);
+
+private:
+    virtual void on_content_length(uint64_t content_length);
+    virtual bool on_data(const char* data, size_t size);
+
+private:
+    std::string* _body;
+    size_t _max_reserve_size;
+};
+
+// 每收到一块即回调，不缓存
+class CHttpChunkSink: public CHttpBodySink
+{
+public:
+    CHttpChunkSink(const HttpChunkCallback& callback);
+
+private:
+    virtual bool on_data(const char* data, size_t size);
+
+private:
+    HttpChunkCallback _callback;
+};
+
+// 先将小块合并到固定大小的缓冲区，满了（和最后）才回调，
+// 缓冲区取自线程的缓冲区池，同一线程中反复下载时不会每次都分配，
+// 所以须在同一线程中创建和销毁
+class CHttpBufferSink: public CHttpBodySink
+{
+public:
+    CHttpBufferSink(const HttpChunkCallback& callback, size_t buffer_size=SIZE_1M);
+    ~CHttpBufferSink();
+
+private:
+    virtual bool on_data(const char* data, size_t size);
+    virtual void on_finish();
+
+private:
+    HttpChunkCallback _callback;
+    char* _buffer;
+    size_t _buffer_size;
+    size_t _size; // 缓冲区中的字节数
+};
+
+// 文件的写方式
+enum http_file_mode_t
+{
+    http_file_write  = 0, // 合并成大块后write
+    http_file_direct = 1, // O_DIRECT，不占页缓存，文件系统不支持时（如tmpfs）自动退为http_file_write
+    http_file_mmap   = 2  // 按Content-Length截断文件并mmap，直接复制到映射区，无Content-Length时退为http_file_write
+};
+
+// 接收到文件中，构造时创建或截断文件，
+// 有Content-Length时，先用posix_fallocate预分配磁盘空间，减少碎片和元数据更新，
+// 缓冲区取自线程的缓冲区池，须在同一线程中创建和销毁
+class CHttpFileSink: public CHttpBodySink
+{
+public:
+    // @exception: 创建文件出错抛出CSyscallException异常
+    CHttpFileSink(const std::string& filepath, http_file_mode_t mode=http_file_write, size_t buffer_size=SIZE_1M);
+    ~CHttpFileSink();
+
+    const std::string& get_filepath() const { return _filepath; }
+    http_file_mode_t get_mode() const { return _mode; } // 实际使用的方式
+    uint64_t get_size() const { return _offset + _size; } // 已收到的字节数
+
+private:
+    virtual void on_content_length(uint64_t content_length);
+    virtual bool on_data(const char* data, size_t size);
+    virtual void on_finish();
+
+private:
+    void write_buffer(size_t size);
+    void close();
+
+private:
+    std::string _filepath;
+    http_file_mode_t _mode;
+    int _fd;
+    char* _buffer;
+    size_t _buffer_size;
+    size_t _size; // 缓冲区中的字节数
+    uint64_t _offset; // 已写入文件的字节数
+    char* _map; // http_file_mmap时的映射区
+    uint64_t _map_size;
+    bool _preallocated;
+};
+
 // libcurl包装类
 // 如果需要访问https，则在编译curl时需要指定configure的参数--with-ssl的值，值为openssl的安装目录
 //
@@ -76,6 +191,11 @@ public:
     void http_get(std::string& response_header, std::string& response_body, const std::string& url, bool enable_insecure=false, const char* cookie=NULL);
     void proxy_http_get(std::string& response_header, std::string& response_body, const std::string& proxy_host, uint16_t proxy_port, const std::string& url, bool enable_insecure=false, const char* cookie=NULL);
 
+    // 响应包体交给body_sink，如：
+    // CHttpFileSink body_sink("/tmp/big.tar.gz", http_file_direct);
+    // curl_wrapper.http_get(response_header, &body_sink, url);
+    void http_get(std::string& response_header, CHttpBodySink* body_sink, const std::string& url, bool enable_insecure=false, const char* cookie=NULL);
+
     // HTTP POST请求
     // 重复调用之前，须先调用reset()清除上一次调用的状态
     void http_post(const std::string& data, std::string& response_header, std::string& response_body, const std::string& url, bool enable_insecure=false, const char* cookie=NULL);
@@ -84,7 +204,11 @@ public:
     void proxy_http_post(const std::string& data, std::string& response_header, std::string& response_body, const std::string& proxy_host, uint16_t proxy_port, const std::string& url, bool enable_insecure=false, const char* cookie=NULL);
     void proxy_http_post(const CHttpPostData* http_post, std::string& response_header, std::string& response_body, const std::string& proxy_host, uint16_t proxy_port, const std::string& url, bool enable_insecure=false, const char* cookie=NULL);
 
-    // GET方式下载文件
+    // 响应包体交给body_sink
+    void http_post(const std::string& data, std::string& response_header, CHttpBodySink* body_sink, const std::string& url, bool enable_insecure=false, const char* cookie=NULL);
+
+    // GET方式下载文件，相当于使用http_file_write方式的CHttpFileSink，
+    // 需要O_DIRECT或mmap时，直接使用CHttpFileSink调用http_get。
     // 注意需要处理CSyscallException异常，如果没有创建和写local_filepath权限，会抛出这个异常。
     void http_get_download(std::string& response_header, const std::string& local_filepath, const std::string& url, bool enable_insecure=false, const char* cookie=NULL);
     void proxy_http_get_download(std::string& response_header, const std::string& local_filepath, const std::string& proxy_host, uint16_t proxy_port, const std::string& url, bool enable_insecure=false, const char* cookie=NULL);
@@ -111,6 +235,9 @@ private:
     // 重置操作
     void reset(const std::string& url, const char* cookie, bool enable_insecure, size_t (*on_write_response_body_into_FILE_proc)(void*, size_t, size_t, void*));
 
+    // 执行请求，包体交给body_sink
+    void perform(CHttpBodySink* body_sink);
+
 private:
     void* _curl_version_info; // curl_version_info_data
     void* _curl;
@@ -0,0 +1,293 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: jian yi, eyjian@qq.com
+ */
+#ifndef MOOON_SYS_DB_CONNECTION_POOL_H
+#define MOOON_SYS_DB_CONNECTION_POOL_H
+#include "mooon/sys/event.h"
+#include "mooon/sys/simple_db.h"
+#include <list>
+SYS_NAMESPACE_BEGIN
+
+/***
+  * CDBConnectionPool的错误码，接在db_exception.h中的错误码之后
+  */
+enum
+{
+    DB_ERROR_POOL_TIMEOUT = 100,    // 在指定时间内没有借到连接
+    DB_ERROR_HOST_UNAVAILABLE = 101 // 分片的所有可用DB都处于连接失败后的退避期
+};
+
+/***
+  * CDBConnectionPool的统计
+  */
+struct DBConnectionPoolMetrics
+{
+    uint64_t lease_count;
+    uint64_t lease_waits;      // 因连接全部借出或正在建连而等待的次数
+    uint64_t lease_timeouts;
+    uint64_t connect_count;
+    uint64_t connect_failures;
+    uint64_t ping_failures;    // 空闲连接借出前ping失败的次数
+    uint64_t broken_count;     // 以断连归还的连接数
+    uint32_t idle_connections;
+    uint32_t leased_connections;
+
+    DBConnectionPoolMetrics()
+        : lease_count(0), lease_waits(0), lease_timeouts(0),
+          connect_count(0), connect_failures(0), ping_failures(0), broken_count(0),
+          idle_connections(0), leased_connections(0)
+    {
+    }
+};
+
+// 创建未打开的DB连接，如：new CMySQLConnection
+typedef std::function<DBConnection* ()> DBConnectionCreator;
+
+/***
+  * 线程安全的DB连接池，支持按键哈希分片和读写分离
+  *
+  * 每个分片有一个主库和零个或多个从库，每个DB各自维护一组连接，连接数不超过set_max_connections()指定的值：
+  * 1) 写（readonly为false）总是借主库的连接，读轮询从库，所有从库都不可用时借主库的连接；
+  * 2) 借出空闲超过set_idle_ping_seconds()的连接前先ping，失败则关闭它再借下一个；
+  * 3) 以断连归还时，同时关闭该DB的全部空闲连接，因为主从切换或DB重启后它们通常都已失效；
+  * 4) 同一DB同一时刻只有一个线程在建连，其它线程等待归还的连接或建连结果，
+  *    建连失败后该DB进入退避期（指数增长），退避期内不再建连，读会转到其它DB，其它请求立即失败，
+  *    以避免主从切换后大量线程同时重连而形成连接风暴。
+  *
+  * 池中的连接不启用自动重连，断连由池关闭并重建。
+  *
+  * 使用示例：
+  * CDBConnectionPool db_pool("mysql_connection");
+  * db_pool.set_db_name("test");
+  * db_pool.set_user("root", "");
+  * db_pool.set_max_connections(16);
+  * const uint32_t shard = db_pool.add_shard("127.0.0.1", 3306);
+  * db_pool.add_replica(shard, "127.0.0.2", 3306);
+  *
+  * // 在任意线程中
+  * CDBConnectionLease db(&db_pool, db_pool.get_shard_by_key(user_id), true);
+  * try
+  * {
+  *     db->query(db_table, "SELECT * FROM t_user WHERE f_id='%s'", db->escape_string(user_id).c_str());
+  * }
+  * catch (CDBException& db_error)
+  * {
+  *     db.check_exception(db_error); // 如果是断连，则归还时关闭该连接
+  *     throw;
+  * }
+  */
+class CDBConnectionPool
+{
+public:
+    /***
+      * @db_type: 通过CObjectFacotry创建连接的类型名，如“mysql_connection”和“sqlite3_connection”，
+      *           对应的实现须被链入（参见mysql_db.h中关于“-whole-archive”的说明）
+      */
+    CDBConnectionPool(const std::string& db_type="mysql_connection");
+    CDBConnectionPool(const DBConnectionCreator& creator);
+    ~CDBConnectionPool();
+
+    /** 以下设置须在add_shard()之前调用，作用于池中的所有连接 */
+    void set_db_name(const std::string& db_name) { _db_name = db_name; }
+    void set_user(const std::string& db_user, const std::string& db_password) { _db_user = db_user; _db_password = db_password; }
+    void set_charset(const std::string& charset) { _charset = charset; }
+    void set_timeout_seconds(int connect_timeout_seconds, int read_timeout_seconds=-1, int write_timeout_seconds=-1);
+
+    /** 每个DB的最大连接数，包括空闲的和借出的，默认为8 */
+    void set_max_connections(uint32_t max_connections) { _max_connections = max_connections; }
+
+    /** 空闲超过指定秒数的连接在借出前ping，为0表示总是ping，默认为30 */
+    void set_idle_ping_seconds(uint32_t seconds) { _idle_ping_seconds = seconds; }
+
+    /** 空闲超过指定秒数的连接被关闭，为0表示不关闭，默认为600，应小于MySQL的wait_timeout */
+    void set_max_idle_seconds(uint32_t seconds) { _max_idle_seconds = seconds; }
+
+    /** 建连失败后的退避毫秒数，从min_milliseconds开始每次失败翻倍，不超过max_milliseconds，默认为100到10000 */
+    void set_backoff_milliseconds(uint32_t min_milliseconds, uint32_t max_milliseconds);
+
+    /***
+      * 增加一个分片，分片号从0开始按增加的顺序编号
+      * @return: 分片号
+      */
+    uint32_t add_shard(const std::string& master_ip, uint16_t master_port);
+
+    /***
+      * 为分片增加一个从库
+      * @exception: 如果分片不存在，则抛出CDBException异常
+      */
+    void add_replica(uint32_t shard, const std::string& ip, uint16_t port);
+
+    uint32_t get_shard_count() const { return static_cast<uint32_t>(_shards.size()); }
+
+    /** 按键哈希得到分片号，同一个键在不同进程中总是得到相同的分片号 */
+    uint32_t get_shard_by_key(const std::string& key) const;
+    uint32_t get_shard_by_key(uint64_t key) const;
+
+    /***
+      * 借一个已打开的连接，须调用pay_back()归还，建议使用CDBConnectionLease
+      * @readonly: 为true时优先借从库的连接
+      * @timeout_milliseconds: 等待可用连接的最长毫秒数
+      * @exception: 借不到连接时抛出CDBException异常，
+      *             错误码为DB_ERROR_POOL_TIMEOUT、DB_ERROR_HOST_UNAVAILABLE或建连时DB返回的错误码
+      */
+    DBConnection* lease(uint32_t shard=0, bool readonly=false, uint32_t timeout_milliseconds=1000);
+
+    /***
+      * 归还借出的连接
+      * @broken: 为true时关闭该连接及其所属DB的全部空闲连接，而不是放回池中
+      */
+    void pay_back(DBConnection* db_connection, bool broken=false);
+
+    /** 是否为须关闭连接的异常，即is_disconnected_exception()或is_lost_connection_exception() */
+    static bool is_broken_exception(const DBConnection* db_connection, CDBException& db_error);
+
+    /** 关闭所有空闲连接，借出的连接在归还时关闭 */
+    void close_idle_connections();
+
+    DBConnectionPoolMetrics get_metrics() const;
+
+private:
+    struct IdleConnection
+    {
+        DBConnection* db_connection;
+        uint64_t idle_milliseconds; // 放回池中的时间
+
+        IdleConnection(DBConnection* db_connection_, uint64_t idle_milliseconds_)
+            : db_connection(db_connection_), idle_milliseconds(idle_milliseconds_)
+        {
+        }
+    };
+
+    struct Host
+    {
+        std::string ip;
+        uint16_t port;
+        std::list<IdleConnection> idle_connections; // 最近归还的在前
+        uint32_t num_connections; // 空闲的、借出的和正在建立的
+        bool connecting;
+        uint32_t consecutive_failures;
+        uint64_t backoff_until_milliseconds;
+        std::string last_error;
+
+        Host(const std::string& ip_, uint16_t port_)
+            : ip(ip_), port(port_), num_connections(0), connecting(false),
+              consecutive_failures(0), backoff_until_milliseconds(0)
+        {
+        }
+    };
+
+    struct Shard
+    {
+        Host* master;
+        std::vector<Host*> replicas;
+        uint32_t next_replica; // 用于轮询从库
+    };
+
+private:
+    CDBConnectionPool(const CDBConnectionPool&);
+    CDBConnectionPool& operator =(const CDBConnectionPool&);
+
+    Host* select_host(Shard* shard, bool readonly, uint64_t now_milliseconds);
+    DBConnection* connect(Host* host);
+    void on_connect_failed(Host* host, const std::string& errmsg);
+    void remove_idle_connections(Host* host, bool expired_only, uint64_t now_milliseconds, std::vector<DBConnection*>* db_connections);
+    static void close_connections(const std::vector<DBConnection*>& db_connections);
+
+private:
+    std::string _db_type;
+    DBConnectionCreator _creator;
+    std::string _db_name;
+    std::string _db_user;
+    std::string _db_password;
+    std::string _charset;
+    int _connect_timeout_seconds;
+    int _read_timeout_seconds;
+    int _write_timeout_seconds;
+    uint32_t _max_connections;
+    uint32_t _idle_ping_seconds;
+    uint32_t _max_idle_seconds;
+    uint32_t _min_backoff_milliseconds;
+    uint32_t _max_backoff_milliseconds;
+
+private:
+    mutable CLock _lock;
+    CEvent _event; // 有连接归还或建连结束时广播
+    std::vector<Shard> _shards;
+    std::map<DBConnection*, Host*> _leased_connections;
+    DBConnectionPoolMetrics _metrics;
+};
+
+/***
+  * 借用连接的帮助类，析构时自动归还
+  */
+class CDBConnectionLease
+{
+public:
+    /***
+      * @exception: 借不到连接时抛出CDBException异常，参见CDBConnectionPool::lease()
+      */
+    CDBConnectionLease(CDBConnectionPool* db_pool, uint32_t shard=0, bool readonly=false, uint32_t timeout_milliseconds=1000)
+        : _db_pool(db_pool), _broken(false)
+    {
+        _db_connection = db_pool->lease(shard, readonly, timeout_milliseconds);
+    }
+
+    ~CDBConnectionLease()
+    {
+        release();
+    }
+
+    DBConnection* get() const { return _db_connection; }
+    DBConnection* operator ->() const { return _db_connection; }
+
+    /***
+      * 检查操作DB时抛出的异常，如果是断连类异常，则归还时关闭连接
+      * @return: 是否为断连类异常
+      */
+    bool check_exception(CDBException& db_error)
+    {
+        if (CDBConnectionPool::is_broken_exception(_db_connection, db_error))
+            _broken = true;
+        return _broken;
+    }
+
+    /** 标记连接不可再用，归还时关闭它 */
+    void set_broken() { _broken = true; }
+
+    /** 提前归还连接，之后不能再使用 */
+    void release()
+    {
+        if (_db_connection != NULL)
+        {
+            _db_pool->pay_back(_db_connection, _broken);
+            _db_connection = NULL;
+        }
+    }
+
+private:
+    CDBConnectionLease(const CDBConnectionLease&);
+    CDBConnectionLease& operator =(const CDBConnectionLease&);
+
+private:
+    CDBConnectionPool* _db_pool;
+    DBConnection* _db_connection;
+    bool _broken;
+};
+
+SYS_NAMESPACE_END
+#endif // MOOON_SYS_DB_CONNECTION_POOL_H
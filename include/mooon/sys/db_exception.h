@@ -37,7 +37,8 @@ enum
 {
     DB_NOT_SUPPORTED,       // 不支持的功能
     DB_ERROR_TOO_MANY_COLS, // 查询结果返回超出预期的列数（即返回的字段数过多）
-    DB_ERROR_TOO_MANY_ROWS  // 查询结果返回超出预期的行数
+    DB_ERROR_TOO_MANY_ROWS, // 查询结果返回超出预期的行数
+    DB_ERROR_INVALID_INDEX  // 预处理语句的参数或结果字段下标越界
 };
 
 class CDBException: public utils::CException
@@ -0,0 +1,191 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#ifndef MOOON_SYS_GROUP_COMMIT_FILE_H
+#define MOOON_SYS_GROUP_COMMIT_FILE_H
+#include "mooon/sys/config.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+SYS_NAMESPACE_BEGIN
+
+/***
+  * CGroupCommitFile的统计
+  */
+struct GroupCommitMetrics
+{
+    uint64_t appended_bytes;
+    uint64_t written_bytes; // 含O_DIRECT时补齐和重写的字节
+    uint32_t write_count;
+    uint32_t write_errors;
+    uint32_t fsync_count;
+    uint32_t append_waits; // 因写线程未跟上而等待的次数
+    uint32_t rolls;
+    uint32_t max_write_microseconds;
+    uint32_t max_fsync_microseconds;
+    uint32_t last_fsync_microseconds;
+
+    GroupCommitMetrics()
+        : appended_bytes(0), written_bytes(0), write_count(0), write_errors(0),
+          fsync_count(0), append_waits(0), rolls(0),
+          max_write_microseconds(0), max_fsync_microseconds(0), last_fsync_microseconds(0)
+    {
+    }
+};
+
+/***
+  * 组提交（group commit）文件写入器，
+  * 多个线程调用append将数据追加到同一个内存块中，由一个写线程将块整体写入文件，
+  * 这样多个线程的小写入合并成大块的顺序写。
+  *
+  * 使用双缓冲：写线程写一块时，append继续填另一块，两块都满时append等待。
+  * 块满、距上次写入超过flush_interval或关闭时写入，
+  * 可选O_DIRECT，绕过页缓存，避免大量只写不读的数据挤掉其它热数据，
+  * 此时块按4096字节对齐，不足一个对齐单位的尾部先补齐写入，之后再被重写，
+  * 并通过ftruncate保证文件大小准确。
+  *
+  * 支持按大小和时间滚动，滚动后的文件名为“原文件名.年月日时分秒”，
+  * 每次append的数据总是完整地位于同一个文件中。
+  *
+  * 使用示例：
+  * sys::CGroupCommitFile file("/data/logs/access.log", SIZE_1M, true);
+  * file.set_fsync_interval(1000);
+  * file.set_max_file_size(SIZE_1G);
+  * file.open();
+  * file.append(logs, '\n'); // 可在多个线程中调用
+  * file.close();
+  */
+class CGroupCommitFile
+{
+public:
+    /***
+      * @block_size: 块大小，即一次写入的大小，O_DIRECT时向上取整为4096的倍数
+      * @direct: 是否使用O_DIRECT，文件系统不支持时（如tmpfs）自动退为普通写
+      */
+    CGroupCommitFile(const std::string& filepath, uint32_t block_size=SIZE_1M, bool direct=false);
+    ~CGroupCommitFile();
+
+    /** 以下设置须在open之前调用 */
+    // 块未满时最长多久写入一次，默认1000毫秒
+    void set_flush_interval(uint32_t milliseconds) { _flush_interval_milliseconds = milliseconds; }
+    // 每隔多少毫秒fdatasync一次，为0表示只在滚动和关闭时fdatasync（默认）
+    void set_fsync_interval(uint32_t milliseconds) { _fsync_interval_milliseconds = milliseconds; }
+    // 文件达到多大时滚动，为0表示不按大小滚动（默认）
+    void set_max_file_size(uint64_t max_file_size) { _max_file_size = max_file_size; }
+    // 文件打开多少秒后滚动，为0表示不按时间滚动（默认）
+    void set_roll_seconds(uint32_t seconds) { _roll_seconds = seconds; }
+
+    /***
+      * 打开文件（追加），并启动写线程
+      * @exception: 出错抛出CSyscallException异常
+      */
+    void open();
+
+    /** 写入所有未写的数据，fdatasync后关闭文件，并等待写线程退出 */
+    void close();
+
+    /** 是否真正使用了O_DIRECT */
+    bool is_direct() const { return _direct; }
+    const std::string& get_filepath() const { return _filepath; }
+
+    /***
+      * 追加数据，线程安全，数据被复制到块中即返回，写入由写线程异步完成
+      */
+    void append(const char* data, size_t size);
+
+    /***
+      * 追加一批日志，每条日志后跟分隔符，整批作为一个整体，不会被滚动分到两个文件中
+      */
+    void append(const std::vector<std::string>& logs, char delimiter);
+
+    /***
+      * 取得统计
+      * @reset: 是否清零，可定时调用作为监控指标
+      */
+    void get_metrics(GroupCommitMetrics* metrics, bool reset=true);
+
+private:
+    struct Buffer
+    {
+        char* data;
+        size_t size; // 有效数据字节数
+        size_t carried; // 开头从上一块带过来的未对齐尾部字节数，已写过，O_DIRECT时需要重写
+        bool roll; // 写入后滚动文件
+    };
+
+    // 打开_filepath，返回文件大小
+    off_t open_file();
+    void roll_file();
+    // 在_lock下调用，将当前块交给写线程，
+    // 返回false表示写线程忙（另一块未写完）
+    bool swap_buffer(bool roll);
+    // 在_append_lock下调用，等待并交出当前块
+    void wait_swap_buffer(bool roll, std::unique_lock<std::mutex>& lock);
+    void copy_data(const char* data, size_t size, std::unique_lock<std::mutex>& lock);
+    void check_roll(size_t size, std::unique_lock<std::mutex>& lock);
+    void run();
+    bool write_buffer(Buffer* buffer);
+    void fsync_file();
+    std::string get_roll_filepath() const;
+    static void update_max(std::atomic<uint32_t>* max_value, uint32_t value);
+
+private:
+    std::string _filepath;
+    size_t _block_size;
+    bool _direct;
+    size_t _align; // O_DIRECT时为4096，否则为1
+    uint32_t _flush_interval_milliseconds;
+    uint32_t _fsync_interval_milliseconds;
+    uint64_t _max_file_size;
+    uint32_t _roll_seconds;
+    int _fd;
+    bool _aligned_write; // 写线程是否按_align对齐写，滚动失败时会退为不对齐写
+    off_t _write_offset; // 写线程下一次写入的位置（不含carried）
+
+private:
+    std::mutex _append_lock; // 保证一次append的数据连续
+    std::mutex _lock;
+    std::condition_variable _writer_cond;
+    std::condition_variable _append_cond;
+    Buffer _buffers[2];
+    Buffer* _active; // append正在填的块
+    Buffer* _pending; // 待写或正在写的块，为NULL表示写线程空闲
+    bool _dirty; // _active中有未写的数据
+    std::atomic<bool> _stop;
+    uint64_t _file_size; // 当前文件已追加的字节数
+    time_t _file_time; // 当前文件打开的时间
+    std::thread _writer_thread;
+
+private:
+    std::atomic<uint64_t> _appended_bytes;
+    std::atomic<uint64_t> _written_bytes;
+    std::atomic<uint32_t> _write_count;
+    std::atomic<uint32_t> _write_errors;
+    std::atomic<uint32_t> _fsync_count;
+    std::atomic<uint32_t> _append_waits;
+    std::atomic<uint32_t> _rolls;
+    std::atomic<uint32_t> _max_write_microseconds;
+    std::atomic<uint32_t> _max_fsync_microseconds;
+    std::atomic<uint32_t> _last_fsync_microseconds;
+};
+
+SYS_NAMESPACE_END
+#endif // MOOON_SYS_GROUP_COMMIT_FILE_H
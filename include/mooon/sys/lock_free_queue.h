@@ -0,0 +1,165 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#ifndef MOOON_SYS_LOCK_FREE_QUEUE_H
+#define MOOON_SYS_LOCK_FREE_QUEUE_H
+#include "mooon/sys/config.h"
+#include <atomic>
+#include <stdint.h>
+#include <vector>
+SYS_NAMESPACE_BEGIN
+
+/***
+  * 有界无锁队列，支持多生产者多消费者（MPMC），
+  * 基于每个槽位的序号实现（Dmitry Vyukov的bounded MPMC queue），
+  * push和pop都只有一次CAS，不会阻塞，队列满或空时立即返回false，由调用者决定等待策略
+  *
+  * 和CEventQueue相比，适合在流水线各阶段之间传递指针等小对象，
+  * 生产者和消费者都不会因为锁而被挂起
+  *
+  * 使用示例：
+  * CLockFreeQueue<Batch*> queue(1024);
+  * if (!queue.push(batch)) { // 队列满 }
+  * if (queue.pop(&batch)) { ... }
+  */
+template <typename DataType>
+class CLockFreeQueue
+{
+public:
+    /***
+      * @capacity: 队列容量，会被向上取整为2的幂，至少为2
+      */
+    CLockFreeQueue(uint32_t capacity)
+        : _enqueue_pos(0), _dequeue_pos(0)
+    {
+        uint32_t size = 2;
+        while (size < capacity)
+            size <<= 1;
+
+        _mask = size - 1;
+        _cells = new Cell[size];
+        for (uint32_t i=0; i<size; ++i)
+            _cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    ~CLockFreeQueue()
+    {
+        delete []_cells;
+    }
+
+    /** 入队，队列满时返回false */
+    bool push(const DataType& elem)
+    {
+        Cell* cell;
+        uint64_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+
+        while (true)
+        {
+            cell = &_cells[pos & _mask];
+            const uint64_t sequence = cell->sequence.load(std::memory_order_acquire);
+            const int64_t diff = static_cast<int64_t>(sequence) - static_cast<int64_t>(pos);
+
+            if (0 == diff)
+            {
+                if (_enqueue_pos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                return false; // 满
+            }
+            else
+            {
+                pos = _enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->data = elem;
+        cell->sequence.store(pos+1, std::memory_order_release);
+        return true;
+    }
+
+    /** 出队，队列空时返回false */
+    bool pop(DataType* elem)
+    {
+        Cell* cell;
+        uint64_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+
+        while (true)
+        {
+            cell = &_cells[pos & _mask];
+            const uint64_t sequence = cell->sequence.load(std::memory_order_acquire);
+            const int64_t diff = static_cast<int64_t>(sequence) - static_cast<int64_t>(pos+1);
+
+            if (0 == diff)
+            {
+                if (_dequeue_pos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                return false; // 空
+            }
+            else
+            {
+                pos = _dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        *elem = cell->data;
+        cell->sequence.store(pos+_mask+1, std::memory_order_release);
+        return true;
+    }
+
+    /** 得到容量 */
+    uint32_t capacity() const
+    {
+        return static_cast<uint32_t>(_mask + 1);
+    }
+
+    /** 得到近似的元素个数，并发时仅供参考 */
+    uint32_t size() const
+    {
+        const uint64_t enqueue_pos = _enqueue_pos.load(std::memory_order_relaxed);
+        const uint64_t dequeue_pos = _dequeue_pos.load(std::memory_order_relaxed);
+        return (enqueue_pos > dequeue_pos)? static_cast<uint32_t>(enqueue_pos - dequeue_pos): 0;
+    }
+
+private:
+    CLockFreeQueue(const CLockFreeQueue&);
+    CLockFreeQueue& operator =(const CLockFreeQueue&);
+
+private:
+    struct Cell
+    {
+        std::atomic<uint64_t> sequence;
+        DataType data;
+    };
+
+    // 入队和出队位置分别占用不同的缓存行，避免伪共享
+    Cell* _cells;
+    uint64_t _mask;
+    char _pad0[64];
+    std::atomic<uint64_t> _enqueue_pos;
+    char _pad1[64];
+    std::atomic<uint64_t> _dequeue_pos;
+    char _pad2[64];
+};
+
+SYS_NAMESPACE_END
+#endif // MOOON_SYS_LOCK_FREE_QUEUE_H
@@ -75,6 +75,11 @@ public:
     ~CMySQLConnection();
     void* get_mysql_handle() const { return _mysql_handle; }
 
+    // 允许执行LOAD DATA LOCAL INFILE，须在open()之前调用，
+    // 连接时设置MYSQL_OPT_LOCAL_INFILE，并在握手时带上CLIENT_LOCAL_FILES，
+    // 自定义的mysql_set_local_infile_handler须在open()或reopen()之后设置
+    void enable_local_infile(bool enabled=true) { _local_infile = enabled; }
+
 public:
     virtual bool is_syntax_exception(int errcode) const; // errcode值为1064
     virtual bool is_duplicate_exception(int errcode) const; // errcode值为1062
@@ -114,6 +119,10 @@ public:
     virtual void enable_autocommit(bool enabled);
 
 public:
+    // 直接执行已拼好的SQL，不经过格式化，也不复制到内部缓冲区，
+    // 适合批量INSERT等很长的语句，返回值同update
+    uint64_t update_sql(const char* sql, size_t sql_length);
+
     // 如果构造函数的multistatements为true，即一次性执行多条语句（可为SELECT和UPDATE等组合），
     // 这时不能调用query和update来执行，而应当调用multi_statements执行。
     // 执行的结果通过调用fetch_results来取得，
@@ -146,6 +155,8 @@ public:
 
 private:
     virtual void do_query(DBTable& db_table, const char* sql, int sql_length);
+    virtual DBCursor* do_open_cursor(const char* sql, int sql_length);
+    virtual DBStatement* do_prepare(const std::string& sql);
 
 private:
     void do_open();
@@ -153,6 +164,7 @@ private:
 private:
     void* _mysql_handle; // MySQL句柄
     int _client_flag;
+    bool _local_infile;
 };
 
 SYS_NAMESPACE_END
@@ -0,0 +1,293 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#ifndef MOOON_SYS_PIPELINE_H
+#define MOOON_SYS_PIPELINE_H
+#include "mooon/sys/adaptive_batch.h"
+#include "mooon/sys/lock_free_queue.h"
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+SYS_NAMESPACE_BEGIN
+
+/***
+  * 流水线中传递的一批消息
+  */
+struct PipelineBatch
+{
+    uint64_t sequence; // 由CPipeline分配，从1开始递增
+    std::vector<std::string> messages;
+    void* ack_context; // 由IPipelineSource设置，在ack中使用和释放，CPipeline不使用
+
+    PipelineBatch(): sequence(0), ack_context(NULL) {}
+};
+
+/***
+  * 数据源，如Redis队列、Kafka和文件，只在源线程中被调用，不需要线程安全
+  */
+class IPipelineSource
+{
+public:
+    virtual ~IPipelineSource() {}
+
+    /***
+      * 取最多max_count条消息，追加到batch->messages
+      * @return: 取到的条数，为0表示源已空，为-1表示出错（会按退避重试）
+      */
+    virtual int fetch(int max_count, PipelineBatch* batch) = 0;
+
+    /***
+      * batch已被成功写出，按sequence顺序回调，用于实现至少一次（at-least-once），
+      * 如提交Kafka的offset，或记录文件的断点
+      */
+    virtual void ack(PipelineBatch* batch) {}
+
+    /***
+      * batch未被确认就被丢弃（停止时超时），用于释放ack_context，不能提交，
+      * 在CPipeline::wait中被调用
+      */
+    virtual void discard(PipelineBatch* batch) {}
+
+    /***
+      * 源是否已经结束（如文件读完），结束后CPipeline处理完已取出的数据即退出，
+      * 对于Redis和Kafka这类持续有数据的源，总是返回false
+      */
+    virtual bool is_eof() const { return false; }
+};
+
+/***
+  * 转换器，在转换线程中被回调，可修改或删除batch->messages，须线程安全
+  */
+class IPipelineTransform
+{
+public:
+    virtual ~IPipelineTransform() {}
+    virtual void transform(PipelineBatch* batch) = 0;
+};
+
+/***
+  * 数据目标，每个写线程一个，只在所属的写线程中被调用，不需要线程安全
+  */
+class IPipelineSink
+{
+public:
+    virtual ~IPipelineSink() {}
+
+    /***
+      * 写出一批消息，返回true表示全部写出成功，
+      * 返回false时CPipeline按退避重试，
+      * 允许部分写出时从batch->messages中移除已写出的，这样重试时只写余下的
+      */
+    virtual bool write(PipelineBatch* batch) = 0;
+
+    /** 写线程退出前被调用 */
+    virtual void flush() {}
+};
+
+/***
+  * 流水线的统计
+  */
+struct PipelineMetrics
+{
+    uint64_t fetched_messages;
+    uint64_t written_messages;
+    uint64_t acked_batches;
+    uint64_t source_errors;
+    uint64_t sink_errors;
+    uint32_t inflight_batches; // 已取出但未确认的批数
+    int batch; // 当前的批量数
+
+    PipelineMetrics()
+        : fetched_messages(0), written_messages(0), acked_batches(0),
+          source_errors(0), sink_errors(0), inflight_batches(0), batch(0)
+    {
+    }
+};
+
+/***
+  * 源->转换->目标的流水线，各阶段在不同线程中运行，阶段之间以有界无锁队列连接，
+  * 源的取数和目标的写出相互重叠。
+  * 每个目标一个写线程，各自从同一队列中取批次并行写出，每批只会写到其中一个目标，
+  * 因此多个目标通常是同一个下游的多个连接，以提高写出的并发度。
+  *
+  * 批次被所有阶段处理完成后，按取出的顺序回调IPipelineSource::ack，
+  * 即使目标并行写出、乱序完成，也只确认连续完成的部分，
+  * 因此对于支持确认的源（如Kafka），停止或崩溃后未确认的数据会被重新消费，不会丢失。
+  *
+  * 使用示例：
+  * sys::CFileLineSource source("/tmp/in.log");
+  * sys::CFileLineSink sink1("/tmp/out1.log"), sink2("/tmp/out2.log");
+  * std::vector<sys::IPipelineSink*> sinks;
+  * sinks.push_back(&sink1);
+  * sinks.push_back(&sink2);
+  *
+  * sys::CPipeline pipeline(&source, sinks);
+  * pipeline.set_batch(1, 1000);
+  * if (pipeline.start())
+  *     pipeline.wait(); // 文件读完且全部写出后返回
+  */
+class CPipeline
+{
+public:
+    /***
+      * source、sinks和transform均由调用者负责销毁，且须在wait返回后才能销毁
+      * @transform: 可以为NULL，为NULL时不创建转换线程
+      */
+    CPipeline(IPipelineSource* source, const std::vector<IPipelineSink*>& sinks, IPipelineTransform* transform=NULL);
+    ~CPipeline();
+
+    /** 以下设置须在start之前调用 */
+    void set_batch(int min_batch, int max_batch) { _min_batch = min_batch; _max_batch = max_batch; }
+    void set_max_inflight(uint32_t max_inflight) { _max_inflight = (max_inflight < 1)? 1: max_inflight; }
+    void set_transform_threads(int transform_threads) { _transform_threads = (transform_threads < 1)? 1: transform_threads; }
+    void set_max_idle_milliseconds(uint32_t milliseconds) { _max_idle_milliseconds = milliseconds; }
+    void set_max_error_milliseconds(uint32_t milliseconds) { _max_error_milliseconds = milliseconds; }
+    void set_drain_milliseconds(uint32_t milliseconds) { _drain_milliseconds = milliseconds; }
+
+    /***
+      * 启动所有线程
+      * @return: 成功返回true，否则返回false
+      */
+    bool start();
+
+    /***
+      * 停止取数，已取出的数据继续写出并确认，
+      * 超过drain_milliseconds（默认30秒）仍未写出的放弃，不确认
+      */
+    void stop();
+
+    /** 等待所有线程退出，源结束（is_eof）时也会自动退出 */
+    void wait();
+
+    /** 取得统计，可定时调用作为监控指标 */
+    void get_metrics(PipelineMetrics* metrics) const;
+
+private:
+    typedef CLockFreeQueue<PipelineBatch*> BatchQueue;
+
+    void source_run();
+    void transform_run();
+    void sink_run(int index);
+
+    // 在源线程中调用，确认连续完成的批次
+    void ack_completed();
+    // 等待线程的空闲退避
+    static void idle_wait(int* idle_count);
+    void discard_batches(BatchQueue* queue);
+
+private:
+    IPipelineSource* _source;
+    std::vector<IPipelineSink*> _sinks;
+    IPipelineTransform* _transform;
+    int _min_batch;
+    int _max_batch;
+    uint32_t _max_inflight;
+    int _transform_threads;
+    uint32_t _max_idle_milliseconds;
+    uint32_t _max_error_milliseconds;
+    uint32_t _drain_milliseconds;
+
+private:
+    std::atomic<bool> _stop; // 停止取数
+    std::atomic<bool> _workers_stop; // 通知转换和写线程在队列空后退出
+    std::atomic<bool> _abort; // 超时放弃未写出的
+    std::atomic<int> _running_transforms;
+    std::shared_ptr<BatchQueue> _transform_queue; // 源->转换
+    std::shared_ptr<BatchQueue> _sink_queue; // 转换（或源）->目标
+    std::shared_ptr<BatchQueue> _done_queue; // 目标->源，待确认
+    std::thread _source_thread;
+    std::vector<std::thread> _transform_thread_array;
+    std::vector<std::thread> _sink_thread_array;
+
+private:
+    // 以下只在源线程中访问
+    uint64_t _next_sequence;
+    uint64_t _next_ack_sequence;
+    std::map<uint64_t, PipelineBatch*> _completed_batches; // 已完成但前面还有未完成的批次
+
+private:
+    std::atomic<uint64_t> _fetched_messages;
+    std::atomic<uint64_t> _written_messages;
+    std::atomic<uint64_t> _acked_batches;
+    std::atomic<uint64_t> _source_errors;
+    std::atomic<uint64_t> _sink_errors;
+    std::atomic<uint32_t> _inflight_batches;
+    std::atomic<int> _batch;
+};
+
+/***
+  * 按分隔符（默认换行）读取文件的源，跳过空行，
+  * ack时记录已确认的文件偏移，可用get_acked_offset保存断点，重启后从断点继续
+  */
+class CFileLineSource: public IPipelineSource
+{
+public:
+    /***
+      * @offset: 开始读的位置，如上次保存的断点
+      * @exception: 打开文件出错，则抛出CSyscallException异常
+      */
+    CFileLineSource(const std::string& filepath, char delimiter='\n', off_t offset=0);
+    ~CFileLineSource();
+
+    virtual int fetch(int max_count, PipelineBatch* batch);
+    virtual void ack(PipelineBatch* batch);
+    virtual void discard(PipelineBatch* batch);
+    virtual bool is_eof() const { return _eof; }
+
+    /** 已确认（写出成功）的文件偏移 */
+    off_t get_acked_offset() const { return _acked_offset; }
+
+private:
+    int _fd;
+    char _delimiter;
+    bool _eof;
+    off_t _offset; // 已取出的位置
+    off_t _acked_offset;
+    std::string _buffer; // 未组成完整行的数据
+    size_t _buffer_offset; // _buffer中未取出部分的开始位置
+    std::vector<char> _read_buffer;
+};
+
+/***
+  * 写文件的目标，每条消息后追加分隔符，一批消息以writev一次写入
+  */
+class CFileLineSink: public IPipelineSink
+{
+public:
+    /***
+      * @sync: 为true时每批写入后调用fdatasync
+      * @exception: 打开文件出错，则抛出CSyscallException异常
+      */
+    CFileLineSink(const std::string& filepath, char delimiter='\n', bool sync=false);
+    ~CFileLineSink();
+
+    virtual bool write(PipelineBatch* batch);
+    virtual void flush();
+
+private:
+    int _fd;
+    char _delimiter;
+    bool _sync;
+    std::string _filepath;
+};
+
+SYS_NAMESPACE_END
+#endif // MOOON_SYS_PIPELINE_H
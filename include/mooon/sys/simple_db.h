@@ -20,6 +20,8 @@
 #define MOOON_SYS_SIMPLE_DB_H
 #include "mooon/utils/object.h"
 #include "mooon/sys/db_exception.h"
+#include <functional>
+#include <map>
 #include <string>
 #include <vector>
 SYS_NAMESPACE_BEGIN
@@ -27,6 +29,224 @@ SYS_NAMESPACE_BEGIN
 typedef std::vector<std::string> DBRow; // 用来存储一行所有字段的值
 typedef std::vector<DBRow> DBTable;     // 用来存储所有行
 
+/***
+  * 字段值的视图，直接指向DB客户端库的缓冲区，不拷贝，
+  * 只在取得它的DBCursor::next()或回调返回之前有效
+  */
+struct DBFieldView
+{
+    const char* data; // 为NULL表示字段在DB表中为NULL
+    size_t length;    // 字段值的字节数，值中可以含有'\0'
+
+    DBFieldView(): data(NULL), length(0) {}
+    bool is_null() const { return NULL == data; }
+    std::string to_string() const { return (NULL == data)? std::string(): std::string(data, length); }
+};
+typedef std::vector<DBFieldView> DBRowView; // 一行所有字段的视图
+
+/***
+  * 流式查询的回调，每行调用一次，返回false时提前结束查询
+  */
+typedef std::function<bool (const DBRowView& row_view)> DBRowCallback;
+
+/***
+  * 流式查询的游标，由DBConnection::open_cursor()创建，
+  * 逐行从DB取结果，不将整个结果集读入内存，内存占用不随结果集大小增长，适合导出大表，
+  * 对MySQL基于mysql_use_result，对SQLite3基于sqlite3_step。
+  *
+  * 注意游标关闭（或析构）之前，同一连接上不能执行其它查询或更新，
+  * 对MySQL而言，提前关闭时服务端仍会将未取的行发送过来并被丢弃，
+  * 而且取完所有行之前，服务端会一直持有相关的锁，因此不要在取行的过程中做耗时的操作。
+  *
+  * 使用示例：
+  * utils::ScopedPtr<DBCursor> cursor(db_connection->open_cursor("SELECT f_id,f_data FROM t_test"));
+  * while (cursor->next())
+  * {
+  *     const DBRowView& row_view = cursor->row();
+  *     fwrite(row_view[1].data, row_view[1].length, 1, fp);
+  * }
+  */
+class DBCursor
+{
+public:
+    virtual ~DBCursor() {}
+
+    /***
+      * 取下一行，之前取得的DBRowView随之失效
+      * @return: 没有更多行时返回false
+      * @exception: 出错抛出CDBException异常
+      */
+    virtual bool next() = 0;
+
+    /** 当前行，只在next()返回true后有效 */
+    virtual const DBRowView& row() const = 0;
+
+    /** 结果集的字段个数 */
+    virtual int get_num_fields() const = 0;
+
+    /** 字段名，index从0开始 */
+    virtual std::string get_field_name(int index) const = 0;
+
+    /** 关闭游标，释放结果集，可重复调用，析构时会自动调用 */
+    virtual void close() throw () = 0;
+};
+
+/***
+  * 预处理语句参数的类型
+  */
+enum DBParamType
+{
+    DB_PARAM_NULL,
+    DB_PARAM_INT,
+    DB_PARAM_DOUBLE,
+    DB_PARAM_STRING,
+    DB_PARAM_BLOB // 二进制数据，存储在string_value中
+};
+
+/***
+  * 预处理语句的一个参数，字符串参数会被拷贝，重复绑定时复用已分配的内存
+  */
+struct DBParam
+{
+    DBParamType type;
+    int64_t int_value;
+    double double_value;
+    std::string string_value;
+
+    DBParam(): type(DB_PARAM_NULL), int_value(0), double_value(0.0) {}
+};
+typedef std::vector<DBParam> DBParams;
+
+/***
+  * 预处理语句，由DBConnection::prepare()创建，
+  * SQL只在prepare时被解析一次，之后每次执行只传参数，
+  * 对MySQL使用二进制协议（mysql_stmt_*），参数和结果都不需要转成字符串，也不需要escape_string，
+  * 对SQLite3使用sqlite3_prepare_v2。
+  *
+  * 使用示例：
+  * DBStatement* stmt = db_connection->prepare("SELECT f_name,f_score FROM t_user WHERE f_id=?");
+  * stmt->bind_int(0, user_id);
+  * stmt->execute();
+  * while (stmt->fetch())
+  * {
+  *     const std::string name = stmt->get_string(0).to_string();
+  *     const double score = stmt->get_double(1);
+  * }
+  *
+  * 批量执行示例：
+  * DBStatement* stmt = db_connection->prepare("INSERT INTO t_user (f_id,f_name) VALUES (?,?)");
+  * for (i=0; i<users.size(); ++i)
+  * {
+  *     stmt->bind_int(0, users[i].id);
+  *     stmt->bind_string(1, users[i].name);
+  *     stmt->add_batch();
+  * }
+  * stmt->execute_batch(); // 通常放在事务中，以减少提交次数
+  */
+class DBStatement
+{
+public:
+    virtual ~DBStatement() {}
+
+    /** 得到SQL语句 */
+    virtual const std::string& get_sql() const = 0;
+
+    /** 得到参数（即“?”）的个数 */
+    virtual int get_param_count() const = 0;
+
+    /***
+      * 绑定参数，index从0开始，对应SQL中的第index+1个“?”，
+      * 绑定的值一直有效，直到被再次绑定，未绑定的参数为NULL
+      * @exception: index越界抛出CDBException异常，错误码为DB_ERROR_INVALID_INDEX
+      */
+    virtual void bind_null(int index) = 0;
+    virtual void bind_int(int index, int64_t value) = 0;
+    virtual void bind_double(int index, double value) = 0;
+    virtual void bind_string(int index, const char* data, size_t length) = 0;
+    virtual void bind_string(int index, const std::string& value) = 0;
+    virtual void bind_blob(int index, const void* data, size_t length) = 0; // 二进制数据，不做字符集转换
+
+    /***
+      * 以当前绑定的参数执行
+      * @return: 对于更新返回影响的行数
+      * @exception: 出错抛出CDBException异常
+      */
+    virtual uint64_t execute() = 0;
+
+    /***
+      * 记录当前绑定的参数，由execute_batch()一起执行
+      */
+    virtual void add_batch() = 0;
+
+    /***
+      * 依次以add_batch()记录的各组参数执行，执行后清空记录，
+      * 语句不会被重新解析，但每组参数仍是一次执行，如需减少提交次数，应由调用者开启事务
+      * @return: 影响的总行数
+      * @exception: 出错抛出CDBException异常，出错之前的已经执行
+      */
+    virtual uint64_t execute_batch() = 0;
+
+    /***
+      * 取查询结果的下一行
+      * @return: 没有更多行时返回false
+      * @exception: 出错抛出CDBException异常
+      */
+    virtual bool fetch() = 0;
+
+    /** 结果的字段个数 */
+    virtual int get_num_fields() const = 0;
+
+    /***
+      * 取当前行的字段值，index从0开始，只在fetch()返回true后有效，
+      * 字段类型和取值类型不一致时会做转换，如对整数字段调用get_string
+      * @exception: index越界抛出CDBException异常，错误码为DB_ERROR_INVALID_INDEX
+      */
+    virtual bool is_null(int index) const = 0;
+    virtual int64_t get_int(int index) const = 0;
+    virtual double get_double(int index) const = 0;
+    virtual DBFieldView get_string(int index) const = 0; // 只在下一次fetch()之前有效
+
+    /** 取得最近一次执行的insert_id */
+    virtual uint64_t get_insert_id() const = 0;
+};
+
+/***
+  * 预处理语句的公共部分：参数的存储和批量执行
+  */
+class CDBStatementBase: public DBStatement
+{
+public:
+    CDBStatementBase(const std::string& sql, int param_count);
+
+    virtual const std::string& get_sql() const { return _sql; }
+    virtual int get_param_count() const { return static_cast<int>(_params.size()); }
+
+    virtual void bind_null(int index);
+    virtual void bind_int(int index, int64_t value);
+    virtual void bind_double(int index, double value);
+    virtual void bind_string(int index, const char* data, size_t length);
+    virtual void bind_string(int index, const std::string& value);
+    virtual void bind_blob(int index, const void* data, size_t length);
+
+    virtual uint64_t execute();
+    virtual void add_batch();
+    virtual uint64_t execute_batch();
+
+protected:
+    DBParam& get_param(int index);
+    void check_field_index(int index) const;
+
+private:
+    // 以params执行，由不同DB实现
+    virtual uint64_t do_execute(const DBParams& params) = 0;
+
+protected:
+    const std::string _sql;
+    DBParams _params;
+    std::vector<DBParams> _batch;
+    size_t _batch_size; // _batch中有效的个数，_batch只增不减，以复用其中字符串的内存
+};
+
 // DB连接、读和写超时时长，单位为秒
 enum
 {
@@ -35,6 +255,9 @@ enum
     DB_WRITE_TIMEOUT_SECONDS_DEFAULT = 2 // MySQL对写有重试两次机制，因此实际的读超时时长可能为两倍
 };
 
+// 每个连接缓存的预处理语句的默认最大个数
+enum { DB_MAX_STATEMENTS_DEFAULT = 256 };
+
 /**
  * 访问DB的接口，是一个抽象接口，当前只支持MySQL
  *
@@ -225,6 +448,32 @@ public:
      */
     virtual std::string query(const char* format, ...) __attribute__((format(printf, 2, 3))) = 0;
 
+    /***
+      * 流式查询，返回的游标由调用者负责delete，可借助utils::ScopedPtr，
+      * 和query不同，NULL通过DBFieldView::is_null()识别，不受set_null_value影响
+      * 出错抛出CDBException异常
+      */
+    virtual DBCursor* open_cursor(const char* format, ...) __attribute__((format(printf, 2, 3))) = 0;
+
+    /***
+      * 流式查询，每取得一行回调一次callback，callback返回false时提前结束
+      * @return: 回调的行数
+      * 出错抛出CDBException异常，callback抛出的异常也会透传给调用者
+      */
+    virtual uint64_t query_each(const DBRowCallback& callback, const char* format, ...) __attribute__((format(printf, 3, 4))) = 0;
+
+    /***
+      * 取得预处理语句，同一连接上以SQL为键缓存，相同的SQL只解析一次，
+      * 返回的DBStatement由连接管理，调用者不能delete，连接close()后失效，
+      * 缓存的个数超过set_max_statements的值时，最久未用的被删除，
+      * 所以不要长期持有返回值，再次prepare其它SQL之后，应重新prepare取得
+      * 出错抛出CDBException异常
+      */
+    virtual DBStatement* prepare(const std::string& sql) = 0;
+
+    /** 设置每个连接缓存的预处理语句的最大个数，默认为DB_MAX_STATEMENTS_DEFAULT */
+    virtual void set_max_statements(size_t max_statements) = 0;
+
     /***
       * 数据库insert和update更新操作
       * 对于MySQL如果update的值并没变化返回0，否则返回变修改的行数
@@ -279,6 +528,10 @@ public:
     virtual void query(DBTable& db_table, const char* format, ...) __attribute__((format(printf, 3, 4)));
     virtual void query(DBRow& db_row, const char* format, ...) __attribute__((format(printf, 3, 4)));
     virtual std::string query(const char* format, ...) __attribute__((format(printf, 2, 3)));
+    virtual DBCursor* open_cursor(const char* format, ...) __attribute__((format(printf, 2, 3)));
+    virtual uint64_t query_each(const DBRowCallback& callback, const char* format, ...) __attribute__((format(printf, 3, 4)));
+    virtual DBStatement* prepare(const std::string& sql);
+    virtual void set_max_statements(size_t max_statements);
 
     virtual void ping();
     virtual void commit();
@@ -292,6 +545,12 @@ public:
 
 private:
     virtual void do_query(DBTable& db_table, const char* sql, int sql_length) = 0;
+    virtual DBCursor* do_open_cursor(const char* sql, int sql_length) = 0;
+    virtual DBStatement* do_prepare(const std::string& sql) = 0;
+
+protected:
+    // 删除缓存的预处理语句，须在关闭DB句柄之前调用
+    void clear_statements();
 
 protected:
     const size_t _sql_size; // 支持的最大SQL语句长度，单位为字节数，不含结尾符
@@ -310,6 +569,16 @@ protected:
     int _read_timeout_seconds;
     int _write_timeout_seconds;
     std::string _null_value; // 字段在DB表中的值为NULL时，返回的内容
+
+private:
+    struct StatementEntry
+    {
+        DBStatement* statement;
+        uint64_t last_used; // 最近一次prepare时_statement_clock的值
+    };
+    std::map<std::string, StatementEntry> _statements; // 以SQL为键的预处理语句缓存
+    uint64_t _statement_clock;
+    size_t _max_statements;
 };
 
 SYS_NAMESPACE_END
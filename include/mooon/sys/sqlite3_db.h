@@ -20,7 +20,12 @@
 #define MOOON_SYS_SQLITE3_DB_H
 #include "mooon/sys/simple_db.h"
 #include "mooon/utils/object.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <set>
 #include <stdarg.h>
+#include <thread>
 
 // SQLite3安装后的include目录结构不标准，需要手动调整成：
 // 头文件sqlite3.h和sqlite3ext.h放到目录：<安装目录>/include/sqlite3
@@ -29,15 +34,69 @@
 #if MOOON_HAVE_SQLITE3==1
 SYS_NAMESPACE_BEGIN
 
+/***
+  * 预定义的SQLite3选项组合
+  */
+typedef enum
+{
+    sqlite3_profile_default = 0, /** 不修改SQLite3的默认设置（DELETE日志，synchronous=FULL） */
+    sqlite3_profile_durable = 1, /** WAL，synchronous=FULL，每次提交都落盘，掉电不丢已提交的事务 */
+    sqlite3_profile_fast    = 2, /** WAL，synchronous=NORMAL，加大页缓存并启用mmap，掉电可能丢最后几个事务，但不会损坏 */
+    sqlite3_profile_bulk    = 3  /** 在fast的基础上关闭自动checkpoint，由CSQLite3Checkpointer在后台线程中进行 */
+}sqlite3_profile_t;
+
+/***
+  * SQLite3选项集合，值为-1或空的选项不设置（保持SQLite3的默认值），在open()时以PRAGMA设置
+  */
+typedef struct sqlite3_options_t
+{
+    std::string journal_mode;   /** PRAGMA journal_mode，如WAL、DELETE和MEMORY */
+    int synchronous;            /** PRAGMA synchronous，0为OFF，1为NORMAL，2为FULL */
+    int64_t mmap_size;          /** PRAGMA mmap_size，字节数 */
+    int cache_size_kb;          /** PRAGMA cache_size，页缓存的KB数 */
+    int temp_store;             /** PRAGMA temp_store，2为MEMORY */
+    int wal_autocheckpoint;     /** PRAGMA wal_autocheckpoint，WAL达到多少页时在提交中自动checkpoint，0为关闭 */
+    int busy_timeout_milliseconds; /** sqlite3_busy_timeout，遇锁时的最长等待毫秒数 */
+    sqlite3_options_t();
+}sqlite3_options_t;
+
+/***
+  * 得到预定义组合对应的选项集合
+  */
+sqlite3_options_t get_sqlite3_profile_options(sqlite3_profile_t profile);
+
+class CSQLite3Cursor;
+
 /**
- * SQLite3版本的DB连接
+ * SQLite3版本的DB连接，
+ * close()时一并关闭未关闭的游标，之后游标的next()返回false
  */
 class CSQLite3Connection: public CDBConnectionBase
 {
+    friend class CSQLite3Cursor;
+
 public:
     CSQLite3Connection(size_t sql_max=8192);
     ~CSQLite3Connection();
 
+    /***
+      * 设置选项，在open()时生效，如果已打开则立即生效
+      * @exception: 如果已打开且设置出错，则抛出CDBException异常
+      */
+    void set_options(const sqlite3_options_t& options);
+    void set_profile(sqlite3_profile_t profile) { set_options(get_sqlite3_profile_options(profile)); }
+
+    /***
+      * 对WAL进行checkpoint，可在另一个连接上进行，以免阻塞写
+      * @mode: SQLITE_CHECKPOINT_PASSIVE（不等锁，不阻塞读写）、SQLITE_CHECKPOINT_FULL、
+      *        SQLITE_CHECKPOINT_RESTART或SQLITE_CHECKPOINT_TRUNCATE（完成后截断WAL文件）
+      * @wal_frames: 不为NULL时返回WAL中的页数
+      * @checkpointed_frames: 不为NULL时返回已写回DB文件的页数
+      * @return: 如果因有读写而未能全部完成（SQLITE_BUSY），则返回false
+      * @exception: 如果出错，则抛出CDBException异常
+      */
+    bool checkpoint(int mode, int* wal_frames=NULL, int* checkpointed_frames=NULL);
+
 public:
     virtual void open();
     virtual void close() throw ();
@@ -48,12 +107,154 @@ public:
 
 private:
     virtual void do_query(DBTable& db_table, const char* sql, int sql_length);
+    virtual DBCursor* do_open_cursor(const char* sql, int sql_length);
+    virtual DBStatement* do_prepare(const std::string& sql);
 
 private:
     void do_open();
+    void apply_options();
+    // 存在未finalize的语句时sqlite3_close会以SQLITE_BUSY失败
+    void close_cursors();
 
 private:
     void* _sqlite;
+    sqlite3_options_t _options;
+    std::set<CSQLite3Cursor*> _cursors; // 未关闭的游标
+};
+
+/***
+  * CSQLite3BulkWriter的统计
+  */
+struct SQLite3BulkMetrics
+{
+    uint64_t rows;
+    uint64_t commits;
+    uint64_t busy_retries; // COMMIT遇到SQLITE_BUSY而重试的次数
+    uint32_t max_commit_microseconds;
+
+    SQLite3BulkMetrics(): rows(0), commits(0), busy_retries(0), max_commit_microseconds(0) {}
+};
+
+/***
+  * 批量写入器，用预处理语句写入，并自动将多次写入合并到一个事务中，
+  * 事务中的行数达到batch_rows或事务已开始batch_milliseconds时提交，
+  * 避免每条语句各自成为一个事务（每个事务都要同步日志）。
+  *
+  * 非线程安全，写入期间连接上不能有其它事务。
+  *
+  * 使用示例：
+  * sys::CSQLite3Connection db;
+  * db.set_db_name("/data/buffer.db");
+  * db.set_profile(sys::sqlite3_profile_bulk);
+  * db.open();
+  * sys::CSQLite3Checkpointer checkpointer;
+  * checkpointer.start("/data/buffer.db", 1000);
+  *
+  * sys::CSQLite3BulkWriter writer(&db, "INSERT INTO t_log (f_time,f_text) VALUES (?,?)");
+  * writer.statement()->bind_int(0, time(NULL));
+  * writer.statement()->bind_string(1, text);
+  * writer.add();
+  * ...
+  * writer.flush();
+  */
+class CSQLite3BulkWriter
+{
+public:
+    /***
+      * @exception: 如果prepare出错，则抛出CDBException异常
+      */
+    CSQLite3BulkWriter(CSQLite3Connection* db_connection, const std::string& sql, uint32_t batch_rows=10000, uint32_t batch_milliseconds=200);
+
+    /** 析构时提交未提交的事务，出错时回滚 */
+    ~CSQLite3BulkWriter();
+
+    /** 用来绑定下一行的参数，连接的语句缓存可能删除它，所以每行都应重新调用取得 */
+    DBStatement* statement() const { return _db_connection->prepare(_sql); }
+
+    /***
+      * 以已绑定的参数执行一次，需要时开始或提交事务
+      * @exception: 如果执行出错，则抛出CDBException异常，并回滚当前事务（事务中已写入的行都丢失），
+      *             提交时出错的同flush()
+      */
+    void add();
+
+    /***
+      * 如果当前事务已达到batch_milliseconds，则提交，用于写入间隙较长时及时提交
+      * @exception: 如果出错，则抛出CDBException异常
+      */
+    void flush_if_due();
+
+    /***
+      * 提交当前事务，COMMIT遇到SQLITE_BUSY时重试几次
+      * @exception: 如果出错，则抛出CDBException异常，
+      *             重试后仍为SQLITE_BUSY时事务保持不变，可再次调用flush()或继续add()，
+      *             其它错误时回滚当前事务
+      */
+    void flush();
+
+    /** 当前事务中未提交的行数 */
+    uint32_t get_pending_rows() const { return _pending_rows; }
+    const SQLite3BulkMetrics& get_metrics() const { return _metrics; }
+
+private:
+    CSQLite3BulkWriter(const CSQLite3BulkWriter&);
+    CSQLite3BulkWriter& operator =(const CSQLite3BulkWriter&);
+    void rollback(); // 回滚当前事务，忽略回滚本身的错误
+
+private:
+    CSQLite3Connection* _db_connection;
+    const std::string _sql; // 语句由_db_connection缓存和拥有
+    const uint32_t _batch_rows;
+    const uint32_t _batch_milliseconds;
+    uint32_t _pending_rows;
+    uint64_t _begin_milliseconds; // 当前事务开始的时间
+    SQLite3BulkMetrics _metrics;
+};
+
+/***
+  * 在后台线程中定期对WAL进行checkpoint，使用独立的连接，
+  * 配合sqlite3_profile_bulk使用，将checkpoint从写线程的提交中移走，
+  * 默认以PASSIVE方式进行，不阻塞读写，WAL超过truncate_frames页时尝试TRUNCATE以回收磁盘空间
+  */
+class CSQLite3Checkpointer
+{
+public:
+    CSQLite3Checkpointer();
+    ~CSQLite3Checkpointer();
+
+    /***
+      * 启动后台线程，已启动时再调用抛出CSyscallException异常（EALREADY），须先stop()
+      * @db_name: DB文件路径，须和写入连接的相同
+      * @interval_milliseconds: checkpoint的间隔
+      * @truncate_frames: WAL的页数超过此值时尝试TRUNCATE，为0表示不TRUNCATE
+      * @exception: 如果打开DB或创建线程出错，则抛出CDBException或CSyscallException异常
+      */
+    void start(const std::string& db_name, uint32_t interval_milliseconds=1000, int truncate_frames=100000);
+
+    /** 停止后台线程，停止前再进行一次checkpoint */
+    void stop();
+
+    uint64_t get_checkpoint_count() const { return _checkpoint_count; }
+    uint64_t get_checkpointed_frames() const { return _checkpointed_frames; } // 累计写回DB文件的页数
+
+private:
+    void run();
+    void do_checkpoint();
+
+private:
+    CSQLite3Connection _db_connection;
+    uint32_t _interval_milliseconds;
+    int _truncate_frames;
+    std::atomic<uint64_t> _checkpoint_count;
+    std::atomic<uint64_t> _checkpointed_frames;
+    int _last_wal_frames;          // 上次checkpoint时WAL中的页数，只在后台线程中访问
+    int _last_checkpointed_frames; // 上次checkpoint时WAL中已写回的页数
+
+private:
+    std::thread _thread;
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    bool _stop;
 };
 
 SYS_NAMESPACE_END
@@ -0,0 +1,169 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#ifndef MOOON_UTILS_LATENCY_HISTOGRAM_H
+#define MOOON_UTILS_LATENCY_HISTOGRAM_H
+#include "mooon/utils/config.h"
+#include <stdint.h>
+#include <vector>
+UTILS_NAMESPACE_BEGIN
+
+/***
+  * 延迟直方图，参考HdrHistogram的对数线性分桶：
+  * 每个2的幂区间再等分为128个子桶，相对误差小于1%，
+  * 记录和求百分位都只需常数时间，内存固定（约30KB），不随记录数增长，
+  * 适合压测工具统计p50、p99、p999等，
+  * 值的单位由使用者决定（通常为微秒），超过2^36的值按2^36记录。
+  *
+  * 非线程安全，多线程时每个线程一个，再用merge合并。
+  *
+  * 使用示例：
+  * utils::CLatencyHistogram histogram;
+  * histogram.record(elapsed_microseconds);
+  * printf("p99: %" PRIu64"us\n", histogram.get_percentile(99.0));
+  */
+class CLatencyHistogram
+{
+public:
+    CLatencyHistogram()
+        : _count(0), _sum(0), _min(0), _max(0)
+    {
+    }
+
+    /** 记录一个值，count为该值出现的次数 */
+    void record(uint64_t value, uint64_t count=1)
+    {
+        if (value > MAX_VALUE)
+            value = MAX_VALUE;
+        if (_counts.empty())
+            _counts.resize(BUCKET_COUNT, 0); // 用到时才分配
+
+        _counts[get_index(value)] += count;
+        if ((0 == _count) || (value < _min))
+            _min = value;
+        if (value > _max)
+            _max = value;
+        _count += count;
+        _sum += value * count;
+    }
+
+    /** 合并另一个直方图 */
+    void merge(const CLatencyHistogram& other)
+    {
+        if (0 == other._count)
+            return;
+        if (_counts.empty())
+            _counts.resize(BUCKET_COUNT, 0);
+
+        for (int i=0; i<BUCKET_COUNT; ++i)
+            _counts[i] += other._counts[i];
+        if ((0 == _count) || (other._min < _min))
+            _min = other._min;
+        if (other._max > _max)
+            _max = other._max;
+        _count += other._count;
+        _sum += other._sum;
+    }
+
+    /** 清零，保留已分配的内存 */
+    void reset()
+    {
+        if (_count > 0)
+            _counts.assign(_counts.size(), 0);
+        _count = 0;
+        _sum = 0;
+        _min = 0;
+        _max = 0;
+    }
+
+    uint64_t get_count() const { return _count; }
+    uint64_t get_min() const { return _min; }
+    uint64_t get_max() const { return _max; }
+    uint64_t get_mean() const { return (0 == _count)? 0: _sum / _count; }
+
+    /***
+      * 得到百分位值，即不小于percentile%的记录的最小值（所在桶的上界，不超过最大值）
+      * @percentile: 0到100，如99.9
+      */
+    uint64_t get_percentile(double percentile) const
+    {
+        if (0 == _count)
+            return 0;
+        if (percentile >= 100.0)
+            return _max;
+
+        // 第rank个记录（从1开始）
+        uint64_t rank = static_cast<uint64_t>(percentile / 100.0 * static_cast<double>(_count) + 0.5);
+        if (rank < 1)
+            rank = 1;
+
+        uint64_t accumulated = 0;
+        for (int i=0; i<BUCKET_COUNT; ++i)
+        {
+            accumulated += _counts[i];
+            if (accumulated >= rank)
+            {
+                const uint64_t value = get_highest_value(i);
+                return (value > _max)? _max: ((value < _min)? _min: value);
+            }
+        }
+        return _max;
+    }
+
+private:
+    enum
+    {
+        SUB_BUCKET_BITS = 7,
+        SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS, // 128
+        MAX_MAGNITUDE = 36, // 最大值为2^36-1
+        BUCKET_COUNT = (MAX_MAGNITUDE - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT
+    };
+    static const uint64_t MAX_VALUE = (static_cast<uint64_t>(1) << MAX_MAGNITUDE) - 1;
+
+    // 小于128的值每个值一个桶，之后每个2的幂区间128个桶
+    static int get_index(uint64_t value)
+    {
+        if (value < SUB_BUCKET_COUNT)
+            return static_cast<int>(value);
+
+        const int magnitude = 63 - __builtin_clzll(value);
+        const int shift = magnitude - SUB_BUCKET_BITS;
+        return (shift + 1) * SUB_BUCKET_COUNT + static_cast<int>((value >> shift) - SUB_BUCKET_COUNT);
+    }
+
+    // 桶能表示的最大值
+    static uint64_t get_highest_value(int index)
+    {
+        if (index < SUB_BUCKET_COUNT)
+            return static_cast<uint64_t>(index);
+
+        const int shift = index / SUB_BUCKET_COUNT - 1;
+        const uint64_t sub_bucket = static_cast<uint64_t>(index % SUB_BUCKET_COUNT + SUB_BUCKET_COUNT);
+        return ((sub_bucket + 1) << shift) - 1;
+    }
+
+private:
+    std::vector<uint64_t> _counts;
+    uint64_t _count;
+    uint64_t _sum;
+    uint64_t _min;
+    uint64_t _max;
+};
+
+UTILS_NAMESPACE_END
+#endif // MOOON_UTILS_LATENCY_HISTOGRAM_H
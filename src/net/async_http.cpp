@@ -0,0 +1,430 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#include "net/async_http.h"
+#include "utils/exception.h"
+#if MOOON_HAVE_CURL==1
+#include <curl/curl.h>
+#include <algorithm>
+#include <time.h>
+NET_NAMESPACE_BEGIN
+
+static uint64_t get_monotonic_milliseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000 + static_cast<uint64_t>(ts.tv_nsec / 1000000);
+}
+
+static size_t on_write_header(void* buffer, size_t size, size_t nmemb, void* stream)
+{
+    std::string* header = static_cast<std::string*>(stream);
+    header->append(static_cast<const char*>(buffer), size*nmemb);
+    return size * nmemb;
+}
+
+static size_t on_write_body(void* buffer, size_t size, size_t nmemb, void* stream)
+{
+    std::string* body = static_cast<std::string*>(stream);
+    body->append(static_cast<const char*>(buffer), size*nmemb);
+    return size * nmemb;
+}
+
+struct AsyncHttpTransfer
+{
+    CURL* easy;
+    curl_slist* headers;
+    std::string body; // 须在请求完成前一直有效
+    AsyncHttpCallback callback;
+    AsyncHttpResponse response;
+    uint64_t submit_milliseconds;
+};
+
+/***
+  * curl的一个SOCKET，SOCKET由curl创建和关闭，这里只负责注册到Epoll
+  */
+class CCurlSocket: public CEpollable
+{
+public:
+    CCurlSocket(int fd)
+        : _removed(false)
+    {
+        set_fd(fd);
+    }
+
+    ~CCurlSocket()
+    {
+        detach(); // 不能关闭curl的SOCKET
+    }
+
+    bool is_removed() const { return _removed; }
+    void set_removed() { _removed = true; }
+
+private:
+    virtual epoll_event_t handle_epoll_event(void* input_ptr, uint32_t events, void* ouput_ptr)
+    {
+        CAsyncHttpClient* client = static_cast<CAsyncHttpClient*>(input_ptr);
+        int event_bitmask = 0;
+
+        // 同一轮中先处理的SOCKET可能导致curl不再使用这个SOCKET
+        if (_removed)
+            return epoll_none;
+
+        if (events & EPOLLIN)
+            event_bitmask |= CURL_CSELECT_IN;
+        if (events & EPOLLOUT)
+            event_bitmask |= CURL_CSELECT_OUT;
+        if (events & (EPOLLERR | EPOLLHUP))
+            event_bitmask |= CURL_CSELECT_ERR;
+
+        client->socket_action(get_fd(), event_bitmask);
+        return epoll_none;
+    }
+
+private:
+    bool _removed;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+CAsyncHttpClient::CAsyncHttpClient()
+    : _connect_timeout_milliseconds(2000), _timeout_milliseconds(10000),
+      _max_host_connections(0), _max_total_connections(0), _max_idle_connections(1024),
+      _dns_cache_seconds(60), _http2(true), _insecure(false),
+      _multi(NULL), _timer_milliseconds(-1), _num_sockets(0), _num_completed(0)
+{
+}
+
+CAsyncHttpClient::~CAsyncHttpClient()
+{
+    destroy();
+}
+
+void CAsyncHttpClient::create(uint32_t epoll_size)
+{
+    CURLM* multi = curl_multi_init();
+    if (NULL == multi)
+        THROW_EXCEPTION("curl_multi_init failed", -1);
+
+    try
+    {
+        _epoller.create(epoll_size);
+    }
+    catch (sys::CSyscallException&)
+    {
+        curl_multi_cleanup(multi);
+        throw;
+    }
+
+    curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, on_socket);
+    curl_multi_setopt(multi, CURLMOPT_SOCKETDATA, this);
+    curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, on_timer);
+    curl_multi_setopt(multi, CURLMOPT_TIMERDATA, this);
+    curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, static_cast<long>(_max_idle_connections));
+    curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, static_cast<long>(_max_host_connections));
+    curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, static_cast<long>(_max_total_connections));
+    if (_http2)
+    {
+        const curl_version_info_data* version_info = curl_version_info(CURLVERSION_NOW);
+        if (0 == (version_info->features & CURL_VERSION_HTTP2))
+            _http2 = false;
+        else
+            curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    }
+
+    _multi = multi;
+}
+
+void CAsyncHttpClient::destroy()
+{
+    if (_multi != NULL)
+    {
+        CURLM* multi = static_cast<CURLM*>(_multi);
+        std::set<AsyncHttpTransfer*> transfers;
+
+        // 未完成的请求以中止回调，回调中可能提交新的请求，所以先交换出来
+        transfers.swap(_transfers);
+        for (std::set<AsyncHttpTransfer*>::iterator iter=transfers.begin(); iter!=transfers.end(); ++iter)
+        {
+            AsyncHttpTransfer* transfer = *iter;
+            curl_multi_remove_handle(multi, transfer->easy);
+
+            transfer->response.errcode = CURLE_ABORTED_BY_CALLBACK;
+            transfer->response.errmsg = curl_easy_strerror(CURLE_ABORTED_BY_CALLBACK);
+            transfer->response.elapsed_milliseconds = static_cast<uint32_t>(get_monotonic_milliseconds() - transfer->submit_milliseconds);
+            if (transfer->callback)
+                transfer->callback(transfer->response);
+            release_transfer(transfer);
+        }
+
+        for (std::vector<void*>::size_type i=0; i<_idle_easies.size(); ++i)
+            curl_easy_cleanup(static_cast<CURL*>(_idle_easies[i]));
+        _idle_easies.clear();
+
+        // 清理时curl关闭缓存的连接，并通过on_socket通知
+        curl_multi_cleanup(multi);
+        _multi = NULL;
+    }
+
+    for (std::vector<CCurlSocket*>::size_type i=0; i<_closed_sockets.size(); ++i)
+        delete _closed_sockets[i];
+    _closed_sockets.clear();
+    _timer_milliseconds = -1;
+    _epoller.destroy();
+}
+
+void CAsyncHttpClient::async_request(const AsyncHttpRequest& request, const AsyncHttpCallback& callback, void* user_data)
+{
+    CURLM* multi = static_cast<CURLM*>(_multi);
+    CURL* easy = static_cast<CURL*>(get_easy());
+    AsyncHttpTransfer* transfer = new AsyncHttpTransfer;
+    const uint32_t timeout_milliseconds = (request.timeout_milliseconds > 0)? request.timeout_milliseconds: _timeout_milliseconds;
+
+    transfer->easy = easy;
+    transfer->headers = NULL;
+    transfer->body = request.body;
+    transfer->callback = callback;
+    transfer->response.user_data = user_data;
+    transfer->submit_milliseconds = get_monotonic_milliseconds();
+    for (std::vector<std::string>::size_type i=0; i<request.headers.size(); ++i)
+        transfer->headers = curl_slist_append(transfer->headers, request.headers[i].c_str());
+
+    curl_easy_setopt(easy, CURLOPT_PRIVATE, transfer);
+    curl_easy_setopt(easy, CURLOPT_URL, request.url.c_str());
+    curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT_MS, static_cast<long>(_connect_timeout_milliseconds));
+    curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS, static_cast<long>(timeout_milliseconds));
+    curl_easy_setopt(easy, CURLOPT_DNS_CACHE_TIMEOUT, static_cast<long>(_dns_cache_seconds));
+    curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, on_write_header);
+    curl_easy_setopt(easy, CURLOPT_HEADERDATA, &transfer->response.header);
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, on_write_body);
+    curl_easy_setopt(easy, CURLOPT_WRITEDATA, &transfer->response.body);
+    if (transfer->headers != NULL)
+        curl_easy_setopt(easy, CURLOPT_HTTPHEADER, transfer->headers);
+    if (_insecure)
+    {
+        curl_easy_setopt(easy, CURLOPT_SSL_VERIFYPEER, 0L);
+        curl_easy_setopt(easy, CURLOPT_SSL_VERIFYHOST, 0L);
+    }
+    if (_http2)
+    {
+        // 明文http仍使用HTTP/1.1，https通过ALPN协商HTTP/2，
+        // PIPEWAIT使新请求等待已有连接确认可多路复用，而不是立即新建连接
+        curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, static_cast<long>(CURL_HTTP_VERSION_2TLS));
+        curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+    }
+
+    if (!request.body.empty() || (request.method == "POST"))
+    {
+        curl_easy_setopt(easy, CURLOPT_POSTFIELDS, transfer->body.data());
+        curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE, static_cast<long>(transfer->body.size()));
+    }
+    if (!request.method.empty() && (request.method != "GET") && (request.method != "POST"))
+        curl_easy_setopt(easy, CURLOPT_CUSTOMREQUEST, request.method.c_str());
+
+    const CURLMcode errcode = curl_multi_add_handle(multi, easy);
+    if (errcode != CURLM_OK)
+    {
+        release_transfer(transfer);
+        THROW_EXCEPTION(curl_multi_strerror(errcode), errcode);
+    }
+
+    _transfers.insert(transfer);
+}
+
+void CAsyncHttpClient::async_get(const std::string& url, const AsyncHttpCallback& callback, void* user_data)
+{
+    AsyncHttpRequest request;
+    request.url = url;
+    async_request(request, callback, user_data);
+}
+
+void CAsyncHttpClient::async_post(const std::string& url, const std::string& data, const AsyncHttpCallback& callback, void* user_data)
+{
+    AsyncHttpRequest request;
+    request.url = url;
+    request.method = "POST";
+    request.body = data;
+    async_request(request, callback, user_data);
+}
+
+int CAsyncHttpClient::run_once(uint32_t milliseconds)
+{
+    _num_completed = 0;
+
+    // 不晚于curl的定时器醒来
+    uint64_t now_milliseconds = get_monotonic_milliseconds();
+    if (_timer_milliseconds >= 0)
+    {
+        const uint64_t timer_milliseconds = static_cast<uint64_t>(_timer_milliseconds);
+        milliseconds = static_cast<uint32_t>(std::min<uint64_t>(milliseconds, (timer_milliseconds > now_milliseconds)? timer_milliseconds-now_milliseconds: 0));
+    }
+
+    const int n = _epoller.timed_wait(milliseconds);
+    for (int i=0; i<n; ++i)
+    {
+        CEpollable* epollable = _epoller.get(i);
+        (void)epollable->handle_epoll_event(this, _epoller.get_events(i), NULL);
+    }
+
+    now_milliseconds = get_monotonic_milliseconds();
+    if ((_timer_milliseconds >= 0) && (now_milliseconds >= static_cast<uint64_t>(_timer_milliseconds)))
+    {
+        _timer_milliseconds = -1;
+        socket_action(CURL_SOCKET_TIMEOUT, 0);
+    }
+
+    for (std::vector<CCurlSocket*>::size_type i=0; i<_closed_sockets.size(); ++i)
+        delete _closed_sockets[i];
+    _closed_sockets.clear();
+    return _num_completed;
+}
+
+int CAsyncHttpClient::on_socket(void* easy, int fd, int what, void* userp, void* socketp)
+{
+    CAsyncHttpClient* self = static_cast<CAsyncHttpClient*>(userp);
+    CCurlSocket* curl_socket = static_cast<CCurlSocket*>(socketp);
+
+    if (CURL_POLL_REMOVE == what)
+    {
+        if (curl_socket != NULL)
+        {
+            // 此时SOCKET尚未被curl关闭
+            if (curl_socket->get_epoll_events() != -1)
+                self->_epoller.del_events(curl_socket);
+            curl_socket->set_removed();
+            curl_multi_assign(static_cast<CURLM*>(self->_multi), fd, NULL);
+            self->_closed_sockets.push_back(curl_socket);
+            --self->_num_sockets;
+        }
+    }
+    else
+    {
+        int events = 0;
+
+        if (NULL == curl_socket)
+        {
+            curl_socket = new CCurlSocket(fd);
+            curl_multi_assign(static_cast<CURLM*>(self->_multi), fd, curl_socket);
+            ++self->_num_sockets;
+        }
+        if ((CURL_POLL_IN == what) || (CURL_POLL_INOUT == what))
+            events |= EPOLLIN;
+        if ((CURL_POLL_OUT == what) || (CURL_POLL_INOUT == what))
+            events |= EPOLLOUT;
+        self->_epoller.set_events(curl_socket, events);
+    }
+
+    return 0;
+}
+
+int CAsyncHttpClient::on_timer(void* multi, long timeout_milliseconds, void* userp)
+{
+    CAsyncHttpClient* self = static_cast<CAsyncHttpClient*>(userp);
+
+    // 为-1表示删除定时器，为0表示尽快调用，在run_once()中进行，不能在curl的回调中调用curl_multi_socket_action
+    if (timeout_milliseconds < 0)
+        self->_timer_milliseconds = -1;
+    else
+        self->_timer_milliseconds = static_cast<int64_t>(get_monotonic_milliseconds() + timeout_milliseconds);
+    return 0;
+}
+
+void CAsyncHttpClient::socket_action(int fd, int event_bitmask)
+{
+    CURLM* multi = static_cast<CURLM*>(_multi);
+    int running_handles = 0;
+
+    const CURLMcode errcode = curl_multi_socket_action(multi, fd, event_bitmask, &running_handles);
+    if (errcode != CURLM_OK)
+        THROW_EXCEPTION(curl_multi_strerror(errcode), errcode);
+    check_completed();
+}
+
+void CAsyncHttpClient::check_completed()
+{
+    CURLM* multi = static_cast<CURLM*>(_multi);
+    CURLMsg* message = NULL;
+    int messages_in_queue = 0;
+
+    while ((message = curl_multi_info_read(multi, &messages_in_queue)) != NULL)
+    {
+        if (message->msg != CURLMSG_DONE)
+            continue;
+
+        CURL* easy = message->easy_handle;
+        const CURLcode result = message->data.result;
+        AsyncHttpTransfer* transfer = NULL;
+        long response_code = 0;
+
+        curl_easy_getinfo(easy, CURLINFO_PRIVATE, &transfer);
+        curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &response_code);
+        curl_multi_remove_handle(multi, easy); // 连接放回连接缓存
+
+        transfer->response.errcode = result;
+        if (result != CURLE_OK)
+            transfer->response.errmsg = curl_easy_strerror(result);
+        transfer->response.response_code = static_cast<int>(response_code);
+        transfer->response.elapsed_milliseconds = static_cast<uint32_t>(get_monotonic_milliseconds() - transfer->submit_milliseconds);
+
+        _transfers.erase(transfer);
+        ++_num_completed;
+        try
+        {
+            if (transfer->callback)
+                transfer->callback(transfer->response);
+        }
+        catch (...)
+        {
+            release_transfer(transfer);
+            throw;
+        }
+        release_transfer(transfer);
+    }
+}
+
+void* CAsyncHttpClient::get_easy()
+{
+    CURL* easy = NULL;
+
+    if (!_idle_easies.empty())
+    {
+        easy = static_cast<CURL*>(_idle_easies.back());
+        _idle_easies.pop_back();
+    }
+    else
+    {
+        easy = curl_easy_init();
+        if (NULL == easy)
+            THROW_EXCEPTION("curl_easy_init failed", -1);
+    }
+
+    return easy;
+}
+
+void CAsyncHttpClient::release_transfer(AsyncHttpTransfer* transfer)
+{
+    // curl_easy_reset保留easy句柄上的会话缓存等，连接在multi句柄的连接缓存中
+    curl_easy_reset(transfer->easy);
+    _idle_easies.push_back(transfer->easy);
+    if (transfer->headers != NULL)
+        curl_slist_free_all(transfer->headers);
+    delete transfer;
+}
+
+NET_NAMESPACE_END
+#endif // MOOON_HAVE_CURL
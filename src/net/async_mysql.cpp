@@ -0,0 +1,660 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#include "net/async_mysql.h"
+#include "sys/log.h"
+#include "utils/scoped_ptr.h"
+#if MOOON_HAVE_MYSQL==1
+#include <mysql/errmsg.h> // CR_SERVER_GONE_ERROR
+#include <mysql/mysql.h>
+#include <algorithm>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <time.h>
+NET_NAMESPACE_BEGIN
+
+// 非阻塞API由MariaDB的客户端库提供，以MYSQL_WAIT_READ是否定义来判断
+#ifdef MYSQL_WAIT_READ
+#define MOOON_HAVE_MYSQL_NONBLOCK 1
+#define MYSQL_WAIT_READ_FLAG MYSQL_WAIT_READ
+#define MYSQL_WAIT_WRITE_FLAG MYSQL_WAIT_WRITE
+#define MYSQL_WAIT_EXCEPT_FLAG MYSQL_WAIT_EXCEPT
+#define MYSQL_WAIT_TIMEOUT_FLAG MYSQL_WAIT_TIMEOUT
+#else
+#define MYSQL_WAIT_READ_FLAG 1
+#define MYSQL_WAIT_WRITE_FLAG 2
+#define MYSQL_WAIT_EXCEPT_FLAG 4
+#define MYSQL_WAIT_TIMEOUT_FLAG 8
+#endif
+
+static uint64_t get_monotonic_milliseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000 + static_cast<uint64_t>(ts.tv_nsec / 1000000);
+}
+
+struct AsyncMySQLQuery
+{
+    std::string sql;
+    AsyncMySQLCallback callback;
+    uint64_t submit_milliseconds;
+    uint64_t deadline_milliseconds; // 为0表示不限
+    CAsyncMySQLConnection* connection; // 排队时为NULL
+};
+
+/***
+  * 一个非阻塞的MySQL连接，状态在建连、空闲、发送查询和接收结果间切换，
+  * 每一步以xxx_start()开始，在SOCKET就绪或超时后以xxx_cont()继续，直到返回0
+  */
+class CAsyncMySQLConnection: public CEpollable
+{
+public:
+    enum State
+    {
+        state_closed,
+        state_connecting,
+        state_idle,
+        state_querying,
+        state_storing
+    };
+
+public:
+    CAsyncMySQLConnection(CAsyncMySQLClient* client)
+        : _client(client), _state(state_closed), _mysql(NULL), _query(NULL),
+          _wait_status(0), _wait_timeout_milliseconds(0), _reconnect_milliseconds(0),
+          _connect_ret(NULL), _query_ret(0), _result(NULL)
+    {
+    }
+
+    ~CAsyncMySQLConnection()
+    {
+        close_mysql(0);
+    }
+
+    State get_state() const { return _state; }
+    int get_wait_status() const { return _wait_status; }
+    uint64_t get_wait_timeout_milliseconds() const { return _wait_timeout_milliseconds; }
+    uint64_t get_reconnect_milliseconds() const { return _reconnect_milliseconds; }
+    AsyncMySQLQuery* get_query() const { return _query; }
+
+    void connect(uint64_t now_milliseconds);
+    void execute(AsyncMySQLQuery* query, uint64_t now_milliseconds);
+
+    // 继续进行中的操作，mysql_status为MYSQL_WAIT_READ等的组合
+    void resume(int mysql_status, uint64_t now_milliseconds);
+
+    // 关闭连接，reconnect_milliseconds为再次建连的时间点
+    void close_mysql(uint64_t reconnect_milliseconds);
+
+    // 执行中的查询超过期限，放弃查询并关闭连接，查询由调用者回调
+    AsyncMySQLQuery* abort_query(uint64_t now_milliseconds);
+
+private:
+    virtual epoll_event_t handle_epoll_event(void* input_ptr, uint32_t events, void* ouput_ptr);
+
+    void on_status(int mysql_status, uint64_t now_milliseconds);
+    void on_finished(uint64_t now_milliseconds);
+    void finish_query(AsyncMySQLResult& result, uint64_t now_milliseconds);
+    void fail_query(uint64_t now_milliseconds);
+
+private:
+    CAsyncMySQLClient* _client;
+    State _state;
+    MYSQL* _mysql;
+    AsyncMySQLQuery* _query;
+    int _wait_status;
+    uint64_t _wait_timeout_milliseconds; // 等待中含MYSQL_WAIT_TIMEOUT时有效
+    uint64_t _reconnect_milliseconds;    // state_closed时有效
+    MYSQL* _connect_ret;
+    int _query_ret;
+    MYSQL_RES* _result;
+};
+
+#if MOOON_HAVE_MYSQL_NONBLOCK==1
+void CAsyncMySQLConnection::connect(uint64_t now_milliseconds)
+{
+    const unsigned int connect_timeout_seconds = static_cast<unsigned int>(_client->_connect_timeout_seconds);
+
+    _mysql = mysql_init(NULL);
+    if (NULL == _mysql)
+    {
+        MYLOG_ERROR("mysql_init failed\n");
+        close_mysql(now_milliseconds + _client->_reconnect_interval_milliseconds);
+        return;
+    }
+
+    mysql_options(_mysql, MYSQL_OPT_NONBLOCK, 0);
+    mysql_options(_mysql, MYSQL_OPT_CONNECT_TIMEOUT, &connect_timeout_seconds);
+    if (!_client->_charset.empty())
+        mysql_options(_mysql, MYSQL_SET_CHARSET_NAME, _client->_charset.c_str());
+
+    _state = state_connecting;
+    const int mysql_status = mysql_real_connect_start(&_connect_ret, _mysql,
+            _client->_db_ip.c_str(), _client->_db_user.c_str(), _client->_db_password.c_str(),
+            _client->_db_name.empty()? NULL: _client->_db_name.c_str(), _client->_db_port, NULL, 0);
+    on_status(mysql_status, now_milliseconds);
+}
+
+void CAsyncMySQLConnection::execute(AsyncMySQLQuery* query, uint64_t now_milliseconds)
+{
+    MOOON_ASSERT(state_idle == _state);
+
+    _query = query;
+    _query->connection = this;
+    _state = state_querying;
+
+    const int mysql_status = mysql_real_query_start(&_query_ret, _mysql, _query->sql.data(), static_cast<unsigned long>(_query->sql.size()));
+    on_status(mysql_status, now_milliseconds);
+}
+
+void CAsyncMySQLConnection::resume(int mysql_status, uint64_t now_milliseconds)
+{
+    if (state_connecting == _state)
+        mysql_status = mysql_real_connect_cont(&_connect_ret, _mysql, mysql_status);
+    else if (state_querying == _state)
+        mysql_status = mysql_real_query_cont(&_query_ret, _mysql, mysql_status);
+    else if (state_storing == _state)
+        mysql_status = mysql_store_result_cont(&_result, _mysql, mysql_status);
+    else
+        return; // 空闲连接上的事件（如对端关闭），在下次查询时发现
+
+    on_status(mysql_status, now_milliseconds);
+}
+
+void CAsyncMySQLConnection::on_status(int mysql_status, uint64_t now_milliseconds)
+{
+    _wait_status = mysql_status;
+    if (0 == mysql_status)
+    {
+        on_finished(now_milliseconds);
+        return;
+    }
+
+    // 在建连过程中SOCKET才被创建
+    const int fd = mysql_get_socket(_mysql);
+    if (fd != get_fd())
+    {
+        if (get_epoll_events() != -1)
+            _client->_epoller.del_events(this);
+        set_fd(fd);
+    }
+    if (mysql_status & MYSQL_WAIT_TIMEOUT_FLAG)
+        _wait_timeout_milliseconds = now_milliseconds + mysql_get_timeout_value_ms(_mysql);
+
+    _client->update_events(this);
+}
+
+void CAsyncMySQLConnection::on_finished(uint64_t now_milliseconds)
+{
+    if (state_connecting == _state)
+    {
+        if (NULL == _connect_ret)
+        {
+            MYLOG_ERROR("connect mysql://%s:%d failed: (%u)%s\n",
+                    _client->_db_ip.c_str(), _client->_db_port, mysql_errno(_mysql), mysql_error(_mysql));
+            close_mysql(now_milliseconds + _client->_reconnect_interval_milliseconds);
+        }
+        else
+        {
+            _state = state_idle;
+            _client->update_events(this);
+        }
+    }
+    else if (state_querying == _state)
+    {
+        if (_query_ret != 0)
+        {
+            fail_query(now_milliseconds);
+        }
+        else
+        {
+            _state = state_storing;
+            const int mysql_status = mysql_store_result_start(&_result, _mysql);
+            on_status(mysql_status, now_milliseconds);
+        }
+    }
+    else if (state_storing == _state)
+    {
+        AsyncMySQLResult result;
+
+        if (NULL == _result)
+        {
+            // 非查询语句没有结果集
+            if (mysql_field_count(_mysql) != 0)
+            {
+                fail_query(now_milliseconds);
+                return;
+            }
+
+            result.affected_rows = static_cast<uint64_t>(mysql_affected_rows(_mysql));
+            result.insert_id = static_cast<uint64_t>(mysql_insert_id(_mysql));
+        }
+        else
+        {
+            // 结果已全部接收到本地，mysql_fetch_row不会阻塞
+            const unsigned int num_fields = mysql_num_fields(_result);
+            result.db_table.reserve(static_cast<size_t>(mysql_num_rows(_result)));
+
+            for (MYSQL_ROW row=mysql_fetch_row(_result); row!=NULL; row=mysql_fetch_row(_result))
+            {
+                const unsigned long* lengths = mysql_fetch_lengths(_result);
+
+                result.db_table.push_back(sys::DBRow());
+                sys::DBRow& db_row = result.db_table.back();
+                db_row.reserve(num_fields);
+                for (unsigned int i=0; i<num_fields; ++i)
+                {
+                    if (NULL == row[i])
+                        db_row.push_back(_client->_null_value);
+                    else
+                        db_row.push_back(std::string(row[i], lengths[i]));
+                }
+            }
+
+            mysql_free_result(_result);
+            _result = NULL;
+        }
+
+        finish_query(result, now_milliseconds);
+    }
+}
+
+void CAsyncMySQLConnection::fail_query(uint64_t now_milliseconds)
+{
+    AsyncMySQLResult result;
+    result.errcode = static_cast<int>(mysql_errno(_mysql));
+    result.errmsg = mysql_error(_mysql);
+
+    // 连接已断开，关闭后稍后重连
+    if ((CR_SERVER_GONE_ERROR == result.errcode) || (CR_SERVER_LOST == result.errcode))
+    {
+        AsyncMySQLQuery* query = _query;
+        _query = NULL;
+        close_mysql(now_milliseconds + _client->_reconnect_interval_milliseconds);
+        _client->complete(query, result, now_milliseconds);
+    }
+    else
+    {
+        finish_query(result, now_milliseconds);
+    }
+}
+
+void CAsyncMySQLConnection::finish_query(AsyncMySQLResult& result, uint64_t now_milliseconds)
+{
+    AsyncMySQLQuery* query = _query;
+
+    _query = NULL;
+    _state = state_idle;
+    _client->update_events(this);
+    _client->complete(query, result, now_milliseconds);
+}
+
+#else // MOOON_HAVE_MYSQL_NONBLOCK
+
+void CAsyncMySQLConnection::connect(uint64_t now_milliseconds)
+{
+    close_mysql(now_milliseconds + _client->_reconnect_interval_milliseconds);
+}
+
+void CAsyncMySQLConnection::execute(AsyncMySQLQuery* query, uint64_t now_milliseconds)
+{
+}
+
+void CAsyncMySQLConnection::resume(int mysql_status, uint64_t now_milliseconds)
+{
+}
+#endif // MOOON_HAVE_MYSQL_NONBLOCK
+
+void CAsyncMySQLConnection::close_mysql(uint64_t reconnect_milliseconds)
+{
+    const int fd = get_fd();
+
+    if (get_epoll_events() != -1)
+        _client->_epoller.del_events(this);
+    detach(); // SOCKET由mysql_close关闭
+
+    // 操作进行中（如查询超时被放弃）时，连接可能停在发送中途，mysql_close以阻塞方式发送COM_QUIT，
+    // 在对端不读时会一直阻塞，所以先shutdown，使mysql_close的读写立即失败
+    if ((fd != -1) && (_state != state_idle) && (_state != state_closed))
+        (void)shutdown(fd, SHUT_RDWR);
+
+    if (_result != NULL)
+    {
+        mysql_free_result(_result);
+        _result = NULL;
+    }
+    if (_mysql != NULL)
+    {
+        mysql_close(_mysql);
+        _mysql = NULL;
+    }
+
+    _state = state_closed;
+    _wait_status = 0;
+    _reconnect_milliseconds = reconnect_milliseconds;
+}
+
+AsyncMySQLQuery* CAsyncMySQLConnection::abort_query(uint64_t now_milliseconds)
+{
+    AsyncMySQLQuery* query = _query;
+
+    _query = NULL;
+    close_mysql(now_milliseconds); // 立即重连
+    return query;
+}
+
+epoll_event_t CAsyncMySQLConnection::handle_epoll_event(void* input_ptr, uint32_t events, void* ouput_ptr)
+{
+#if MOOON_HAVE_MYSQL_NONBLOCK==1
+    const uint64_t now_milliseconds = *static_cast<uint64_t*>(input_ptr);
+    int mysql_status = 0;
+
+    // 出错时同时置读和写，由xxx_cont()得到具体的错误
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        mysql_status |= MYSQL_WAIT_READ_FLAG;
+    if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+        mysql_status |= MYSQL_WAIT_WRITE_FLAG;
+    if (events & EPOLLPRI)
+        mysql_status |= MYSQL_WAIT_EXCEPT_FLAG;
+
+    mysql_status &= _wait_status;
+    if (mysql_status != 0)
+    {
+        resume(mysql_status, now_milliseconds);
+    }
+    else if ((events & (EPOLLERR | EPOLLHUP))
+          || ((state_idle == _state) && (events & (EPOLLIN | EPOLLRDHUP))))
+    {
+        // 空闲连接被MySQL关闭（如超过wait_timeout），立即重连，
+        // 否则EPOLLIN、EPOLLRDHUP或EPOLLHUP会一直触发
+        close_mysql(now_milliseconds);
+    }
+#endif // MOOON_HAVE_MYSQL_NONBLOCK
+    return epoll_none;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+CAsyncMySQLClient::CAsyncMySQLClient()
+    : _db_port(3306), _connect_timeout_seconds(sys::DB_CONNECT_TIMEOUT_SECONDS_DEFAULT),
+      _null_value("$NULL$"), _reconnect_interval_milliseconds(1000),
+      _num_queries(0), _num_completed(0)
+{
+}
+
+CAsyncMySQLClient::~CAsyncMySQLClient()
+{
+    destroy();
+}
+
+void CAsyncMySQLClient::create(uint32_t num_connections)
+{
+#if MOOON_HAVE_MYSQL_NONBLOCK==1
+    const uint64_t now_milliseconds = get_monotonic_milliseconds();
+
+    _epoller.create(num_connections+1);
+    for (uint32_t i=0; i<num_connections; ++i)
+    {
+        CAsyncMySQLConnection* connection = new CAsyncMySQLConnection(this);
+        _connections.push_back(connection);
+        _epollables[connection] = connection;
+        connection->connect(now_milliseconds);
+    }
+#else
+    THROW_DB_EXCEPTION(NULL, "non-blocking API not supported by the mysql client library", sys::DB_NOT_SUPPORTED);
+#endif // MOOON_HAVE_MYSQL_NONBLOCK
+}
+
+void CAsyncMySQLClient::destroy()
+{
+    const uint64_t now_milliseconds = get_monotonic_milliseconds();
+    AsyncMySQLResult result;
+
+    result.errcode = ASYNC_MYSQL_ERROR_CANCELED;
+    result.errmsg = "canceled";
+    for (std::vector<CAsyncMySQLConnection*>::size_type i=0; i<_connections.size(); ++i)
+    {
+        CAsyncMySQLConnection* connection = _connections[i];
+        AsyncMySQLQuery* query = connection->get_query();
+
+        if (query != NULL)
+        {
+            connection->abort_query(now_milliseconds);
+            complete(query, result, now_milliseconds);
+        }
+        delete connection;
+    }
+    _connections.clear();
+    _epollables.clear();
+
+    while (!_pending_queries.empty())
+    {
+        AsyncMySQLQuery* query = _pending_queries.front();
+        _pending_queries.pop_front();
+        complete(query, result, now_milliseconds);
+    }
+
+    _epoller.destroy();
+}
+
+void CAsyncMySQLClient::async_query(const AsyncMySQLCallback& callback, uint32_t timeout_milliseconds, const char* format, ...)
+{
+    std::string sql(256, '\0');
+    va_list ap;
+
+    va_start(ap, format);
+    int sql_length = vsnprintf(const_cast<char*>(sql.data()), sql.size(), format, ap);
+    va_end(ap);
+    if (sql_length >= static_cast<int>(sql.size()))
+    {
+        sql.resize(sql_length+1);
+        va_start(ap, format);
+        sql_length = vsnprintf(const_cast<char*>(sql.data()), sql.size(), format, ap);
+        va_end(ap);
+    }
+
+    sql.resize((sql_length > 0)? sql_length: 0);
+    async_query(callback, timeout_milliseconds, sql);
+}
+
+void CAsyncMySQLClient::async_query(const AsyncMySQLCallback& callback, uint32_t timeout_milliseconds, const std::string& sql)
+{
+    AsyncMySQLQuery* query = new AsyncMySQLQuery;
+
+    query->sql = sql;
+    query->callback = callback;
+    query->submit_milliseconds = get_monotonic_milliseconds();
+    query->deadline_milliseconds = (0 == timeout_milliseconds)? 0: query->submit_milliseconds + timeout_milliseconds;
+    query->connection = NULL;
+
+    // 在run_once()中发送，保证回调不会发生在async_query()中
+    _pending_queries.push_back(query);
+    ++_num_queries;
+}
+
+int CAsyncMySQLClient::run_once(uint32_t milliseconds)
+{
+    uint64_t now_milliseconds = get_monotonic_milliseconds();
+
+    _num_completed = 0;
+    dispatch(now_milliseconds);
+
+    const int n = _epoller.timed_wait(get_wait_milliseconds(milliseconds, now_milliseconds));
+    now_milliseconds = get_monotonic_milliseconds();
+    for (int i=0; i<n; ++i)
+    {
+        CEpollable* epollable = _epoller.get(i);
+        std::map<CEpollable*, CAsyncMySQLConnection*>::iterator iter = _epollables.find(epollable);
+
+        if (iter == _epollables.end())
+        {
+            // 非连接对象，如CEpoller内部的感应器
+            (void)epollable->handle_epoll_event(NULL, _epoller.get_events(i), NULL);
+            continue;
+        }
+
+        (void)epollable->handle_epoll_event(&now_milliseconds, _epoller.get_events(i), NULL);
+    }
+
+    expire(now_milliseconds);
+    dispatch(now_milliseconds);
+    return _num_completed;
+}
+
+uint32_t CAsyncMySQLClient::get_established_count() const
+{
+    uint32_t count = 0;
+
+    for (std::vector<CAsyncMySQLConnection*>::size_type i=0; i<_connections.size(); ++i)
+    {
+        const CAsyncMySQLConnection::State state = _connections[i]->get_state();
+        if ((state != CAsyncMySQLConnection::state_closed) && (state != CAsyncMySQLConnection::state_connecting))
+            ++count;
+    }
+
+    return count;
+}
+
+void CAsyncMySQLClient::dispatch(uint64_t now_milliseconds)
+{
+    for (std::vector<CAsyncMySQLConnection*>::size_type i=0; i<_connections.size(); ++i)
+    {
+        CAsyncMySQLConnection* connection = _connections[i];
+
+        if ((CAsyncMySQLConnection::state_closed == connection->get_state())
+         && (now_milliseconds >= connection->get_reconnect_milliseconds()))
+        {
+            connection->connect(now_milliseconds);
+        }
+        if ((CAsyncMySQLConnection::state_idle == connection->get_state()) && !_pending_queries.empty())
+        {
+            AsyncMySQLQuery* query = _pending_queries.front();
+            _pending_queries.pop_front();
+            connection->execute(query, now_milliseconds);
+        }
+    }
+}
+
+void CAsyncMySQLClient::expire(uint64_t now_milliseconds)
+{
+    AsyncMySQLResult result;
+    result.errcode = ASYNC_MYSQL_ERROR_TIMEOUT;
+    result.errmsg = "timeout";
+
+    for (std::vector<CAsyncMySQLConnection*>::size_type i=0; i<_connections.size(); ++i)
+    {
+        CAsyncMySQLConnection* connection = _connections[i];
+        AsyncMySQLQuery* query = connection->get_query();
+
+        if ((query != NULL) && (query->deadline_milliseconds > 0) && (now_milliseconds >= query->deadline_milliseconds))
+        {
+            connection->abort_query(now_milliseconds);
+            complete(query, result, now_milliseconds);
+        }
+        else if ((connection->get_wait_status() & MYSQL_WAIT_TIMEOUT_FLAG) && (now_milliseconds >= connection->get_wait_timeout_milliseconds()))
+        {
+            // 客户端库请求的超时（如建连超时）到了
+            connection->resume(MYSQL_WAIT_TIMEOUT_FLAG, now_milliseconds);
+        }
+    }
+
+    for (std::list<AsyncMySQLQuery*>::iterator iter=_pending_queries.begin(); iter!=_pending_queries.end();)
+    {
+        AsyncMySQLQuery* query = *iter;
+
+        if ((query->deadline_milliseconds > 0) && (now_milliseconds >= query->deadline_milliseconds))
+        {
+            iter = _pending_queries.erase(iter);
+            complete(query, result, now_milliseconds);
+        }
+        else
+        {
+            ++iter;
+        }
+    }
+}
+
+void CAsyncMySQLClient::complete(AsyncMySQLQuery* query, AsyncMySQLResult& result, uint64_t now_milliseconds)
+{
+    utils::ScopedPtr<AsyncMySQLQuery> query_deleter(query);
+
+    --_num_queries;
+    ++_num_completed;
+    result.elapsed_milliseconds = static_cast<uint32_t>(now_milliseconds - query->submit_milliseconds);
+    if (query->callback)
+        query->callback(result);
+}
+
+uint32_t CAsyncMySQLClient::get_wait_milliseconds(uint32_t milliseconds, uint64_t now_milliseconds) const
+{
+    uint64_t wait_milliseconds = milliseconds;
+
+    // 不晚于最早的期限、客户端库请求的超时和重连时间醒来
+    for (std::vector<CAsyncMySQLConnection*>::size_type i=0; i<_connections.size(); ++i)
+    {
+        const CAsyncMySQLConnection* connection = _connections[i];
+        const AsyncMySQLQuery* query = connection->get_query();
+        uint64_t wakeup_milliseconds = 0;
+
+        if ((query != NULL) && (query->deadline_milliseconds > 0))
+            wakeup_milliseconds = query->deadline_milliseconds;
+        if (connection->get_wait_status() & MYSQL_WAIT_TIMEOUT_FLAG)
+        {
+            if ((0 == wakeup_milliseconds) || (connection->get_wait_timeout_milliseconds() < wakeup_milliseconds))
+                wakeup_milliseconds = connection->get_wait_timeout_milliseconds();
+        }
+        if (CAsyncMySQLConnection::state_closed == connection->get_state())
+            wakeup_milliseconds = connection->get_reconnect_milliseconds();
+
+        if (wakeup_milliseconds > 0)
+            wait_milliseconds = std::min<uint64_t>(wait_milliseconds, (wakeup_milliseconds > now_milliseconds)? wakeup_milliseconds-now_milliseconds: 0);
+    }
+    for (std::list<AsyncMySQLQuery*>::const_iterator iter=_pending_queries.begin(); iter!=_pending_queries.end(); ++iter)
+    {
+        const uint64_t deadline_milliseconds = (*iter)->deadline_milliseconds;
+        if (deadline_milliseconds > 0)
+            wait_milliseconds = std::min<uint64_t>(wait_milliseconds, (deadline_milliseconds > now_milliseconds)? deadline_milliseconds-now_milliseconds: 0);
+    }
+
+    return static_cast<uint32_t>(wait_milliseconds);
+}
+
+void CAsyncMySQLClient::update_events(CAsyncMySQLConnection* connection)
+{
+    int events = 0;
+
+    if (CAsyncMySQLConnection::state_idle == connection->get_state())
+    {
+        // 空闲连接上不应有数据，MySQL关闭连接（如超过wait_timeout）时会先发错误包再发FIN，
+        // 关注EPOLLIN和EPOLLRDHUP才能及时发现，EPOLLERR和EPOLLHUP总是被关注
+        events = EPOLLIN | EPOLLRDHUP;
+    }
+    else
+    {
+        if (connection->get_wait_status() & MYSQL_WAIT_READ_FLAG)
+            events |= EPOLLIN;
+        if (connection->get_wait_status() & MYSQL_WAIT_WRITE_FLAG)
+            events |= EPOLLOUT;
+        if (connection->get_wait_status() & MYSQL_WAIT_EXCEPT_FLAG)
+            events |= EPOLLPRI;
+    }
+    _epoller.set_events(connection, events);
+}
+
+NET_NAMESPACE_END
+#endif // MOOON_HAVE_MYSQL
@@ -132,6 +132,95 @@ void set_nodelay(int fd, bool yes)
     set_socket_flags(fd, yes, O_NDELAY);
 }
 
+socket_options_t::socket_options_t()
+    : nodelay(-1), quickack(-1), busy_poll_microseconds(-1), notsent_lowat(-1),
+      send_buffer_size(-1), receive_buffer_size(-1),
+      keepalive(-1), keepidle_seconds(-1), keepintvl_seconds(-1), keepcnt(-1),
+      user_timeout_milliseconds(-1)
+{
+}
+
+socket_options_t get_socket_profile_options(socket_profile_t profile)
+{
+    socket_options_t options;
+
+    if (socket_profile_low_latency == profile)
+    {
+        options.nodelay = 1;
+        options.quickack = 1;
+        options.busy_poll_microseconds = 50;
+        options.notsent_lowat = SIZE_16K;
+    }
+    else if (socket_profile_bulk == profile)
+    {
+        // 不固定收发缓冲区，以保留内核的自动调整，需要时由调用者按带宽时延积设置
+        options.nodelay = 0;
+    }
+    else if (socket_profile_long_idle == profile)
+    {
+        options.keepalive = 1;
+        options.keepidle_seconds = 60;
+        options.keepintvl_seconds = 10;
+        options.keepcnt = 5;
+        options.user_timeout_milliseconds = 60000 + 10000 * 5;
+    }
+
+    return options;
+}
+
+// 设置单个选项，value为-1时不设置，不支持时返回false
+static bool set_socket_option(int fd, int level, int option, int value)
+{
+    if (-1 == value)
+        return true;
+
+    if (-1 == setsockopt(fd, level, option, &value, sizeof(value)))
+    {
+        if ((ENOPROTOOPT == errno) || (EOPNOTSUPP == errno) || (EPERM == errno))
+            return false;
+        THROW_SYSCALL_EXCEPTION(NULL, errno, "setsockopt");
+    }
+
+    return true;
+}
+
+int set_socket_options(int fd, const socket_options_t& options)
+{
+    int skipped = 0;
+
+    // 缓冲区大小须在连接建立前设置才能影响窗口扩大因子，故先设置
+    if (!set_socket_option(fd, SOL_SOCKET, SO_SNDBUF, options.send_buffer_size)) ++skipped;
+    if (!set_socket_option(fd, SOL_SOCKET, SO_RCVBUF, options.receive_buffer_size)) ++skipped;
+    if (!set_socket_option(fd, SOL_TCP, TCP_NODELAY, options.nodelay)) ++skipped;
+    if (!set_socket_option(fd, SOL_TCP, TCP_QUICKACK, options.quickack)) ++skipped;
+#if defined(SO_BUSY_POLL)
+    if (!set_socket_option(fd, SOL_SOCKET, SO_BUSY_POLL, options.busy_poll_microseconds)) ++skipped;
+#else
+    if (options.busy_poll_microseconds != -1) ++skipped;
+#endif // SO_BUSY_POLL
+#if defined(TCP_NOTSENT_LOWAT)
+    if (!set_socket_option(fd, SOL_TCP, TCP_NOTSENT_LOWAT, options.notsent_lowat)) ++skipped;
+#else
+    if (options.notsent_lowat != -1) ++skipped;
+#endif // TCP_NOTSENT_LOWAT
+    if (!set_socket_option(fd, SOL_SOCKET, SO_KEEPALIVE, options.keepalive)) ++skipped;
+    if (!set_socket_option(fd, SOL_TCP, TCP_KEEPIDLE, options.keepidle_seconds)) ++skipped;
+    if (!set_socket_option(fd, SOL_TCP, TCP_KEEPINTVL, options.keepintvl_seconds)) ++skipped;
+    if (!set_socket_option(fd, SOL_TCP, TCP_KEEPCNT, options.keepcnt)) ++skipped;
+#if defined(TCP_USER_TIMEOUT)
+    if (!set_socket_option(fd, SOL_TCP, TCP_USER_TIMEOUT, options.user_timeout_milliseconds)) ++skipped;
+#else
+    if (options.user_timeout_milliseconds != -1) ++skipped;
+#endif // TCP_USER_TIMEOUT
+
+    return skipped;
+}
+
+int set_socket_profile(int fd, socket_profile_t profile)
+{
+    return set_socket_options(fd, get_socket_profile_options(profile));
+}
+
 void close_fd(int fd) throw ()
 {
     (void)::close(fd);
@@ -228,6 +317,16 @@ void CEpollable::set_nodelay(bool yes)
 	net::set_nodelay(_fd, yes);
 }
 
+int CEpollable::set_socket_options(const socket_options_t& options)
+{
+    return net::set_socket_options(_fd, options);
+}
+
+int CEpollable::set_socket_profile(socket_profile_t profile)
+{
+    return net::set_socket_profile(_fd, profile);
+}
+
 int CEpollable::get_socket_error_code()
 {
     int error_code;
@@ -0,0 +1,403 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#include "mooon/net/file_transfer.h"
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <algorithm>
+#include <chrono>
+NET_NAMESPACE_BEGIN
+
+// 单次事件最多传输的字节数，避免一个传输长时间独占事件循环
+static const uint64_t TRANSFER_SLICE_MAX = SIZE_1M;
+
+// 接收时使用的管道大小，设置失败时使用系统默认值（通常为64K）
+static const int PIPE_SIZE = SIZE_1M;
+
+static uint64_t get_monotonic_microseconds()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+//////////////////////////////////////////////////////////////////////////
+// CFileTransfer
+
+CFileTransfer::CFileTransfer(file_transfer_direction_t direction, int sock_fd, int file_fd, off_t offset, uint64_t size, uint64_t rate_limit)
+    : _direction(direction), _file_fd(file_fd), _pipe_bytes(0),
+      _offset(offset), _size(size), _transferred(0),
+      _rate_limit(rate_limit), _tokens(0), _last_refill_microseconds(0), _resume_microseconds(0),
+      _added_round(0), _finished(false), _errcode(0), _observer(NULL), _user_data(NULL)
+{
+    _pipefd[0] = -1;
+    _pipefd[1] = -1;
+
+    if (file_transfer_receive == direction)
+    {
+        if (-1 == pipe2(_pipefd, O_NONBLOCK|O_CLOEXEC))
+            THROW_SYSCALL_EXCEPTION(NULL, errno, "pipe2");
+
+#if defined(F_SETPIPE_SZ)
+        (void)fcntl(_pipefd[1], F_SETPIPE_SZ, PIPE_SIZE);
+#endif // F_SETPIPE_SZ
+    }
+
+    set_fd(sock_fd);
+}
+
+CFileTransfer::~CFileTransfer()
+{
+    if (_pipefd[0] != -1)
+        close_fd(_pipefd[0]);
+    if (_pipefd[1] != -1)
+        close_fd(_pipefd[1]);
+
+    // 不拥有SOCKET句柄，不能由CEpollable关闭
+    detach();
+}
+
+epoll_event_t CFileTransfer::handle_epoll_event(void* input_ptr, uint32_t events, void* ouput_ptr)
+{
+    const uint64_t now_microseconds = *static_cast<uint64_t*>(input_ptr);
+
+    if (events & EPOLLERR)
+    {
+        const int errcode = get_socket_error_code();
+        finish((0 == errcode)? EIO: errcode);
+        return epoll_destroy;
+    }
+    if ((events & EPOLLHUP) && ((file_transfer_send == _direction) || !(events & EPOLLIN)))
+    {
+        // 接收时如果还有数据可读，则先读完，未收完时由读到的EOF判定失败
+        finish((file_transfer_send == _direction)? EPIPE: ECONNRESET);
+        return epoll_destroy;
+    }
+
+    const uint64_t allowance = get_allowance(now_microseconds);
+    if (0 == allowance)
+        return epoll_remove;
+
+    return (file_transfer_send == _direction)? do_send(allowance): do_receive(allowance);
+}
+
+uint64_t CFileTransfer::get_allowance(uint64_t now_microseconds)
+{
+    uint64_t allowance = std::min(_size - _transferred, TRANSFER_SLICE_MAX);
+
+    if (_rate_limit > 0)
+    {
+        if (0 == _last_refill_microseconds)
+        {
+            // 首次最多立即发送1/20秒的量，之后匀速
+            _tokens = static_cast<double>(std::max<uint64_t>(_rate_limit / 20, 1));
+        }
+        else if (now_microseconds > _last_refill_microseconds)
+        {
+            _tokens += static_cast<double>(now_microseconds - _last_refill_microseconds) * _rate_limit / 1000000;
+            _tokens = std::min(_tokens, static_cast<double>(_rate_limit)); // 最多积累1秒
+        }
+
+        _last_refill_microseconds = now_microseconds;
+        allowance = (_tokens < 1)? 0: std::min(allowance, static_cast<uint64_t>(_tokens));
+    }
+
+    return allowance;
+}
+
+uint64_t CFileTransfer::get_pause_microseconds() const
+{
+    // 每次暂停至少积累1/20秒的量，避免过于频繁的唤醒
+    const uint64_t wanted = std::min(_size - _transferred, std::max<uint64_t>(_rate_limit / 20, 1));
+    const double needed = static_cast<double>(wanted) - _tokens;
+
+    if ((0 == _rate_limit) || (needed <= 0))
+        return 0;
+    return static_cast<uint64_t>(needed * 1000000 / _rate_limit) + 1;
+}
+
+void CFileTransfer::consume(uint64_t bytes)
+{
+    _transferred += bytes;
+    if (_rate_limit > 0)
+        _tokens -= static_cast<double>(bytes);
+}
+
+void CFileTransfer::finish(int errcode)
+{
+    _finished = true;
+    _errcode = errcode;
+}
+
+epoll_event_t CFileTransfer::do_send(uint64_t allowance)
+{
+    while (allowance > 0)
+    {
+        const ssize_t bytes = ::sendfile(get_fd(), _file_fd, &_offset, allowance);
+        if (-1 == bytes)
+        {
+            if (EINTR == errno)
+                continue;
+            if ((EAGAIN == errno) || (EWOULDBLOCK == errno))
+                return epoll_none; // 等待可写
+            THROW_SYSCALL_EXCEPTION(NULL, errno, "sendfile");
+        }
+        if (0 == bytes)
+        {
+            // 文件比预期的小
+            finish(EIO);
+            return epoll_destroy;
+        }
+
+        consume(bytes);
+        allowance -= bytes;
+    }
+
+    if (_transferred == _size)
+    {
+        finish(0);
+        return epoll_destroy;
+    }
+
+    // 限速额度已用完则暂停，否则是本次事件的分片已用完，等待下一轮
+    return ((_rate_limit > 0) && (_tokens < 1))? epoll_remove: epoll_none;
+}
+
+epoll_event_t CFileTransfer::do_receive(uint64_t allowance)
+{
+    while (allowance > 0)
+    {
+        if (0 == _pipe_bytes)
+        {
+            const ssize_t bytes = ::splice(get_fd(), NULL, _pipefd[1], NULL, allowance, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+            if (-1 == bytes)
+            {
+                if (EINTR == errno)
+                    continue;
+                if ((EAGAIN == errno) || (EWOULDBLOCK == errno))
+                    return epoll_none; // 等待可读
+                THROW_SYSCALL_EXCEPTION(NULL, errno, "splice");
+            }
+            if (0 == bytes)
+            {
+                // 对端提前关闭了连接
+                finish(ECONNRESET);
+                return epoll_destroy;
+            }
+
+            _pipe_bytes = static_cast<size_t>(bytes);
+        }
+
+        // 将管道中的数据全部写入文件
+        while (_pipe_bytes > 0)
+        {
+            const ssize_t bytes = ::splice(_pipefd[0], NULL, _file_fd, &_offset, _pipe_bytes, SPLICE_F_MOVE);
+            if (-1 == bytes)
+            {
+                if (EINTR == errno)
+                    continue;
+                THROW_SYSCALL_EXCEPTION(NULL, errno, "splice");
+            }
+
+            _pipe_bytes -= bytes;
+            consume(bytes);
+            allowance = (allowance > static_cast<uint64_t>(bytes))? allowance - bytes: 0;
+        }
+    }
+
+    if (_transferred == _size)
+    {
+        finish(0);
+        return epoll_destroy;
+    }
+
+    return ((_rate_limit > 0) && (_tokens < 1))? epoll_remove: epoll_none;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// CFileTransferEngine
+
+CFileTransferEngine::CFileTransferEngine()
+    : _round(0)
+{
+}
+
+CFileTransferEngine::~CFileTransferEngine()
+{
+    destroy();
+}
+
+void CFileTransferEngine::create(uint32_t epoll_size)
+{
+    _epoller.create(epoll_size);
+}
+
+void CFileTransferEngine::destroy()
+{
+    while (!_transfers.empty())
+        finish_transfer(_transfers.begin()->second, ECANCELED);
+
+    _epoller.destroy();
+}
+
+void CFileTransferEngine::add(CFileTransfer* transfer)
+{
+    transfer->_added_round = _round;
+    _transfers.insert(std::make_pair(static_cast<CEpollable*>(transfer), transfer));
+
+    if (transfer->get_transferred() == transfer->get_size())
+    {
+        finish_transfer(transfer, 0);
+    }
+    else
+    {
+        try
+        {
+            transfer->set_nonblock(true);
+            register_transfer(transfer);
+        }
+        catch (...)
+        {
+            _transfers.erase(transfer);
+            throw;
+        }
+    }
+}
+
+void CFileTransferEngine::remove(CFileTransfer* transfer)
+{
+    if (_transfers.count(transfer) > 0)
+        finish_transfer(transfer, ECANCELED);
+}
+
+int CFileTransferEngine::run_once(uint32_t milliseconds)
+{
+    uint64_t now_microseconds = get_monotonic_microseconds();
+    int handled = 0;
+
+    // 恢复到期的限速暂停，并缩短等待时长以便按时恢复
+    resume_transfers(now_microseconds);
+    for (std::list<CFileTransfer*>::iterator iter=_paused_transfers.begin(); iter!=_paused_transfers.end(); ++iter)
+    {
+        const uint64_t resume_microseconds = (*iter)->_resume_microseconds;
+        const uint64_t wait_milliseconds = (resume_microseconds > now_microseconds)? (resume_microseconds - now_microseconds + 999) / 1000: 0;
+        milliseconds = static_cast<uint32_t>(std::min<uint64_t>(milliseconds, wait_milliseconds));
+    }
+
+    const int n = _epoller.timed_wait(milliseconds);
+    now_microseconds = get_monotonic_microseconds();
+    const uint64_t round = ++_round;
+    for (int i=0; i<n; ++i)
+    {
+        CEpollable* epollable = _epoller.get(i);
+        std::map<CEpollable*, CFileTransfer*>::iterator iter = _transfers.find(epollable);
+
+        if (iter == _transfers.end())
+        {
+            // 只处理CEpoller内部的感应器，其它的为本轮回调中已被remove或delete的传输，其事件已失效
+            if (_epoller.is_internal(epollable))
+                (void)epollable->handle_epoll_event(NULL, _epoller.get_events(i), NULL);
+            continue;
+        }
+
+        CFileTransfer* transfer = iter->second;
+        if (transfer->_added_round == round)
+        {
+            // 本轮回调中新加入的传输，复用了已删除传输的地址，事件属于已删除的传输
+            continue;
+        }
+
+        const uint64_t transferred = transfer->get_transferred();
+        epoll_event_t retval;
+
+        ++handled;
+        try
+        {
+            retval = transfer->handle_epoll_event(&now_microseconds, _epoller.get_events(i), NULL);
+        }
+        catch (sys::CSyscallException& ex)
+        {
+            finish_transfer(transfer, ex.errcode());
+            continue;
+        }
+
+        if ((transfer->get_transferred() != transferred) && (transfer->_observer != NULL))
+            transfer->_observer->on_progress(transfer);
+
+        if (epoll_destroy == retval)
+        {
+            finish_transfer(transfer, transfer->get_errcode());
+        }
+        else if (epoll_remove == retval)
+        {
+            transfer->_resume_microseconds = now_microseconds + transfer->get_pause_microseconds();
+            _epoller.del_events(transfer);
+            _paused_transfers.push_back(transfer);
+        }
+    }
+
+    return handled;
+}
+
+void CFileTransferEngine::resume_transfers(uint64_t now_microseconds)
+{
+    for (std::list<CFileTransfer*>::iterator iter=_paused_transfers.begin(); iter!=_paused_transfers.end();)
+    {
+        CFileTransfer* transfer = *iter;
+
+        if (transfer->_resume_microseconds > now_microseconds)
+        {
+            ++iter;
+        }
+        else
+        {
+            iter = _paused_transfers.erase(iter);
+            register_transfer(transfer);
+        }
+    }
+}
+
+void CFileTransferEngine::finish_transfer(CFileTransfer* transfer, int errcode)
+{
+    if (transfer->get_epoll_events() != -1)
+    {
+        try
+        {
+            _epoller.del_events(transfer);
+        }
+        catch (sys::CSyscallException&)
+        {
+            // SOCKET可能已被调用者关闭
+        }
+    }
+
+    _paused_transfers.remove(transfer);
+    _transfers.erase(transfer);
+    transfer->finish(errcode);
+
+    // 最后回调，回调中可能delete transfer
+    if (transfer->_observer != NULL)
+        transfer->_observer->on_finish(transfer, errcode);
+}
+
+void CFileTransferEngine::register_transfer(CFileTransfer* transfer)
+{
+    const int events = (file_transfer_send == transfer->get_direction())? EPOLLOUT: EPOLLIN;
+    _epoller.set_events(transfer, events);
+}
+
+NET_NAMESPACE_END
@@ -5,6 +5,7 @@
 #include "utils/string_utils.h"
 #include <time.h>
 #if MOOON_HAVE_LIBRDKAFKA==1
+#include <librdkafka/rdkafka.h>
 NET_NAMESPACE_BEGIN
 
 // 消息模式
@@ -26,6 +27,37 @@ MessageInfo::~MessageInfo()
     //    delete message;
 }
 
+CKafkaBatch::CKafkaBatch()
+{
+}
+
+CKafkaBatch::~CKafkaBatch()
+{
+    clear();
+}
+
+void CKafkaBatch::clear()
+{
+    for (std::vector<rd_kafka_message_t*>::size_type i=0; i<_messages.size(); ++i)
+        rd_kafka_message_destroy(_messages[i]);
+    _messages.clear(); // 只清空元素，保留容量
+    _views.clear();
+}
+
+void CKafkaBatch::get_commit_offsets(std::map<int32_t, int64_t>* offsets) const
+{
+    for (std::vector<KafkaMessageView>::size_type i=0; i<_views.size(); ++i)
+    {
+        const KafkaMessageView& view = _views[i];
+        std::map<int32_t, int64_t>::iterator iter = offsets->find(view.partition);
+
+        if (iter == offsets->end())
+            offsets->insert(std::make_pair(view.partition, view.offset+1));
+        else if (view.offset+1 > iter->second)
+            iter->second = view.offset+1;
+    }
+}
+
 class DefEventImpl: public RdKafka::EventCb
 {
 private:
@@ -92,6 +124,7 @@ private:
 CKafkaConsumer::CKafkaConsumer(RdKafka::EventCb* event_cb, RdKafka::ConsumeCb* consume_cb, RdKafka::RebalanceCb* rebalance_cb, RdKafka::OffsetCommitCb* offset_commitcb)
 {
     _consumed_mode = CM_NONE;
+    _queue = NULL;
 
     // KafkaConsumer::create和Producer::create
     // 调用HandleImpl::set_common_config注册下列回调。
@@ -123,6 +156,8 @@ CKafkaConsumer::CKafkaConsumer(RdKafka::EventCb* event_cb, RdKafka::ConsumeCb* c
 
 CKafkaConsumer::~CKafkaConsumer()
 {
+    destroy_queue();
+
     bool success = true;
     if (_consumed_mode == CM_SUBSCRIBE)
         success = unsubscribe_topic();
@@ -144,6 +179,7 @@ void CKafkaConsumer::close()
     // Close and shut down the proper
     // 最大阻塞时间由配置 session.timeout.ms 指定
     // 过程中 RdKafka::RebalanceCb 和 RdKafka::OffsetCommitCb 可能被调用
+    destroy_queue(); // 队列须在消费者关闭前释放
     if (_consumer.get() != NULL)
     {
         // The consumer object must later be freed with delete
@@ -507,6 +543,124 @@ int CKafkaConsumer::consume_batch(int batch_size, std::vector<std::string>* logs
     return num_logs;
 }
 
+int CKafkaConsumer::consume_batch(int batch_size, CKafkaBatch* batch, int timeout_ms, bool* timeout)
+{
+    batch->clear();
+    if (timeout != NULL)
+    {
+        *timeout = false;
+    }
+    if (batch_size <= 0)
+    {
+        // 避免对空的_messages取&_messages[0]
+        return 0;
+    }
+    if (NULL == _queue)
+    {
+        // 取得KafkaConsumer的消费者队列，
+        // 其上的批量消费和consume一样会更新待自动提交的offset
+        _queue = rd_kafka_queue_get_consumer(_consumer->c_ptr());
+        if (NULL == _queue)
+        {
+            MYLOG_ERROR("Get consumer queue of topic://%s failed: no consumer group\n", _topic_str.c_str());
+            return -1;
+        }
+    }
+
+    batch->_messages.resize(batch_size);
+    const ssize_t num_messages = rd_kafka_consume_batch_queue(_queue, timeout_ms, &batch->_messages[0], batch_size);
+    if (num_messages < 0)
+    {
+        const rd_kafka_resp_err_t errcode = rd_kafka_last_error();
+        MYLOG_ERROR("Consume batch from topic://%s error: (%d)%s.\n", _topic_str.c_str(), (int)errcode, rd_kafka_err2str(errcode));
+        batch->_messages.clear();
+        return -1;
+    }
+
+    // 错误和事件消息释放后移除，只保留正常消息，并建立视图
+    int num_logs = 0;
+    batch->_messages.resize(num_messages);
+    batch->_views.reserve(num_messages);
+    for (ssize_t i=0; i<num_messages; ++i)
+    {
+        rd_kafka_message_t* message = batch->_messages[i];
+
+        if (message->err != RD_KAFKA_RESP_ERR_NO_ERROR)
+        {
+            // (ERR__PARTITION_EOF, -191)Broker: No more messages
+            if (RD_KAFKA_RESP_ERR__PARTITION_EOF == message->err)
+                MYLOG_DETAIL("Consume topic://%s error: (%d)%s.\n", _topic_str.c_str(), (int)message->err, rd_kafka_message_errstr(message));
+            else
+                MYLOG_ERROR("Consume topic://%s error: (%d)%s.\n", _topic_str.c_str(), (int)message->err, rd_kafka_message_errstr(message));
+            rd_kafka_message_destroy(message);
+            continue;
+        }
+
+        KafkaMessageView view;
+        view.payload = static_cast<const char*>(message->payload);
+        view.len = message->len;
+        view.key = static_cast<const char*>(message->key);
+        view.key_len = message->key_len;
+        view.partition = message->partition;
+        view.offset = message->offset;
+        view.timestamp = rd_kafka_message_timestamp(message, NULL);
+        batch->_messages[num_logs++] = message;
+        batch->_views.push_back(view);
+    }
+
+    batch->_messages.resize(num_logs);
+    if ((0 == num_logs) && (0 == num_messages) && (timeout != NULL))
+        *timeout = true;
+    return num_logs;
+}
+
+int CKafkaConsumer::sync_commit(const CKafkaBatch& batch)
+{
+    std::map<int32_t, int64_t> offsets;
+    batch.get_commit_offsets(&offsets);
+    return commit_offsets(offsets, false);
+}
+
+int CKafkaConsumer::async_commit(const CKafkaBatch& batch)
+{
+    std::map<int32_t, int64_t> offsets;
+    batch.get_commit_offsets(&offsets);
+    return commit_offsets(offsets, true);
+}
+
+int CKafkaConsumer::sync_commit(const std::map<int32_t, int64_t>& offsets)
+{
+    return commit_offsets(offsets, false);
+}
+
+int CKafkaConsumer::async_commit(const std::map<int32_t, int64_t>& offsets)
+{
+    return commit_offsets(offsets, true);
+}
+
+int CKafkaConsumer::commit_offsets(const std::map<int32_t, int64_t>& offsets, bool async)
+{
+    std::vector<RdKafka::TopicPartition*> partitions;
+
+    if (offsets.empty())
+        return RdKafka::ERR_NO_ERROR;
+    for (std::map<int32_t, int64_t>::const_iterator iter=offsets.begin(); iter!=offsets.end(); ++iter)
+        partitions.push_back(RdKafka::TopicPartition::create(_topic_str, iter->first, iter->second));
+
+    const int errcode = async? async_commit(partitions): sync_commit(partitions);
+    RdKafka::TopicPartition::destroy(partitions);
+    return errcode;
+}
+
+void CKafkaConsumer::destroy_queue()
+{
+    if (_queue != NULL)
+    {
+        rd_kafka_queue_destroy(_queue);
+        _queue = NULL;
+    }
+}
+
 int CKafkaConsumer::sync_commit()
 {
     return int(_consumer->commitSync());
@@ -542,6 +696,32 @@ int CKafkaConsumer::assignment(std::vector<RdKafka::TopicPartition*>* partitions
     return _consumer->assignment(*partitions);
 }
 
+int CKafkaConsumer::pause_partitions()
+{
+    std::vector<RdKafka::TopicPartition*> partitions;
+    RdKafka::ErrorCode errcode = _consumer->assignment(partitions);
+
+    if ((errcode == RdKafka::ERR_NO_ERROR) && !partitions.empty())
+        errcode = _consumer->pause(partitions);
+    RdKafka::TopicPartition::destroy(partitions);
+    if (errcode != RdKafka::ERR_NO_ERROR)
+        MYLOG_ERROR("Pause topic://%s error: (%d)%s.\n", _topic_str.c_str(), (int)errcode, err2str(errcode).c_str());
+    return errcode;
+}
+
+int CKafkaConsumer::resume_partitions()
+{
+    std::vector<RdKafka::TopicPartition*> partitions;
+    RdKafka::ErrorCode errcode = _consumer->assignment(partitions);
+
+    if ((errcode == RdKafka::ERR_NO_ERROR) && !partitions.empty())
+        errcode = _consumer->resume(partitions);
+    RdKafka::TopicPartition::destroy(partitions);
+    if (errcode != RdKafka::ERR_NO_ERROR)
+        MYLOG_ERROR("Resume topic://%s error: (%d)%s.\n", _topic_str.c_str(), (int)errcode, err2str(errcode).c_str());
+    return errcode;
+}
+
 int CKafkaConsumer::subscription(std::vector<std::string>* topics)
 {
     return _consumer->subscription(*topics);
@@ -0,0 +1,408 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#include "net/kafka_parallel_consumer.h"
+#include "sys/datetime_utils.h"
+#include "sys/log.h"
+#if MOOON_HAVE_LIBRDKAFKA==1
+NET_NAMESPACE_BEGIN
+
+void CKafkaOffsetTracker::dispatch(int32_t partition, int64_t offset)
+{
+    PartitionState& state = _partitions[partition];
+    state.inflight.insert(offset);
+    if (offset+1 > state.next_offset)
+        state.next_offset = offset+1;
+}
+
+void CKafkaOffsetTracker::complete(int32_t partition, int64_t offset)
+{
+    std::map<int32_t, PartitionState>::iterator iter = _partitions.find(partition);
+    if (iter != _partitions.end())
+        iter->second.inflight.erase(offset);
+}
+
+void CKafkaOffsetTracker::get_commit_offsets(std::map<int32_t, int64_t>* offsets, bool only_changed) const
+{
+    for (std::map<int32_t, PartitionState>::const_iterator iter=_partitions.begin(); iter!=_partitions.end(); ++iter)
+    {
+        const PartitionState& state = iter->second;
+        const int64_t watermark = state.watermark();
+
+        if ((watermark >= 0) && (!only_changed || (watermark != state.committed)))
+            (*offsets)[iter->first] = watermark;
+    }
+}
+
+void CKafkaOffsetTracker::mark_committed(const std::map<int32_t, int64_t>& offsets)
+{
+    for (std::map<int32_t, int64_t>::const_iterator iter=offsets.begin(); iter!=offsets.end(); ++iter)
+    {
+        std::map<int32_t, PartitionState>::iterator state_iter = _partitions.find(iter->first);
+        if (state_iter != _partitions.end())
+            state_iter->second.committed = iter->second;
+    }
+}
+
+size_t CKafkaOffsetTracker::get_inflight_count() const
+{
+    size_t count = 0;
+    for (std::map<int32_t, PartitionState>::const_iterator iter=_partitions.begin(); iter!=_partitions.end(); ++iter)
+        count += iter->second.inflight.size();
+    return count;
+}
+
+void CKafkaOffsetTracker::clear()
+{
+    _partitions.clear();
+}
+
+// 由CKafkaConsumer负责销毁
+class ParallelRebalanceImpl: public RdKafka::RebalanceCb
+{
+public:
+    ParallelRebalanceImpl(CKafkaParallelConsumer* parallel_consumer)
+        : _parallel_consumer(parallel_consumer)
+    {
+    }
+
+private:
+    virtual void rebalance_cb (RdKafka::KafkaConsumer *consumer, RdKafka::ErrorCode errcode, std::vector<RdKafka::TopicPartition*>& partitions)
+    {
+        if (RdKafka::ERR__ASSIGN_PARTITIONS == errcode)
+        {
+            MYLOG_INFO("RebalanceCb: assign %d partitions\n", (int)partitions.size());
+            _parallel_consumer->on_assign(consumer, partitions);
+        }
+        else if (RdKafka::ERR__REVOKE_PARTITIONS == errcode)
+        {
+            MYLOG_INFO("RebalanceCb: revoke %d partitions\n", (int)partitions.size());
+            _parallel_consumer->on_revoke(consumer);
+        }
+        else
+        {
+            MYLOG_ERROR("RebalanceCb error: %s\n", RdKafka::err2str(errcode).c_str());
+            _parallel_consumer->on_revoke(consumer);
+        }
+    }
+
+private:
+    CKafkaParallelConsumer* _parallel_consumer;
+};
+
+CKafkaParallelConsumer::CKafkaParallelConsumer(IKafkaMessageHandler* handler)
+    : _handler(handler), _batch_size(0), _commit_interval_ms(0), _max_inflight(0),
+      _stop(false), _workers_stop(false), _paused(false),
+      _consumed_number(0), _handled_number(0), _commit_number(0)
+{
+}
+
+CKafkaParallelConsumer::~CKafkaParallelConsumer()
+{
+    stop();
+    wait();
+
+    // 关闭消费者时可能回调on_revoke，所以须在其它成员析构前关闭
+    _consumer.reset();
+}
+
+void CKafkaParallelConsumer::set_auto_offset_reset(const std::string& str)
+{
+    _auto_offset_reset = str;
+}
+
+bool CKafkaParallelConsumer::init(const std::string& brokers, const std::string& topic, const std::string& group,
+                                  int num_workers, int batch_size, int commit_interval_ms, int max_inflight)
+{
+    if (num_workers < 1)
+    {
+        MYLOG_ERROR("Parameter[num_workers] is invalid: %d.\n", num_workers);
+        return false;
+    }
+
+    _topic = topic;
+    _batch_size = (batch_size < 1)? 1: batch_size;
+    _commit_interval_ms = commit_interval_ms;
+    _max_inflight = (max_inflight < _batch_size)? _batch_size: max_inflight;
+    _workers.resize(num_workers);
+    for (int i=0; i<num_workers; ++i)
+        _workers[i].reset(new Worker);
+
+    // 开启再平衡回调，关闭自动提交，由水位决定提交的offset
+    _consumer.reset(new CKafkaConsumer(NULL, NULL, new ParallelRebalanceImpl(this), NULL));
+    if (!_auto_offset_reset.empty())
+        _consumer->set_auto_offset_reset(_auto_offset_reset);
+    return _consumer->init(brokers, topic, group, true, false);
+}
+
+bool CKafkaParallelConsumer::start()
+{
+    if (!_consumer->subscribe_topic())
+        return false;
+
+    try
+    {
+        for (int i=0; i<int(_workers.size()); ++i)
+            _workers[i]->thread = std::thread(&CKafkaParallelConsumer::worker_run, this, i);
+        _poll_thread = std::thread(&CKafkaParallelConsumer::poll_run, this);
+        return true;
+    }
+    catch (std::system_error& ex)
+    {
+        MYLOG_ERROR("Start parallel consumer of topic://%s failed: %s\n", _topic.c_str(), ex.what());
+        stop();
+        wait();
+        return false;
+    }
+}
+
+void CKafkaParallelConsumer::stop()
+{
+    _stop = true;
+}
+
+void CKafkaParallelConsumer::wait()
+{
+    if (_poll_thread.joinable())
+        _poll_thread.join();
+
+    _workers_stop = true;
+    for (int i=0; i<int(_workers.size()); ++i)
+    {
+        Worker* worker = _workers[i].get();
+        {
+            std::unique_lock<std::mutex> lock(worker->lock);
+            worker->cond.notify_one();
+        }
+        if (worker->thread.joinable())
+            worker->thread.join();
+    }
+}
+
+size_t CKafkaParallelConsumer::get_inflight_count() const
+{
+    std::unique_lock<std::mutex> lock(_lock);
+    return _tracker.get_inflight_count();
+}
+
+void CKafkaParallelConsumer::poll_run()
+{
+    uint64_t last_commit_ms = sys::CDatetimeUtils::get_current_milliseconds();
+
+    MYLOG_INFO("Parallel consumer of topic://%s start now\n", _topic.c_str());
+    while (!_stop)
+    {
+        bool timeout = false;
+        flow_control();
+
+        // 暂停期间也须调用，以处理再平衡回调和维持消费组成员身份，
+        // 暂停前已拉到本地的消息仍可能返回，所以未完成数可略超过_max_inflight
+        std::shared_ptr<CKafkaBatch> batch(new CKafkaBatch);
+        if (_consumer->consume_batch(_batch_size, batch.get(), 100, &timeout) > 0)
+            dispatch(batch);
+
+        const uint64_t now_ms = sys::CDatetimeUtils::get_current_milliseconds();
+        if (now_ms >= last_commit_ms + _commit_interval_ms)
+        {
+            commit(false);
+            last_commit_ms = now_ms;
+        }
+    }
+
+    // 退出前处理完已分发的消息，并同步提交
+    wait_drained();
+    commit(true);
+    MYLOG_INFO("Parallel consumer of topic://%s exit now\n", _topic.c_str());
+}
+
+void CKafkaParallelConsumer::worker_run(int index)
+{
+    Worker* worker = _workers[index].get();
+
+    while (true)
+    {
+        Task task;
+        {
+            std::unique_lock<std::mutex> lock(worker->lock);
+            while (worker->tasks.empty() && !_workers_stop)
+                worker->cond.wait(lock);
+            if (worker->tasks.empty())
+                break;
+            task = worker->tasks.front();
+            worker->tasks.pop_front();
+        }
+
+        const KafkaMessageView& message = (*task.batch)[task.index];
+        try
+        {
+            _handler->handle(index, message);
+        }
+        catch (std::exception& ex)
+        {
+            MYLOG_ERROR("Handle message(partition:%d, offset:%" PRId64") of topic://%s failed: %s\n",
+                        message.partition, message.offset, _topic.c_str(), ex.what());
+        }
+        catch (...)
+        {
+            // 不能让异常终止工作线程，否则该线程的消息永远不会完成
+            MYLOG_ERROR("Handle message(partition:%d, offset:%" PRId64") of topic://%s failed: unknown exception\n",
+                        message.partition, message.offset, _topic.c_str());
+        }
+
+        ++_handled_number;
+        complete(message.partition, message.offset);
+    }
+}
+
+void CKafkaParallelConsumer::dispatch(const std::shared_ptr<CKafkaBatch>& batch)
+{
+    const int num_workers = static_cast<int>(_workers.size());
+    std::vector<std::vector<int> > indexes(num_workers); // 各工作线程分到的消息
+
+    {
+        // 须在工作线程能完成之前登记
+        std::unique_lock<std::mutex> lock(_lock);
+        for (int i=0; i<batch->size(); ++i)
+        {
+            const KafkaMessageView& message = (*batch)[i];
+            _tracker.dispatch(message.partition, message.offset);
+            indexes[message.partition % num_workers].push_back(i);
+        }
+    }
+    for (int i=0; i<num_workers; ++i)
+    {
+        if (indexes[i].empty())
+            continue;
+
+        Worker* worker = _workers[i].get();
+        std::unique_lock<std::mutex> lock(worker->lock);
+        for (std::vector<int>::size_type j=0; j<indexes[i].size(); ++j)
+        {
+            Task task;
+            task.batch = batch;
+            task.index = indexes[i][j];
+            worker->tasks.push_back(task);
+        }
+        worker->cond.notify_one();
+    }
+
+    _consumed_number += batch->size();
+}
+
+void CKafkaParallelConsumer::complete(int32_t partition, int64_t offset)
+{
+    std::unique_lock<std::mutex> lock(_lock);
+    _tracker.complete(partition, offset);
+    _drained.notify_all();
+}
+
+void CKafkaParallelConsumer::commit(bool sync, RdKafka::KafkaConsumer* consumer)
+{
+    std::map<int32_t, int64_t> offsets;
+    std::vector<RdKafka::TopicPartition*> partitions;
+
+    {
+        std::unique_lock<std::mutex> lock(_lock);
+        _tracker.get_commit_offsets(&offsets, true);
+    }
+    if (offsets.empty())
+        return;
+    for (std::map<int32_t, int64_t>::const_iterator iter=offsets.begin(); iter!=offsets.end(); ++iter)
+        partitions.push_back(RdKafka::TopicPartition::create(_topic, iter->first, iter->second));
+
+    int errcode;
+    if (consumer != NULL)
+        errcode = consumer->commitSync(partitions);
+    else if (sync)
+        errcode = _consumer->sync_commit(partitions);
+    else
+        errcode = _consumer->async_commit(partitions);
+    RdKafka::TopicPartition::destroy(partitions);
+    if (errcode != RdKafka::ERR_NO_ERROR)
+    {
+        MYLOG_ERROR("Commit %d partitions of topic://%s error: (%d)%s.\n",
+                    (int)offsets.size(), _topic.c_str(), errcode, RdKafka::err2str(static_cast<RdKafka::ErrorCode>(errcode)).c_str());
+    }
+    else
+    {
+        std::unique_lock<std::mutex> lock(_lock);
+        _tracker.mark_committed(offsets);
+        ++_commit_number;
+    }
+}
+
+void CKafkaParallelConsumer::wait_drained()
+{
+    std::unique_lock<std::mutex> lock(_lock);
+    while (_tracker.get_inflight_count() > 0)
+        _drained.wait_for(lock, std::chrono::milliseconds(100));
+}
+
+void CKafkaParallelConsumer::flow_control()
+{
+    int inflight_count;
+    {
+        std::unique_lock<std::mutex> lock(_lock);
+        inflight_count = static_cast<int>(_tracker.get_inflight_count());
+    }
+
+    if (!_paused && (inflight_count >= _max_inflight))
+    {
+        if (_consumer->pause_partitions() == RdKafka::ERR_NO_ERROR)
+        {
+            _paused = true;
+            MYLOG_DEBUG("Pause topic://%s with %d inflight messages\n", _topic.c_str(), inflight_count);
+        }
+    }
+    else if (_paused && (inflight_count <= _max_inflight/2))
+    {
+        if (_consumer->resume_partitions() == RdKafka::ERR_NO_ERROR)
+        {
+            _paused = false;
+            MYLOG_DEBUG("Resume topic://%s with %d inflight messages\n", _topic.c_str(), inflight_count);
+        }
+    }
+}
+
+void CKafkaParallelConsumer::on_assign(RdKafka::KafkaConsumer* consumer, std::vector<RdKafka::TopicPartition*>& partitions)
+{
+    {
+        std::unique_lock<std::mutex> lock(_lock);
+        _tracker.clear();
+    }
+    // 新分配的分区未被暂停，由flow_control按需重新暂停
+    _paused = false;
+    consumer->assign(partitions);
+}
+
+void CKafkaParallelConsumer::on_revoke(RdKafka::KafkaConsumer* consumer)
+{
+    // 分区被其它消费者接管前，处理完已分发的消息并同步提交，避免重复消费
+    // 析构时_consumer可能已为空，所以直接使用回调传入的consumer提交
+    wait_drained();
+    commit(true, consumer);
+    {
+        std::unique_lock<std::mutex> lock(_lock);
+        _tracker.clear();
+    }
+    _paused = false;
+    consumer->unassign();
+}
+
+NET_NAMESPACE_END
+#endif // MOOON_HAVE_LIBRDKAFKA
@@ -0,0 +1,130 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#include "net/kafka_pipeline.h"
+#include "sys/log.h"
+#if MOOON_HAVE_LIBRDKAFKA==1
+NET_NAMESPACE_BEGIN
+
+CKafkaPipelineSource::CKafkaPipelineSource(CKafkaConsumer* consumer, int timeout_ms)
+    : _consumer(consumer), _timeout_ms(timeout_ms)
+{
+}
+
+int CKafkaPipelineSource::fetch(int max_count, sys::PipelineBatch* batch)
+{
+    const int n = _consumer->consume_batch(max_count, &_kafka_batch, _timeout_ms);
+
+    if (n <= 0)
+        return n; // 出错时为-1，由CPipeline按出错退避
+
+    batch->messages.resize(n);
+    for (int i=0; i<n; ++i)
+    {
+        const KafkaMessageView& view = _kafka_batch[i];
+        batch->messages[i].assign(static_cast<const char*>(view.payload), view.len);
+    }
+
+    // 消息数据已复制，只留下各分区待提交的offset，librdkafka的消息即可释放
+    std::map<int32_t, int64_t>* offsets = new std::map<int32_t, int64_t>;
+    _kafka_batch.get_commit_offsets(offsets);
+    _kafka_batch.clear();
+    batch->ack_context = offsets;
+    return n;
+}
+
+void CKafkaPipelineSource::ack(sys::PipelineBatch* batch)
+{
+    std::map<int32_t, int64_t>* offsets = static_cast<std::map<int32_t, int64_t>*>(batch->ack_context);
+    const int errcode = _consumer->async_commit(*offsets);
+
+    // 提交失败不影响正确性，之后的批次提交时会覆盖
+    if (errcode != RdKafka::ERR_NO_ERROR)
+        MYLOG_WARN("Commit batch(%" PRIu64") failed: (%d)%s\n", batch->sequence, errcode, RdKafka::err2str(static_cast<RdKafka::ErrorCode>(errcode)).c_str());
+    delete offsets;
+}
+
+void CKafkaPipelineSource::discard(sys::PipelineBatch* batch)
+{
+    delete static_cast<std::map<int32_t, int64_t>*>(batch->ack_context);
+}
+
+CKafkaPipelineSink::CKafkaPipelineSink(CKafkaProducer* producer, const std::string& key, int flush_timeout_ms)
+    : _producer(producer), _key(key), _flush_timeout_ms(flush_timeout_ms), _sequence(0)
+{
+}
+
+bool CKafkaPipelineSink::write(sys::PipelineBatch* batch)
+{
+    int errcode = RdKafka::ERR_NO_ERROR;
+    std::string errmsg;
+
+    // 同一批次重试时，之前入队的消息仍在等待递送报告，
+    // 换批次时上一批次的消息都已有递送结果（write返回了true或已放弃）
+    if (batch->sequence != _sequence)
+    {
+        _sequence = batch->sequence;
+        _tracker.failed = 0;
+        _tracker.failed_logs.clear();
+    }
+
+    // 入队成功的从batch->messages中删除，重试时只写余下的
+    if (!batch->messages.empty())
+        _producer->produce_batch(_key, &batch->messages, &_tracker, RdKafka::Topic::PARTITION_UA, &errcode, &errmsg);
+    if (!batch->messages.empty())
+    {
+        if (errcode != RdKafka::ERR__QUEUE_FULL)
+            MYLOG_ERROR("Produce batch(%" PRIu64") failed: (%d)%s\n", batch->sequence, errcode, errmsg.c_str());
+        _producer->timed_poll(0);
+        return false;
+    }
+
+    // 等待本批全部的递送报告，librdkafka保证每条消息在message.timeout.ms内有结果
+    if (_tracker.pending > 0)
+        (void)_producer->flush(_flush_timeout_ms);
+    if (_tracker.failed > 0)
+    {
+        MYLOG_ERROR("Deliver batch(%" PRIu64") failed: %d messages, (%d)%s\n",
+                batch->sequence, _tracker.failed, _tracker.errcode, RdKafka::err2str(static_cast<RdKafka::ErrorCode>(_tracker.errcode)).c_str());
+
+        // 放回递送失败的消息，重试时重新produce
+        for (std::vector<std::string>::size_type i=0; i<_tracker.failed_logs.size(); ++i)
+        {
+            batch->messages.push_back(std::string());
+            batch->messages.back().swap(_tracker.failed_logs[i]);
+        }
+        _tracker.failed = 0;
+        _tracker.failed_logs.clear();
+        return false;
+    }
+    if (_tracker.pending > 0)
+    {
+        MYLOG_WARN("Wait delivery of batch(%" PRIu64") timeout: %d messages pending\n", batch->sequence, _tracker.pending);
+        return false;
+    }
+
+    return true;
+}
+
+void CKafkaPipelineSink::flush()
+{
+    _producer->flush(10000);
+}
+
+NET_NAMESPACE_END
+#endif // MOOON_HAVE_LIBRDKAFKA==1
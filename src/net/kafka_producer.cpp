@@ -13,6 +13,64 @@ private:
     virtual void dr_cb (RdKafka::Message &message);
 };
 
+// 零拷贝消息，作为msg_opaque传给librdkafka，在递送报告回调中释放
+struct NocopyMessage
+{
+    std::string log; // 接管的std::string，为空表示使用buffer
+    char* buffer;
+    size_t buffer_size;
+    IKafkaBufferReleaser* releaser;
+    void* user_data;
+    KafkaDeliveryTracker* tracker; // 可为NULL
+
+    NocopyMessage()
+        : buffer(NULL), buffer_size(0), releaser(NULL), user_data(NULL), tracker(NULL)
+    {
+    }
+
+    ~NocopyMessage()
+    {
+        if (releaser != NULL)
+            releaser->release(buffer, buffer_size, user_data);
+    }
+};
+
+// 先回调使用者的dr_cb，再释放零拷贝消息，
+// 保证使用者的dr_cb中仍可访问message.payload()
+class DeliveryReportDispatcher: public RdKafka::DeliveryReportCb
+{
+public:
+    DeliveryReportDispatcher(RdKafka::DeliveryReportCb* dr_cb)
+        : _dr_cb(dr_cb)
+    {
+    }
+
+private:
+    virtual void dr_cb (RdKafka::Message &message)
+    {
+        NocopyMessage* nocopy_message = static_cast<NocopyMessage*>(message.msg_opaque());
+
+        _dr_cb->dr_cb(message);
+        if ((nocopy_message != NULL) && (nocopy_message->tracker != NULL))
+        {
+            KafkaDeliveryTracker* tracker = nocopy_message->tracker;
+
+            --tracker->pending;
+            if (message.err() != RdKafka::ERR_NO_ERROR)
+            {
+                ++tracker->failed;
+                tracker->errcode = message.err();
+                tracker->failed_logs.push_back(std::string());
+                tracker->failed_logs.back().swap(nocopy_message->log);
+            }
+        }
+        delete nocopy_message;
+    }
+
+private:
+    mooon::utils::ScopedPtr<RdKafka::DeliveryReportCb> _dr_cb;
+};
+
 class DefEventImpl: public RdKafka::EventCb
 {
 public:
@@ -64,10 +122,11 @@ CKafkaProducer::CKafkaProducer(RdKafka::DeliveryReportCb* dr_cb, RdKafka::EventC
     // 调用HandleImpl::set_common_config注册下列回调。
 
     // dr_cb
+    // 由DeliveryReportDispatcher转发，以便在递送报告后释放零拷贝消息
     if (NULL == dr_cb)
-        _dr_cb.reset(new DefDeliveryReportImpl);
+        _dr_cb.reset(new DeliveryReportDispatcher(new DefDeliveryReportImpl));
     else
-        _dr_cb.reset(dr_cb);
+        _dr_cb.reset(new DeliveryReportDispatcher(dr_cb));
 
     // event_cb
     if (NULL == event_cb)
@@ -249,6 +308,123 @@ int CKafkaProducer::produce_batch(const std::string& key, const std::vector<std:
     return num_logs;
 }
 
+bool CKafkaProducer::produce(const std::string& key, std::string&& log, int32_t partition, int* errcode, std::string* errmsg)
+{
+    NocopyMessage* message = new NocopyMessage;
+    message->log.swap(log);
+
+    const RdKafka::ErrorCode errcode_ = produce_nocopy(key, message->log.data(), message->log.size(), partition, message);
+    timed_poll(0);
+    set_error(errcode_, errcode, errmsg);
+
+    if (RdKafka::ERR_NO_ERROR == errcode_)
+    {
+        return true;
+    }
+    else
+    {
+        // 入队失败时librdkafka不会回调dr_cb，归还log以便重试
+        log.swap(message->log);
+        delete message;
+        return false;
+    }
+}
+
+int CKafkaProducer::produce_batch(const std::string& key, std::vector<std::string>* logs, int32_t partition, int* errcode, std::string* errmsg)
+{
+    return produce_batch(key, logs, NULL, partition, errcode, errmsg);
+}
+
+int CKafkaProducer::produce_batch(const std::string& key, std::vector<std::string>* logs, KafkaDeliveryTracker* tracker, int32_t partition, int* errcode, std::string* errmsg)
+{
+    int num_logs = 0;
+
+    timed_poll(0);
+    for (; num_logs<int(logs->size()); ++num_logs)
+    {
+        NocopyMessage* message = new NocopyMessage;
+        message->log.swap((*logs)[num_logs]);
+        message->tracker = tracker;
+
+        const RdKafka::ErrorCode errcode_ = produce_nocopy(key, message->log.data(), message->log.size(), partition, message);
+        set_error(errcode_, errcode, errmsg);
+        if (RdKafka::ERR_NO_ERROR == errcode_)
+        {
+            if (tracker != NULL)
+                ++tracker->pending;
+        }
+        else
+        {
+            (*logs)[num_logs].swap(message->log);
+            delete message;
+            if (errcode_ == RdKafka::ERR__QUEUE_FULL)
+                timed_poll(0);
+            break;
+        }
+    }
+
+    // 删除已入队的，只移动std::string内部的指针，不复制数据
+    logs->erase(logs->begin(), logs->begin()+num_logs);
+    return num_logs;
+}
+
+bool CKafkaProducer::produce(const std::string& key, char* buffer, size_t buffer_size, IKafkaBufferReleaser* releaser, void* user_data, int32_t partition, int* errcode, std::string* errmsg)
+{
+    NocopyMessage* message = new NocopyMessage;
+    message->buffer = buffer;
+    message->buffer_size = buffer_size;
+    message->user_data = user_data;
+    message->releaser = releaser;
+
+    const RdKafka::ErrorCode errcode_ = produce_nocopy(key, buffer, buffer_size, partition, message);
+    if (RdKafka::ERR_NO_ERROR == errcode_)
+    {
+        // 入队成功后，message可能在timed_poll中被释放，之后不能再访问
+        timed_poll(0);
+        set_error(errcode_, errcode, errmsg);
+        return true;
+    }
+    else
+    {
+        // 失败时buffer仍由调用者负责，不能调用releaser
+        message->releaser = NULL;
+        delete message;
+        timed_poll(0);
+        set_error(errcode_, errcode, errmsg);
+        return false;
+    }
+}
+
+RdKafka::ErrorCode CKafkaProducer::produce_nocopy(const std::string& key, const char* data, size_t data_size, int32_t partition, void* msg_opaque)
+{
+    // msgflags为0，即不指定RK_MSG_COPY和RK_MSG_FREE，
+    // librdkafka直接引用data，由NocopyMessage在dr_cb中负责释放
+    if (key.empty())
+        return _producer->produce(
+                _topic.get(), partition, 0, const_cast<char*>(data), data_size, NULL, 0, msg_opaque);
+    else
+        return _producer->produce(
+                _topic.get(), partition, 0, const_cast<char*>(data), data_size, (void*)key.data(), key.size(), msg_opaque);
+}
+
+void CKafkaProducer::set_error(RdKafka::ErrorCode errcode_, int* errcode, std::string* errmsg) const
+{
+    if (RdKafka::ERR_NO_ERROR == errcode_)
+    {
+        if (errcode != NULL)
+            *errcode = 0;
+        if (errmsg != NULL)
+            *errmsg = "SUCCESS";
+    }
+    else
+    {
+        if (errcode != NULL)
+            *errcode = errcode_;
+        if (errmsg != NULL)
+            *errmsg = err2str(errcode_);
+    }
+}
+
 // rd_kafka_poll_cb:
 // int rd_kafka_poll (rd_kafka_t *rk, int timeout_ms) {
 //        return rd_kafka_q_serve(rk->rk_rep, timeout_ms, 0,
@@ -17,11 +17,32 @@
  * Author: jian yi, eyjian@qq.com
  */
 #include <fcntl.h>
+#include <linux/filter.h>
 #include <sys/utils.h>
 #include "net/utils.h"
 #include "net/listener.h"
 NET_NAMESPACE_BEGIN
 
+// 从accept得到的地址中取出对端IP和端口
+static void get_peer_address(const struct sockaddr_in6& peer_addr_in6, ip_address_t& peer_ip, uint16_t& peer_port)
+{
+    const struct sockaddr* peer_addr = (const struct sockaddr*)&peer_addr_in6;
+
+    // 接受的是一个IPV4请求
+    if (AF_INET == peer_addr->sa_family)
+    {
+        const struct sockaddr_in* peer_addr_in = (const struct sockaddr_in*)peer_addr;
+        peer_port = peer_addr_in->sin_port;
+        peer_ip = peer_addr_in->sin_addr.s_addr;
+    }
+    else
+    {
+        // 接受的是一个IPV6请求
+        peer_port = peer_addr_in6.sin6_port;
+        peer_ip = (uint32_t*)&peer_addr_in6.sin6_addr;
+    }
+}
+
 CListener::CListener()
     :_port(0)
 {
@@ -129,13 +150,13 @@ void CListener::listen(const ip_address_t& ip, uint16_t port, bool nonblock, boo
 void CListener::listen(const ipv4_node_t& ip_node, bool nonblock, bool enabled_address_zero, bool reuse_port)
 {
     ip_address_t ip = ip_node.ip;
-    listen(ip, ip_node.port, nonblock, enabled_address_zero);
+    listen(ip, ip_node.port, nonblock, enabled_address_zero, reuse_port);
 }
 
 void CListener::listen(const ipv6_node_t& ip_node, bool nonblock, bool enabled_address_zero, bool reuse_port)
 {
     ip_address_t ip = (uint32_t*)ip_node.ip;
-    listen(ip, ip_node.port, nonblock, enabled_address_zero);
+    listen(ip, ip_node.port, nonblock, enabled_address_zero, reuse_port);
 }
 
 int CListener::accept(ip_address_t& peer_ip, uint16_t& peer_port)
@@ -153,21 +174,89 @@ int CListener::accept(ip_address_t& peer_ip, uint16_t& peer_port)
         return -1;      
     }
 
-    // 接受的是一个IPV4请求
-    if (AF_INET == peer_addr->sa_family)
+    get_peer_address(peer_addr_in6, peer_ip, peer_port);
+    return newfd;
+}
+
+int CListener::accept4(ip_address_t& peer_ip, uint16_t& peer_port, int flags)
+{
+    struct sockaddr_in6 peer_addr_in6;
+    struct sockaddr* peer_addr = (struct sockaddr*)&peer_addr_in6;
+    socklen_t peer_addrlen = sizeof(struct sockaddr_in6); // 使用最大的
+    int newfd;
+
+    for (;;)
     {
-        struct sockaddr_in* peer_addr_in = (struct sockaddr_in*)peer_addr;
-        peer_port = peer_addr_in->sin_port;
-        peer_ip = peer_addr_in->sin_addr.s_addr;
+        newfd = ::accept4(CEpollable::get_fd(), peer_addr, &peer_addrlen, flags);
+        if (newfd != -1) break;
+
+        // 连接在accept之前已被对端重置，继续取下一个
+        if ((EINTR == errno) || (ECONNABORTED == errno))
+        {
+            peer_addrlen = sizeof(struct sockaddr_in6);
+            continue;
+        }
+        if ((EAGAIN == errno) || (EWOULDBLOCK == errno))
+            return -1;
+
+        THROW_SYSCALL_EXCEPTION(NULL, errno, "accept4");
     }
-    else
+
+    get_peer_address(peer_addr_in6, peer_ip, peer_port);
+    return newfd;
+}
+
+int CListener::accept_all(std::vector<accepted_connection_t>* connections, int max_count, int flags)
+{
+    int count = 0;
+
+    while (count < max_count)
     {
-        // 接受的是一个IPV6请求
-        peer_port = peer_addr_in6.sin6_port;
-        peer_ip = (uint32_t*)&peer_addr_in6.sin6_addr;
+        accepted_connection_t connection;
+
+        connection.fd = accept4(connection.peer_ip, connection.peer_port, flags);
+        if (-1 == connection.fd)
+            break;
+
+        connections->push_back(connection);
+        ++count;
     }
 
-    return newfd;
+    return count;
+}
+
+void CListener::set_incoming_cpu(int cpu)
+{
+#if defined(SO_INCOMING_CPU)
+    if (-1 == ::setsockopt(CEpollable::get_fd(), SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)))
+        THROW_SYSCALL_EXCEPTION(NULL, errno, "setsockopt");
+#else
+    THROW_SYSCALL_EXCEPTION(NULL, ENOPROTOOPT, "setsockopt");
+#endif // SO_INCOMING_CPU
+}
+
+void CListener::attach_reuseport_cpu_bpf(uint16_t group_size)
+{
+#if defined(SO_ATTACH_REUSEPORT_CBPF)
+    if (0 == group_size)
+        THROW_SYSCALL_EXCEPTION(NULL, EINVAL, NULL);
+
+    // A = 当前CPU编号; A = A % group_size; return A
+    struct sock_filter code[] =
+    {
+        { BPF_LD  | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU) },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, group_size },
+        { BPF_RET | BPF_A, 0, 0, 0 }
+    };
+    struct sock_fprog prog;
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+
+    if (-1 == ::setsockopt(CEpollable::get_fd(), SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)))
+        THROW_SYSCALL_EXCEPTION(NULL, errno, "setsockopt");
+#else
+    THROW_SYSCALL_EXCEPTION(NULL, ENOPROTOOPT, "setsockopt");
+#endif // SO_ATTACH_REUSEPORT_CBPF
 }
 
 NET_NAMESPACE_END
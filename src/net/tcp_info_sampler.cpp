@@ -0,0 +1,247 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#include "mooon/net/tcp_info_sampler.h"
+#include "mooon/net/utils.h"
+#include "mooon/sys/log.h"
+#include "mooon/utils/string_utils.h"
+NET_NAMESPACE_BEGIN
+
+tcp_info_sample_t::tcp_info_sample_t()
+    : fd(-1), state(0), ca_state(0), retransmits(0),
+      rto(0), rtt(0), rttvar(0), rcv_rtt(0),
+      snd_mss(0), snd_cwnd(0), snd_ssthresh(0),
+      unacked(0), lost(0), total_retrans(0)
+{
+}
+
+void get_tcp_info(int fd, tcp_info_sample_t* sample)
+{
+    struct tcp_info info;
+    socklen_t info_length = sizeof(info);
+
+    memset(&info, 0, sizeof(info));
+    if (-1 == getsockopt(fd, SOL_TCP, TCP_INFO, &info, &info_length))
+        THROW_SYSCALL_EXCEPTION(NULL, errno, "getsockopt");
+
+    sample->fd = fd;
+    sample->peer = get_peer(fd);
+    sample->state = info.tcpi_state;
+    sample->ca_state = info.tcpi_ca_state;
+    sample->retransmits = info.tcpi_retransmits;
+    sample->rto = info.tcpi_rto;
+    sample->rtt = info.tcpi_rtt;
+    sample->rttvar = info.tcpi_rttvar;
+    sample->rcv_rtt = info.tcpi_rcv_rtt;
+    sample->snd_mss = info.tcpi_snd_mss;
+    sample->snd_cwnd = info.tcpi_snd_cwnd;
+    sample->snd_ssthresh = info.tcpi_snd_ssthresh;
+    sample->unacked = info.tcpi_unacked;
+    sample->lost = info.tcpi_lost;
+    sample->total_retrans = info.tcpi_total_retrans;
+}
+
+std::string to_string(const tcp_info_sample_t& sample)
+{
+    return utils::CStringUtils::format_string(
+        "peer:%s,fd:%d,state:%u,ca_state:%u,rtt:%u,rttvar:%u,rcv_rtt:%u,rto:%u,mss:%u,cwnd:%u,ssthresh:%u,unacked:%u,lost:%u,retrans:%u,total_retrans:%u",
+        sample.peer.c_str(), sample.fd,
+        static_cast<unsigned int>(sample.state), static_cast<unsigned int>(sample.ca_state),
+        sample.rtt, sample.rttvar, sample.rcv_rtt, sample.rto,
+        sample.snd_mss, sample.snd_cwnd, sample.snd_ssthresh,
+        sample.unacked, sample.lost,
+        static_cast<unsigned int>(sample.retransmits), sample.total_retrans);
+}
+
+std::string to_string(const TcpInfoMetrics& metrics)
+{
+    return utils::CStringUtils::format_string(
+        "rounds:%u,connections:%u,avg_rtt:%u,max_rtt:%u,max_rtt_peer:%s,max_rttvar:%u,retransmitting:%u,unacked:%u,lost:%u,total_retrans:%" PRIu64,
+        metrics.rounds, metrics.connections, metrics.avg_rtt, metrics.max_rtt,
+        metrics.max_rtt_peer.empty()? "-": metrics.max_rtt_peer.c_str(),
+        metrics.max_rttvar, metrics.retransmitting, metrics.unacked, metrics.lost, metrics.total_retrans);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+CTcpInfoSampler::CTcpInfoSampler()
+    : _stop(false), _interval_milliseconds(0), _observer(NULL), _engine(NULL)
+{
+}
+
+CTcpInfoSampler::~CTcpInfoSampler()
+{
+    stop();
+    wait();
+}
+
+void CTcpInfoSampler::add(CEpollable* epollable)
+{
+    sys::LockHelper<sys::CLock> lock_helper(_lock);
+    _epollables.insert(epollable);
+}
+
+void CTcpInfoSampler::remove(CEpollable* epollable)
+{
+    sys::LockHelper<sys::CLock> lock_helper(_lock);
+    _epollables.erase(epollable);
+}
+
+size_t CTcpInfoSampler::get_count() const
+{
+    sys::LockHelper<sys::CLock> lock_helper(_lock);
+    return _epollables.size();
+}
+
+size_t CTcpInfoSampler::sample(std::vector<tcp_info_sample_t>* samples)
+{
+    size_t count = 0;
+    sys::LockHelper<sys::CLock> lock_helper(_lock);
+
+    samples->reserve(samples->size() + _epollables.size());
+    for (std::set<CEpollable*>::const_iterator iter=_epollables.begin(); iter!=_epollables.end(); ++iter)
+    {
+        const int fd = (*iter)->get_fd();
+        if (-1 == fd)
+            continue;
+
+        try
+        {
+            tcp_info_sample_t tcp_info_sample;
+            get_tcp_info(fd, &tcp_info_sample);
+            samples->push_back(tcp_info_sample);
+            ++count;
+        }
+        catch (sys::CSyscallException&)
+        {
+            // 非TCP连接或连接已关闭，跳过
+        }
+    }
+
+    return count;
+}
+
+bool CTcpInfoSampler::start(uint32_t interval_milliseconds, ITcpInfoObserver* observer)
+{
+    try
+    {
+        _interval_milliseconds = interval_milliseconds;
+        _observer = observer;
+        _engine = new sys::CThreadEngine(sys::bind(&CTcpInfoSampler::run, this));
+        return true;
+    }
+    catch (sys::CSyscallException& ex)
+    {
+        MYLOG_ERROR("Start tcp-info-sampler failed: %s\n", ex.str().c_str());
+        return false;
+    }
+}
+
+void CTcpInfoSampler::stop()
+{
+    sys::LockHelper<sys::CLock> lock_helper(_lock);
+    _stop = true;
+    _event.signal();
+}
+
+void CTcpInfoSampler::wait()
+{
+    if (_engine != NULL)
+    {
+        _engine->join();
+        delete _engine;
+        _engine = NULL;
+    }
+}
+
+void CTcpInfoSampler::run()
+{
+    MYLOG_INFO("Tcp-info-sampler start now\n");
+    while (!_stop)
+    {
+        {
+            // 等待采样间隔，stop时被立即唤醒
+            sys::LockHelper<sys::CLock> lock_helper(_lock);
+            if (!_stop)
+                _event.timed_wait(_lock, _interval_milliseconds);
+        }
+        if (_stop)
+            break;
+
+        std::vector<tcp_info_sample_t> samples;
+        sample(&samples);
+        update_metrics(samples);
+        if (_observer != NULL)
+            _observer->on_tcp_info(samples);
+    }
+
+    MYLOG_INFO("Tcp-info-sampler exit now\n");
+}
+
+void CTcpInfoSampler::get_metrics(TcpInfoMetrics* metrics, bool reset)
+{
+    sys::LockHelper<sys::CLock> lock_helper(_lock);
+    *metrics = _metrics;
+
+    if (reset)
+    {
+        _metrics.rounds = 0;
+        _metrics.max_rtt = 0;
+        _metrics.max_rtt_peer.clear();
+        _metrics.max_rttvar = 0;
+    }
+}
+
+void CTcpInfoSampler::update_metrics(const std::vector<tcp_info_sample_t>& samples)
+{
+    uint64_t sum_rtt = 0;
+    uint32_t retransmitting = 0;
+    uint32_t unacked = 0;
+    uint32_t lost = 0;
+    uint64_t total_retrans = 0;
+    sys::LockHelper<sys::CLock> lock_helper(_lock);
+
+    for (std::vector<tcp_info_sample_t>::size_type i=0; i<samples.size(); ++i)
+    {
+        const tcp_info_sample_t& sample = samples[i];
+
+        sum_rtt += sample.rtt;
+        if (sample.retransmits > 0)
+            ++retransmitting;
+        unacked += sample.unacked;
+        lost += sample.lost;
+        total_retrans += sample.total_retrans;
+
+        if (sample.rtt > _metrics.max_rtt)
+        {
+            _metrics.max_rtt = sample.rtt;
+            _metrics.max_rtt_peer = sample.peer;
+        }
+        if (sample.rttvar > _metrics.max_rttvar)
+            _metrics.max_rttvar = sample.rttvar;
+    }
+
+    ++_metrics.rounds;
+    _metrics.connections = static_cast<uint32_t>(samples.size());
+    _metrics.avg_rtt = samples.empty()? 0: static_cast<uint32_t>(sum_rtt / samples.size());
+    _metrics.retransmitting = retransmitting;
+    _metrics.unacked = unacked;
+    _metrics.lost = lost;
+    _metrics.total_retrans = total_retrans;
+}
+
+NET_NAMESPACE_END
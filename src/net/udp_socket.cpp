@@ -18,10 +18,140 @@
  */
 #include "mooon/net/udp_socket.h"
 #include "mooon/net/utils.h"
+#include <netinet/udp.h>
+#include <algorithm>
 #include <unistd.h>
+
+// 旧版本的头文件可能没有定义，但运行的内核可能已经支持，
+// 不支持时setsockopt返回ENOPROTOOPT
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif // SOL_UDP
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif // UDP_SEGMENT
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif // UDP_GRO
 NET_NAMESPACE_BEGIN
 
+//////////////////////////////////////////////////////////////////////////
+// CUdpMessageBatch
+
+CUdpMessageBatch::CUdpMessageBatch(unsigned int capacity, size_t message_size)
+    : _capacity(capacity), _count(0), _message_size(message_size),
+      _control_size(CMSG_SPACE(sizeof(int))) // 内核以int类型填充UDP_GRO
+{
+    if ((0 == capacity) || (0 == message_size))
+        THROW_SYSCALL_EXCEPTION(NULL, EINVAL, NULL);
+
+    _msgs.reset(new struct mmsghdr[capacity]);
+    _iovecs.reset(new struct iovec[capacity]);
+    _addrs.reset(new struct sockaddr_in[capacity]);
+    _controls.reset(new char[capacity * _control_size]);
+    _buffers.reset(new char[capacity * message_size]);
+
+    memset(_msgs.get(), 0, sizeof(struct mmsghdr) * capacity);
+    memset(_addrs.get(), 0, sizeof(struct sockaddr_in) * capacity);
+    for (unsigned int i=0; i<capacity; ++i)
+    {
+        _iovecs[i].iov_base = _buffers.get() + i * message_size;
+        _iovecs[i].iov_len = message_size;
+        _msgs[i].msg_hdr.msg_name = &_addrs[i];
+        _msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        _msgs[i].msg_hdr.msg_iov = &_iovecs[i];
+        _msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+bool CUdpMessageBatch::add(const void* data, size_t size, const struct sockaddr_in& to_addr)
+{
+    if ((_count >= _capacity) || (size > _message_size))
+        return false;
+
+    memcpy(get_buffer(_count), data, size);
+    return set_message(_count, size, to_addr);
+}
+
+bool CUdpMessageBatch::add(const void* data, size_t size, uint32_t to_ip, uint16_t to_port)
+{
+    struct sockaddr_in to_addr;
+
+    to_addr.sin_family = AF_INET;
+    to_addr.sin_port = htons(to_port);
+    to_addr.sin_addr.s_addr = to_ip;
+    memset(to_addr.sin_zero, 0, sizeof(to_addr.sin_zero));
+
+    return add(data, size, to_addr);
+}
+
+bool CUdpMessageBatch::set_message(unsigned int index, size_t size, const struct sockaddr_in& to_addr)
+{
+    if ((index != _count) || (index >= _capacity) || (size > _message_size))
+        return false;
+
+    _addrs[index] = to_addr;
+    _iovecs[index].iov_len = size;
+    _msgs[index].msg_len = static_cast<unsigned int>(size);
+    ++_count;
+    return true;
+}
+
+size_t CUdpMessageBatch::get_length(unsigned int index) const
+{
+    return _msgs[index].msg_len;
+}
+
+uint16_t CUdpMessageBatch::get_segment_size(unsigned int index) const
+{
+    const struct msghdr* msg_hdr = &_msgs[index].msg_hdr;
+    if (NULL == msg_hdr->msg_control)
+        return 0;
+
+    for (struct cmsghdr* cmsg=CMSG_FIRSTHDR(msg_hdr); cmsg!=NULL; cmsg=CMSG_NXTHDR(const_cast<struct msghdr*>(msg_hdr), cmsg))
+    {
+        if ((SOL_UDP == cmsg->cmsg_level) && (UDP_GRO == cmsg->cmsg_type))
+        {
+            // 内核以int类型填充
+            int segment_size = 0;
+            memcpy(&segment_size, CMSG_DATA(cmsg), std::min(sizeof(segment_size), (size_t)(cmsg->cmsg_len - CMSG_LEN(0))));
+            return static_cast<uint16_t>(segment_size);
+        }
+    }
+
+    return 0;
+}
+
+void CUdpMessageBatch::prepare_receive()
+{
+    _count = 0;
+    for (unsigned int i=0; i<_capacity; ++i)
+    {
+        _iovecs[i].iov_len = _message_size;
+        _msgs[i].msg_len = 0;
+        _msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        _msgs[i].msg_hdr.msg_control = _controls.get() + i * _control_size;
+        _msgs[i].msg_hdr.msg_controllen = _control_size;
+        _msgs[i].msg_hdr.msg_flags = 0;
+    }
+}
+
+void CUdpMessageBatch::prepare_send()
+{
+    for (unsigned int i=0; i<_count; ++i)
+    {
+        _msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        _msgs[i].msg_hdr.msg_control = NULL;
+        _msgs[i].msg_hdr.msg_controllen = 0;
+        _msgs[i].msg_hdr.msg_flags = 0;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// CUdpSocket
+
 CUdpSocket::CUdpSocket()
+    : _gro(false)
 {
     int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
     if (-1 == fd)
@@ -144,4 +274,69 @@ int CUdpSocket::timed_receive_from(void* buffer, size_t buffer_size, struct sock
     return receive_from(buffer, buffer_size, from_addr);
 }
 
+int CUdpSocket::receive_batch(CUdpMessageBatch* batch)
+{
+    int count;
+
+    batch->prepare_receive();
+    for (;;)
+    {
+        count = ::recvmmsg(get_fd(), batch->_msgs.get(), batch->_capacity, MSG_WAITFORONE, NULL);
+        if (count != -1) break;
+        if (EINTR == errno) continue;
+        if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) break;
+
+        THROW_SYSCALL_EXCEPTION(NULL, errno, "recvmmsg");
+    }
+
+    if (count > 0)
+        batch->_count = static_cast<unsigned int>(count);
+    return count;
+}
+
+int CUdpSocket::timed_receive_batch(CUdpMessageBatch* batch, uint32_t milliseconds)
+{
+    if (!CUtils::timed_poll(get_fd(), POLLIN, milliseconds))
+        THROW_SYSCALL_EXCEPTION("receive timeout", ETIMEDOUT, "poll");
+
+    return receive_batch(batch);
+}
+
+int CUdpSocket::send_batch(CUdpMessageBatch* batch)
+{
+    int count = 0;
+
+    if (0 == batch->_count)
+        return 0;
+
+    batch->prepare_send();
+    for (;;)
+    {
+        count = ::sendmmsg(get_fd(), batch->_msgs.get(), batch->_count, 0);
+        if (count != -1) break;
+        if (EINTR == errno) continue;
+        if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) break;
+
+        THROW_SYSCALL_EXCEPTION(NULL, errno, "sendmmsg");
+    }
+
+    return count;
+}
+
+void CUdpSocket::set_gso_segment(uint16_t segment_size)
+{
+    int value = segment_size;
+    if (-1 == ::setsockopt(get_fd(), SOL_UDP, UDP_SEGMENT, &value, sizeof(value)))
+        THROW_SYSCALL_EXCEPTION(NULL, errno, "setsockopt");
+}
+
+void CUdpSocket::set_gro(bool yes)
+{
+    int on = yes? 1: 0;
+    if (-1 == ::setsockopt(get_fd(), SOL_UDP, UDP_GRO, &on, sizeof(on)))
+        THROW_SYSCALL_EXCEPTION(NULL, errno, "setsockopt");
+
+    _gro = yes;
+}
+
 NET_NAMESPACE_END
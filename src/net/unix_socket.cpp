@@ -0,0 +1,378 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#include "data_channel.h"
+#include "mooon/net/unix_socket.h"
+#include <sstream>
+NET_NAMESPACE_BEGIN
+
+// 根据路径生成地址，以“@”开头的为抽象名字空间
+static socklen_t make_unix_address(const std::string& path, struct sockaddr_un* addr)
+{
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+
+    if (path.empty() || (path.size() >= sizeof(addr->sun_path)))
+        THROW_SYSCALL_EXCEPTION(path, ENAMETOOLONG, "socket");
+
+    if ('@' == path[0])
+    {
+        // 抽象名字空间的地址长度不包括结尾符
+        addr->sun_path[0] = '\0';
+        memcpy(addr->sun_path+1, path.data()+1, path.size()-1);
+        return static_cast<socklen_t>(offsetof(struct sockaddr_un, sun_path) + path.size());
+    }
+    else
+    {
+        memcpy(addr->sun_path, path.data(), path.size());
+        return static_cast<socklen_t>(sizeof(struct sockaddr_un));
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// CUnixListener
+
+CUnixListener::CUnixListener()
+    :_type(SOCK_STREAM), _owner_pid(0)
+{
+}
+
+CUnixListener::~CUnixListener()
+{
+    close();
+}
+
+void CUnixListener::listen(const std::string& path, int type, bool nonblock, bool unlink_existing)
+{
+    struct sockaddr_un addr;
+    const socklen_t addr_len = make_unix_address(path, &addr);
+
+    int fd = ::socket(AF_UNIX, type|SOCK_CLOEXEC, 0);
+    if (-1 == fd)
+        THROW_SYSCALL_EXCEPTION(NULL, errno, "socket");
+
+    try
+    {
+        if (unlink_existing && (path[0] != '@'))
+        {
+            if ((-1 == ::unlink(path.c_str())) && (errno != ENOENT))
+                THROW_SYSCALL_EXCEPTION(path, errno, "unlink");
+        }
+
+        if (-1 == ::bind(fd, (struct sockaddr*)&addr, addr_len))
+            THROW_SYSCALL_EXCEPTION(path, errno, "bind");
+        if (-1 == ::listen(fd, 10000))
+            THROW_SYSCALL_EXCEPTION(path, errno, "listen");
+        if (nonblock)
+            net::set_nonblock(fd, true);
+
+        _type = type;
+        _path = path;
+        _owner_pid = getpid();
+        CEpollable::set_fd(fd);
+    }
+    catch (...)
+    {
+        ::close(fd);
+        throw;
+    }
+}
+
+int CUnixListener::accept(bool nonblock)
+{
+    const int flags = nonblock? (SOCK_NONBLOCK|SOCK_CLOEXEC): SOCK_CLOEXEC;
+
+    for (;;)
+    {
+        int newfd = ::accept4(CEpollable::get_fd(), NULL, NULL, flags);
+        if (newfd != -1)
+            return newfd;
+        if ((EINTR == errno) || (ECONNABORTED == errno))
+            continue;
+        if ((EAGAIN == errno) || (EWOULDBLOCK == errno))
+            return -1;
+
+        THROW_SYSCALL_EXCEPTION(NULL, errno, "accept4");
+    }
+}
+
+void CUnixListener::before_close()
+{
+    // 删除监听时创建的文件，抽象名字空间无文件，
+    // fork出的子进程关闭继承的句柄时不能删除，否则父进程仍在监听的路径将无法连接
+    if (!_path.empty() && (_path[0] != '@') && (getpid() == _owner_pid))
+        (void)::unlink(_path.c_str());
+}
+
+//////////////////////////////////////////////////////////////////////////
+// CUnixSocket
+
+CUnixSocket::CUnixSocket()
+{
+    _data_channel = new CDataChannel;
+}
+
+CUnixSocket::~CUnixSocket()
+{
+    delete (CDataChannel *)_data_channel;
+}
+
+void CUnixSocket::socketpair(CUnixSocket& first, CUnixSocket& second, int type)
+{
+    int fds[2];
+
+    if (-1 == ::socketpair(AF_UNIX, type|SOCK_CLOEXEC, 0, fds))
+        THROW_SYSCALL_EXCEPTION(NULL, errno, "socketpair");
+
+    first.attach(fds[0]);
+    second.attach(fds[1]);
+}
+
+std::string CUnixSocket::to_string() const
+{
+    std::stringstream id;
+    id << "unix://" << get_fd() << "@" << _path;
+    return id.str();
+}
+
+void CUnixSocket::connect(const std::string& path, int type, uint32_t milliseconds)
+{
+    struct sockaddr_un addr;
+    const socklen_t addr_len = make_unix_address(path, &addr);
+
+    int fd = ::socket(AF_UNIX, type|SOCK_CLOEXEC, 0);
+    if (-1 == fd)
+        THROW_SYSCALL_EXCEPTION(NULL, errno, "socket");
+
+    try
+    {
+        // Unix域的connect只在对端accept队列满时阻塞，受SO_SNDTIMEO控制
+        struct timeval timeout;
+        timeout.tv_sec = milliseconds / 1000;
+        timeout.tv_usec = (milliseconds % 1000) * 1000;
+        if (-1 == ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)))
+            THROW_SYSCALL_EXCEPTION(NULL, errno, "setsockopt");
+
+        while (-1 == ::connect(fd, (struct sockaddr*)&addr, addr_len))
+        {
+            if (errno != EINTR)
+                THROW_SYSCALL_EXCEPTION(path, (EAGAIN == errno)? ETIMEDOUT: errno, "connect");
+        }
+
+        // 恢复为不超时
+        timeout.tv_sec = 0;
+        timeout.tv_usec = 0;
+        if (-1 == ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)))
+            THROW_SYSCALL_EXCEPTION(NULL, errno, "setsockopt");
+    }
+    catch (...)
+    {
+        ::close(fd);
+        throw;
+    }
+
+    close();
+    attach(fd);
+    _path = path;
+}
+
+void CUnixSocket::attach(int fd)
+{
+    set_fd(fd);
+    _path.clear();
+    ((CDataChannel *)_data_channel)->attach(fd);
+}
+
+void CUnixSocket::get_peer_credentials(pid_t* pid, uid_t* uid, gid_t* gid) const
+{
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+
+    if (-1 == ::getsockopt(get_fd(), SOL_SOCKET, SO_PEERCRED, &cred, &cred_len))
+        THROW_SYSCALL_EXCEPTION(NULL, errno, "getsockopt");
+
+    if (pid != NULL) *pid = cred.pid;
+    if (uid != NULL) *uid = cred.uid;
+    if (gid != NULL) *gid = cred.gid;
+}
+
+ssize_t CUnixSocket::receive(char* buffer, size_t buffer_size)
+{
+    return ((CDataChannel *)_data_channel)->receive(buffer, buffer_size);
+}
+
+ssize_t CUnixSocket::send(const char* buffer, size_t buffer_size)
+{
+    return ((CDataChannel *)_data_channel)->send(buffer, buffer_size);
+}
+
+ssize_t CUnixSocket::timed_receive(char* buffer, size_t buffer_size, uint32_t milliseconds)
+{
+    return ((CDataChannel *)_data_channel)->timed_receive(buffer, buffer_size, milliseconds);
+}
+
+ssize_t CUnixSocket::timed_send(const char* buffer, size_t buffer_size, uint32_t milliseconds)
+{
+    return ((CDataChannel *)_data_channel)->timed_send(buffer, buffer_size, milliseconds);
+}
+
+bool CUnixSocket::full_receive(char* buffer, size_t& buffer_size)
+{
+    return ((CDataChannel *)_data_channel)->full_receive(buffer, buffer_size);
+}
+
+void CUnixSocket::full_send(const char* buffer, size_t& buffer_size)
+{
+    ((CDataChannel *)_data_channel)->full_send(buffer, buffer_size);
+}
+
+ssize_t CUnixSocket::readv(const struct iovec *iov, int iovcnt)
+{
+    return ((CDataChannel *)_data_channel)->readv(iov, iovcnt);
+}
+
+ssize_t CUnixSocket::writev(const struct iovec *iov, int iovcnt)
+{
+    return ((CDataChannel *)_data_channel)->writev(iov, iovcnt);
+}
+
+ssize_t CUnixSocket::send_fds(const int* fds, int fd_count, const char* buffer, size_t buffer_size)
+{
+    if ((fd_count < 1) || (fd_count > UNIX_SOCKET_FD_MAX))
+        THROW_SYSCALL_EXCEPTION(NULL, EINVAL, "sendmsg");
+
+    // 至少需要1字节的数据，才能携带控制信息
+    char zero = '\0';
+    struct iovec iov;
+    iov.iov_base = (NULL == buffer)? &zero: const_cast<char*>(buffer);
+    iov.iov_len = (NULL == buffer)? 1: buffer_size;
+    if (0 == iov.iov_len)
+        THROW_SYSCALL_EXCEPTION(NULL, EINVAL, "sendmsg");
+
+    union
+    {
+        struct cmsghdr align; // 保证对齐
+        char buf[CMSG_SPACE(sizeof(int) * UNIX_SOCKET_FD_MAX)];
+    }control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+
+    for (;;)
+    {
+        ssize_t retval = ::sendmsg(get_fd(), &msg, MSG_NOSIGNAL);
+        if (retval != -1)
+            return retval;
+        if (EINTR == errno)
+            continue;
+        if ((EAGAIN == errno) || (EWOULDBLOCK == errno))
+            return -1;
+
+        THROW_SYSCALL_EXCEPTION(NULL, errno, "sendmsg");
+    }
+}
+
+ssize_t CUnixSocket::send_fd(int fd, const char* buffer, size_t buffer_size)
+{
+    return send_fds(&fd, 1, buffer, buffer_size);
+}
+
+ssize_t CUnixSocket::receive_fds(int* fds, int* fd_count, char* buffer, size_t buffer_size)
+{
+    if (0 == buffer_size)
+        THROW_SYSCALL_EXCEPTION(NULL, EINVAL, "recvmsg");
+
+    struct iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = buffer_size;
+
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * UNIX_SOCKET_FD_MAX)];
+    }control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t retval;
+    *fd_count = 0;
+    for (;;)
+    {
+        retval = ::recvmsg(get_fd(), &msg, MSG_CMSG_CLOEXEC);
+        if (retval != -1)
+            break;
+        if (EINTR == errno)
+            continue;
+        if ((EAGAIN == errno) || (EWOULDBLOCK == errno))
+            return -1;
+
+        THROW_SYSCALL_EXCEPTION(NULL, errno, "recvmsg");
+    }
+
+    for (struct cmsghdr* cmsg=CMSG_FIRSTHDR(&msg); cmsg!=NULL; cmsg=CMSG_NXTHDR(&msg, cmsg))
+    {
+        if ((SOL_SOCKET == cmsg->cmsg_level) && (SCM_RIGHTS == cmsg->cmsg_type))
+        {
+            const int n = static_cast<int>((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            memcpy(fds + *fd_count, CMSG_DATA(cmsg), sizeof(int) * n);
+            *fd_count += n;
+        }
+    }
+
+    if (msg.msg_flags & MSG_CTRUNC)
+    {
+        // 句柄被截断，已收到的也不完整，全部关闭
+        for (int i=0; i<*fd_count; ++i)
+            close_fd(fds[i]);
+        *fd_count = 0;
+        THROW_SYSCALL_EXCEPTION("control message truncated", EMSGSIZE, "recvmsg");
+    }
+
+    return retval;
+}
+
+ssize_t CUnixSocket::receive_fd(int* fd, char* buffer, size_t buffer_size)
+{
+    int fds[UNIX_SOCKET_FD_MAX];
+    int fd_count = 0;
+
+    ssize_t retval = receive_fds(fds, &fd_count, buffer, buffer_size);
+    *fd = (fd_count > 0)? fds[0]: -1;
+    for (int i=1; i<fd_count; ++i)
+        close_fd(fds[i]);
+
+    return retval;
+}
+
+NET_NAMESPACE_END
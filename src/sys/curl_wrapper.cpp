@@ -4,6 +4,13 @@
 
 #if MOOON_HAVE_CURL==1
 #include <curl/curl.h>
+#include <algorithm>
+#include <exception>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utility>
 SYS_NAMESPACE_BEGIN
 
 //
@@ -97,6 +104,327 @@ void CHttpPostData::add_file(const std::string& name, const std::string& filepat
         THROW_EXCEPTION(utils::CStringUtils::format_string("add file[%s] error", name.c_str()), errcode);
 }
 
+//
+// 缓冲区池
+//
+
+// O_DIRECT要求的对齐字节数
+#define HTTP_BUFFER_ALIGN 4096
+// 每个线程最多缓存的空闲缓冲区个数
+#define HTTP_BUFFER_CACHE_MAX 4
+
+// 线程的空闲缓冲区，CHttpBufferSink和CHttpFileSink在同一线程中反复使用，
+// 缓冲区总是按HTTP_BUFFER_ALIGN对齐，大小为HTTP_BUFFER_ALIGN的倍数，可直接用于O_DIRECT
+class CHttpBufferCache
+{
+public:
+    ~CHttpBufferCache()
+    {
+        for (std::vector<std::pair<size_t, char*> >::size_type i=0; i<_buffers.size(); ++i)
+            free(_buffers[i].second);
+    }
+
+    char* get(size_t buffer_size)
+    {
+        for (std::vector<std::pair<size_t, char*> >::size_type i=0; i<_buffers.size(); ++i)
+        {
+            if (_buffers[i].first == buffer_size)
+            {
+                char* buffer = _buffers[i].second;
+                _buffers.erase(_buffers.begin()+i);
+                return buffer;
+            }
+        }
+
+        void* buffer = NULL;
+        if (posix_memalign(&buffer, HTTP_BUFFER_ALIGN, buffer_size) != 0)
+            THROW_SYSCALL_EXCEPTION(NULL, ENOMEM, "posix_memalign");
+        return static_cast<char*>(buffer);
+    }
+
+    void put(char* buffer, size_t buffer_size)
+    {
+        if (_buffers.size() < HTTP_BUFFER_CACHE_MAX)
+        {
+            _buffers.push_back(std::make_pair(buffer_size, buffer));
+        }
+        else
+        {
+            free(_buffers.front().second);
+            _buffers.erase(_buffers.begin());
+            _buffers.push_back(std::make_pair(buffer_size, buffer));
+        }
+    }
+
+private:
+    std::vector<std::pair<size_t, char*> > _buffers;
+};
+
+static thread_local CHttpBufferCache http_buffer_cache;
+
+static size_t align_buffer_size(size_t buffer_size)
+{
+    if (0 == buffer_size)
+        buffer_size = HTTP_BUFFER_ALIGN;
+    return ((buffer_size + HTTP_BUFFER_ALIGN - 1) / HTTP_BUFFER_ALIGN) * HTTP_BUFFER_ALIGN;
+}
+
+//
+// CHttpStringSink
+//
+
+CHttpStringSink::CHttpStringSink(std::string* body, size_t max_reserve_size)
+    : _body(body), _max_reserve_size(max_reserve_size)
+{
+}
+
+void CHttpStringSink::on_content_length(uint64_t content_length)
+{
+    const uint64_t reserve_size = std::min<uint64_t>(_body->size()+content_length, _max_reserve_size);
+    if (reserve_size > _body->capacity())
+        _body->reserve(static_cast<size_t>(reserve_size));
+}
+
+bool CHttpStringSink::on_data(const char* data, size_t size)
+{
+    _body->append(data, size);
+    return true;
+}
+
+//
+// CHttpChunkSink
+//
+
+CHttpChunkSink::CHttpChunkSink(const HttpChunkCallback& callback)
+    : _callback(callback)
+{
+}
+
+bool CHttpChunkSink::on_data(const char* data, size_t size)
+{
+    return _callback(data, size);
+}
+
+//
+// CHttpBufferSink
+//
+
+CHttpBufferSink::CHttpBufferSink(const HttpChunkCallback& callback, size_t buffer_size)
+    : _callback(callback), _buffer(NULL), _buffer_size(align_buffer_size(buffer_size)), _size(0)
+{
+    _buffer = http_buffer_cache.get(_buffer_size);
+}
+
+CHttpBufferSink::~CHttpBufferSink()
+{
+    http_buffer_cache.put(_buffer, _buffer_size);
+}
+
+bool CHttpBufferSink::on_data(const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        const size_t copy_size = std::min(size, _buffer_size-_size);
+        memcpy(_buffer+_size, data, copy_size);
+        _size += copy_size;
+        data += copy_size;
+        size -= copy_size;
+
+        if (_size == _buffer_size)
+        {
+            _size = 0;
+            if (!_callback(_buffer, _buffer_size))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+void CHttpBufferSink::on_finish()
+{
+    if (_size > 0)
+    {
+        const size_t size = _size;
+        _size = 0;
+        if (!_callback(_buffer, size))
+            THROW_EXCEPTION(curl_easy_strerror(CURLE_WRITE_ERROR), CURLE_WRITE_ERROR);
+    }
+}
+
+//
+// CHttpFileSink
+//
+
+CHttpFileSink::CHttpFileSink(const std::string& filepath, http_file_mode_t mode, size_t buffer_size)
+    : _filepath(filepath), _mode(mode), _fd(-1), _buffer(NULL), _buffer_size(align_buffer_size(buffer_size)),
+      _size(0), _offset(0), _map(NULL), _map_size(0), _preallocated(false)
+{
+    const int flags = O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC;
+
+    if (http_file_direct == _mode)
+    {
+        _fd = ::open(_filepath.c_str(), flags|O_DIRECT, FILE_DEFAULT_PERM);
+        if ((-1 == _fd) && (EINVAL == errno))
+            _mode = http_file_write;
+    }
+    else if (http_file_mmap == _mode)
+    {
+        // PROT_WRITE的共享映射要求文件以读写方式打开
+        _fd = ::open(_filepath.c_str(), O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, FILE_DEFAULT_PERM);
+    }
+    if (-1 == _fd)
+        _fd = ::open(_filepath.c_str(), flags, FILE_DEFAULT_PERM);
+    if (-1 == _fd)
+        THROW_SYSCALL_EXCEPTION(mooon::utils::CStringUtils::format_string("open %s error: %s", _filepath.c_str(), strerror(errno)), errno, "open");
+
+    try
+    {
+        _buffer = http_buffer_cache.get(_buffer_size);
+    }
+    catch (...)
+    {
+        ::close(_fd);
+        _fd = -1;
+        throw;
+    }
+}
+
+CHttpFileSink::~CHttpFileSink()
+{
+    if (_map != NULL)
+        munmap(_map, _map_size);
+    if (_fd != -1)
+        ::close(_fd);
+    http_buffer_cache.put(_buffer, _buffer_size);
+}
+
+void CHttpFileSink::on_content_length(uint64_t content_length)
+{
+    if (0 == content_length)
+        return;
+
+    if (http_file_mmap == _mode)
+    {
+        if (-1 == ftruncate(_fd, static_cast<off_t>(content_length)))
+            THROW_SYSCALL_EXCEPTION(mooon::utils::CStringUtils::format_string("ftruncate %s error: %s", _filepath.c_str(), strerror(errno)), errno, "ftruncate");
+
+        void* map = mmap(NULL, static_cast<size_t>(content_length), PROT_WRITE, MAP_SHARED, _fd, 0);
+        if (map != MAP_FAILED)
+        {
+            _map = static_cast<char*>(map);
+            _map_size = content_length;
+            (void)madvise(_map, static_cast<size_t>(_map_size), MADV_SEQUENTIAL);
+            return;
+        }
+
+        // 映射失败（如地址空间不足）时退为普通写，文件大小在on_finish时修正
+        _mode = http_file_write;
+        _preallocated = true;
+        return;
+    }
+
+    // 预分配失败（如文件系统不支持）不影响写入
+    if (0 == posix_fallocate(_fd, 0, static_cast<off_t>(content_length)))
+        _preallocated = true;
+}
+
+bool CHttpFileSink::on_data(const char* data, size_t size)
+{
+    if (_map != NULL)
+    {
+        // 实际数据多于Content-Length
+        if (_offset+size > _map_size)
+            THROW_SYSCALL_EXCEPTION(mooon::utils::CStringUtils::format_string("write %s error: more data than Content-Length(%" PRIu64")", _filepath.c_str(), _map_size), EFBIG, "mmap");
+
+        memcpy(_map+_offset, data, size);
+        _offset += size;
+        return true;
+    }
+
+    // 没有Content-Length时不能映射
+    if (http_file_mmap == _mode)
+        _mode = http_file_write;
+
+    while (size > 0)
+    {
+        const size_t copy_size = std::min(size, _buffer_size-_size);
+        memcpy(_buffer+_size, data, copy_size);
+        _size += copy_size;
+        data += copy_size;
+        size -= copy_size;
+
+        if (_size == _buffer_size)
+        {
+            write_buffer(_buffer_size);
+            _offset += _buffer_size;
+            _size = 0;
+        }
+    }
+
+    return true;
+}
+
+void CHttpFileSink::on_finish()
+{
+    uint64_t file_size = _offset + _size;
+
+    if (_map != NULL)
+    {
+        munmap(_map, _map_size);
+        _map = NULL;
+        if (_offset != _map_size)
+            THROW_SYSCALL_EXCEPTION(mooon::utils::CStringUtils::format_string("write %s error: less data(%" PRIu64") than Content-Length(%" PRIu64")", _filepath.c_str(), _offset, _map_size), EIO, "mmap");
+    }
+    else if (_size > 0)
+    {
+        // O_DIRECT要求写入大小对齐，补齐后写入，多出的部分由ftruncate截掉
+        const size_t write_size = (http_file_direct == _mode)? align_buffer_size(_size): _size;
+
+        memset(_buffer+_size, 0, write_size-_size);
+        write_buffer(write_size);
+        _offset += _size;
+        _size = 0;
+    }
+
+    // 预分配或补齐后，文件可能比实际数据大
+    if (_preallocated || (http_file_direct == _mode))
+    {
+        if (-1 == ftruncate(_fd, static_cast<off_t>(file_size)))
+            THROW_SYSCALL_EXCEPTION(mooon::utils::CStringUtils::format_string("ftruncate %s error: %s", _filepath.c_str(), strerror(errno)), errno, "ftruncate");
+    }
+
+    close();
+}
+
+void CHttpFileSink::write_buffer(size_t size)
+{
+    size_t written = 0;
+
+    while (written < size)
+    {
+        const ssize_t bytes = pwrite(_fd, _buffer+written, size-written, static_cast<off_t>(_offset+written));
+        if (-1 == bytes)
+        {
+            if (EINTR == errno)
+                continue;
+            THROW_SYSCALL_EXCEPTION(mooon::utils::CStringUtils::format_string("write %s error: %s", _filepath.c_str(), strerror(errno)), errno, "pwrite");
+        }
+
+        written += static_cast<size_t>(bytes);
+    }
+}
+
+void CHttpFileSink::close()
+{
+    const int fd = _fd;
+
+    // 同fclose，close只保证数据进入内核，如果要确保落盘，应调用fsync
+    _fd = -1;
+    if (-1 == ::close(fd))
+        THROW_SYSCALL_EXCEPTION(mooon::utils::CStringUtils::format_string("close %s error: %s", _filepath.c_str(), strerror(errno)), errno, "close");
+}
+
 //
 // CCurlWrapper
 //
@@ -134,19 +462,54 @@ static size_t on_write_response_header(void* buffer, size_t size, size_t nmemb,
     return size * nmemb;
 }
 
-static size_t on_write_response_body(void* buffer, size_t size, size_t nmemb, void* stream)
+// 传给on_write_response_body_into_sink的上下文
+struct HttpSinkContext
 {
-    std::string* result = reinterpret_cast<std::string*>(stream);
-    result->append(reinterpret_cast<char*>(buffer), size*nmemb);
-    return size * nmemb;
-}
+    CURL* curl;
+    CHttpBodySink* body_sink;
+    bool started; // 是否已收到第一块数据
+    std::exception_ptr exception; // 异常不能穿过curl，先保存，perform之后重新抛出
+
+    HttpSinkContext(CURL* curl_, CHttpBodySink* body_sink_)
+        : curl(curl_), body_sink(body_sink_), started(false)
+    {
+    }
+};
 
-static size_t on_write_response_body_into_FILE(void* buffer, size_t size, size_t nmemb, void* file)
+static size_t on_write_response_body_into_sink(void* buffer, size_t size, size_t nmemb, void* stream)
 {
-    FILE* fp = static_cast<FILE*>(file);
-    if (fwrite(buffer, size, nmemb, fp) != nmemb)
-        THROW_SYSCALL_EXCEPTION(mooon::utils::CStringUtils::format_string("fwrite response_body error: %s", strerror(errno)), errno, "fopen");
-    return size * nmemb;
+    HttpSinkContext* context = static_cast<HttpSinkContext*>(stream);
+    const size_t bytes = size * nmemb;
+
+    try
+    {
+        if (!context->started)
+        {
+            context->started = true;
+
+            // 此时响应头已收完，取不到时为-1
+#if LIBCURL_VERSION_NUM >= 0x073700 // 7.55.0
+            curl_off_t content_length = -1;
+            if ((CURLE_OK == curl_easy_getinfo(context->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length)) && (content_length > 0))
+                context->body_sink->on_content_length(static_cast<uint64_t>(content_length));
+#else
+            double content_length = -1;
+            if ((CURLE_OK == curl_easy_getinfo(context->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &content_length)) && (content_length > 0))
+                context->body_sink->on_content_length(static_cast<uint64_t>(content_length));
+#endif // LIBCURL_VERSION_NUM
+        }
+
+        // 返回值不等于bytes时，curl以CURLE_WRITE_ERROR中止传输
+        if (!context->body_sink->on_data(static_cast<const char*>(buffer), bytes))
+            return 0;
+    }
+    catch (...)
+    {
+        context->exception = std::current_exception();
+        return 0;
+    }
+
+    return bytes;
 }
 
 CCurlWrapper::CCurlWrapper(
@@ -245,32 +608,31 @@ bool CCurlWrapper::add_request_header(const std::string& name_value_pair)
 }
 
 void CCurlWrapper::http_get(std::string& response_header, std::string& response_body, const std::string& url, bool enable_insecure, const char* cookie)
+{
+    CHttpStringSink body_sink(&response_body);
+    http_get(response_header, &body_sink, url, enable_insecure, cookie);
+}
+
+void CCurlWrapper::http_get(std::string& response_header, CHttpBodySink* body_sink, const std::string& url, bool enable_insecure, const char* cookie)
 {
     CURLcode errcode;
     CURL* curl = (CURL*)_curl;
 
     // 复位初始化
-    reset(url, cookie, enable_insecure, on_write_response_body);
+    reset(url, cookie, enable_insecure, on_write_response_body_into_sink);
 
     // CURLOPT_HEADERFUNCTION
     errcode = curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response_header);
     if (errcode != CURLE_OK)
         THROW_EXCEPTION(curl_easy_strerror(errcode), errcode);
 
-    // CURLOPT_WRITEDATA
-    errcode = curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response_body);
-    if (errcode != CURLE_OK)
-        THROW_EXCEPTION(curl_easy_strerror(errcode), errcode);
-
     // CURLOPT_HTTPGET
     // 之前如何调用了非GET如POST，这个是必须的
     errcode = curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
     if (errcode != CURLE_OK)
         THROW_EXCEPTION(curl_easy_strerror(errcode), errcode);
 
-    errcode = curl_easy_perform(curl);
-    if (errcode != CURLE_OK)
-        THROW_EXCEPTION(curl_easy_strerror(errcode), errcode);
+    perform(body_sink);
 }
 
 void CCurlWrapper::proxy_http_get(std::string& response_header, std::string& response_body, const std::string& proxy_host, uint16_t proxy_port, const std::string& url, bool enable_insecure, const char* cookie)
@@ -292,23 +654,24 @@ void CCurlWrapper::proxy_http_get(std::string& response_header, std::string& res
 }
 
 void CCurlWrapper::http_post(const std::string& data, std::string& response_header, std::string& response_body, const std::string& url, bool enable_insecure, const char* cookie)
+{
+    CHttpStringSink body_sink(&response_body);
+    http_post(data, response_header, &body_sink, url, enable_insecure, cookie);
+}
+
+void CCurlWrapper::http_post(const std::string& data, std::string& response_header, CHttpBodySink* body_sink, const std::string& url, bool enable_insecure, const char* cookie)
 {
     CURLcode errcode;
     CURL* curl = (CURL*)_curl;
 
     // 复位初始化
-    reset(url, cookie, enable_insecure, on_write_response_body);
+    reset(url, cookie, enable_insecure, on_write_response_body_into_sink);
 
     // CURLOPT_HEADERFUNCTION
     errcode = curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response_header);
     if (errcode != CURLE_OK)
         THROW_EXCEPTION(curl_easy_strerror(errcode), errcode);
 
-    // CURLOPT_WRITEDATA
-    errcode = curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response_body);
-    if (errcode != CURLE_OK)
-        THROW_EXCEPTION(curl_easy_strerror(errcode), errcode);
-
     // CURLOPT_POSTFIELDS，需与CURLOPT_HTTPPOST区分
     errcode = curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data.c_str());
     if (errcode != CURLE_OK)
@@ -320,37 +683,29 @@ void CCurlWrapper::http_post(const std::string& data, std::string& response_head
     if (errcode != CURLE_OK)
         THROW_EXCEPTION(curl_easy_strerror(errcode), errcode);
 
-    errcode = curl_easy_perform(curl);
-    if (errcode != CURLE_OK)
-        THROW_EXCEPTION(curl_easy_strerror(errcode), errcode);
+    perform(body_sink);
 }
 
 void CCurlWrapper::http_post(const CHttpPostData* http_post_data, std::string& response_header, std::string& response_body, const std::string& url, bool enable_insecure, const char* cookie)
 {
     CURLcode errcode;
     CURL* curl = (CURL*)_curl;
+    CHttpStringSink body_sink(&response_body);
 
     // 复位初始化
-    reset(url, cookie, enable_insecure, on_write_response_body);
+    reset(url, cookie, enable_insecure, on_write_response_body_into_sink);
 
     // CURLOPT_HEADERFUNCTION
     errcode = curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response_header);
     if (errcode != CURLE_OK)
         THROW_EXCEPTION(curl_easy_strerror(errcode), errcode);
 
-    // CURLOPT_WRITEDATA
-    errcode = curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response_body);
-    if (errcode != CURLE_OK)
-        THROW_EXCEPTION(curl_easy_strerror(errcode), errcode);
-
     // CURLOPT_HTTPPOST需与CURLOPT_POSTFIELDS区分
     errcode = curl_easy_setopt(curl, CURLOPT_HTTPPOST, http_post_data->get_post());
     if (errcode != CURLE_OK)
         THROW_EXCEPTION(curl_easy_strerror(errcode), errcode);
 
-    errcode = curl_easy_perform(curl);
-    if (errcode != CURLE_OK)
-        THROW_EXCEPTION(curl_easy_strerror(errcode), errcode);
+    perform(&body_sink);
 }
 
 void CCurlWrapper::proxy_http_post(const std::string& data, std::string& response_header, std::string& response_body, const std::string& proxy_host, uint16_t proxy_port, const std::string& url, bool enable_insecure, const char* cookie)
@@ -391,52 +746,9 @@ void CCurlWrapper::proxy_http_post(const CHttpPostData* http_post_data, std::str
 
 void CCurlWrapper::http_get_download(std::string& response_header, const std::string& local_filepath, const std::string& url, bool enable_insecure, const char* cookie)
 {
-    CURLcode errcode;
-    CURL* curl = (CURL*)_curl;
-    FILE* fp = fopen(local_filepath.c_str(), "w+");
-    if (NULL == fp)
-        THROW_SYSCALL_EXCEPTION(mooon::utils::CStringUtils::format_string("fopen %s error: %s", local_filepath.c_str(), strerror(errno)), errno, "fopen");
-
-    try
-    {
-        // 复位初始化
-        reset(url, cookie, enable_insecure, on_write_response_body_into_FILE);
-
-        // CURLOPT_HEADERFUNCTION
-        errcode = curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response_header);
-        if (errcode != CURLE_OK)
-            THROW_EXCEPTION(curl_easy_strerror(errcode), errcode);
-
-        // CURLOPT_WRITEDATA
-        errcode = curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
-        if (errcode != CURLE_OK)
-            THROW_EXCEPTION(curl_easy_strerror(errcode), errcode);
-
-        // CURLOPT_HTTPGET
-        // 之前如何调用了非GET如POST，这个是必须的
-        errcode = curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
-        if (errcode != CURLE_OK)
-            THROW_EXCEPTION(curl_easy_strerror(errcode), errcode);
-
-        errcode = curl_easy_perform(curl);
-        if (errcode != CURLE_OK)
-            THROW_EXCEPTION(curl_easy_strerror(errcode), errcode);
-
-        // 关闭文件
-        FILE* fp_ = fp;
-        fp = NULL;
-        // fclose失败会产生内存泄漏，
-        // fclose只是将数据从用户空间刷到内核空间，
-        // 如果要确保数据刷到磁盘，应调用fsync(fd)，
-        // close(fd)也存在同样的问题，即使返回成功，如果没有用fsync(fd)。
-        if (EOF == fclose(fp_))
-            THROW_SYSCALL_EXCEPTION(mooon::utils::CStringUtils::format_string("fclose %s error: %s", local_filepath.c_str(), strerror(errno)), errno, "fopen");
-    }
-    catch (...)
-    {
-        if (fp != NULL)
-            fclose(fp);
-    }
+    // 合并成大块写入，有Content-Length时预分配文件空间
+    CHttpFileSink body_sink(local_filepath);
+    http_get(response_header, &body_sink, url, enable_insecure, cookie);
 }
 
 void CCurlWrapper::proxy_http_get_download(std::string& response_header, const std::string& local_filepath, const std::string& proxy_host, uint16_t proxy_port, const std::string& url, bool enable_insecure, const char* cookie)
@@ -459,57 +771,8 @@ void CCurlWrapper::proxy_http_get_download(std::string& response_header, const s
 
 void CCurlWrapper::http_post_download(const std::string& data, std::string& response_header, const std::string& local_filepath, const std::string& url, bool enable_insecure, const char* cookie)
 {
-    CURLcode errcode;
-    CURL* curl = (CURL*)_curl;
-    FILE* fp = fopen(local_filepath.c_str(), "w+");
-    if (NULL == fp)
-        THROW_SYSCALL_EXCEPTION(mooon::utils::CStringUtils::format_string("fopen %s error: %s", local_filepath.c_str(), strerror(errno)), errno, "fopen");
-
-    try
-    {
-        // 复位初始化
-        reset(url, cookie, enable_insecure, on_write_response_body_into_FILE);
-
-        // CURLOPT_HEADERFUNCTION
-        errcode = curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response_header);
-        if (errcode != CURLE_OK)
-            THROW_EXCEPTION(curl_easy_strerror(errcode), errcode);
-
-        // CURLOPT_WRITEDATA
-        errcode = curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
-        if (errcode != CURLE_OK)
-            THROW_EXCEPTION(curl_easy_strerror(errcode), errcode);
-
-        // CURLOPT_POSTFIELDS
-        errcode = curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data.c_str());
-        if (errcode != CURLE_OK)
-            THROW_EXCEPTION(curl_easy_strerror(errcode), errcode);
-
-        // CURLOPT_POSTFIELDSIZE
-        // if we don't provide POSTFIELDSIZE, libcurl will strlen() by itself
-        errcode = curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, static_cast<long>(data.size()));
-        if (errcode != CURLE_OK)
-            THROW_EXCEPTION(curl_easy_strerror(errcode), errcode);
-
-        errcode = curl_easy_perform(curl);
-        if (errcode != CURLE_OK)
-            THROW_EXCEPTION(curl_easy_strerror(errcode), errcode);
-
-        // 关闭文件
-        FILE* fp_ = fp;
-        fp = NULL;
-        // fclose失败会产生内存泄漏，
-        // fclose只是将数据从用户空间刷到内核空间，
-        // 如果要确保数据刷到磁盘，应调用fsync(fd)，
-        // close(fd)也存在同样的问题，即使返回成功，如果没有用fsync(fd)。
-        if (EOF == fclose(fp_))
-            THROW_SYSCALL_EXCEPTION(mooon::utils::CStringUtils::format_string("fclose %s error: %s", local_filepath.c_str(), strerror(errno)), errno, "fopen");
-    }
-    catch (...)
-    {
-        if (fp != NULL)
-            fclose(fp);
-    }
+    CHttpFileSink body_sink(local_filepath);
+    http_post(data, response_header, &body_sink, url, enable_insecure, cookie);
 }
 
 void CCurlWrapper::proxy_http_post_download(const std::string& data, std::string& response_header, const std::string& local_filepath, const std::string& proxy_host, uint16_t proxy_port, const std::string& url, bool enable_insecure, const char* cookie)
@@ -604,6 +867,26 @@ void CCurlWrapper::set_low_speed_time(long speedtime)
     _low_speed_time = speedtime;
 }
 
+void CCurlWrapper::perform(CHttpBodySink* body_sink)
+{
+    CURLcode errcode;
+    CURL* curl = (CURL*)_curl;
+    HttpSinkContext context(curl, body_sink);
+
+    // CURLOPT_WRITEDATA
+    errcode = curl_easy_setopt(curl, CURLOPT_WRITEDATA, &context);
+    if (errcode != CURLE_OK)
+        THROW_EXCEPTION(curl_easy_strerror(errcode), errcode);
+
+    errcode = curl_easy_perform(curl);
+    if (context.exception)
+        std::rethrow_exception(context.exception);
+    if (errcode != CURLE_OK)
+        THROW_EXCEPTION(curl_easy_strerror(errcode), errcode);
+
+    body_sink->on_finish();
+}
+
 void CCurlWrapper::reset(const std::string& url, const char* cookie, bool enable_insecure, size_t (*on_write_response_body_into_FILE_proc)(void*, size_t, size_t, void*))
 {
     const curl_version_info_data* curl_version_info = (curl_version_info_data*)_curl_version_info;
@@ -749,7 +1032,7 @@ void CCurlWrapper::reset(const std::string& url, const char* cookie, bool enable
 
     // CURLOPT_WRITEFUNCTION
     if (NULL == on_write_response_body_into_FILE_proc)
-        errcode = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, on_write_response_body);
+        errcode = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, on_write_response_body_into_sink);
     else
         errcode = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, on_write_response_body_into_FILE_proc);
     if (errcode != CURLE_OK)
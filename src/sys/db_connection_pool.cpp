@@ -0,0 +1,395 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: JianYi, eyjian@qq.com or eyjian@gmail.com
+ */
+#include "sys/db_connection_pool.h"
+#include "sys/datetime_utils.h"
+#include "utils/object.h"
+#include "utils/string_utils.h"
+SYS_NAMESPACE_BEGIN
+
+CDBConnectionPool::CDBConnectionPool(const std::string& db_type)
+    : _db_type(db_type),
+      _connect_timeout_seconds(DB_CONNECT_TIMEOUT_SECONDS_DEFAULT),
+      _read_timeout_seconds(DB_READ_TIMEOUT_SECONDS_DEFAULT),
+      _write_timeout_seconds(DB_WRITE_TIMEOUT_SECONDS_DEFAULT),
+      _max_connections(8), _idle_ping_seconds(30), _max_idle_seconds(600),
+      _min_backoff_milliseconds(100), _max_backoff_milliseconds(10000)
+{
+}
+
+CDBConnectionPool::CDBConnectionPool(const DBConnectionCreator& creator)
+    : _creator(creator),
+      _connect_timeout_seconds(DB_CONNECT_TIMEOUT_SECONDS_DEFAULT),
+      _read_timeout_seconds(DB_READ_TIMEOUT_SECONDS_DEFAULT),
+      _write_timeout_seconds(DB_WRITE_TIMEOUT_SECONDS_DEFAULT),
+      _max_connections(8), _idle_ping_seconds(30), _max_idle_seconds(600),
+      _min_backoff_milliseconds(100), _max_backoff_milliseconds(10000)
+{
+}
+
+CDBConnectionPool::~CDBConnectionPool()
+{
+    // 借出的连接须在析构之前全部归还
+    MOOON_ASSERT(_leased_connections.empty());
+    close_idle_connections();
+
+    for (std::vector<Shard>::size_type i=0; i<_shards.size(); ++i)
+    {
+        delete _shards[i].master;
+        for (std::vector<Host*>::size_type j=0; j<_shards[i].replicas.size(); ++j)
+            delete _shards[i].replicas[j];
+    }
+}
+
+void CDBConnectionPool::set_timeout_seconds(int connect_timeout_seconds, int read_timeout_seconds, int write_timeout_seconds)
+{
+    _connect_timeout_seconds = connect_timeout_seconds;
+    _read_timeout_seconds = read_timeout_seconds;
+    _write_timeout_seconds = write_timeout_seconds;
+}
+
+void CDBConnectionPool::set_backoff_milliseconds(uint32_t min_milliseconds, uint32_t max_milliseconds)
+{
+    _min_backoff_milliseconds = min_milliseconds;
+    _max_backoff_milliseconds = (max_milliseconds < min_milliseconds)? min_milliseconds: max_milliseconds;
+}
+
+uint32_t CDBConnectionPool::add_shard(const std::string& master_ip, uint16_t master_port)
+{
+    Shard shard;
+    shard.master = new Host(master_ip, master_port);
+    shard.next_replica = 0;
+
+    LockHelper<CLock> lock_helper(_lock);
+    _shards.push_back(shard);
+    return static_cast<uint32_t>(_shards.size()-1);
+}
+
+void CDBConnectionPool::add_replica(uint32_t shard, const std::string& ip, uint16_t port)
+{
+    LockHelper<CLock> lock_helper(_lock);
+
+    if (shard >= _shards.size())
+        THROW_DB_EXCEPTION(NULL, utils::CStringUtils::format_string("invalid shard: %u (%d)", shard, static_cast<int>(_shards.size())), DB_ERROR_INVALID_INDEX);
+    _shards[shard].replicas.push_back(new Host(ip, port));
+}
+
+uint32_t CDBConnectionPool::get_shard_by_key(const std::string& key) const
+{
+    MOOON_ASSERT(!_shards.empty());
+    return utils::CStringUtils::hash(key.data(), static_cast<int>(key.size())) % static_cast<uint32_t>(_shards.size());
+}
+
+uint32_t CDBConnectionPool::get_shard_by_key(uint64_t key) const
+{
+    MOOON_ASSERT(!_shards.empty());
+    return static_cast<uint32_t>(key % _shards.size());
+}
+
+DBConnection* CDBConnectionPool::lease(uint32_t shard, bool readonly, uint32_t timeout_milliseconds)
+{
+    const uint64_t deadline_milliseconds = CDatetimeUtils::get_current_milliseconds() + timeout_milliseconds;
+    bool waited = false;
+
+    if (shard >= _shards.size())
+        THROW_DB_EXCEPTION(NULL, utils::CStringUtils::format_string("invalid shard: %u (%d)", shard, static_cast<int>(_shards.size())), DB_ERROR_INVALID_INDEX);
+
+    for (;;)
+    {
+        Host* host = NULL;
+        DBConnection* db_connection = NULL;
+        std::vector<DBConnection*> expired_connections;
+        bool need_ping = false;
+
+        // 在锁内决定是借空闲连接、建新连接还是等待，慢操作（ping和建连）都在锁外进行
+        {
+            LockHelper<CLock> lock_helper(_lock);
+            const uint64_t now_milliseconds = CDatetimeUtils::get_current_milliseconds();
+
+            host = select_host(&_shards[shard], readonly, now_milliseconds);
+            if (NULL == host)
+            {
+                const Host* master = _shards[shard].master;
+                THROW_DB_EXCEPTION(NULL,
+                        utils::CStringUtils::format_string("no available db for shard %u, last error: %s", shard, master->last_error.c_str()),
+                        DB_ERROR_HOST_UNAVAILABLE);
+            }
+
+            if (_max_idle_seconds > 0)
+                remove_idle_connections(host, true, now_milliseconds, &expired_connections);
+
+            if (!host->idle_connections.empty())
+            {
+                const IdleConnection& idle_connection = host->idle_connections.front();
+                db_connection = idle_connection.db_connection;
+                need_ping = now_milliseconds >= idle_connection.idle_milliseconds + _idle_ping_seconds*static_cast<uint64_t>(1000);
+                host->idle_connections.pop_front();
+                _leased_connections[db_connection] = host;
+            }
+            else if ((host->num_connections < _max_connections) && !host->connecting)
+            {
+                // 同一DB同时只有一个线程建连
+                ++host->num_connections;
+                host->connecting = true;
+            }
+            else
+            {
+                if (now_milliseconds >= deadline_milliseconds)
+                {
+                    ++_metrics.lease_timeouts;
+                    THROW_DB_EXCEPTION(NULL,
+                            utils::CStringUtils::format_string("lease timeout for db %s:%d", host->ip.c_str(), host->port),
+                            DB_ERROR_POOL_TIMEOUT);
+                }
+                if (!waited)
+                {
+                    waited = true;
+                    ++_metrics.lease_waits;
+                }
+
+                _event.timed_wait(_lock, static_cast<uint32_t>(deadline_milliseconds-now_milliseconds));
+                host = NULL;
+            }
+        }
+
+        close_connections(expired_connections);
+        if (NULL == host)
+            continue;
+
+        if (NULL == db_connection)
+        {
+            db_connection = connect(host);
+            if (NULL == db_connection)
+                continue; // 已进入退避期，重新选择，读可能转到其它DB
+        }
+        else if (need_ping)
+        {
+            try
+            {
+                db_connection->ping();
+            }
+            catch (CDBException& db_error)
+            {
+                // 不支持ping的连接（如SQLite）视为有效
+                if (db_error.errcode() != DB_NOT_SUPPORTED)
+                {
+                    {
+                        LockHelper<CLock> lock_helper(_lock);
+                        ++_metrics.ping_failures;
+                    }
+
+                    pay_back(db_connection, true);
+                    continue;
+                }
+            }
+        }
+
+        LockHelper<CLock> lock_helper(_lock);
+        ++_metrics.lease_count;
+        return db_connection;
+    }
+}
+
+void CDBConnectionPool::pay_back(DBConnection* db_connection, bool broken)
+{
+    std::vector<DBConnection*> db_connections;
+
+    {
+        LockHelper<CLock> lock_helper(_lock);
+        std::map<DBConnection*, Host*>::iterator iter = _leased_connections.find(db_connection);
+        MOOON_ASSERT(iter != _leased_connections.end());
+
+        Host* host = iter->second;
+        _leased_connections.erase(iter);
+
+        if (broken || !db_connection->is_established())
+        {
+            ++_metrics.broken_count;
+            --host->num_connections;
+            db_connections.push_back(db_connection);
+            remove_idle_connections(host, false, 0, &db_connections);
+        }
+        else
+        {
+            host->idle_connections.push_front(IdleConnection(db_connection, CDatetimeUtils::get_current_milliseconds()));
+        }
+
+        _event.broadcast();
+    }
+
+    close_connections(db_connections);
+}
+
+bool CDBConnectionPool::is_broken_exception(const DBConnection* db_connection, CDBException& db_error)
+{
+    return db_connection->is_disconnected_exception(db_error)
+        || db_connection->is_lost_connection_exception(db_error);
+}
+
+void CDBConnectionPool::close_idle_connections()
+{
+    std::vector<DBConnection*> db_connections;
+
+    {
+        LockHelper<CLock> lock_helper(_lock);
+        for (std::vector<Shard>::size_type i=0; i<_shards.size(); ++i)
+        {
+            remove_idle_connections(_shards[i].master, false, 0, &db_connections);
+            for (std::vector<Host*>::size_type j=0; j<_shards[i].replicas.size(); ++j)
+                remove_idle_connections(_shards[i].replicas[j], false, 0, &db_connections);
+        }
+    }
+
+    close_connections(db_connections);
+}
+
+DBConnectionPoolMetrics CDBConnectionPool::get_metrics() const
+{
+    LockHelper<CLock> lock_helper(_lock);
+    DBConnectionPoolMetrics metrics = _metrics;
+
+    metrics.idle_connections = 0;
+    metrics.leased_connections = static_cast<uint32_t>(_leased_connections.size());
+    for (std::vector<Shard>::size_type i=0; i<_shards.size(); ++i)
+    {
+        metrics.idle_connections += static_cast<uint32_t>(_shards[i].master->idle_connections.size());
+        for (std::vector<Host*>::size_type j=0; j<_shards[i].replicas.size(); ++j)
+            metrics.idle_connections += static_cast<uint32_t>(_shards[i].replicas[j]->idle_connections.size());
+    }
+
+    return metrics;
+}
+
+CDBConnectionPool::Host* CDBConnectionPool::select_host(Shard* shard, bool readonly, uint64_t now_milliseconds)
+{
+    if (readonly)
+    {
+        const uint32_t num_replicas = static_cast<uint32_t>(shard->replicas.size());
+        for (uint32_t i=0; i<num_replicas; ++i)
+        {
+            Host* replica = shard->replicas[(shard->next_replica+i) % num_replicas];
+            if (now_milliseconds >= replica->backoff_until_milliseconds)
+            {
+                shard->next_replica = (shard->next_replica+i+1) % num_replicas;
+                return replica;
+            }
+        }
+    }
+
+    if (now_milliseconds >= shard->master->backoff_until_milliseconds)
+        return shard->master;
+    return NULL;
+}
+
+DBConnection* CDBConnectionPool::connect(Host* host)
+{
+    DBConnection* db_connection = NULL;
+
+    try
+    {
+        if (_creator)
+            db_connection = _creator();
+        else
+            db_connection = static_cast<DBConnection*>(utils::CObjectFacotry::get_singleton()->create_object(_db_type));
+        if (NULL == db_connection)
+            THROW_DB_EXCEPTION(NULL, utils::CStringUtils::format_string("can not create %s", _db_type.c_str()), DB_NOT_SUPPORTED);
+
+        db_connection->set_host(host->ip, host->port);
+        db_connection->set_db_name(_db_name);
+        db_connection->set_user(_db_user, _db_password);
+        if (!_charset.empty())
+            db_connection->set_charset(_charset);
+        db_connection->set_timeout_seconds(_connect_timeout_seconds, _read_timeout_seconds, _write_timeout_seconds);
+        db_connection->enable_auto_reconnect(false);
+        db_connection->open();
+    }
+    catch (CDBException& db_error)
+    {
+        delete db_connection;
+        on_connect_failed(host, db_error.what());
+        return NULL;
+    }
+    catch (std::exception& ex)
+    {
+        // 如_creator或内存分配抛出的其它异常，同样要复位connecting，否则该DB再也不会建连
+        delete db_connection;
+        on_connect_failed(host, ex.what());
+        throw;
+    }
+    catch (...)
+    {
+        delete db_connection;
+        on_connect_failed(host, "unknown exception");
+        throw;
+    }
+
+    LockHelper<CLock> lock_helper(_lock);
+    ++_metrics.connect_count;
+    host->connecting = false;
+    host->consecutive_failures = 0;
+    host->backoff_until_milliseconds = 0;
+    _leased_connections[db_connection] = host;
+    _event.broadcast(); // 唤醒等待者，可以继续建下一个连接
+    return db_connection;
+}
+
+void CDBConnectionPool::on_connect_failed(Host* host, const std::string& errmsg)
+{
+    LockHelper<CLock> lock_helper(_lock);
+
+    // 退避时长按连续失败次数翻倍
+    uint64_t backoff_milliseconds = _min_backoff_milliseconds;
+    for (uint32_t i=0; (i<host->consecutive_failures) && (backoff_milliseconds<_max_backoff_milliseconds); ++i)
+        backoff_milliseconds *= 2;
+    if (backoff_milliseconds > _max_backoff_milliseconds)
+        backoff_milliseconds = _max_backoff_milliseconds;
+
+    ++_metrics.connect_failures;
+    --host->num_connections;
+    host->connecting = false;
+    ++host->consecutive_failures;
+    host->backoff_until_milliseconds = CDatetimeUtils::get_current_milliseconds() + backoff_milliseconds;
+    host->last_error = errmsg;
+    _event.broadcast();
+}
+
+void CDBConnectionPool::remove_idle_connections(Host* host, bool expired_only, uint64_t now_milliseconds, std::vector<DBConnection*>* db_connections)
+{
+    // 最久未用的在队尾
+    while (!host->idle_connections.empty())
+    {
+        const IdleConnection& idle_connection = host->idle_connections.back();
+        if (expired_only && (now_milliseconds < idle_connection.idle_milliseconds + _max_idle_seconds*static_cast<uint64_t>(1000)))
+            break;
+
+        db_connections->push_back(idle_connection.db_connection);
+        host->idle_connections.pop_back();
+        --host->num_connections;
+    }
+}
+
+void CDBConnectionPool::close_connections(const std::vector<DBConnection*>& db_connections)
+{
+    for (std::vector<DBConnection*>::size_type i=0; i<db_connections.size(); ++i)
+    {
+        db_connections[i]->close();
+        delete db_connections[i];
+    }
+}
+
+SYS_NAMESPACE_END
@@ -0,0 +1,502 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#include "mooon/sys/group_commit_file.h"
+#include "mooon/sys/adaptive_batch.h"
+#include "mooon/sys/datetime_utils.h"
+#include "mooon/sys/error.h"
+#include "mooon/sys/log.h"
+#include "mooon/sys/stop_watch.h"
+#include "mooon/sys/syscall_exception.h"
+#include "mooon/utils/string_utils.h"
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+SYS_NAMESPACE_BEGIN
+
+// O_DIRECT要求的对齐字节数，4096可满足常见的磁盘和文件系统
+#define DIRECT_IO_ALIGN 4096
+
+CGroupCommitFile::CGroupCommitFile(const std::string& filepath, uint32_t block_size, bool direct)
+    : _filepath(filepath), _block_size(block_size), _direct(direct), _align(1),
+      _flush_interval_milliseconds(1000), _fsync_interval_milliseconds(0),
+      _max_file_size(0), _roll_seconds(0), _fd(-1), _aligned_write(false), _write_offset(0),
+      _active(NULL), _pending(NULL), _dirty(false), _stop(false), _file_size(0), _file_time(0),
+      _appended_bytes(0), _written_bytes(0), _write_count(0), _write_errors(0),
+      _fsync_count(0), _append_waits(0), _rolls(0),
+      _max_write_microseconds(0), _max_fsync_microseconds(0), _last_fsync_microseconds(0)
+{
+    for (int i=0; i<2; ++i)
+    {
+        _buffers[i].data = NULL;
+        _buffers[i].size = 0;
+        _buffers[i].carried = 0;
+        _buffers[i].roll = false;
+    }
+}
+
+CGroupCommitFile::~CGroupCommitFile()
+{
+    close();
+    for (int i=0; i<2; ++i)
+        free(_buffers[i].data);
+}
+
+void CGroupCommitFile::open()
+{
+    const off_t file_size = open_file();
+
+    _align = _direct? DIRECT_IO_ALIGN: 1;
+    _block_size = ((_block_size + DIRECT_IO_ALIGN - 1) / DIRECT_IO_ALIGN) * DIRECT_IO_ALIGN;
+    for (int i=0; i<2; ++i)
+    {
+        // close后再open时复用已分配的块，块在析构时释放
+        if ((NULL == _buffers[i].data)
+         && (posix_memalign(reinterpret_cast<void**>(&_buffers[i].data), DIRECT_IO_ALIGN, _block_size) != 0))
+        {
+            _buffers[i].data = NULL;
+            ::close(_fd);
+            _fd = -1;
+            THROW_SYSCALL_EXCEPTION(NULL, ENOMEM, "posix_memalign");
+        }
+        _buffers[i].size = 0;
+        _buffers[i].carried = 0;
+        _buffers[i].roll = false;
+    }
+
+    _active = &_buffers[0];
+    _pending = NULL;
+    _file_size = static_cast<uint64_t>(file_size);
+    _file_time = time(NULL);
+    _aligned_write = _direct;
+    _write_offset = file_size;
+
+    // 已有文件的未对齐尾部须读入，和之后追加的数据一起对齐写
+    const size_t tail = static_cast<size_t>(file_size % _align);
+    if (tail > 0)
+    {
+        if (pread(_fd, _active->data, _align, file_size-tail) != static_cast<ssize_t>(tail))
+        {
+            const int errcode = errno;
+            ::close(_fd);
+            _fd = -1;
+            THROW_SYSCALL_EXCEPTION(utils::CStringUtils::format_string("pread `%s` error: %s", _filepath.c_str(), Error::to_string(errcode).c_str()), errcode, "pread");
+        }
+    }
+    _active->size = tail;
+    _active->carried = tail;
+
+    _stop = false;
+    try
+    {
+        _writer_thread = std::thread(&CGroupCommitFile::run, this);
+    }
+    catch (std::system_error& ex)
+    {
+        ::close(_fd);
+        _fd = -1;
+        THROW_SYSCALL_EXCEPTION(ex.what(), ex.code().value(), "std::thread");
+    }
+}
+
+void CGroupCommitFile::close()
+{
+    if (_writer_thread.joinable())
+    {
+        {
+            std::unique_lock<std::mutex> lock(_lock);
+            _stop = true;
+            _writer_cond.notify_one();
+        }
+        _writer_thread.join();
+    }
+    if (_fd != -1)
+    {
+        ::close(_fd);
+        _fd = -1;
+    }
+}
+
+void CGroupCommitFile::append(const char* data, size_t size)
+{
+    std::unique_lock<std::mutex> append_lock(_append_lock);
+    std::unique_lock<std::mutex> lock(_lock);
+
+    check_roll(size, lock);
+    copy_data(data, size, lock);
+    _file_size += size;
+    _appended_bytes += size;
+}
+
+void CGroupCommitFile::append(const std::vector<std::string>& logs, char delimiter)
+{
+    std::unique_lock<std::mutex> append_lock(_append_lock);
+    std::unique_lock<std::mutex> lock(_lock);
+    size_t size = 0;
+
+    for (std::vector<std::string>::size_type i=0; i<logs.size(); ++i)
+        size += logs[i].size() + 1;
+    check_roll(size, lock);
+    for (std::vector<std::string>::size_type i=0; i<logs.size(); ++i)
+    {
+        copy_data(logs[i].data(), logs[i].size(), lock);
+        copy_data(&delimiter, 1, lock);
+    }
+    _file_size += size;
+    _appended_bytes += size;
+}
+
+void CGroupCommitFile::get_metrics(GroupCommitMetrics* metrics, bool reset)
+{
+    if (reset)
+    {
+        metrics->appended_bytes = _appended_bytes.exchange(0);
+        metrics->written_bytes = _written_bytes.exchange(0);
+        metrics->write_count = _write_count.exchange(0);
+        metrics->write_errors = _write_errors.exchange(0);
+        metrics->fsync_count = _fsync_count.exchange(0);
+        metrics->append_waits = _append_waits.exchange(0);
+        metrics->rolls = _rolls.exchange(0);
+        metrics->max_write_microseconds = _max_write_microseconds.exchange(0);
+        metrics->max_fsync_microseconds = _max_fsync_microseconds.exchange(0);
+    }
+    else
+    {
+        metrics->appended_bytes = _appended_bytes;
+        metrics->written_bytes = _written_bytes;
+        metrics->write_count = _write_count;
+        metrics->write_errors = _write_errors;
+        metrics->fsync_count = _fsync_count;
+        metrics->append_waits = _append_waits;
+        metrics->rolls = _rolls;
+        metrics->max_write_microseconds = _max_write_microseconds;
+        metrics->max_fsync_microseconds = _max_fsync_microseconds;
+    }
+    metrics->last_fsync_microseconds = _last_fsync_microseconds;
+}
+
+off_t CGroupCommitFile::open_file()
+{
+    const int flags = O_RDWR|O_CREAT|O_CLOEXEC;
+
+    _fd = -1;
+    if (_direct)
+    {
+        _fd = ::open(_filepath.c_str(), flags|O_DIRECT, FILE_DEFAULT_PERM);
+        if ((-1 == _fd) && (EINVAL == errno))
+        {
+            MYLOG_WARN("`%s` does not support O_DIRECT, use buffered write\n", _filepath.c_str());
+            _direct = false;
+        }
+    }
+    if (-1 == _fd)
+        _fd = ::open(_filepath.c_str(), flags, FILE_DEFAULT_PERM);
+    if (-1 == _fd)
+        THROW_SYSCALL_EXCEPTION(utils::CStringUtils::format_string("open `%s` error: %s", _filepath.c_str(), Error::to_string().c_str()), errno, "open");
+
+    const off_t file_size = lseek(_fd, 0, SEEK_END);
+    if (-1 == file_size)
+    {
+        const int errcode = errno;
+        ::close(_fd);
+        _fd = -1;
+        THROW_SYSCALL_EXCEPTION(utils::CStringUtils::format_string("lseek `%s` error: %s", _filepath.c_str(), Error::to_string(errcode).c_str()), errcode, "lseek");
+    }
+
+    return file_size;
+}
+
+void CGroupCommitFile::roll_file()
+{
+    const std::string roll_filepath = get_roll_filepath();
+
+    fsync_file();
+    if (-1 == rename(_filepath.c_str(), roll_filepath.c_str()))
+    {
+        // 继续写原文件，原文件的尾部未和新块一起读入，所以不能再对齐写
+        MYLOG_ERROR("Roll `%s` to `%s` failed: %s\n", _filepath.c_str(), roll_filepath.c_str(), Error::to_string().c_str());
+        if (_aligned_write)
+        {
+            (void)fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) & ~O_DIRECT);
+            _aligned_write = false;
+        }
+        return;
+    }
+
+    ::close(_fd);
+    CBackoff backoff(10, 1000);
+    while (true)
+    {
+        try
+        {
+            _write_offset = open_file();
+            break;
+        }
+        catch (CSyscallException& ex)
+        {
+            MYLOG_ERROR("%s\n", ex.str().c_str());
+            CUtils::millisleep(backoff.next());
+        }
+    }
+
+    // 文件被别的进程抢先创建了
+    _aligned_write = _direct && (0 == _write_offset % _align);
+    ++_rolls;
+    MYLOG_INFO("`%s` is rolled to `%s`\n", _filepath.c_str(), roll_filepath.c_str());
+}
+
+bool CGroupCommitFile::swap_buffer(bool roll)
+{
+    if (_pending != NULL)
+        return false;
+
+    // 滚动时新块写到新文件，不需要带上尾部
+    Buffer* buffer = (_active == &_buffers[0])? &_buffers[1]: &_buffers[0];
+    const size_t tail = roll? 0: _active->size % _align;
+    memcpy(buffer->data, _active->data+_active->size-tail, tail);
+    buffer->size = tail;
+    buffer->carried = tail;
+    buffer->roll = false;
+
+    _active->roll = roll;
+    _pending = _active;
+    _active = buffer;
+    _dirty = false;
+    _writer_cond.notify_one();
+    return true;
+}
+
+void CGroupCommitFile::wait_swap_buffer(bool roll, std::unique_lock<std::mutex>& lock)
+{
+    if (!swap_buffer(roll))
+    {
+        ++_append_waits;
+        _append_cond.wait(lock, [this] { return NULL == _pending; });
+        swap_buffer(roll);
+    }
+}
+
+void CGroupCommitFile::copy_data(const char* data, size_t size, std::unique_lock<std::mutex>& lock)
+{
+    while (size > 0)
+    {
+        if (_active->size == _block_size)
+            wait_swap_buffer(false, lock);
+
+        const size_t n = std::min(size, _block_size-_active->size);
+        memcpy(_active->data+_active->size, data, n);
+        _active->size += n;
+        _dirty = true;
+        data += n;
+        size -= n;
+
+        // 写线程空闲则立即交出，否则等下一次
+        if (_active->size == _block_size)
+            swap_buffer(false);
+    }
+}
+
+void CGroupCommitFile::check_roll(size_t size, std::unique_lock<std::mutex>& lock)
+{
+    if (0 == _file_size)
+        return;
+
+    const time_t now = time(NULL);
+    if (((_max_file_size > 0) && (_file_size+size > _max_file_size))
+     || ((_roll_seconds > 0) && (now-_file_time >= static_cast<time_t>(_roll_seconds))))
+    {
+        // 之前的数据留在当前文件，之后的写到新文件
+        wait_swap_buffer(true, lock);
+        _file_size = 0;
+        _file_time = now;
+    }
+}
+
+void CGroupCommitFile::run()
+{
+    std::unique_lock<std::mutex> lock(_lock);
+    uint64_t last_fsync_milliseconds = CDatetimeUtils::get_current_milliseconds();
+    bool unsynced = false;
+
+    while (true)
+    {
+        if (NULL == _pending)
+        {
+            if (!_stop)
+            {
+                _writer_cond.wait_for(lock, std::chrono::milliseconds(_flush_interval_milliseconds),
+                                      [this] { return (_pending != NULL) || _stop; });
+            }
+            if ((NULL == _pending) && _dirty)
+            {
+                // 超时或关闭，写入未满的块
+                swap_buffer(false);
+            }
+            if (NULL == _pending)
+            {
+                if (_stop)
+                    break;
+
+                // 空闲时也按时fdatasync
+                if (unsynced && (_fsync_interval_milliseconds > 0)
+                 && (CDatetimeUtils::get_current_milliseconds() - last_fsync_milliseconds >= _fsync_interval_milliseconds))
+                {
+                    lock.unlock();
+                    fsync_file();
+                    lock.lock();
+                    unsynced = false;
+                    last_fsync_milliseconds = CDatetimeUtils::get_current_milliseconds();
+                }
+                continue;
+            }
+        }
+
+        Buffer* buffer = _pending;
+        lock.unlock();
+
+        // 关闭时不再无限重试，避免磁盘故障时无法退出
+        CBackoff backoff(10, 1000);
+        for (int retries=0; !write_buffer(buffer); ++retries)
+        {
+            ++_write_errors;
+            if (_stop && (retries >= 3))
+            {
+                MYLOG_ERROR("Discard %zu bytes of `%s`\n", buffer->size-buffer->carried, _filepath.c_str());
+                _write_offset += static_cast<off_t>(buffer->size - buffer->carried);
+                break;
+            }
+            CUtils::millisleep(backoff.next());
+        }
+
+        unsynced = true;
+        if (buffer->roll)
+        {
+            roll_file();
+            unsynced = false;
+            last_fsync_milliseconds = CDatetimeUtils::get_current_milliseconds();
+        }
+        else if ((_fsync_interval_milliseconds > 0)
+              && (CDatetimeUtils::get_current_milliseconds() - last_fsync_milliseconds >= _fsync_interval_milliseconds))
+        {
+            fsync_file();
+            unsynced = false;
+            last_fsync_milliseconds = CDatetimeUtils::get_current_milliseconds();
+        }
+
+        lock.lock();
+        _pending = NULL;
+        _append_cond.notify_all();
+    }
+
+    lock.unlock();
+    if (unsynced)
+        fsync_file();
+}
+
+bool CGroupCommitFile::write_buffer(Buffer* buffer)
+{
+    CStopWatch stop_watch;
+    const char* data;
+    size_t size;
+    off_t offset;
+
+    if (_aligned_write)
+    {
+        // 从对齐位置开始，补齐到对齐的长度，补齐部分会被下一块覆盖或被ftruncate截掉
+        data = buffer->data;
+        offset = _write_offset - static_cast<off_t>(buffer->carried);
+        size = ((buffer->size + _align - 1) / _align) * _align;
+        memset(buffer->data+buffer->size, 0, size-buffer->size);
+    }
+    else
+    {
+        data = buffer->data + buffer->carried;
+        offset = _write_offset;
+        size = buffer->size - buffer->carried;
+    }
+
+    // pwrite写固定位置，出错重试时从头重写即可
+    for (size_t written=0; written<size;)
+    {
+        const ssize_t n = pwrite(_fd, data+written, size-written, offset+static_cast<off_t>(written));
+        if (-1 == n)
+        {
+            if (EINTR == errno)
+                continue;
+            MYLOG_ERROR("pwrite `%s` error: %s\n", _filepath.c_str(), Error::to_string().c_str());
+            return false;
+        }
+
+        written += static_cast<size_t>(n);
+        _written_bytes += static_cast<uint64_t>(n);
+    }
+
+    if (_aligned_write && (size != buffer->size))
+    {
+        if (-1 == ftruncate(_fd, offset+static_cast<off_t>(buffer->size)))
+        {
+            MYLOG_ERROR("ftruncate `%s` error: %s\n", _filepath.c_str(), Error::to_string().c_str());
+            return false;
+        }
+    }
+
+    _write_offset = offset + static_cast<off_t>(_aligned_write? buffer->size: size);
+    ++_write_count;
+    update_max(&_max_write_microseconds, static_cast<uint32_t>(stop_watch.get_elapsed_microseconds()));
+    return true;
+}
+
+void CGroupCommitFile::fsync_file()
+{
+    CStopWatch stop_watch;
+
+    if (-1 == fdatasync(_fd))
+    {
+        MYLOG_ERROR("fdatasync `%s` error: %s\n", _filepath.c_str(), Error::to_string().c_str());
+    }
+    else
+    {
+        const uint32_t microseconds = static_cast<uint32_t>(stop_watch.get_elapsed_microseconds());
+        ++_fsync_count;
+        _last_fsync_microseconds = microseconds;
+        update_max(&_max_fsync_microseconds, microseconds);
+    }
+}
+
+std::string CGroupCommitFile::get_roll_filepath() const
+{
+    const std::string datetime = CDatetimeUtils::get_current_datetime("%04d%02d%02d%02d%02d%02d");
+    std::string roll_filepath = _filepath + std::string(".") + datetime;
+
+    // 同一秒内多次滚动
+    for (int i=1; 0 == access(roll_filepath.c_str(), F_OK); ++i)
+        roll_filepath = utils::CStringUtils::format_string("%s.%s.%d", _filepath.c_str(), datetime.c_str(), i);
+    return roll_filepath;
+}
+
+void CGroupCommitFile::update_max(std::atomic<uint32_t>* max_value, uint32_t value)
+{
+    uint32_t current = *max_value;
+    while ((value > current) && !max_value->compare_exchange_weak(current, value))
+        ;
+}
+
+SYS_NAMESPACE_END
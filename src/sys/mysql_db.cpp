@@ -27,6 +27,8 @@
 #include <mysql/errmsg.h> // CR_SERVER_GONE_ERROR
 #include <mysql/mysql.h>
 #include <mysql/mysqld_error.h> // ER_QUERY_INTERRUPTED
+#include <algorithm>
+#include <inttypes.h>
 #include <stdarg.h>
 #include <strings.h>
 SYS_NAMESPACE_BEGIN
@@ -52,6 +54,421 @@ REGISTER_OBJECT_CREATOR("mysql_connection", CMySQLConnection)
 //     return 0;
 // }
 
+// 基于mysql_use_result的流式游标，
+// 每次mysql_fetch_row才从网络读取一行，字段值直接指向MySQL客户端库的行缓冲区
+class CMySQLCursor: public DBCursor
+{
+public:
+    CMySQLCursor(MYSQL* mysql_handle, MYSQL_RES* result_set)
+        : _mysql_handle(mysql_handle), _result_set(result_set)
+    {
+        if (result_set != NULL)
+            _row_view.resize(mysql_num_fields(result_set));
+    }
+
+    ~CMySQLCursor()
+    {
+        close();
+    }
+
+    virtual bool next()
+    {
+        if (NULL == _result_set)
+            return false;
+
+        MYSQL_ROW row = mysql_fetch_row(_result_set);
+        if (NULL == row)
+        {
+            // 对于mysql_use_result，返回NULL也可能是读出错，如连接断开
+            if (mysql_errno(_mysql_handle) != 0)
+            {
+                throw CDBException(NULL, utils::StringFormatter("%s", mysql_error(_mysql_handle)).c_str(),
+                        mysql_errno(_mysql_handle), __FILE__, __LINE__);
+            }
+
+            close();
+            return false;
+        }
+
+        const unsigned long* lengths = mysql_fetch_lengths(_result_set);
+        for (DBRowView::size_type i=0; i<_row_view.size(); ++i)
+        {
+            _row_view[i].data = row[i];
+            _row_view[i].length = (NULL == row[i])? 0: static_cast<size_t>(lengths[i]);
+        }
+
+        return true;
+    }
+
+    virtual const DBRowView& row() const
+    {
+        return _row_view;
+    }
+
+    virtual int get_num_fields() const
+    {
+        return static_cast<int>(_row_view.size());
+    }
+
+    virtual std::string get_field_name(int index) const
+    {
+        if ((NULL == _result_set) || (index < 0) || (index >= static_cast<int>(_row_view.size())))
+            return std::string();
+
+        const MYSQL_FIELD* field = mysql_fetch_field_direct(_result_set, static_cast<unsigned int>(index));
+        return std::string(field->name, field->name_length);
+    }
+
+    virtual void close() throw ()
+    {
+        // 如果还有未取的行，mysql_free_result会读取并丢弃它们，
+        // 这样连接才可以继续用于其它查询
+        if (_result_set != NULL)
+        {
+            mysql_free_result(_result_set);
+            _result_set = NULL;
+        }
+    }
+
+private:
+    MYSQL* _mysql_handle;
+    MYSQL_RES* _result_set;
+    DBRowView _row_view;
+};
+
+// 基于二进制协议的预处理语句，
+// 整数和浮点字段直接取到int64_t和double中，其它字段（包括DECIMAL和日期时间）以字符串取得
+class CMySQLStatement: public CDBStatementBase
+{
+public:
+    CMySQLStatement(MYSQL* mysql_handle, MYSQL_STMT* stmt, const std::string& sql)
+        : CDBStatementBase(sql, static_cast<int>(mysql_stmt_param_count(stmt))),
+          _mysql_handle(mysql_handle), _stmt(stmt), _thread_id(mysql_thread_id(mysql_handle)), _insert_id(0)
+    {
+        _param_binds.resize(_params.size());
+        _param_lengths.resize(_params.size());
+        init_result();
+    }
+
+    ~CMySQLStatement()
+    {
+        mysql_stmt_close(_stmt);
+    }
+
+    virtual bool fetch()
+    {
+        if (_columns.empty())
+            return false;
+
+        const int ret = mysql_stmt_fetch(_stmt);
+        if (MYSQL_NO_DATA == ret)
+            return false;
+        if (1 == ret)
+        {
+            throw CDBException(_sql.c_str(), utils::StringFormatter("%s", mysql_stmt_error(_stmt)).c_str(),
+                    mysql_stmt_errno(_stmt), __FILE__, __LINE__);
+        }
+
+        // 字符串字段的缓冲区不够大时，扩大缓冲区后重新取该字段
+        bool rebind = false;
+        for (std::vector<Column>::size_type i=0; i<_columns.size(); ++i)
+        {
+            Column& column = _columns[i];
+            if ((column.buffer_type != MYSQL_TYPE_STRING) || column.is_null)
+                continue;
+
+            if (column.length >= column.buffer.size())
+            {
+                MYSQL_BIND& bind = _result_binds[i];
+
+                column.buffer.resize(column.length+1);
+                bind.buffer = &column.buffer[0];
+                bind.buffer_length = static_cast<unsigned long>(column.buffer.size()-1);
+                if (mysql_stmt_fetch_column(_stmt, &bind, static_cast<unsigned int>(i), 0) != 0)
+                {
+                    throw CDBException(_sql.c_str(), utils::StringFormatter("%s", mysql_stmt_error(_stmt)).c_str(),
+                            mysql_stmt_errno(_stmt), __FILE__, __LINE__);
+                }
+                rebind = true;
+            }
+            column.buffer[column.length] = '\0';
+        }
+        if (rebind)
+            mysql_stmt_bind_result(_stmt, &_result_binds[0]);
+
+        return true;
+    }
+
+    virtual int get_num_fields() const
+    {
+        return static_cast<int>(_columns.size());
+    }
+
+    virtual bool is_null(int index) const
+    {
+        check_field_index(index);
+        return _columns[index].is_null;
+    }
+
+    virtual int64_t get_int(int index) const
+    {
+        check_field_index(index);
+
+        const Column& column = _columns[index];
+        if (column.is_null)
+            return 0;
+        if (MYSQL_TYPE_LONGLONG == column.buffer_type)
+            return column.int_value;
+        if (MYSQL_TYPE_DOUBLE == column.buffer_type)
+            return static_cast<int64_t>(column.double_value);
+        return static_cast<int64_t>(strtoll(&column.buffer[0], NULL, 10));
+    }
+
+    virtual double get_double(int index) const
+    {
+        check_field_index(index);
+
+        const Column& column = _columns[index];
+        if (column.is_null)
+            return 0.0;
+        if (MYSQL_TYPE_DOUBLE == column.buffer_type)
+            return column.double_value;
+        if (MYSQL_TYPE_LONGLONG == column.buffer_type)
+            return column.is_unsigned? static_cast<double>(static_cast<uint64_t>(column.int_value)): static_cast<double>(column.int_value);
+        return strtod(&column.buffer[0], NULL);
+    }
+
+    virtual DBFieldView get_string(int index) const
+    {
+        DBFieldView field_view;
+        check_field_index(index);
+
+        const Column& column = _columns[index];
+        if (column.is_null)
+            return field_view;
+
+        if (MYSQL_TYPE_STRING == column.buffer_type)
+        {
+            field_view.data = &column.buffer[0];
+            field_view.length = column.length;
+        }
+        else
+        {
+            int n;
+            if (MYSQL_TYPE_DOUBLE == column.buffer_type)
+                n = snprintf(column.text, sizeof(column.text), "%.17g", column.double_value);
+            else if (column.is_unsigned)
+                n = snprintf(column.text, sizeof(column.text), "%" PRIu64, static_cast<uint64_t>(column.int_value));
+            else
+                n = snprintf(column.text, sizeof(column.text), "%" PRId64, column.int_value);
+            field_view.data = column.text;
+            field_view.length = static_cast<size_t>(n);
+        }
+        return field_view;
+    }
+
+    virtual uint64_t get_insert_id() const
+    {
+        return _insert_id;
+    }
+
+private:
+    virtual uint64_t do_execute(const DBParams& params)
+    {
+        for (int retry=0;; ++retry)
+        {
+            // 自动重连后语句和连接分离，已不能执行，且连接本身可用，直接重新prepare，
+            // mysql_reset_connection等不换连接的分离，执行时报CR_STMT_CLOSED，由下面的重试处理
+            if (is_detached())
+                reprepare();
+
+            bind_params(params);
+            mysql_stmt_free_result(_stmt); // 丢弃上次执行未取完的结果
+
+            if (0 == mysql_stmt_execute(_stmt))
+                break;
+
+            // 连接断开重连后，服务端已没有这个预处理语句，重新prepare后重试一次，
+            // mysql_stmt_execute不会自动重连，由mysql_ping触发重连
+            const unsigned int errcode = mysql_stmt_errno(_stmt);
+            if ((retry > 0) || !is_reprepare_error(errcode) || (mysql_ping(_mysql_handle) != 0))
+            {
+                throw CDBException(_sql.c_str(), utils::StringFormatter("%s", mysql_stmt_error(_stmt)).c_str(),
+                        errcode, __FILE__, __LINE__);
+            }
+            reprepare();
+        }
+
+        // 将结果全部取到客户端，这样连接可以继续执行其它语句
+        if (!_columns.empty() && (mysql_stmt_store_result(_stmt) != 0))
+        {
+            throw CDBException(_sql.c_str(), utils::StringFormatter("%s", mysql_stmt_error(_stmt)).c_str(),
+                    mysql_stmt_errno(_stmt), __FILE__, __LINE__);
+        }
+
+        _insert_id = static_cast<uint64_t>(mysql_stmt_insert_id(_stmt));
+        return static_cast<uint64_t>(mysql_stmt_affected_rows(_stmt));
+    }
+
+    static bool is_reprepare_error(unsigned int errcode)
+    {
+        return (CR_SERVER_GONE_ERROR == errcode) || (CR_SERVER_LOST == errcode)
+            || (CR_STMT_CLOSED == errcode) || (ER_UNKNOWN_STMT_HANDLER == errcode);
+    }
+
+    // 连接的thread id和prepare时的不同，说明已重连，语句是在旧连接上prepare的
+    bool is_detached() const
+    {
+        return mysql_thread_id(_mysql_handle) != _thread_id;
+    }
+
+    void reprepare()
+    {
+        mysql_stmt_close(_stmt);
+        _stmt = mysql_stmt_init(_mysql_handle);
+        if (NULL == _stmt)
+            throw CDBException(_sql.c_str(), "mysql_stmt_init failed", -1, __FILE__, __LINE__);
+        if (mysql_stmt_prepare(_stmt, _sql.data(), static_cast<unsigned long>(_sql.size())) != 0)
+        {
+            throw CDBException(_sql.c_str(), utils::StringFormatter("%s", mysql_stmt_error(_stmt)).c_str(),
+                    mysql_stmt_errno(_stmt), __FILE__, __LINE__);
+        }
+
+        _thread_id = mysql_thread_id(_mysql_handle);
+        init_result();
+    }
+
+    void bind_params(const DBParams& params)
+    {
+        if (params.empty())
+            return;
+
+        memset(&_param_binds[0], 0, sizeof(MYSQL_BIND)*_param_binds.size());
+        for (DBParams::size_type i=0; i<params.size(); ++i)
+        {
+            const DBParam& param = params[i];
+            MYSQL_BIND& bind = _param_binds[i];
+
+            // 参数在执行完之前不会变，直接指向参数的存储
+            if (DB_PARAM_INT == param.type)
+            {
+                bind.buffer_type = MYSQL_TYPE_LONGLONG;
+                bind.buffer = const_cast<int64_t*>(&param.int_value);
+            }
+            else if (DB_PARAM_DOUBLE == param.type)
+            {
+                bind.buffer_type = MYSQL_TYPE_DOUBLE;
+                bind.buffer = const_cast<double*>(&param.double_value);
+            }
+            else if ((DB_PARAM_STRING == param.type) || (DB_PARAM_BLOB == param.type))
+            {
+                _param_lengths[i] = static_cast<unsigned long>(param.string_value.size());
+                bind.buffer_type = (DB_PARAM_BLOB == param.type)? MYSQL_TYPE_BLOB: MYSQL_TYPE_STRING;
+                bind.buffer = const_cast<char*>(param.string_value.data());
+                bind.buffer_length = _param_lengths[i];
+                bind.length = &_param_lengths[i];
+            }
+            else
+            {
+                bind.buffer_type = MYSQL_TYPE_NULL;
+            }
+        }
+
+        if (mysql_stmt_bind_param(_stmt, &_param_binds[0]) != 0)
+        {
+            throw CDBException(_sql.c_str(), utils::StringFormatter("%s", mysql_stmt_error(_stmt)).c_str(),
+                    mysql_stmt_errno(_stmt), __FILE__, __LINE__);
+        }
+    }
+
+    // 根据结果集的元数据，为每个字段准备接收的缓冲区
+    void init_result()
+    {
+        MYSQL_RES* metadata = mysql_stmt_result_metadata(_stmt);
+
+        _columns.clear();
+        _result_binds.clear();
+        if (NULL == metadata)
+            return; // 不是查询，没有结果集
+
+        const unsigned int num_fields = mysql_num_fields(metadata);
+        const MYSQL_FIELD* fields = mysql_fetch_fields(metadata);
+        _columns.resize(num_fields);
+        _result_binds.resize(num_fields);
+        memset(&_result_binds[0], 0, sizeof(MYSQL_BIND)*num_fields);
+
+        for (unsigned int i=0; i<num_fields; ++i)
+        {
+            Column& column = _columns[i];
+            MYSQL_BIND& bind = _result_binds[i];
+
+            switch (fields[i].type)
+            {
+            case MYSQL_TYPE_TINY:
+            case MYSQL_TYPE_SHORT:
+            case MYSQL_TYPE_INT24:
+            case MYSQL_TYPE_LONG:
+            case MYSQL_TYPE_LONGLONG:
+            case MYSQL_TYPE_YEAR:
+                column.buffer_type = MYSQL_TYPE_LONGLONG;
+                column.is_unsigned = (fields[i].flags & UNSIGNED_FLAG) != 0;
+                bind.buffer = &column.int_value;
+                bind.is_unsigned = column.is_unsigned;
+                break;
+            case MYSQL_TYPE_FLOAT:
+            case MYSQL_TYPE_DOUBLE:
+                column.buffer_type = MYSQL_TYPE_DOUBLE;
+                bind.buffer = &column.double_value;
+                break;
+            default:
+                // 先分配一个较小的缓冲区，遇到更长的值时再扩大
+                column.buffer_type = MYSQL_TYPE_STRING;
+                column.buffer.resize(std::min<unsigned long>(fields[i].length, 256)+1);
+                bind.buffer = &column.buffer[0];
+                bind.buffer_length = static_cast<unsigned long>(column.buffer.size()-1);
+                break;
+            }
+
+            bind.buffer_type = column.buffer_type;
+            bind.length = &column.length;
+            bind.is_null = &column.is_null;
+            bind.error = &column.error;
+        }
+
+        mysql_free_result(metadata);
+        if (mysql_stmt_bind_result(_stmt, &_result_binds[0]) != 0)
+        {
+            throw CDBException(_sql.c_str(), utils::StringFormatter("%s", mysql_stmt_error(_stmt)).c_str(),
+                    mysql_stmt_errno(_stmt), __FILE__, __LINE__);
+        }
+    }
+
+private:
+    struct Column
+    {
+        enum_field_types buffer_type; // MYSQL_TYPE_LONGLONG、MYSQL_TYPE_DOUBLE或MYSQL_TYPE_STRING
+        bool is_unsigned;
+        int64_t int_value;
+        double double_value;
+        std::vector<char> buffer; // 多一个字节用于结尾符
+        unsigned long length;
+        my_bool is_null;
+        my_bool error;
+        mutable char text[32];    // 数值转成的字符串
+
+        Column(): buffer_type(MYSQL_TYPE_STRING), is_unsigned(false), int_value(0), double_value(0.0), length(0), is_null(0), error(0) {}
+    };
+
+    MYSQL* _mysql_handle;
+    MYSQL_STMT* _stmt;
+    unsigned long _thread_id; // prepare时连接的thread id，用来识别重连
+    uint64_t _insert_id;
+    std::vector<MYSQL_BIND> _param_binds;
+    std::vector<unsigned long> _param_lengths;
+    std::vector<Column> _columns;
+    std::vector<MYSQL_BIND> _result_binds;
+};
+
 // 用来标识是否成功调用过library_init
 static bool sg_library_initialized = false;
 
@@ -98,7 +515,7 @@ void CMySQLConnection::escape_string(const std::string& str, std::string* escape
 
 ////////////////////////////////////////////////////////////////////////////////
 CMySQLConnection::CMySQLConnection(size_t sql_max, bool multistatements)
-    : CDBConnectionBase(sql_max), _mysql_handle(NULL), _client_flag(0)
+    : CDBConnectionBase(sql_max), _mysql_handle(NULL), _client_flag(0), _local_infile(false)
 {
     // In MySQL 5.7, CLIENT_MULTI_RESULTS is enabled by default.
     if (multistatements)
@@ -278,6 +695,7 @@ void CMySQLConnection::close() throw ()
         MYSQL* mysql_handle = static_cast<MYSQL*>(_mysql_handle);
 
         _is_established = false;
+        clear_statements();
         mysql_close(mysql_handle);
         _mysql_handle = NULL;
     }
@@ -292,9 +710,6 @@ void CMySQLConnection::reopen()
 
 uint64_t CMySQLConnection::update(const char* format, ...)
 {
-    MOOON_ASSERT(_mysql_handle != NULL);
-
-    MYSQL* mysql_handle = static_cast<MYSQL*>(_mysql_handle);
     int excepted = 0;
     size_t sql_size = _sql_size;
     utils::ScopedArray<char> sql(new char[sql_size]);
@@ -319,10 +734,18 @@ uint64_t CMySQLConnection::update(const char* format, ...)
         sql.reset(new char[sql_size]);
     }
 
+    return update_sql(sql.get(), static_cast<size_t>(excepted));
+}
+
+uint64_t CMySQLConnection::update_sql(const char* sql, size_t sql_length)
+{
+    MOOON_ASSERT(_mysql_handle != NULL);
+    MYSQL* mysql_handle = static_cast<MYSQL*>(_mysql_handle);
+
     // 如果查询成功，返回0。如果出现错误，返回非0值
-    if (mysql_real_query(mysql_handle, sql.get(), (unsigned long)excepted) != 0)
+    if (mysql_real_query(mysql_handle, sql, (unsigned long)sql_length) != 0)
     {
-        throw CDBException(sql.get(), utils::StringFormatter("%s", mysql_error(mysql_handle)).c_str(),
+        throw CDBException(sql, utils::StringFormatter("%s", mysql_error(mysql_handle)).c_str(),
                 mysql_errno(mysql_handle), __FILE__, __LINE__); // 不将sql包含在error中，因为sql可能很长
     }
 
@@ -545,6 +968,61 @@ void CMySQLConnection::do_query(DBTable& db_table, const char* sql, int sql_leng
     }
 }
 
+DBStatement* CMySQLConnection::do_prepare(const std::string& sql)
+{
+    MOOON_ASSERT(_mysql_handle != NULL);
+    MYSQL* mysql_handle = static_cast<MYSQL*>(_mysql_handle);
+
+    MYSQL_STMT* stmt = mysql_stmt_init(mysql_handle);
+    if (NULL == stmt)
+    {
+        throw CDBException(sql.c_str(), utils::StringFormatter("%s", mysql_error(mysql_handle)).c_str(),
+                mysql_errno(mysql_handle), __FILE__, __LINE__);
+    }
+    if (mysql_stmt_prepare(stmt, sql.data(), static_cast<unsigned long>(sql.size())) != 0)
+    {
+        const CDBException ex(sql.c_str(), utils::StringFormatter("%s", mysql_stmt_error(stmt)).c_str(),
+                mysql_stmt_errno(stmt), __FILE__, __LINE__);
+        mysql_stmt_close(stmt);
+        throw ex;
+    }
+
+    try
+    {
+        return new CMySQLStatement(mysql_handle, stmt, sql);
+    }
+    catch (...)
+    {
+        mysql_stmt_close(stmt);
+        throw;
+    }
+}
+
+DBCursor* CMySQLConnection::do_open_cursor(const char* sql, int sql_length)
+{
+    MOOON_ASSERT(_mysql_handle != NULL);
+    MYSQL* mysql_handle = static_cast<MYSQL*>(_mysql_handle);
+
+    // 如果查询成功，返回0。如果出现错误，返回非0值
+    if (mysql_real_query(mysql_handle, sql, (unsigned long)sql_length) != 0)
+    {
+        throw CDBException(sql, utils::StringFormatter("%s", mysql_error(mysql_handle)).c_str(),
+                mysql_errno(mysql_handle), __FILE__, __LINE__);
+    }
+
+    // 和mysql_store_result不同，mysql_use_result不将结果集读到客户端，
+    // 而是在mysql_fetch_row时逐行读取
+    MYSQL_RES* result_set = mysql_use_result(mysql_handle);
+    if ((NULL == result_set) && (mysql_field_count(mysql_handle) != 0))
+    {
+        throw CDBException(sql, utils::StringFormatter("%s", mysql_error(mysql_handle)).c_str(),
+                mysql_errno(mysql_handle), __FILE__, __LINE__);
+    }
+
+    // 不是SELECT等有结果集的语句时，result_set为NULL，游标没有任何行
+    return new CMySQLCursor(mysql_handle, result_set);
+}
+
 void CMySQLConnection::do_open()
 {
     MOOON_ASSERT(NULL == _mysql_handle);
@@ -588,6 +1066,12 @@ void CMySQLConnection::do_open()
         // 设置字符集
         mysql_options(mysql_handle, MYSQL_SET_CHARSET_NAME, _charset.c_str());
     }
+    if (_local_infile)
+    {
+        // 须在mysql_real_connect之前设置，否则握手时不会协商CLIENT_LOCAL_FILES，服务端拒绝LOAD DATA LOCAL
+        unsigned int local_infile = 1;
+        mysql_options(mysql_handle, MYSQL_OPT_LOCAL_INFILE, &local_infile);
+    }
 
     try
     {
@@ -597,7 +1081,7 @@ void CMySQLConnection::do_open()
         // See the note following this table for more information about this flag.
         if (NULL == mysql_real_connect(mysql_handle,
                                        _db_ip.c_str(), _db_user.c_str(), _db_password.c_str(),
-                                       _db_name.c_str(), _db_port, NULL, _client_flag))
+                                       _db_name.c_str(), _db_port, NULL, _local_infile? (_client_flag|CLIENT_LOCAL_FILES): _client_flag))
         {
             throw CDBException(NULL,
                                mysql_error(mysql_handle), mysql_errno(mysql_handle),
@@ -0,0 +1,500 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+#include "mooon/sys/pipeline.h"
+#include "mooon/sys/datetime_utils.h"
+#include "mooon/sys/error.h"
+#include "mooon/sys/log.h"
+#include "mooon/sys/syscall_exception.h"
+#include "mooon/utils/string_utils.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <system_error>
+#include <unistd.h>
+SYS_NAMESPACE_BEGIN
+
+CPipeline::CPipeline(IPipelineSource* source, const std::vector<IPipelineSink*>& sinks, IPipelineTransform* transform)
+    : _source(source), _sinks(sinks), _transform(transform),
+      _min_batch(1), _max_batch(1000), _max_inflight(1024), _transform_threads(1),
+      _max_idle_milliseconds(1000), _max_error_milliseconds(10000), _drain_milliseconds(30000),
+      _stop(false), _workers_stop(false), _abort(false), _running_transforms(0),
+      _next_sequence(1), _next_ack_sequence(1),
+      _fetched_messages(0), _written_messages(0), _acked_batches(0),
+      _source_errors(0), _sink_errors(0), _inflight_batches(0), _batch(0)
+{
+}
+
+CPipeline::~CPipeline()
+{
+    stop();
+    wait();
+}
+
+bool CPipeline::start()
+{
+    if (_sinks.empty())
+    {
+        MYLOG_ERROR("Start pipeline failed: no sink\n");
+        return false;
+    }
+
+    // 同时存在的批次数不超过_max_inflight，队列容量不小于它，入队就不会因满而失败
+    if (_transform != NULL)
+        _transform_queue.reset(new BatchQueue(_max_inflight));
+    _sink_queue.reset(new BatchQueue(_max_inflight));
+    _done_queue.reset(new BatchQueue(_max_inflight));
+
+    try
+    {
+        _source_thread = std::thread(&CPipeline::source_run, this);
+        if (_transform != NULL)
+        {
+            _running_transforms = _transform_threads;
+            for (int i=0; i<_transform_threads; ++i)
+                _transform_thread_array.push_back(std::thread(&CPipeline::transform_run, this));
+        }
+        for (int i=0; i<static_cast<int>(_sinks.size()); ++i)
+            _sink_thread_array.push_back(std::thread(&CPipeline::sink_run, this, i));
+        return true;
+    }
+    catch (std::system_error& ex)
+    {
+        MYLOG_ERROR("Start pipeline failed: %s\n", ex.what());
+        _stop = true;
+        _workers_stop = true;
+        _abort = true;
+        return false;
+    }
+}
+
+void CPipeline::stop()
+{
+    _stop = true;
+}
+
+void CPipeline::wait()
+{
+    if (_source_thread.joinable())
+        _source_thread.join();
+    for (std::vector<std::thread>::size_type i=0; i<_transform_thread_array.size(); ++i)
+        _transform_thread_array[i].join();
+    for (std::vector<std::thread>::size_type i=0; i<_sink_thread_array.size(); ++i)
+        _sink_thread_array[i].join();
+    _transform_thread_array.clear();
+    _sink_thread_array.clear();
+
+    // 超时放弃的批次，不确认
+    if (_transform_queue)
+        discard_batches(_transform_queue.get());
+    if (_sink_queue)
+        discard_batches(_sink_queue.get());
+    if (_done_queue)
+        discard_batches(_done_queue.get());
+    for (std::map<uint64_t, PipelineBatch*>::iterator iter=_completed_batches.begin(); iter!=_completed_batches.end(); ++iter)
+    {
+        _source->discard(iter->second);
+        delete iter->second;
+    }
+    _completed_batches.clear();
+}
+
+void CPipeline::get_metrics(PipelineMetrics* metrics) const
+{
+    metrics->fetched_messages = _fetched_messages;
+    metrics->written_messages = _written_messages;
+    metrics->acked_batches = _acked_batches;
+    metrics->source_errors = _source_errors;
+    metrics->sink_errors = _sink_errors;
+    metrics->inflight_batches = _inflight_batches;
+    metrics->batch = _batch;
+}
+
+void CPipeline::source_run()
+{
+    BatchQueue* queue = (_transform != NULL)? _transform_queue.get(): _sink_queue.get();
+    CAdaptiveBatch adaptive_batch(_min_batch, _max_batch, _max_idle_milliseconds, _max_error_milliseconds);
+    int idle_count = 0;
+
+    while (!_stop)
+    {
+        ack_completed();
+        if (_inflight_batches >= _max_inflight)
+        {
+            // 背压：下游未跟上，暂停取数
+            idle_wait(&idle_count);
+            continue;
+        }
+
+        PipelineBatch* batch = new PipelineBatch;
+        const int n = _source->fetch(adaptive_batch.get_batch(), batch);
+        _batch = adaptive_batch.get_batch();
+        idle_count = 0;
+
+        if (n < 0)
+        {
+            ++_source_errors;
+            delete batch;
+            interruptible_millisleep(adaptive_batch.on_error(), _stop);
+            continue;
+        }
+
+        adaptive_batch.on_success();
+        if (0 == n)
+        {
+            const bool eof = _source->is_eof();
+            delete batch;
+            if (eof)
+                break;
+            interruptible_millisleep(adaptive_batch.on_fetched(0), _stop);
+            continue;
+        }
+
+        adaptive_batch.on_fetched(n);
+        _fetched_messages += n;
+        batch->sequence = _next_sequence++;
+        ++_inflight_batches;
+        while (!queue->push(batch))
+            idle_wait(&idle_count);
+    }
+
+    // 等待已取出的写出并确认，收到stop后最多等待_drain_milliseconds
+    uint64_t stop_milliseconds = 0;
+    while (_inflight_batches > 0)
+    {
+        ack_completed();
+        if (_stop)
+        {
+            const uint64_t now_milliseconds = CDatetimeUtils::get_current_milliseconds();
+            if (0 == stop_milliseconds)
+                stop_milliseconds = now_milliseconds;
+            else if (now_milliseconds - stop_milliseconds >= _drain_milliseconds)
+                break;
+        }
+
+        CUtils::millisleep(1);
+    }
+
+    if (_inflight_batches > 0)
+    {
+        MYLOG_WARN("Pipeline abort with %u inflight batches\n", _inflight_batches.load());
+        _abort = true;
+    }
+    _workers_stop = true;
+}
+
+void CPipeline::transform_run()
+{
+    int idle_count = 0;
+
+    while (!_abort)
+    {
+        PipelineBatch* batch;
+
+        if (!_transform_queue->pop(&batch))
+        {
+            if (_workers_stop)
+                break;
+            idle_wait(&idle_count);
+        }
+        else
+        {
+            idle_count = 0;
+            _transform->transform(batch);
+            while (!_sink_queue->push(batch))
+                idle_wait(&idle_count);
+        }
+    }
+
+    --_running_transforms;
+}
+
+void CPipeline::sink_run(int index)
+{
+    IPipelineSink* sink = _sinks[index];
+    CBackoff backoff(10, _max_error_milliseconds);
+    int idle_count = 0;
+
+    while (!_abort)
+    {
+        PipelineBatch* batch;
+
+        if (!_sink_queue->pop(&batch))
+        {
+            // 须等转换线程都退出，才能确定不会再有数据
+            if (_workers_stop && (0 == _running_transforms))
+                break;
+            idle_wait(&idle_count);
+            continue;
+        }
+
+        idle_count = 0;
+        const std::vector<std::string>::size_type count = batch->messages.size();
+        while (!sink->write(batch))
+        {
+            ++_sink_errors;
+            interruptible_millisleep(backoff.next(), _abort);
+            if (_abort)
+                break;
+        }
+
+        if (_abort)
+        {
+            // 放回，由wait释放
+            while (!_sink_queue->push(batch))
+                idle_wait(&idle_count);
+            break;
+        }
+
+        backoff.reset();
+        _written_messages += count;
+        while (!_done_queue->push(batch))
+            idle_wait(&idle_count);
+    }
+
+    sink->flush();
+}
+
+void CPipeline::ack_completed()
+{
+    PipelineBatch* batch;
+
+    while (_done_queue->pop(&batch))
+        _completed_batches.insert(std::make_pair(batch->sequence, batch));
+
+    // 只确认连续完成的，保证确认顺序和取出顺序一致
+    while (!_completed_batches.empty())
+    {
+        std::map<uint64_t, PipelineBatch*>::iterator iter = _completed_batches.begin();
+        if (iter->first != _next_ack_sequence)
+            break;
+
+        batch = iter->second;
+        _completed_batches.erase(iter);
+        _source->ack(batch);
+        delete batch;
+
+        ++_next_ack_sequence;
+        ++_acked_batches;
+        --_inflight_batches;
+    }
+}
+
+void CPipeline::idle_wait(int* idle_count)
+{
+    // 刚空闲时让出CPU即可，持续空闲则休眠，避免空转
+    if (++*idle_count < 100)
+        std::this_thread::yield();
+    else
+        CUtils::millisleep(1);
+}
+
+void CPipeline::discard_batches(BatchQueue* queue)
+{
+    PipelineBatch* batch;
+
+    while (queue->pop(&batch))
+    {
+        _source->discard(batch);
+        delete batch;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+CFileLineSource::CFileLineSource(const std::string& filepath, char delimiter, off_t offset)
+    : _fd(-1), _delimiter(delimiter), _eof(false),
+      _offset(offset), _acked_offset(offset), _buffer_offset(0), _read_buffer(65536)
+{
+    _fd = open(filepath.c_str(), O_RDONLY|O_CLOEXEC);
+    if (-1 == _fd)
+        THROW_SYSCALL_EXCEPTION(utils::CStringUtils::format_string("open `%s` error: %s", filepath.c_str(), Error::to_string().c_str()), errno, "open");
+
+    if ((offset > 0) && (-1 == lseek(_fd, offset, SEEK_SET)))
+    {
+        const int errcode = errno;
+        close(_fd);
+        THROW_SYSCALL_EXCEPTION(utils::CStringUtils::format_string("lseek `%s` error: %s", filepath.c_str(), Error::to_string(errcode).c_str()), errcode, "lseek");
+    }
+}
+
+CFileLineSource::~CFileLineSource()
+{
+    close(_fd);
+}
+
+int CFileLineSource::fetch(int max_count, PipelineBatch* batch)
+{
+    int count = 0;
+
+    while ((count < max_count) && !_eof)
+    {
+        const std::string::size_type pos = _buffer.find(_delimiter, _buffer_offset);
+
+        if (pos != std::string::npos)
+        {
+            if (pos > _buffer_offset)
+            {
+                batch->messages.push_back(_buffer.substr(_buffer_offset, pos-_buffer_offset));
+                ++count;
+            }
+
+            _offset += static_cast<off_t>(pos - _buffer_offset + 1);
+            _buffer_offset = pos + 1;
+            continue;
+        }
+
+        // 不足一行，丢弃已取出的部分后继续读
+        _buffer.erase(0, _buffer_offset);
+        _buffer_offset = 0;
+
+        const ssize_t bytes = read(_fd, &_read_buffer[0], _read_buffer.size());
+        if (bytes > 0)
+        {
+            _buffer.append(&_read_buffer[0], bytes);
+        }
+        else if (0 == bytes)
+        {
+            // 最后一行可能没有分隔符
+            if (!_buffer.empty())
+            {
+                batch->messages.push_back(_buffer);
+                _offset += static_cast<off_t>(_buffer.size());
+                _buffer.clear();
+                ++count;
+            }
+
+            _eof = true;
+        }
+        else if (errno != EINTR)
+        {
+            MYLOG_ERROR("read error: %s\n", Error::to_string().c_str());
+            break;
+        }
+    }
+
+    if ((0 == count) && !_eof)
+        return -1;
+    if (count > 0)
+        batch->ack_context = new off_t(_offset);
+    return count;
+}
+
+void CFileLineSource::ack(PipelineBatch* batch)
+{
+    off_t* offset = static_cast<off_t*>(batch->ack_context);
+    _acked_offset = *offset;
+    delete offset;
+}
+
+void CFileLineSource::discard(PipelineBatch* batch)
+{
+    delete static_cast<off_t*>(batch->ack_context);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+CFileLineSink::CFileLineSink(const std::string& filepath, char delimiter, bool sync)
+    : _fd(-1), _delimiter(delimiter), _sync(sync), _filepath(filepath)
+{
+    _fd = open(filepath.c_str(), O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, FILE_DEFAULT_PERM);
+    if (-1 == _fd)
+        THROW_SYSCALL_EXCEPTION(utils::CStringUtils::format_string("open `%s` error: %s", filepath.c_str(), Error::to_string().c_str()), errno, "open");
+}
+
+CFileLineSink::~CFileLineSink()
+{
+    close(_fd);
+}
+
+bool CFileLineSink::write(PipelineBatch* batch)
+{
+    std::vector<std::string>& messages = batch->messages;
+    std::vector<std::string>::size_type index = 0; // 已完整写出（含分隔符）的消息数
+    std::string::size_type partial = 0; // messages[index]已写出的字节数
+
+    while (index < messages.size())
+    {
+        struct iovec iov[IOV_MAX];
+        int iovcnt = 0;
+
+        for (std::vector<std::string>::size_type i=index; (i<messages.size()) && (iovcnt+2<=IOV_MAX); ++i)
+        {
+            const std::string& message = messages[i];
+            const std::string::size_type skip = (i == index)? partial: 0;
+
+            if (skip < message.size())
+            {
+                iov[iovcnt].iov_base = const_cast<char*>(message.data()) + skip;
+                iov[iovcnt].iov_len = message.size() - skip;
+                ++iovcnt;
+            }
+
+            iov[iovcnt].iov_base = &_delimiter;
+            iov[iovcnt].iov_len = 1;
+            ++iovcnt;
+        }
+
+        const ssize_t bytes = writev(_fd, iov, iovcnt);
+        if (-1 == bytes)
+        {
+            if (EINTR == errno)
+                continue;
+
+            // 移除已写出的，重试时只写余下的，避免重复
+            MYLOG_ERROR("writev `%s` error: %s\n", _filepath.c_str(), Error::to_string().c_str());
+            messages.erase(messages.begin(), messages.begin()+index);
+            messages.front().erase(0, partial);
+            return false;
+        }
+
+        std::string::size_type left = static_cast<std::string::size_type>(bytes);
+        while (left > 0)
+        {
+            const std::string::size_type remain = messages[index].size() + 1 - partial;
+
+            if (left < remain)
+            {
+                partial += left;
+                left = 0;
+            }
+            else
+            {
+                left -= remain;
+                partial = 0;
+                ++index;
+            }
+        }
+    }
+
+    if (_sync && (-1 == fdatasync(_fd)))
+    {
+        // 数据已写入，重试时只需再次同步
+        MYLOG_ERROR("fdatasync `%s` error: %s\n", _filepath.c_str(), Error::to_string().c_str());
+        messages.clear();
+        return false;
+    }
+
+    return true;
+}
+
+void CFileLineSink::flush()
+{
+    if (-1 == fdatasync(_fd))
+        MYLOG_ERROR("fdatasync `%s` error: %s\n", _filepath.c_str(), Error::to_string().c_str());
+}
+
+SYS_NAMESPACE_END
@@ -30,7 +30,8 @@ CDBConnectionBase::CDBConnectionBase(size_t sql_size)
     : _sql_size(sql_size), _is_established(false),
       _db_port(3306), _auto_reconnect(false),
       _connect_timeout_seconds(DB_CONNECT_TIMEOUT_SECONDS_DEFAULT), _read_timeout_seconds(DB_READ_TIMEOUT_SECONDS_DEFAULT), _write_timeout_seconds(DB_WRITE_TIMEOUT_SECONDS_DEFAULT),
-      _null_value("$NULL$")
+      _null_value("$NULL$"),
+      _statement_clock(0), _max_statements(DB_MAX_STATEMENTS_DEFAULT)
 {
 }
 
@@ -218,6 +219,115 @@ std::string CDBConnectionBase::query(const char* format, ...)
     return result;
 }
 
+DBCursor* CDBConnectionBase::open_cursor(const char* format, ...)
+{
+    int excepted = 0;
+    size_t sql_size = _sql_size;
+    utils::ScopedArray<char> sql(new char[sql_size]);
+    va_list ap;
+
+    while (true)
+    {
+        va_start(ap, format);
+        excepted = vsnprintf(sql.get(), sql_size, format, ap);
+        va_end(ap);
+
+        /* If that worked, return the string. */
+        if (excepted > -1 && excepted < (int)sql_size)
+            break;
+
+        /* Else try again with more space. */
+        if (excepted > -1)    /* glibc 2.1 */
+            sql_size = (size_t)excepted + 1; /* precisely what is needed */
+        else           /* glibc 2.0 */
+            sql_size *= 2;  /* twice the old size */
+
+        sql.reset(new char[sql_size]);
+    }
+
+    return do_open_cursor(sql.get(), excepted);
+}
+
+uint64_t CDBConnectionBase::query_each(const DBRowCallback& callback, const char* format, ...)
+{
+    int excepted = 0;
+    size_t sql_size = _sql_size;
+    utils::ScopedArray<char> sql(new char[sql_size]);
+    va_list ap;
+
+    while (true)
+    {
+        va_start(ap, format);
+        excepted = vsnprintf(sql.get(), sql_size, format, ap);
+        va_end(ap);
+
+        /* If that worked, return the string. */
+        if (excepted > -1 && excepted < (int)sql_size)
+            break;
+
+        /* Else try again with more space. */
+        if (excepted > -1)    /* glibc 2.1 */
+            sql_size = (size_t)excepted + 1; /* precisely what is needed */
+        else           /* glibc 2.0 */
+            sql_size *= 2;  /* twice the old size */
+
+        sql.reset(new char[sql_size]);
+    }
+
+    uint64_t num_rows = 0;
+    utils::ScopedPtr<DBCursor> cursor(do_open_cursor(sql.get(), excepted));
+    while (cursor->next())
+    {
+        ++num_rows;
+        if (!callback(cursor->row()))
+            break;
+    }
+
+    return num_rows;
+}
+
+DBStatement* CDBConnectionBase::prepare(const std::string& sql)
+{
+    std::map<std::string, StatementEntry>::iterator iter = _statements.find(sql);
+    if (iter != _statements.end())
+    {
+        iter->second.last_used = ++_statement_clock;
+        return iter->second.statement;
+    }
+
+    StatementEntry entry;
+    entry.statement = do_prepare(sql);
+    entry.last_used = ++_statement_clock;
+
+    // 满时删除最久未用的，只在未命中时遍历，个数不多
+    if (_statements.size() >= _max_statements)
+    {
+        std::map<std::string, StatementEntry>::iterator oldest = _statements.begin();
+        for (iter=_statements.begin(); iter!=_statements.end(); ++iter)
+        {
+            if (iter->second.last_used < oldest->second.last_used)
+                oldest = iter;
+        }
+        delete oldest->second.statement;
+        _statements.erase(oldest);
+    }
+
+    _statements.insert(std::make_pair(sql, entry));
+    return entry.statement;
+}
+
+void CDBConnectionBase::set_max_statements(size_t max_statements)
+{
+    _max_statements = (0 == max_statements)? 1: max_statements;
+}
+
+void CDBConnectionBase::clear_statements()
+{
+    for (std::map<std::string, StatementEntry>::iterator iter=_statements.begin(); iter!=_statements.end(); ++iter)
+        delete iter->second.statement;
+    _statements.clear();
+}
+
 void CDBConnectionBase::ping()
 {
     THROW_DB_EXCEPTION(NULL, "not supported", DB_NOT_SUPPORTED);
@@ -243,4 +353,92 @@ bool CDBConnectionBase::is_established() const
     return _is_established;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+CDBStatementBase::CDBStatementBase(const std::string& sql, int param_count)
+    : _sql(sql), _params(param_count), _batch_size(0)
+{
+}
+
+void CDBStatementBase::bind_null(int index)
+{
+    get_param(index).type = DB_PARAM_NULL;
+}
+
+void CDBStatementBase::bind_int(int index, int64_t value)
+{
+    DBParam& param = get_param(index);
+    param.type = DB_PARAM_INT;
+    param.int_value = value;
+}
+
+void CDBStatementBase::bind_double(int index, double value)
+{
+    DBParam& param = get_param(index);
+    param.type = DB_PARAM_DOUBLE;
+    param.double_value = value;
+}
+
+void CDBStatementBase::bind_string(int index, const char* data, size_t length)
+{
+    DBParam& param = get_param(index);
+    param.type = DB_PARAM_STRING;
+    param.string_value.assign(data, length); // 复用已有的内存
+}
+
+void CDBStatementBase::bind_string(int index, const std::string& value)
+{
+    bind_string(index, value.data(), value.size());
+}
+
+void CDBStatementBase::bind_blob(int index, const void* data, size_t length)
+{
+    DBParam& param = get_param(index);
+    param.type = DB_PARAM_BLOB;
+    param.string_value.assign(static_cast<const char*>(data), length);
+}
+
+uint64_t CDBStatementBase::execute()
+{
+    return do_execute(_params);
+}
+
+void CDBStatementBase::add_batch()
+{
+    if (_batch_size == _batch.size())
+        _batch.push_back(_params);
+    else
+        _batch[_batch_size] = _params;
+    ++_batch_size;
+}
+
+uint64_t CDBStatementBase::execute_batch()
+{
+    uint64_t affected_rows = 0;
+    const size_t batch_size = _batch_size;
+
+    // 出错时也清空，避免下次重复执行
+    _batch_size = 0;
+    for (size_t i=0; i<batch_size; ++i)
+        affected_rows += do_execute(_batch[i]);
+    return affected_rows;
+}
+
+DBParam& CDBStatementBase::get_param(int index)
+{
+    if ((index < 0) || (index >= static_cast<int>(_params.size())))
+    {
+        THROW_DB_EXCEPTION(_sql.c_str(), utils::StringFormatter("invalid param index: %d (%d)", index, (int)_params.size()).c_str(), DB_ERROR_INVALID_INDEX);
+    }
+
+    return _params[index];
+}
+
+void CDBStatementBase::check_field_index(int index) const
+{
+    if ((index < 0) || (index >= get_num_fields()))
+    {
+        THROW_DB_EXCEPTION(_sql.c_str(), utils::StringFormatter("invalid field index: %d (%d)", index, get_num_fields()).c_str(), DB_ERROR_INVALID_INDEX);
+    }
+}
+
 SYS_NAMESPACE_END
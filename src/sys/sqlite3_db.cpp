@@ -17,6 +17,10 @@
  * Author: JianYi, eyjian@qq.com or eyjian@gmail.com
  */
 #include "sys/sqlite3_db.h"
+#include "sys/datetime_utils.h"
+#include "sys/log.h"
+#include "sys/syscall_exception.h"
+#include "sys/utils.h"
 #include "utils/scoped_ptr.h"
 #include "utils/string_formatter.h"
 #include "utils/string_utils.h"
@@ -30,11 +34,326 @@ SYS_NAMESPACE_BEGIN
 // 将自己注释到CObjectFactdory中
 REGISTER_OBJECT_CREATOR("sqlite3_connection", CSQLite3Connection)
 
+// 基于sqlite3_step的流式游标
+class CSQLite3Cursor: public DBCursor
+{
+public:
+    CSQLite3Cursor(CSQLite3Connection* db_connection, sqlite3* sqlite, sqlite3_stmt* stmt)
+        : _db_connection(db_connection), _sqlite(sqlite), _stmt(stmt)
+    {
+        _row_view.resize(sqlite3_column_count(stmt));
+        _db_connection->_cursors.insert(this);
+    }
+
+    ~CSQLite3Cursor()
+    {
+        close();
+    }
+
+    virtual bool next()
+    {
+        if (NULL == _stmt)
+            return false;
+
+        const int ret = sqlite3_step(_stmt);
+        if (SQLITE_DONE == ret)
+        {
+            close();
+            return false;
+        }
+        if (ret != SQLITE_ROW)
+        {
+            throw CDBException(sqlite3_sql(_stmt),
+                    utils::StringFormatter("step error: %s", sqlite3_errmsg(_sqlite)).c_str(),
+                    ret, __FILE__, __LINE__);
+        }
+
+        for (int i=0; i<static_cast<int>(_row_view.size()); ++i)
+        {
+            DBFieldView& field_view = _row_view[i];
+            const int type = sqlite3_column_type(_stmt, i);
+
+            if (SQLITE_NULL == type)
+            {
+                field_view.data = NULL;
+                field_view.length = 0;
+            }
+            else
+            {
+                // 须先取值再取长度，空值时返回的指针可能为NULL
+                const void* data = (SQLITE_BLOB == type)? sqlite3_column_blob(_stmt, i): sqlite3_column_text(_stmt, i);
+                field_view.length = static_cast<size_t>(sqlite3_column_bytes(_stmt, i));
+                field_view.data = (NULL == data)? "": static_cast<const char*>(data);
+            }
+        }
+
+        return true;
+    }
+
+    virtual const DBRowView& row() const
+    {
+        return _row_view;
+    }
+
+    virtual int get_num_fields() const
+    {
+        return static_cast<int>(_row_view.size());
+    }
+
+    virtual std::string get_field_name(int index) const
+    {
+        const char* name = (NULL == _stmt)? NULL: sqlite3_column_name(_stmt, index);
+        return (NULL == name)? std::string(): std::string(name);
+    }
+
+    virtual void close() throw ()
+    {
+        if (_stmt != NULL)
+        {
+            sqlite3_finalize(_stmt);
+            _stmt = NULL;
+            _db_connection->_cursors.erase(this);
+        }
+    }
+
+private:
+    CSQLite3Connection* _db_connection;
+    sqlite3* _sqlite;
+    sqlite3_stmt* _stmt;
+    DBRowView _row_view;
+};
+
+// 基于sqlite3_prepare_v2的预处理语句
+class CSQLite3Statement: public CDBStatementBase
+{
+public:
+    CSQLite3Statement(sqlite3* sqlite, sqlite3_stmt* stmt, const std::string& sql)
+        : CDBStatementBase(sql, sqlite3_bind_parameter_count(stmt)),
+          _sqlite(sqlite), _stmt(stmt), _has_row(false), _row_pending(false), _insert_id(0)
+    {
+    }
+
+    ~CSQLite3Statement()
+    {
+        sqlite3_finalize(_stmt);
+    }
+
+    virtual bool fetch()
+    {
+        // execute时已取得第一行
+        if (_row_pending)
+        {
+            _row_pending = false;
+            return true;
+        }
+        if (!_has_row)
+            return false;
+
+        const int ret = sqlite3_step(_stmt);
+        if (SQLITE_ROW == ret)
+            return true;
+
+        _has_row = false;
+        if (ret != SQLITE_DONE)
+        {
+            throw CDBException(_sql.c_str(),
+                    utils::StringFormatter("step error: %s", sqlite3_errmsg(_sqlite)).c_str(),
+                    ret, __FILE__, __LINE__);
+        }
+        return false;
+    }
+
+    virtual int get_num_fields() const
+    {
+        return sqlite3_column_count(_stmt);
+    }
+
+    virtual bool is_null(int index) const
+    {
+        check_field_index(index);
+        return SQLITE_NULL == sqlite3_column_type(_stmt, index);
+    }
+
+    virtual int64_t get_int(int index) const
+    {
+        check_field_index(index);
+        return static_cast<int64_t>(sqlite3_column_int64(_stmt, index));
+    }
+
+    virtual double get_double(int index) const
+    {
+        check_field_index(index);
+        return sqlite3_column_double(_stmt, index);
+    }
+
+    virtual DBFieldView get_string(int index) const
+    {
+        DBFieldView field_view;
+        check_field_index(index);
+
+        const int type = sqlite3_column_type(_stmt, index);
+        if (type != SQLITE_NULL)
+        {
+            const void* data = (SQLITE_BLOB == type)? sqlite3_column_blob(_stmt, index): sqlite3_column_text(_stmt, index);
+            field_view.length = static_cast<size_t>(sqlite3_column_bytes(_stmt, index));
+            field_view.data = (NULL == data)? "": static_cast<const char*>(data);
+        }
+        return field_view;
+    }
+
+    virtual uint64_t get_insert_id() const
+    {
+        return _insert_id;
+    }
+
+private:
+    virtual uint64_t do_execute(const DBParams& params)
+    {
+        int ret = SQLITE_OK;
+
+        sqlite3_reset(_stmt);
+        _has_row = false;
+        _row_pending = false;
+        for (int i=0; (SQLITE_OK==ret) && (i<static_cast<int>(params.size())); ++i)
+        {
+            const DBParam& param = params[i];
+
+            // 参数的下标从1开始，参数在执行完之前不会变，因此字符串不需要拷贝
+            if (DB_PARAM_INT == param.type)
+                ret = sqlite3_bind_int64(_stmt, i+1, static_cast<sqlite3_int64>(param.int_value));
+            else if (DB_PARAM_DOUBLE == param.type)
+                ret = sqlite3_bind_double(_stmt, i+1, param.double_value);
+            else if (DB_PARAM_STRING == param.type)
+                ret = sqlite3_bind_text(_stmt, i+1, param.string_value.data(), static_cast<int>(param.string_value.size()), SQLITE_STATIC);
+            else if (DB_PARAM_BLOB == param.type)
+                ret = sqlite3_bind_blob(_stmt, i+1, param.string_value.data(), static_cast<int>(param.string_value.size()), SQLITE_STATIC);
+            else
+                ret = sqlite3_bind_null(_stmt, i+1);
+        }
+        if (SQLITE_OK == ret)
+            ret = sqlite3_step(_stmt);
+
+        if (SQLITE_ROW == ret)
+        {
+            _has_row = true;
+            _row_pending = true;
+            return 0;
+        }
+        if (ret != SQLITE_DONE)
+        {
+            const std::string errmsg = sqlite3_errmsg(_sqlite);
+            sqlite3_reset(_stmt);
+            throw CDBException(_sql.c_str(),
+                    utils::StringFormatter("sql[%s] error: %s", _sql.c_str(), errmsg.c_str()).c_str(),
+                    ret, __FILE__, __LINE__);
+        }
+
+        _insert_id = static_cast<uint64_t>(sqlite3_last_insert_rowid(_sqlite));
+        return static_cast<uint64_t>(sqlite3_changes(_sqlite));
+    }
+
+private:
+    sqlite3* _sqlite;
+    sqlite3_stmt* _stmt;
+    bool _has_row;     // 是否还可能有行
+    bool _row_pending; // execute取得的第一行还未被fetch
+    uint64_t _insert_id;
+};
+
+sqlite3_options_t::sqlite3_options_t()
+    : synchronous(-1), mmap_size(-1), cache_size_kb(-1), temp_store(-1),
+      wal_autocheckpoint(-1), busy_timeout_milliseconds(-1)
+{
+}
+
+sqlite3_options_t get_sqlite3_profile_options(sqlite3_profile_t profile)
+{
+    sqlite3_options_t options;
+
+    if (sqlite3_profile_durable == profile)
+    {
+        options.journal_mode = "WAL";
+        options.synchronous = 2;
+        options.busy_timeout_milliseconds = 5000;
+    }
+    else if ((sqlite3_profile_fast == profile) || (sqlite3_profile_bulk == profile))
+    {
+        // WAL模式下NORMAL只在checkpoint时同步，提交时只写WAL
+        options.journal_mode = "WAL";
+        options.synchronous = 1;
+        options.mmap_size = static_cast<int64_t>(256) * 1024 * 1024;
+        options.cache_size_kb = 64 * 1024;
+        options.temp_store = 2;
+        options.busy_timeout_milliseconds = 5000;
+        if (sqlite3_profile_bulk == profile)
+            options.wal_autocheckpoint = 0;
+    }
+
+    return options;
+}
+
 CSQLite3Connection::CSQLite3Connection(size_t sql_max)
     : CDBConnectionBase(sql_max), _sqlite(NULL)
 {
 }
 
+void CSQLite3Connection::set_options(const sqlite3_options_t& options)
+{
+    _options = options;
+    if (_sqlite != NULL)
+        apply_options();
+}
+
+bool CSQLite3Connection::checkpoint(int mode, int* wal_frames, int* checkpointed_frames)
+{
+    MOOON_ASSERT(_sqlite != NULL);
+    sqlite3* sqlite = static_cast<sqlite3*>(_sqlite);
+
+    const int ret = sqlite3_wal_checkpoint_v2(sqlite, NULL, mode, wal_frames, checkpointed_frames);
+    if (SQLITE_BUSY == ret)
+        return false;
+    if (ret != SQLITE_OK)
+        THROW_DB_EXCEPTION(NULL, utils::StringFormatter("checkpoint error: %s", sqlite3_errmsg(sqlite)).c_str(), ret);
+    return true;
+}
+
+void CSQLite3Connection::apply_options()
+{
+    sqlite3* sqlite = static_cast<sqlite3*>(_sqlite);
+    std::string pragmas;
+
+    if (_options.busy_timeout_milliseconds >= 0)
+        sqlite3_busy_timeout(sqlite, _options.busy_timeout_milliseconds);
+
+    // journal_mode须最先设置，之后的synchronous等和它相关
+    if (!_options.journal_mode.empty())
+        pragmas += utils::CStringUtils::format_string("PRAGMA journal_mode=%s;", _options.journal_mode.c_str());
+    if (_options.synchronous >= 0)
+        pragmas += utils::CStringUtils::format_string("PRAGMA synchronous=%d;", _options.synchronous);
+    if (_options.mmap_size >= 0)
+        pragmas += utils::CStringUtils::format_string("PRAGMA mmap_size=%" PRId64";", _options.mmap_size);
+    if (_options.cache_size_kb >= 0)
+        pragmas += utils::CStringUtils::format_string("PRAGMA cache_size=-%d;", _options.cache_size_kb); // 负值表示KB数
+    if (_options.temp_store >= 0)
+        pragmas += utils::CStringUtils::format_string("PRAGMA temp_store=%d;", _options.temp_store);
+    if (_options.wal_autocheckpoint >= 0)
+        pragmas += utils::CStringUtils::format_string("PRAGMA wal_autocheckpoint=%d;", _options.wal_autocheckpoint);
+
+    if (!pragmas.empty())
+    {
+        char *errmsg = NULL;
+        const int ret = sqlite3_exec(sqlite, pragmas.c_str(), 0, 0, &errmsg);
+        if (ret != SQLITE_OK)
+        {
+            std::string errmsg_ = (NULL == errmsg)? "": errmsg;
+            sqlite3_free(errmsg);
+
+            throw CDBException(pragmas.c_str(), utils::StringFormatter("sql[%s] error: %s", pragmas.c_str(), errmsg_.c_str()).c_str(),
+                    ret, __FILE__, __LINE__);
+        }
+    }
+}
+
 CSQLite3Connection::~CSQLite3Connection()
 {
     close(); // 不要在父类的析构中调用虚拟函数
@@ -56,12 +375,26 @@ void CSQLite3Connection::open()
 
         if (sqlite3_open(_db_name.c_str(), &sqlite) != SQLITE_OK)
         {
-            throw CDBException(NULL,
+            // 失败时也会分配句柄，须关闭
+            const CDBException db_error(NULL,
                                sqlite3_errmsg(sqlite), sqlite3_errcode(sqlite),
                                __FILE__, __LINE__);
+            sqlite3_close(sqlite);
+            throw db_error;
         }
 
         _sqlite = sqlite;
+        try
+        {
+            apply_options();
+        }
+        catch (CDBException&)
+        {
+            sqlite3_close(sqlite);
+            _sqlite = NULL;
+            throw;
+        }
+        _is_established = true;
     }
 }
 
@@ -73,7 +406,11 @@ void CSQLite3Connection::close() throw ()
     {
         sqlite3* sqlite = static_cast<sqlite3*>(_sqlite);
 
-        sqlite3_close(sqlite);
+        // 存在未释放的预处理语句或游标时，sqlite3_close会失败
+        close_cursors();
+        clear_statements();
+        if (sqlite3_close(sqlite) != SQLITE_OK)
+            MYLOG_ERROR("close %s error: %s\n", _id.c_str(), sqlite3_errmsg(sqlite));
         _sqlite = NULL;
     }
 }
@@ -184,5 +521,270 @@ void CSQLite3Connection::do_query(DBTable& db_table, const char* sql, int sql_le
     }
 }
 
+DBCursor* CSQLite3Connection::do_open_cursor(const char* sql, int sql_length)
+{
+    MOOON_ASSERT(_sqlite != NULL);
+
+    sqlite3* sqlite = static_cast<sqlite3*>(_sqlite);
+    sqlite3_stmt* stmt = NULL;
+
+    const int ret = sqlite3_prepare_v2(sqlite, sql, sql_length, &stmt, NULL);
+    if (ret != SQLITE_OK)
+    {
+        throw CDBException(sql,
+                utils::StringFormatter("sql[%s] error: %s", sql, sqlite3_errmsg(sqlite)).c_str(),
+                ret, __FILE__, __LINE__);
+    }
+
+    return new CSQLite3Cursor(this, sqlite, stmt);
+}
+
+void CSQLite3Connection::close_cursors()
+{
+    // 游标的close会将自己从_cursors中删除
+    while (!_cursors.empty())
+        (*_cursors.begin())->close();
+}
+
+DBStatement* CSQLite3Connection::do_prepare(const std::string& sql)
+{
+    MOOON_ASSERT(_sqlite != NULL);
+
+    sqlite3* sqlite = static_cast<sqlite3*>(_sqlite);
+    sqlite3_stmt* stmt = NULL;
+
+    const int ret = sqlite3_prepare_v2(sqlite, sql.c_str(), static_cast<int>(sql.size()), &stmt, NULL);
+    if (ret != SQLITE_OK)
+    {
+        throw CDBException(sql.c_str(),
+                utils::StringFormatter("sql[%s] error: %s", sql.c_str(), sqlite3_errmsg(sqlite)).c_str(),
+                ret, __FILE__, __LINE__);
+    }
+
+    return new CSQLite3Statement(sqlite, stmt, sql);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+CSQLite3BulkWriter::CSQLite3BulkWriter(CSQLite3Connection* db_connection, const std::string& sql, uint32_t batch_rows, uint32_t batch_milliseconds)
+    : _db_connection(db_connection), _sql(sql),
+      _batch_rows(batch_rows), _batch_milliseconds(batch_milliseconds),
+      _pending_rows(0), _begin_milliseconds(0)
+{
+    (void)statement(); // 尽早发现SQL的错误
+}
+
+CSQLite3BulkWriter::~CSQLite3BulkWriter()
+{
+    try
+    {
+        flush();
+    }
+    catch (CDBException& db_error)
+    {
+        // 硬错误时flush()已回滚，SQLITE_BUSY时事务仍在，回滚以免连接停留在事务中
+        MYLOG_ERROR("%s flush error: %s\n", _db_connection->str().c_str(), db_error.str().c_str());
+        if (_pending_rows > 0)
+            rollback();
+    }
+}
+
+void CSQLite3BulkWriter::add()
+{
+    if (0 == _pending_rows)
+    {
+        _db_connection->update("BEGIN");
+        _begin_milliseconds = CDatetimeUtils::get_current_milliseconds();
+    }
+
+    try
+    {
+        statement()->execute();
+    }
+    catch (CDBException&)
+    {
+        // 回滚出错不能掩盖原来的异常
+        rollback();
+        throw;
+    }
+
+    ++_pending_rows;
+    ++_metrics.rows;
+    if (_pending_rows >= _batch_rows)
+        flush();
+    else
+        flush_if_due();
+}
+
+void CSQLite3BulkWriter::flush_if_due()
+{
+    if ((_pending_rows > 0) && (CDatetimeUtils::get_current_milliseconds() >= _begin_milliseconds+_batch_milliseconds))
+        flush();
+}
+
+void CSQLite3BulkWriter::flush()
+{
+    if (_pending_rows > 0)
+    {
+        const uint64_t begin_microseconds = CDatetimeUtils::get_current_microseconds();
+
+        for (int retries=0;; ++retries)
+        {
+            try
+            {
+                _db_connection->update("COMMIT");
+                break;
+            }
+            catch (CDBException& db_error)
+            {
+                // SQLITE_BUSY时事务仍未结束，可重试COMMIT，已写入的行不丢失
+                if (SQLITE_BUSY == (db_error.errcode() & 0xff))
+                {
+                    if (retries < 3)
+                    {
+                        ++_metrics.busy_retries;
+                        CUtils::millisleep(10);
+                        continue;
+                    }
+                    throw;
+                }
+
+                // 其它错误时回滚使下一次add()重新BEGIN，
+                // 否则后续的行不在事务中执行，而之后的COMMIT报“no transaction is active”
+                rollback();
+                throw;
+            }
+        }
+
+        _pending_rows = 0;
+        const uint64_t commit_microseconds = CDatetimeUtils::get_current_microseconds() - begin_microseconds;
+        ++_metrics.commits;
+        if (commit_microseconds > _metrics.max_commit_microseconds)
+            _metrics.max_commit_microseconds = static_cast<uint32_t>(commit_microseconds);
+    }
+}
+
+void CSQLite3BulkWriter::rollback()
+{
+    _pending_rows = 0;
+    try
+    {
+        _db_connection->update("ROLLBACK");
+    }
+    catch (CDBException& db_error)
+    {
+        // SQLite已自动回滚时，ROLLBACK报没有活动的事务
+        MYLOG_DEBUG("%s rollback error: %s\n", _db_connection->str().c_str(), db_error.str().c_str());
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+CSQLite3Checkpointer::CSQLite3Checkpointer()
+    : _interval_milliseconds(1000), _truncate_frames(0),
+      _checkpoint_count(0), _checkpointed_frames(0),
+      _last_wal_frames(0), _last_checkpointed_frames(0), _stop(false)
+{
+}
+
+CSQLite3Checkpointer::~CSQLite3Checkpointer()
+{
+    stop();
+}
+
+void CSQLite3Checkpointer::start(const std::string& db_name, uint32_t interval_milliseconds, int truncate_frames)
+{
+    // 否则给仍可joinable的_thread赋值会调用std::terminate
+    if (_thread.joinable())
+        THROW_SYSCALL_EXCEPTION("checkpointer already started", EALREADY, "start");
+
+    sqlite3_options_t options;
+    options.journal_mode = "WAL"; // 新连接在读DB文件之前不知道是WAL模式，checkpoint会直接返回
+    options.busy_timeout_milliseconds = 0; // PASSIVE不等锁
+    options.wal_autocheckpoint = 0;
+
+    _interval_milliseconds = interval_milliseconds;
+    _truncate_frames = truncate_frames;
+    _db_connection.set_db_name(db_name);
+    _db_connection.set_options(options);
+    _db_connection.open();
+
+    _stop = false;
+    try
+    {
+        _thread = std::thread(&CSQLite3Checkpointer::run, this);
+    }
+    catch (std::system_error& ex)
+    {
+        _db_connection.close();
+        THROW_SYSCALL_EXCEPTION(ex.what(), ex.code().value(), "std::thread");
+    }
+}
+
+void CSQLite3Checkpointer::stop()
+{
+    if (_thread.joinable())
+    {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _stop = true;
+            _cond.notify_one();
+        }
+        _thread.join();
+    }
+
+    _db_connection.close();
+}
+
+void CSQLite3Checkpointer::run()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    for (;;)
+    {
+        _cond.wait_for(lock, std::chrono::milliseconds(_interval_milliseconds), [this] { return _stop; });
+
+        lock.unlock();
+        do_checkpoint();
+        lock.lock();
+
+        if (_stop)
+            break;
+    }
+}
+
+void CSQLite3Checkpointer::do_checkpoint()
+{
+    try
+    {
+        int wal_frames = 0;
+        int checkpointed_frames = 0;
+
+        (void)_db_connection.checkpoint(SQLITE_CHECKPOINT_PASSIVE, &wal_frames, &checkpointed_frames);
+        ++_checkpoint_count;
+
+        // 返回的是当前WAL中累计已写回的页数，只累加本次新增的部分，
+        // WAL从头复用后重新计数，这时变小，本次写回的即为全部
+        if ((wal_frames < _last_wal_frames) || (checkpointed_frames < _last_checkpointed_frames))
+            _last_checkpointed_frames = 0;
+        if (checkpointed_frames > _last_checkpointed_frames)
+            _checkpointed_frames += static_cast<uint64_t>(checkpointed_frames - _last_checkpointed_frames);
+        _last_wal_frames = wal_frames;
+        _last_checkpointed_frames = checkpointed_frames;
+
+        // 全部写回后WAL才能从头复用，TRUNCATE在有读写时返回SQLITE_BUSY，下次再试
+        if ((_truncate_frames > 0) && (wal_frames >= _truncate_frames) && (checkpointed_frames == wal_frames))
+        {
+            if (_db_connection.checkpoint(SQLITE_CHECKPOINT_TRUNCATE))
+            {
+                _last_wal_frames = 0;
+                _last_checkpointed_frames = 0;
+            }
+        }
+    }
+    catch (CDBException& db_error)
+    {
+        MYLOG_ERROR("%s checkpoint error: %s\n", _db_connection.str().c_str(), db_error.str().c_str());
+    }
+}
+
 SYS_NAMESPACE_END
 #endif // MOOON_HAVE_SQLITE3
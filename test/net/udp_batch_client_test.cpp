@@ -0,0 +1,109 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+// 批量发送压测客户端，与udp_batch_server_test配对使用
+//
+// 用法：udp_batch_client_test ip port [count] [size] [batch] [gso]
+// count 发送的消息总数，默认为1000000
+// size 单个消息字节数，默认为64
+// batch 一次sendmmsg的消息个数，为1时退化为send_to，默认为64
+// gso 为1时开启UDP_SEGMENT，将一个批次合并成一个大消息交由内核分段，要求size*batch不超过SIZE_64K，默认为0
+#include "mooon/net/udp_socket.h"
+#include "mooon/sys/stop_watch.h"
+MOOON_NAMESPACE_USE
+
+int main(int argc, char* argv[])
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "Usage: udp_batch_client_test ip port [count] [size] [batch] [gso]\n");
+        exit(1);
+    }
+
+    const char* ip = argv[1];
+    const uint16_t port = static_cast<uint16_t>(atoi(argv[2]));
+    const uint64_t count = (argc > 3)? strtoull(argv[3], NULL, 10): 1000000;
+    const size_t size = (argc > 4)? static_cast<size_t>(atoi(argv[4])): 64;
+    const int batch_size = (argc > 5)? atoi(argv[5]): 64;
+    const bool gso = (argc > 6) && (atoi(argv[6]) == 1);
+
+    if ((0 == size) || (size > 1472) || (batch_size < 1))
+    {
+        fprintf(stderr, "Invalid size or batch\n");
+        exit(1);
+    }
+    if (gso && (size * batch_size > SIZE_64K - 8 - 20))
+    {
+        fprintf(stderr, "size*batch is too large for gso\n");
+        exit(1);
+    }
+
+    try
+    {
+        uint64_t sent = 0;
+        net::CUdpSocket udp_socket;
+        std::string message(size, 'x');
+        sys::CStopWatch stop_watch;
+
+        if (gso)
+        {
+            // 一个大消息经内核分段成batch_size个数据报
+            std::string large_message(size * batch_size, 'x');
+            udp_socket.set_gso_segment(static_cast<uint16_t>(size));
+            while (sent < count)
+            {
+                if (udp_socket.send_to(large_message.data(), large_message.size(), ip, port) > 0)
+                    sent += batch_size;
+            }
+        }
+        else if (batch_size > 1)
+        {
+            net::CUdpMessageBatch batch(batch_size, size);
+            const uint32_t to_ip = inet_addr(ip);
+
+            for (int i=0; i<batch_size; ++i)
+                batch.add(message.data(), message.size(), to_ip, port);
+            while (sent < count)
+            {
+                const int n = udp_socket.send_batch(&batch);
+                if (n > 0)
+                    sent += n;
+            }
+        }
+        else
+        {
+            while (sent < count)
+            {
+                if (udp_socket.send_to(message.data(), message.size(), ip, port) > 0)
+                    ++sent;
+            }
+        }
+
+        const uint64_t elapsed_microseconds = stop_watch.get_elapsed_microseconds();
+        printf("sent %" PRIu64 " messages in %" PRIu64 "us, %" PRIu64 " messages/s\n",
+               sent, elapsed_microseconds,
+               (elapsed_microseconds > 0)? sent * 1000000 / elapsed_microseconds: sent);
+    }
+    catch (sys::CSyscallException& syscall_ex)
+    {
+        fprintf(stderr, "%s\n", syscall_ex.str().c_str());
+        exit(1);
+    }
+
+    return 0;
+}
@@ -0,0 +1,125 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+// 批量接收压测服务端，与udp_batch_client_test配对使用，
+// 对比udp_server_test的单个receive_from，用来观察recvmmsg和SO_REUSEPORT分片带来的提升
+//
+// 用法：udp_batch_server_test [port] [threads] [batch] [gro]
+// port 监听端口，默认为2015
+// threads 读线程数，每个线程独占一个以SO_REUSEPORT方式监听同一端口的CUdpSocket，默认为1
+// batch 一次recvmmsg的最大消息个数，为1时退化为receive_from，默认为64
+// gro 为1时开启UDP_GRO，默认为0
+#include "mooon/net/udp_socket.h"
+#include "mooon/sys/stop_watch.h"
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+MOOON_NAMESPACE_USE
+
+static std::atomic<uint64_t> sg_messages(0);
+static std::atomic<uint64_t> sg_bytes(0);
+
+static void receive_thread(uint16_t port, int batch_size, bool gro)
+{
+    try
+    {
+        net::CUdpSocket udp_socket;
+        udp_socket.listen(port, false, true);
+        if (gro)
+            udp_socket.set_gro(true);
+
+        if (batch_size > 1)
+        {
+            net::CUdpMessageBatch batch(batch_size, gro? SIZE_64K: 1472);
+
+            while (true)
+            {
+                const int n = udp_socket.receive_batch(&batch);
+                for (int i=0; i<n; ++i)
+                {
+                    const size_t length = batch.get_length(i);
+                    const uint16_t segment_size = batch.get_segment_size(i);
+
+                    sg_bytes += length;
+                    if (segment_size > 0)
+                        sg_messages += (length + segment_size - 1) / segment_size;
+                    else
+                        ++sg_messages;
+                }
+            }
+        }
+        else
+        {
+            char buffer[1472];
+            struct sockaddr_in from_addr;
+
+            while (true)
+            {
+                const int bytes = udp_socket.receive_from(buffer, sizeof(buffer), &from_addr);
+                if (bytes > 0)
+                {
+                    sg_bytes += bytes;
+                    ++sg_messages;
+                }
+            }
+        }
+    }
+    catch (sys::CSyscallException& syscall_ex)
+    {
+        fprintf(stderr, "%s\n", syscall_ex.str().c_str());
+        exit(1);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    const uint16_t port = (argc > 1)? static_cast<uint16_t>(atoi(argv[1])): 2015;
+    const int threads = (argc > 2)? atoi(argv[2]): 1;
+    const int batch_size = (argc > 3)? atoi(argv[3]): 64;
+    const bool gro = (argc > 4) && (atoi(argv[4]) == 1);
+    std::vector<std::shared_ptr<std::thread>> receive_threads;
+
+    if ((threads < 1) || (batch_size < 1))
+    {
+        fprintf(stderr, "Usage: udp_batch_server_test [port] [threads] [batch] [gro]\n");
+        exit(1);
+    }
+
+    printf("udp listen on: %d, threads: %d, batch: %d, gro: %d\n", port, threads, batch_size, gro? 1: 0);
+    for (int i=0; i<threads; ++i)
+        receive_threads.push_back(std::make_shared<std::thread>(receive_thread, port, batch_size, gro));
+
+    sys::CStopWatch stop_watch;
+    while (true)
+    {
+        sleep(1);
+
+        const uint64_t elapsed_microseconds = stop_watch.get_elapsed_microseconds();
+        const uint64_t messages = sg_messages.exchange(0);
+        const uint64_t bytes = sg_bytes.exchange(0);
+        if (elapsed_microseconds > 0)
+        {
+            printf("%" PRIu64 " messages/s, %.2f MB/s\n",
+                   messages * 1000000 / elapsed_microseconds,
+                   static_cast<double>(bytes) / elapsed_microseconds);
+        }
+    }
+
+    return 0;
+}
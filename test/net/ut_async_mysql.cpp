@@ -0,0 +1,178 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+// 测试异步MySQL客户端放弃超时的查询：
+// 一个假的MySQL服务端完成握手后不再读取，客户端发送一个大查询时停在发送中途，
+// 查询超时后应立即回调ASYNC_MYSQL_ERROR_TIMEOUT，关闭连接不能阻塞
+#include <mooon/net/async_mysql.h>
+#include <mooon/sys/stop_watch.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+MOOON_NAMESPACE_USE
+
+#if MOOON_HAVE_MYSQL==1
+static std::atomic<bool> sg_stop(false);
+
+static void check(bool ok, const char* step)
+{
+    if (!ok)
+    {
+        fprintf(stderr, "FAILURE: %s\n", step);
+        exit(1);
+    }
+}
+
+static void on_alarm(int signo)
+{
+    const char message[] = "FAILURE: blocked\n";
+    (void)write(STDERR_FILENO, message, sizeof(message)-1);
+    _exit(1);
+}
+
+static bool read_full(int fd, void* buf, size_t size)
+{
+    for (size_t n=0; n<size;)
+    {
+        const ssize_t bytes = read(fd, static_cast<char*>(buf)+n, size-n);
+        if (bytes <= 0)
+            return false;
+        n += static_cast<size_t>(bytes);
+    }
+    return true;
+}
+
+// 发送一个MySQL协议包，包头为3字节长度和1字节序号
+static void send_packet(int fd, uint8_t sequence, const std::string& payload)
+{
+    std::string packet(4, '\0');
+    packet[0] = static_cast<char>(payload.size() & 0xff);
+    packet[1] = static_cast<char>((payload.size() >> 8) & 0xff);
+    packet[2] = static_cast<char>((payload.size() >> 16) & 0xff);
+    packet[3] = static_cast<char>(sequence);
+    packet += payload;
+    check(write(fd, packet.data(), packet.size()) == static_cast<ssize_t>(packet.size()), "send packet");
+}
+
+// 完成握手（不校验密码）后不再读取，直到测试结束
+static void fake_mysql_server(int listen_fd)
+{
+    const int fd = accept(listen_fd, NULL, NULL);
+    check(fd != -1, "accept");
+
+    // Handshake V10：CLIENT_LONG_PASSWORD|CLIENT_PROTOCOL_41|CLIENT_SECURE_CONNECTION
+    std::string handshake;
+    handshake += '\x0a';
+    handshake.append("5.7.0-fake", sizeof("5.7.0-fake"));
+    handshake.append("\x01\x00\x00\x00", 4);         // connection id
+    handshake.append("abcdefgh", 8);                 // auth-plugin-data-part-1
+    handshake += '\0';
+    handshake.append("\x01\x82", 2);                 // capability flags (lower)
+    handshake += '\x21';                             // utf8_general_ci
+    handshake.append("\x02\x00", 2);                 // status flags
+    handshake.append("\x00\x00", 2);                 // capability flags (upper)
+    handshake += '\0';
+    handshake.append(10, '\0');
+    handshake.append("ijklmnopqrst", 13);            // auth-plugin-data-part-2
+    send_packet(fd, 0, handshake);
+
+    char header[4];
+    check(read_full(fd, header, sizeof(header)), "read handshake response header");
+    const size_t length = static_cast<uint8_t>(header[0]) | (static_cast<uint8_t>(header[1]) << 8) | (static_cast<uint8_t>(header[2]) << 16);
+    std::string response(length, '\0');
+    check(read_full(fd, &response[0], length), "read handshake response");
+    send_packet(fd, static_cast<uint8_t>(header[3])+1, std::string("\x00\x00\x00\x02\x00\x00\x00", 7)); // OK
+
+    while (!sg_stop)
+        usleep(10000);
+    close(fd);
+}
+
+int main()
+{
+    // 服务端的接收缓冲区很小，大查询很快写满
+    const int rcvbuf = 4096;
+    const int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    check(0 == setsockopt(listen_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)), "SO_RCVBUF");
+    check(0 == bind(listen_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)), "bind");
+    check(0 == listen(listen_fd, 10), "listen");
+    check(0 == getsockname(listen_fd, reinterpret_cast<struct sockaddr*>(&addr), &addrlen), "getsockname");
+
+    net::CAsyncMySQLClient client;
+    client.set_host("127.0.0.1", ntohs(addr.sin_port));
+    client.set_user("root", "");
+    try
+    {
+        client.create(1);
+    }
+    catch (sys::CDBException& ex)
+    {
+        fprintf(stdout, "SKIPPED: %s\n", ex.str().c_str());
+        close(listen_fd);
+        return 0;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGALRM, on_alarm);
+    alarm(10);
+
+    std::thread server_thread(fake_mysql_server, listen_fd);
+    for (int i=0; (i<100)&&(0==client.get_established_count()); ++i)
+        client.run_once(100);
+    check(1 == client.get_established_count(), "established");
+
+    int errcode = -1;
+    sys::CStopWatch stop_watch;
+    const std::string sql = std::string("SELECT '") + std::string(8*1024*1024, 'x') + "'";
+    client.async_query([&errcode](net::AsyncMySQLResult& result) { errcode = result.errcode; }, 300, sql);
+    while (client.get_query_count() > 0)
+        client.run_once(100);
+
+    const unsigned int elapsed_milliseconds = stop_watch.get_elapsed_microseconds() / 1000;
+    fprintf(stdout, "errcode: %d, elapsed: %ums\n", errcode, elapsed_milliseconds);
+    check(net::ASYNC_MYSQL_ERROR_TIMEOUT == errcode, "timeout errcode");
+    check(elapsed_milliseconds < 2000, "abort not blocked");
+
+    client.destroy();
+    sg_stop = true;
+    server_thread.join();
+    close(listen_fd);
+    fprintf(stdout, "SUCCESS\n");
+    return 0;
+}
+
+#else
+int main()
+{
+    fprintf(stdout, "SKIPPED: without MySQL\n");
+    return 0;
+}
+#endif // MOOON_HAVE_MYSQL
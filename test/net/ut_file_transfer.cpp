@@ -0,0 +1,169 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+// 在同一个CFileTransferEngine中，经本机TCP连接限速发送一个文件并同时接收到另一个文件，
+// 然后比较两个文件的内容，最后测试接收中对端以RST断开时接收失败
+//
+// 用法：ut_file_transfer [size] [rate_limit]
+// size 文件字节数，默认为20M
+// rate_limit 发送限速（字节/秒），为0表示不限速，默认为40M
+#include "mooon/net/file_transfer.h"
+#include "mooon/net/listener.h"
+#include "mooon/sys/stop_watch.h"
+#include <sys/stat.h>
+MOOON_NAMESPACE_USE
+
+class CObserver: public net::IFileTransferObserver
+{
+public:
+    CObserver(): _progress_number(0), _errcode(-1) {}
+    int get_errcode() const { return _errcode; }
+
+private:
+    virtual void on_progress(net::CFileTransfer* transfer)
+    {
+        ++_progress_number;
+    }
+
+    virtual void on_finish(net::CFileTransfer* transfer, int errcode)
+    {
+        fprintf(stdout, "[%s] errcode: %d, transferred: %" PRIu64 ", progress: %d\n",
+                (net::file_transfer_send == transfer->get_direction())? "send": "receive",
+                errcode, transfer->get_transferred(), _progress_number);
+        _errcode = errcode;
+    }
+
+private:
+    int _progress_number;
+    int _errcode;
+};
+
+// 建立一个本机连接，返回客户端句柄，服务端句柄由server_fd返回
+static int connect_local(net::CListener* listener, int* server_fd)
+{
+    uint16_t peer_port;
+    net::ip_address_t peer_ip;
+
+    int client_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in server_addr;
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(5175);
+    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    memset(server_addr.sin_zero, 0, sizeof(server_addr.sin_zero));
+    if (-1 == connect(client_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)))
+        THROW_SYSCALL_EXCEPTION(NULL, errno, "connect");
+    *server_fd = listener->accept(peer_ip, peer_port);
+    return client_fd;
+}
+
+// 发送一部分后以RST断开，接收应以错误结束，而不是抛出异常或一直等待
+static bool test_peer_reset(net::CListener* listener, int dst_fd)
+{
+    int server_fd = -1;
+    int client_fd = connect_local(listener, &server_fd);
+
+    CObserver receive_observer;
+    net::CFileTransfer receive_transfer(net::file_transfer_receive, client_fd, dst_fd, 0, SIZE_1M);
+    receive_transfer.set_observer(&receive_observer);
+
+    net::CFileTransferEngine engine;
+    engine.create(16);
+    engine.add(&receive_transfer);
+
+    const std::string data(SIZE_4K, 'x');
+    struct linger linger;
+    linger.l_onoff = 1;
+    linger.l_linger = 0;
+    if (write(server_fd, data.data(), data.size()) != static_cast<ssize_t>(data.size()))
+        THROW_SYSCALL_EXCEPTION(NULL, errno, "write");
+    engine.run_once(100);
+    if (-1 == setsockopt(server_fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger)))
+        THROW_SYSCALL_EXCEPTION(NULL, errno, "setsockopt");
+    close(server_fd);
+
+    for (int i=0; (i<10)&&(engine.get_transfer_count()>0); ++i)
+        engine.run_once(1000);
+    close(client_fd);
+
+    const bool ok = (0 == engine.get_transfer_count()) && (receive_observer.get_errcode() > 0);
+    fprintf(stdout, "peer reset: %s\n", ok? "OK": "FAILED");
+    return ok;
+}
+
+int main(int argc, char* argv[])
+{
+    const uint64_t size = (argc > 1)? static_cast<uint64_t>(strtoull(argv[1], NULL, 10)): static_cast<uint64_t>(SIZE_20M);
+    const uint64_t rate_limit = (argc > 2)? static_cast<uint64_t>(strtoull(argv[2], NULL, 10)): static_cast<uint64_t>(2 * SIZE_20M);
+    const char* src_filepath = "/tmp/ut_file_transfer.src";
+    const char* dst_filepath = "/tmp/ut_file_transfer.dst";
+
+    try
+    {
+        std::string data(size, '\0');
+        for (uint64_t i=0; i<size; ++i)
+            data[i] = static_cast<char>(i*7 + i/1000);
+
+        int src_fd = open(src_filepath, O_RDWR|O_CREAT|O_TRUNC, 0644);
+        int dst_fd = open(dst_filepath, O_RDWR|O_CREAT|O_TRUNC, 0644);
+        if ((-1 == src_fd) || (-1 == dst_fd))
+            THROW_SYSCALL_EXCEPTION(NULL, errno, "open");
+        if (pwrite(src_fd, data.data(), data.size(), 0) != static_cast<ssize_t>(data.size()))
+            THROW_SYSCALL_EXCEPTION(NULL, errno, "pwrite");
+
+        // 建立一个本机连接
+        int server_fd = -1;
+        net::CListener listener;
+        listener.listen(net::ip_address_t("127.0.0.1"), 5175, false);
+        int client_fd = connect_local(&listener, &server_fd);
+
+        CObserver send_observer, receive_observer;
+        net::CFileTransfer send_transfer(net::file_transfer_send, server_fd, src_fd, 0, size, rate_limit);
+        net::CFileTransfer receive_transfer(net::file_transfer_receive, client_fd, dst_fd, 0, size);
+        send_transfer.set_observer(&send_observer);
+        receive_transfer.set_observer(&receive_observer);
+
+        sys::CStopWatch stop_watch;
+        net::CFileTransferEngine engine;
+        engine.create(16);
+        engine.add(&send_transfer);
+        engine.add(&receive_transfer);
+        while (engine.get_transfer_count() > 0)
+            engine.run_once(1000);
+
+        const uint64_t elapsed_microseconds = stop_watch.get_elapsed_microseconds();
+        std::string received(size, '\0');
+        if (pread(dst_fd, &received[0], size, 0) != static_cast<ssize_t>(size))
+            THROW_SYSCALL_EXCEPTION(NULL, errno, "pread");
+
+        fprintf(stdout, "elapsed: %" PRIu64 "us, %s\n", elapsed_microseconds, (received == data)? "OK": "MISMATCH");
+        close(client_fd);
+        close(server_fd);
+
+        const bool reset_ok = test_peer_reset(&listener, dst_fd);
+        close(src_fd);
+        close(dst_fd);
+        unlink(src_filepath);
+        unlink(dst_filepath);
+        return ((received == data) && reset_ok)? 0: 1;
+    }
+    catch (sys::CSyscallException& ex)
+    {
+        fprintf(stderr, "exception %s at %s:%d.\n", ex.str().c_str(), ex.file(), ex.line());
+        exit(1);
+    }
+}
@@ -0,0 +1,149 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+// 测试分区并行消费者：
+// 1) CKafkaOffsetTracker只提交连续完成的offset
+// 2) 未完成的消息数达到上限时暂停分区而非阻塞拉取，处理慢且抛出非std::exception异常时所有消息仍被处理完
+// 用法：ut_kafka_parallel_consumer [brokers] [topic]，不指定brokers时只测试1)
+#include <mooon/net/kafka_parallel_consumer.h>
+#include <mooon/net/kafka_producer.h>
+#include <mooon/utils/string_utils.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+MOOON_NAMESPACE_USE
+
+#if MOOON_HAVE_LIBRDKAFKA==1
+static void check(bool ok, const char* step)
+{
+    if (!ok)
+    {
+        fprintf(stderr, "FAILURE: %s\n", step);
+        exit(1);
+    }
+}
+
+static void test_offset_tracker()
+{
+    net::CKafkaOffsetTracker tracker;
+    std::map<int32_t, int64_t> offsets;
+
+    for (int64_t offset=10; offset<15; ++offset)
+        tracker.dispatch(0, offset);
+    tracker.dispatch(1, 100);
+    check(tracker.get_inflight_count() == 6, "inflight count");
+
+    // 分区0的10未完成，水位停在10
+    tracker.complete(0, 11);
+    tracker.complete(0, 12);
+    tracker.get_commit_offsets(&offsets, false);
+    check((offsets[0] == 10) && (offsets[1] == 100), "watermark with gap");
+
+    // 10完成后水位推进到13
+    tracker.complete(0, 10);
+    offsets.clear();
+    tracker.get_commit_offsets(&offsets, false);
+    check(offsets[0] == 13, "watermark after gap filled");
+
+    // 已提交且未变化的分区不再取出
+    tracker.mark_committed(offsets);
+    tracker.complete(1, 100);
+    offsets.clear();
+    tracker.get_commit_offsets(&offsets, true);
+    check((offsets.size() == 1) && (offsets[1] == 101), "only changed");
+}
+
+// 处理慢，且每隔若干条抛出一个非std::exception异常
+class CSlowHandler: public net::IKafkaMessageHandler
+{
+public:
+    CSlowHandler(const std::string& prefix): _prefix(prefix), _handled(0) {}
+    int get_handled() const { return _handled; }
+
+private:
+    virtual void handle(int worker_index, const net::KafkaMessageView& message)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        if ((message.len < _prefix.size()) || (0 != memcmp(message.payload, _prefix.data(), _prefix.size())))
+            return;
+        if (++_handled % 10 == 0)
+            throw 2020;
+    }
+
+private:
+    const std::string _prefix;
+    std::atomic<int> _handled;
+};
+
+static void test_parallel_consumer(const std::string& brokers, const std::string& topic)
+{
+    const int num_messages = 500;
+    const int max_inflight = 20;
+    const std::string prefix = utils::CStringUtils::format_string("ut_kafka_parallel_consumer_%d_%u_", (int)getpid(), (unsigned int)time(NULL));
+    const std::string group = prefix + "group";
+    net::CKafkaProducer producer;
+    std::string errmsg;
+
+    check(producer.init(brokers, topic, &errmsg), "init producer");
+    for (int i=0; i<num_messages; ++i)
+        check(producer.produce("", prefix + utils::CStringUtils::int_tostring(i)), "produce");
+    producer.flush(10000);
+
+    CSlowHandler handler(prefix);
+    net::CKafkaParallelConsumer consumer(&handler);
+    consumer.set_auto_offset_reset("earliest");
+    check(consumer.init(brokers, topic, group, 4, 10, 100, max_inflight), "init consumer");
+    check(consumer.start(), "start consumer");
+
+    size_t max_inflight_count = 0;
+    for (int i=0; (i<600)&&(handler.get_handled()<num_messages); ++i)
+    {
+        const size_t inflight_count = consumer.get_inflight_count();
+        if (inflight_count > max_inflight_count)
+            max_inflight_count = inflight_count;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    consumer.stop();
+    consumer.wait();
+
+    fprintf(stdout, "handled:%d, max inflight:%d\n", handler.get_handled(), (int)max_inflight_count);
+    check(handler.get_handled() == num_messages, "all messages handled");
+    check(consumer.get_inflight_count() == 0, "drained");
+    check(consumer.get_commit_number() > 0, "committed");
+}
+
+int main(int argc, char* argv[])
+{
+    test_offset_tracker();
+    if (argc > 1)
+        test_parallel_consumer(argv[1], (argc > 2)? argv[2]: "mooon_ut");
+    fprintf(stdout, "SUCCESS\n");
+    return 0;
+}
+
+#else
+int main()
+{
+    fprintf(stdout, "SKIPPED: without librdkafka\n");
+    return 0;
+}
+#endif // MOOON_HAVE_LIBRDKAFKA
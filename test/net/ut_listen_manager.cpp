@@ -0,0 +1,87 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+// 测试监听管理者：
+// 1) create_reuseport在同一地址上创建多个监听者
+// 2) 未destroy时再次create被拒绝，已有的监听者不受影响
+// 3) destroy后恢复初始状态，可再次create
+#include "mooon/net/listen_manager.h"
+#include "mooon/net/listener.h"
+#include <stdio.h>
+#include <stdlib.h>
+MOOON_NAMESPACE_USE
+
+static void check(bool ok, const char* step)
+{
+    if (!ok)
+    {
+        fprintf(stderr, "FAILURE: %s\n", step);
+        exit(1);
+    }
+}
+
+template <class Function>
+static void check_already_created(Function create, const char* step)
+{
+    try
+    {
+        create();
+        check(false, step);
+    }
+    catch (sys::CSyscallException& ex)
+    {
+        check(EALREADY == ex.errcode(), step);
+    }
+}
+
+int main()
+{
+    net::CListenManager<net::CListener> listen_manager;
+    listen_manager.add("127.0.0.1", 0);
+
+    try
+    {
+        listen_manager.create_reuseport(2, true, true);
+        check(listen_manager.get_listener_count() == 2, "listener count");
+        check(listen_manager.get_listeners_per_address() == 2, "listeners per address");
+
+        net::CListener* listener_array = listen_manager.get_listener_array();
+        check_already_created([&listen_manager] { listen_manager.create(); }, "create after create_reuseport");
+        check_already_created([&listen_manager] { listen_manager.create_reuseport(4); }, "create_reuseport twice");
+        check(listen_manager.get_listener_array() == listener_array, "listeners kept");
+        check(listen_manager.get_listener_count() == 2, "listener count kept");
+
+        listen_manager.destroy();
+        check(listen_manager.get_listener_count() == 0, "count after destroy");
+        check(listen_manager.get_listener_array() == NULL, "array after destroy");
+        check(listen_manager.get_listeners_per_address() == 1, "listeners per address reset");
+        check(!listen_manager.is_cpu_steering(), "cpu steering reset");
+
+        listen_manager.create();
+        check(listen_manager.get_listener_count() == 1, "create after destroy");
+        listen_manager.destroy();
+    }
+    catch (sys::CSyscallException& ex)
+    {
+        fprintf(stderr, "FAILURE: %s\n", ex.str().c_str());
+        exit(1);
+    }
+
+    fprintf(stdout, "SUCCESS\n");
+    return 0;
+}
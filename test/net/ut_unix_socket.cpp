@@ -0,0 +1,64 @@
+// Writed by yijian on 2026/10/19
+// 监听进程经Unix域连接将句柄交给工作进程（子进程），工作进程通过收到的句柄写回数据
+#include "mooon/net/unix_socket.h"
+#include <sys/wait.h>
+MOOON_NAMESPACE_USE
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        net::CUnixListener listener;
+        listener.listen("@mooon_ut_unix_socket", SOCK_SEQPACKET, false);
+
+        int pipefd[2];
+        if (-1 == pipe(pipefd))
+            THROW_SYSCALL_EXCEPTION(NULL, errno, "pipe");
+
+        pid_t pid = fork();
+        if (-1 == pid)
+        {
+            THROW_SYSCALL_EXCEPTION(NULL, errno, "fork");
+        }
+        else if (0 == pid)
+        {
+            // 工作进程
+            net::CUnixSocket worker;
+            worker.connect("@mooon_ut_unix_socket", SOCK_SEQPACKET);
+
+            int fd = -1;
+            char buffer[IO_BUFFER_MAX];
+            ssize_t bytes = worker.receive_fd(&fd, buffer, sizeof(buffer));
+            if ((bytes > 0) && (fd != -1))
+            {
+                (void)write(fd, buffer, bytes);
+                close(fd);
+            }
+            exit(0);
+        }
+
+        // 监听进程
+        net::CUnixSocket dispatcher;
+        dispatcher.attach(listener.accept(false));
+
+        pid_t peer_pid;
+        dispatcher.get_peer_credentials(&peer_pid, NULL, NULL);
+        fprintf(stdout, "worker pid: %d, peer pid: %d\n", pid, peer_pid);
+
+        const char message[] = "hello";
+        dispatcher.send_fd(pipefd[1], message, sizeof(message)-1);
+        close(pipefd[1]);
+
+        char buffer[sizeof(message)] = { '\0' };
+        ssize_t bytes = read(pipefd[0], buffer, sizeof(buffer)-1);
+        waitpid(pid, NULL, 0);
+
+        fprintf(stdout, "received through passed fd: %.*s\n", (int)bytes, buffer);
+        return (0 == strcmp(buffer, message))? 0: 1;
+    }
+    catch (sys::CSyscallException& ex)
+    {
+        fprintf(stderr, "exception %s at %s:%d.\n", ex.str().c_str(), ex.file(), ex.line());
+        exit(1);
+    }
+}
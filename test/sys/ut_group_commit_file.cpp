@@ -0,0 +1,148 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+// 测试组提交文件写入器：
+// 1) 多个线程并发append，数据不丢不乱，且多次append合并成较少的写入
+// 2) O_DIRECT时，已有文件的未对齐尾部和之后追加的数据一起对齐写，关闭后文件大小准确，
+//    同一对象close后再open，块被复用
+// 用法：ut_group_commit_file [dir]，dir默认为/tmp，所在文件系统不支持O_DIRECT时2)退为普通写
+#include <mooon/sys/group_commit_file.h>
+#include <mooon/sys/syscall_exception.h>
+#include <mooon/utils/string_utils.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
+#include <thread>
+MOOON_NAMESPACE_USE
+
+static void check(bool ok, const char* step)
+{
+    if (!ok)
+    {
+        fprintf(stderr, "FAILURE: %s\n", step);
+        exit(1);
+    }
+}
+
+static std::string read_file(const std::string& filepath)
+{
+    std::ifstream fs(filepath.c_str(), std::ios::binary);
+    std::stringstream ss;
+    ss << fs.rdbuf();
+    return ss.str();
+}
+
+static void test_group_commit(const std::string& filepath)
+{
+    const int num_threads = 4;
+    const int num_appends = 10000;
+    sys::CGroupCommitFile file(filepath, 8192, false);
+    std::vector<std::thread> threads;
+
+    file.open();
+    for (int i=0; i<num_threads; ++i)
+    {
+        threads.push_back(std::thread([&file, i, num_appends] {
+            for (int j=0; j<num_appends; ++j)
+            {
+                const std::string line = utils::CStringUtils::format_string("%d:%d\n", i, j);
+                file.append(line.data(), line.size());
+            }
+        }));
+    }
+    for (int i=0; i<num_threads; ++i)
+        threads[i].join();
+    file.close();
+
+    // 每个线程的行完整，且保持各自的顺序
+    std::istringstream lines(read_file(filepath));
+    std::vector<int> next(num_threads, 0);
+    std::string line;
+    int count = 0;
+    while (std::getline(lines, line))
+    {
+        int i = -1, j = -1;
+        check(2 == sscanf(line.c_str(), "%d:%d", &i, &j), "line format");
+        check((i >= 0) && (i < num_threads) && (j == next[i]), "line order");
+        ++next[i];
+        ++count;
+    }
+    check(num_threads*num_appends == count, "line count");
+
+    sys::GroupCommitMetrics metrics;
+    file.get_metrics(&metrics);
+    fprintf(stdout, "appends: %d, writes: %u, waits: %u\n", count, metrics.write_count, metrics.append_waits);
+    check(metrics.write_count < static_cast<uint32_t>(count), "appends merged");
+}
+
+static void append_and_check(sys::CGroupCommitFile* file, std::string* expected, size_t size, char c)
+{
+    const std::string data(size, c);
+
+    file->open();
+    file->append(data.data(), data.size());
+    file->close();
+    expected->append(data);
+    check(read_file(file->get_filepath()) == *expected, "content");
+}
+
+static void test_direct(const std::string& filepath)
+{
+    // 已有文件的大小不是4096的倍数
+    std::string expected(1000, 'a');
+    std::ofstream(filepath.c_str(), std::ios::binary).write(expected.data(), expected.size());
+
+    sys::CGroupCommitFile file(filepath, 4096, true);
+    append_and_check(&file, &expected, 5000, 'b'); // 跨块，尾部未对齐
+    fprintf(stdout, "direct: %s\n", file.is_direct()? "yes": "no");
+
+    // close后再open，复用已分配的块
+    append_and_check(&file, &expected, 100, 'c');
+    append_and_check(&file, &expected, 8192, 'd');
+
+    sys::GroupCommitMetrics metrics;
+    file.get_metrics(&metrics);
+    check(metrics.appended_bytes == 5000+100+8192, "appended bytes");
+    if (file.is_direct())
+        check(metrics.written_bytes % 4096 == 0, "aligned write");
+}
+
+int main(int argc, char* argv[])
+{
+    const std::string dir = (argc > 1)? argv[1]: "/tmp";
+    const std::string filepath = utils::CStringUtils::format_string("%s/ut_group_commit_file_%d.log", dir.c_str(), (int)getpid());
+
+    try
+    {
+        (void)unlink(filepath.c_str());
+        test_group_commit(filepath);
+        (void)unlink(filepath.c_str());
+        test_direct(filepath);
+        (void)unlink(filepath.c_str());
+    }
+    catch (sys::CSyscallException& ex)
+    {
+        fprintf(stderr, "FAILURE: %s\n", ex.str().c_str());
+        exit(1);
+    }
+
+    fprintf(stdout, "SUCCESS\n");
+    return 0;
+}
@@ -0,0 +1,120 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+// 测试连接重连后继续使用缓存的预处理语句：
+// 1) 由另一连接KILL掉当前连接，服务端的预处理语句随之失效，执行时应自动重连并重新prepare
+// 2) mysql_reset_connection使语句和连接分离（CR_STMT_CLOSED），执行时应重新prepare
+// 用法：ut_mysql_statement [host] [port] [user] [password]，连接不上时跳过
+#include <mooon/sys/mysql_db.h>
+#include <mooon/utils/scoped_ptr.h>
+#include <stdio.h>
+#include <stdlib.h>
+#if MOOON_HAVE_MYSQL==1
+#include <mysql/mysql.h>
+#endif // MOOON_HAVE_MYSQL
+MOOON_NAMESPACE_USE
+
+#if MOOON_HAVE_MYSQL==1
+static const char* g_sql = "SELECT ?+1";
+
+static void execute_and_check(sys::DBStatement* stmt, int64_t value, const char* step)
+{
+    stmt->bind_int(0, value);
+    stmt->execute();
+    if (!stmt->fetch() || (stmt->get_int(0) != value+1))
+    {
+        fprintf(stderr, "FAILURE: %s\n", step);
+        exit(1);
+    }
+    while (stmt->fetch());
+}
+
+static void open_connection(sys::CMySQLConnection* mysql, const char* host, uint16_t port, const char* user, const char* password)
+{
+    mysql->set_host(host, port);
+    mysql->set_user(user, password);
+    mysql->enable_auto_reconnect(true);
+    mysql->open();
+}
+
+int main(int argc, char* argv[])
+{
+    const char* host = (argc > 1)? argv[1]: "127.0.0.1";
+    const uint16_t port = (argc > 2)? static_cast<uint16_t>(atoi(argv[2])): 3306;
+    const char* user = (argc > 3)? argv[3]: "root";
+    const char* password = (argc > 4)? argv[4]: "";
+    sys::CMySQLConnection mysql;
+    sys::CMySQLConnection admin;
+
+    try
+    {
+        open_connection(&mysql, host, port, user, password);
+        open_connection(&admin, host, port, user, password);
+    }
+    catch (sys::CDBException& ex)
+    {
+        fprintf(stdout, "SKIPPED: %s\n", ex.str().c_str());
+        return 0;
+    }
+
+    try
+    {
+        sys::DBStatement* stmt = mysql.prepare(g_sql);
+        execute_and_check(stmt, 1, "first execute");
+
+        // 服务端断开连接，缓存的语句在新连接上不存在
+        const std::string connection_id = mysql.query("SELECT CONNECTION_ID()");
+        admin.update("KILL %s", connection_id.c_str());
+        if (mysql.prepare(g_sql) != stmt)
+        {
+            fprintf(stderr, "FAILURE: statement not cached\n");
+            exit(1);
+        }
+        execute_and_check(stmt, 2, "execute after KILL");
+        if (mysql.query("SELECT CONNECTION_ID()") == connection_id)
+        {
+            fprintf(stderr, "FAILURE: not reconnected\n");
+            exit(1);
+        }
+
+#if MYSQL_VERSION_ID >= 50703
+        // 连接仍可用，但语句已和连接分离
+        if (mysql_reset_connection(static_cast<MYSQL*>(mysql.get_mysql_handle())) != 0)
+        {
+            fprintf(stderr, "FAILURE: mysql_reset_connection\n");
+            exit(1);
+        }
+        execute_and_check(mysql.prepare(g_sql), 3, "execute after reset");
+#endif // MYSQL_VERSION_ID
+
+        fprintf(stdout, "SUCCESS\n");
+    }
+    catch (sys::CDBException& ex)
+    {
+        fprintf(stderr, "%s\n", ex.str().c_str());
+        exit(1);
+    }
+
+    return 0;
+}
+
+#else
+int main()
+{
+    fprintf(stdout, "SKIPPED: without MySQL\n");
+    return 0;
+}
+#endif // MOOON_HAVE_MYSQL
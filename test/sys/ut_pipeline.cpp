@@ -0,0 +1,134 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+// 以文件为源和目标测试流水线：
+// 生成一个有N行的文件，经转换（转大写）后由多个目标并行写出，
+// 检查写出的总行数等于N，且确认的偏移等于文件大小
+#include <ctype.h>
+#include <mooon/sys/datetime_utils.h>
+#include <mooon/sys/file_utils.h>
+#include <mooon/sys/pipeline.h>
+#include <mooon/utils/string_utils.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+MOOON_NAMESPACE_USE
+
+class CUpperTransform: public sys::IPipelineTransform
+{
+private:
+    virtual void transform(sys::PipelineBatch* batch)
+    {
+        for (std::vector<std::string>::size_type i=0; i<batch->messages.size(); ++i)
+        {
+            std::string& message = batch->messages[i];
+            for (std::string::size_type j=0; j<message.size(); ++j)
+                message[j] = toupper(message[j]);
+        }
+    }
+};
+
+static int count_lines(const std::string& filepath)
+{
+    int lines = 0;
+    FILE* fp = fopen(filepath.c_str(), "r");
+
+    if (fp != NULL)
+    {
+        char line[1024];
+        while (fgets(line, sizeof(line), fp) != NULL)
+            ++lines;
+        fclose(fp);
+    }
+
+    return lines;
+}
+
+int main(int argc, char* argv[])
+{
+    const int num_lines = (argc > 1)? atoi(argv[1]): 1000000;
+    const int num_sinks = (argc > 2)? atoi(argv[2]): 4;
+    const std::string input_filepath = "/tmp/ut_pipeline.in";
+    int i;
+
+    FILE* fp = fopen(input_filepath.c_str(), "w");
+    if (NULL == fp)
+    {
+        perror("fopen");
+        exit(1);
+    }
+    for (i=0; i<num_lines; ++i)
+        fprintf(fp, "line-%d\n", i);
+    fclose(fp);
+
+    try
+    {
+        std::vector<std::string> output_filepaths;
+        std::vector<sys::IPipelineSink*> sinks;
+        for (i=0; i<num_sinks; ++i)
+        {
+            output_filepaths.push_back(utils::CStringUtils::format_string("/tmp/ut_pipeline.out.%d", i));
+            unlink(output_filepaths[i].c_str());
+            sinks.push_back(new sys::CFileLineSink(output_filepaths[i]));
+        }
+
+        sys::CFileLineSource source(input_filepath);
+        CUpperTransform transform;
+        sys::CPipeline pipeline(&source, sinks, &transform);
+        pipeline.set_batch(10, 1000);
+        pipeline.set_max_inflight(64);
+        pipeline.set_transform_threads(2);
+
+        const uint64_t begin_milliseconds = sys::CDatetimeUtils::get_current_milliseconds();
+        if (!pipeline.start())
+            exit(1);
+        pipeline.wait();
+        const uint64_t milliseconds = sys::CDatetimeUtils::get_current_milliseconds() - begin_milliseconds;
+
+        sys::PipelineMetrics metrics;
+        pipeline.get_metrics(&metrics);
+        fprintf(stdout, "fetched:%" PRIu64", written:%" PRIu64", acked_batches:%" PRIu64", milliseconds:%" PRIu64"\n",
+            metrics.fetched_messages, metrics.written_messages, metrics.acked_batches, milliseconds);
+
+        int total_lines = 0;
+        for (i=0; i<num_sinks; ++i)
+        {
+            delete sinks[i];
+            total_lines += count_lines(output_filepaths[i]);
+            unlink(output_filepaths[i].c_str());
+        }
+
+        const off_t file_size = sys::CFileUtils::get_file_size(input_filepath.c_str());
+        unlink(input_filepath.c_str());
+        if ((total_lines != num_lines) || (source.get_acked_offset() != file_size))
+        {
+            fprintf(stderr, "FAILURE: lines:%d/%d, acked_offset:%" PRId64"/%" PRId64"\n",
+                total_lines, num_lines, static_cast<int64_t>(source.get_acked_offset()), static_cast<int64_t>(file_size));
+            exit(1);
+        }
+
+        fprintf(stdout, "SUCCESS\n");
+    }
+    catch (sys::CSyscallException& ex)
+    {
+        fprintf(stderr, "%s\n", ex.str().c_str());
+        exit(1);
+    }
+
+    return 0;
+}
@@ -0,0 +1,195 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+// 测试SQLite3批量写入器和后台checkpoint：
+// 1) 按batch_rows合并提交
+// 2) 读者持有共享锁时COMMIT遇到SQLITE_BUSY，事务保持不变，读者释放后再flush不丢行
+// 3) 执行出错时抛出原来的异常并回滚
+// 4) CSQLite3Checkpointer重复start被拒绝，stop后可再start
+#include <mooon/sys/sqlite3_db.h>
+#include <mooon/sys/syscall_exception.h>
+#include <mooon/utils/string_utils.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#if MOOON_HAVE_SQLITE3==1
+#include <sqlite3/sqlite3.h>
+#endif // MOOON_HAVE_SQLITE3
+MOOON_NAMESPACE_USE
+
+#if MOOON_HAVE_SQLITE3==1
+static void check(bool ok, const char* step)
+{
+    if (!ok)
+    {
+        fprintf(stderr, "FAILURE: %s\n", step);
+        exit(1);
+    }
+}
+
+static int count_rows(sys::CSQLite3Connection* db_connection)
+{
+    return atoi(db_connection->query("SELECT COUNT(*) FROM t").c_str());
+}
+
+static void open_connection(sys::CSQLite3Connection* db_connection, const std::string& db_name, const char* journal_mode)
+{
+    sys::sqlite3_options_t options;
+    options.journal_mode = journal_mode;
+    options.busy_timeout_milliseconds = 0;
+    db_connection->set_db_name(db_name);
+    db_connection->set_options(options);
+    db_connection->open();
+}
+
+static void add_rows(sys::CSQLite3BulkWriter* writer, int first, int count)
+{
+    for (int i=first; i<first+count; ++i)
+    {
+        writer->statement()->bind_int(0, i);
+        writer->add();
+    }
+}
+
+static void test_batch(const std::string& db_name)
+{
+    sys::CSQLite3Connection db_connection;
+    open_connection(&db_connection, db_name, "DELETE");
+    db_connection.update("CREATE TABLE t (id INTEGER PRIMARY KEY)");
+
+    sys::CSQLite3BulkWriter writer(&db_connection, "INSERT INTO t VALUES (?)", 10, 60000);
+    add_rows(&writer, 0, 25);
+    check(writer.get_metrics().commits == 2, "commit by batch_rows");
+    check(writer.get_pending_rows() == 5, "pending rows");
+    writer.flush();
+    check(count_rows(&db_connection) == 25, "rows after flush");
+}
+
+static void test_busy_commit(const std::string& db_name)
+{
+    sys::CSQLite3Connection db_connection;
+    sys::CSQLite3Connection reader;
+    open_connection(&db_connection, db_name, "DELETE");
+    open_connection(&reader, db_name, "DELETE");
+
+    sys::CSQLite3BulkWriter writer(&db_connection, "INSERT INTO t VALUES (?)", 10000, 60000);
+    add_rows(&writer, 100, 5);
+
+    // 读者持有共享锁，COMMIT拿不到排它锁
+    reader.update("BEGIN");
+    check(count_rows(&reader) == 25, "reader sees committed rows");
+    try
+    {
+        writer.flush();
+        check(false, "flush should be busy");
+    }
+    catch (sys::CDBException& ex)
+    {
+        check(SQLITE_BUSY == (ex.errcode() & 0xff), "busy errcode");
+    }
+    check(writer.get_pending_rows() == 5, "transaction kept after busy");
+    check(writer.get_metrics().busy_retries > 0, "busy retried");
+
+    // 事务仍在，可继续写入，读者释放后全部提交
+    add_rows(&writer, 105, 5);
+    reader.update("COMMIT");
+    writer.flush();
+    check(count_rows(&reader) == 35, "rows after busy flush");
+}
+
+static void test_execute_error(const std::string& db_name)
+{
+    sys::CSQLite3Connection db_connection;
+    open_connection(&db_connection, db_name, "DELETE");
+
+    sys::CSQLite3BulkWriter writer(&db_connection, "INSERT INTO t VALUES (?)", 10000, 60000);
+    add_rows(&writer, 200, 3);
+    try
+    {
+        add_rows(&writer, 0, 1); // 主键冲突
+        check(false, "add should fail");
+    }
+    catch (sys::CDBException& ex)
+    {
+        check(SQLITE_CONSTRAINT == (ex.errcode() & 0xff), "original exception");
+    }
+    check(writer.get_pending_rows() == 0, "rolled back");
+    check(count_rows(&db_connection) == 35, "rows after rollback");
+
+    // 回滚后重新开始事务
+    add_rows(&writer, 200, 3);
+    writer.flush();
+    check(count_rows(&db_connection) == 38, "rows after new transaction");
+}
+
+static void test_checkpointer(const std::string& db_name)
+{
+    sys::CSQLite3Checkpointer checkpointer;
+
+    checkpointer.start(db_name, 10);
+    try
+    {
+        checkpointer.start(db_name, 10);
+        check(false, "start twice should fail");
+    }
+    catch (sys::CSyscallException& ex)
+    {
+        check(EALREADY == ex.errcode(), "already started");
+    }
+    checkpointer.stop();
+
+    checkpointer.start(db_name, 10);
+    checkpointer.stop();
+    check(checkpointer.get_checkpoint_count() >= 2, "checkpoint count");
+}
+
+int main()
+{
+    const std::string db_name = utils::CStringUtils::format_string("/tmp/ut_sqlite3_bulk_%d.db", (int)getpid());
+
+    (void)unlink(db_name.c_str());
+    try
+    {
+        test_batch(db_name);
+        test_busy_commit(db_name);
+        test_execute_error(db_name);
+        test_checkpointer(db_name);
+    }
+    catch (sys::CDBException& ex)
+    {
+        fprintf(stderr, "FAILURE: %s\n", ex.str().c_str());
+        exit(1);
+    }
+    catch (sys::CSyscallException& ex)
+    {
+        fprintf(stderr, "FAILURE: %s\n", ex.str().c_str());
+        exit(1);
+    }
+
+    (void)unlink(db_name.c_str());
+    fprintf(stdout, "SUCCESS\n");
+    return 0;
+}
+
+#else
+int main()
+{
+    fprintf(stdout, "SKIPPED: without SQLite3\n");
+    return 0;
+}
+#endif // MOOON_HAVE_SQLITE3
@@ -0,0 +1,138 @@
+/**
+ * Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Author: eyjian@qq.com or eyjian@gmail.com
+ */
+// 测试SQLite3的流式游标：
+// 1) 逐行取完所有行
+// 2) 游标未取完时关闭连接，游标被一并关闭，连接真正关闭（释放共享锁，其它连接可写），
+//    之后游标的next()返回false，连接析构后再析构游标也安全
+// 3) reopen后可再打开游标
+#include <mooon/sys/sqlite3_db.h>
+#include <mooon/utils/scoped_ptr.h>
+#include <mooon/utils/string_utils.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+MOOON_NAMESPACE_USE
+
+#if MOOON_HAVE_SQLITE3==1
+static const int sg_num_rows = 100;
+
+static void check(bool ok, const char* step)
+{
+    if (!ok)
+    {
+        fprintf(stderr, "FAILURE: %s\n", step);
+        exit(1);
+    }
+}
+
+static void open_connection(sys::CSQLite3Connection* db_connection, const std::string& db_name)
+{
+    sys::sqlite3_options_t options;
+    options.journal_mode = "DELETE";
+    options.busy_timeout_milliseconds = 0;
+    db_connection->set_db_name(db_name);
+    db_connection->set_options(options);
+    db_connection->open();
+}
+
+static int count_cursor_rows(sys::DBCursor* cursor)
+{
+    int rows = 0;
+    while (cursor->next())
+    {
+        const sys::DBRowView& row_view = cursor->row();
+        check(atoi(std::string(row_view[0].data, row_view[0].length).c_str()) == rows, "row value");
+        ++rows;
+    }
+    return rows;
+}
+
+static void test_fetch_all(const std::string& db_name)
+{
+    sys::CSQLite3Connection db_connection;
+    open_connection(&db_connection, db_name);
+    db_connection.update("CREATE TABLE t (id INTEGER PRIMARY KEY)");
+    db_connection.update("BEGIN");
+    for (int i=0; i<sg_num_rows; ++i)
+        db_connection.update("INSERT INTO t VALUES (%d)", i);
+    db_connection.update("COMMIT");
+
+    utils::ScopedPtr<sys::DBCursor> cursor(db_connection.open_cursor("SELECT id FROM t ORDER BY id"));
+    check(1 == cursor->get_num_fields(), "num fields");
+    check(cursor->get_field_name(0) == "id", "field name");
+    check(count_cursor_rows(cursor.get()) == sg_num_rows, "fetch all");
+}
+
+static void test_close_with_open_cursor(const std::string& db_name)
+{
+    utils::ScopedPtr<sys::DBCursor> cursor;
+    {
+        sys::CSQLite3Connection db_connection;
+        open_connection(&db_connection, db_name);
+        cursor.reset(db_connection.open_cursor("SELECT id FROM t ORDER BY id"));
+        check(cursor->next(), "first row");
+
+        // 游标未取完，语句持有共享锁
+        db_connection.close();
+        check(!cursor->next(), "next after close");
+
+        // 共享锁已随连接关闭而释放
+        sys::CSQLite3Connection writer;
+        open_connection(&writer, db_name);
+        writer.update("INSERT INTO t VALUES (%d)", sg_num_rows);
+
+        db_connection.reopen();
+        utils::ScopedPtr<sys::DBCursor> cursor2(db_connection.open_cursor("SELECT id FROM t ORDER BY id"));
+        check(count_cursor_rows(cursor2.get()) == sg_num_rows+1, "cursor after reopen");
+
+        // 这个游标在连接析构时被关闭，之后才析构
+        cursor.reset(db_connection.open_cursor("SELECT id FROM t ORDER BY id"));
+        check(cursor->next(), "first row again");
+    }
+    check(!cursor->next(), "next after destroyed");
+}
+
+int main()
+{
+    const std::string db_name = utils::CStringUtils::format_string("/tmp/ut_sqlite3_cursor_%d.db", (int)getpid());
+
+    (void)unlink(db_name.c_str());
+    try
+    {
+        test_fetch_all(db_name);
+        test_close_with_open_cursor(db_name);
+    }
+    catch (sys::CDBException& ex)
+    {
+        fprintf(stderr, "FAILURE: %s\n", ex.str().c_str());
+        exit(1);
+    }
+
+    (void)unlink(db_name.c_str());
+    fprintf(stdout, "SUCCESS\n");
+    return 0;
+}
+
+#else
+int main()
+{
+    fprintf(stdout, "SKIPPED: without SQLite3\n");
+    return 0;
+}
+#endif // MOOON_HAVE_SQLITE3
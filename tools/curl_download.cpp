@@ -5,24 +5,40 @@
 static void usage(const char* argv0)
 {
     char* s = strdup(argv0);
-    fprintf(stderr, "Usage: %s <-k> local_filepath url\n", basename(s));
+    fprintf(stderr, "Usage: %s <-k> <-d|-m> local_filepath url\n", basename(s));
+    fprintf(stderr, "-k: insecure, do not verify the server certificate\n");
+    fprintf(stderr, "-d: write with O_DIRECT, bypass the page cache\n");
+    fprintf(stderr, "-m: write through mmap, requires Content-Length\n");
     free(s);
 }
 
 int main(int argc, char* argv[])
 {
     bool enable_insecure = false;
+    mooon::sys::http_file_mode_t mode = mooon::sys::http_file_write;
+    int i = 1;
 
-    if (argc < 3)
+    for (; i<argc && '-'==argv[i][0]; ++i)
     {
-        usage(argv[0]);
-        exit(1);
+        if (0 == strcmp(argv[i], "-k"))
+        {
+            enable_insecure = true;
+        }
+        else if (0 == strcmp(argv[i], "-d"))
+        {
+            mode = mooon::sys::http_file_direct;
+        }
+        else if (0 == strcmp(argv[i], "-m"))
+        {
+            mode = mooon::sys::http_file_mmap;
+        }
+        else
+        {
+            usage(argv[0]);
+            exit(1);
+        }
     }
-    if (0 == strcmp(argv[1], "-k"))
-    {
-        enable_insecure = true;
-    }
-    if (enable_insecure && argc!=4)
+    if (argc-i != 2)
     {
         usage(argv[0]);
         exit(1);
@@ -30,11 +46,14 @@ int main(int argc, char* argv[])
 
     try
     {
-        const std::string& local_filepath = enable_insecure? argv[2]: argv[1];
-        const std::string& url = enable_insecure? argv[3]: argv[2];
+        const std::string& local_filepath = argv[i];
+        const std::string& url = argv[i+1];
         mooon::sys::CCurlWrapper curl;
+        mooon::sys::CHttpFileSink body_sink(local_filepath, mode);
         std::string response_header;
-        curl.http_get_download(response_header, local_filepath, url, enable_insecure);
+
+        // 包体直接写文件，不在内存中拼接
+        curl.http_get(response_header, &body_sink, url, enable_insecure);
 
         return 0;
     }
@@ -16,144 +16,628 @@
  *
  * Author: eyjian@qq.com or eyjian@gmail.com
  */
-// 磁盘性能测试工具，用于测试磁盘的读写性能：每秒写和读的笔数、每笔写和读花费的时长
-// 可以指定每次写和读的块大小，以及连读多少次写和读来求平均值。
+// 磁盘性能测试工具，用于测试磁盘的读写性能：IOPS、带宽，以及每笔读写和同步的延迟分布（p50、p99等）。
+// 依次运行--workloads指定的各项测试，全程无需交互，可输出JSON格式的结果，便于验收新机器时对比。
+//
+// 测试项：
+// seqwrite 顺序写
+// seqread  顺序读
+// randwrite 随机写
+// randread 随机读
+// randrw 随机混合读写，读所占百分比由--rwmix_read指定
+//
+// 读写方式（--engine）：
+// psync 使用pread和pwrite，每线程同一时刻只有一个请求
+// aio 使用Linux原生AIO（io_submit），每线程同一时刻有--iodepth个请求，通常和--direct=1一起使用，
+//     否则内核会退化为同步执行
+// mmap 将文件映射到内存后memcpy，同步使用msync
+//
+// 运行示例：
+// disk_benchmark --dir=/data --file_size=4096 --block=4096 --threads=4 --duration=30 --direct=1 --engine=aio --iodepth=32 --format=json
 #include <mooon/sys/close_helper.h>
 #include <mooon/sys/stop_watch.h>
 #include <mooon/sys/utils.h>
 #include <mooon/utils/args_parser.h>
+#include <mooon/utils/latency_histogram.h>
 #include <mooon/utils/print_color.h>
 #include <mooon/utils/string_utils.h>
+#include <mooon/utils/tokener.h>
+#include <linux/aio_abi.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <atomic>
+#include <chrono>
+#include <random>
 #include <signal.h>
+#include <thread>
 
 STRING_ARG_DEFINE(dir, ".", "temporary file directory");
 INTEGER_ARG_DEFINE(uint32_t, block, 4096, 1, 1024*1024*1024, "block bytes");
-INTEGER_ARG_DEFINE(uint32_t, times, 100000, 1, std::numeric_limits<uint32_t>::max(), "times to write and read");
+INTEGER_ARG_DEFINE(uint32_t, times, 100000, 1, std::numeric_limits<uint32_t>::max(), "times to write and read of each workload if duration is 0");
+// 为0时等同于--fsync_every=1，保留以兼容原有用法
 INTEGER_ARG_DEFINE(uint8_t, buffer, 1, 0, 1, "buffer write");
 
-static char filename[sizeof("disk_benchmark_XXXXXX")] = { '\0' };
+INTEGER_ARG_DEFINE(uint32_t, file_size, 1024, 1, 1024*1024*16, "size of test file in MB");
+STRING_ARG_DEFINE(workloads, "seqwrite,seqread,randwrite,randread", "comma separated workloads: seqwrite, seqread, randwrite, randread, randrw");
+INTEGER_ARG_DEFINE(uint8_t, rwmix_read, 70, 0, 100, "percentage of reads of randrw");
+STRING_ARG_DEFINE(engine, "psync", "psync, aio or mmap");
+INTEGER_ARG_DEFINE(uint8_t, direct, 0, 0, 1, "use O_DIRECT");
+INTEGER_ARG_DEFINE(uint16_t, threads, 1, 1, 1024, "number of threads");
+INTEGER_ARG_DEFINE(uint16_t, iodepth, 1, 1, 1024, "number of requests in flight per thread, only for aio");
+INTEGER_ARG_DEFINE(uint32_t, fsync_every, 0, 0, std::numeric_limits<uint32_t>::max(), "fdatasync after every N writes per thread, 0 for never");
+INTEGER_ARG_DEFINE(uint32_t, duration, 0, 0, 86400, "seconds of each workload, 0 for running times");
+INTEGER_ARG_DEFINE(uint8_t, drop_caches, 0, 0, 1, "drop page cache before read workloads, need root");
+STRING_ARG_DEFINE(format, "text", "output format: text or json");
+INTEGER_ARG_DEFINE(uint8_t, keep, 0, 0, 1, "keep test file");
+
+enum EngineType { ENGINE_PSYNC, ENGINE_AIO, ENGINE_MMAP };
+
+// 单项测试的参数
+struct Workload
+{
+    std::string name;
+    bool random;
+    int read_percentage; // 0为只写，100为只读
+};
+
+// 单个线程的统计，延迟单位为纳秒
+struct ThreadResult
+{
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    mooon::utils::CLatencyHistogram read_latency;
+    mooon::utils::CLatencyHistogram write_latency;
+    mooon::utils::CLatencyHistogram sync_latency;
+    std::string errmsg;
+
+    ThreadResult(): read_bytes(0), write_bytes(0) {}
+};
+
+static char filename[PATH_MAX] = { '\0' };
+static int sg_fd = -1;
+static char* sg_mmap = NULL;
+static uint64_t sg_file_size = 0;
+static uint32_t sg_block = 0;
+static uint32_t sg_fsync_every = 0;
+static EngineType sg_engine = ENGINE_PSYNC;
+static std::atomic<bool> sg_stop(false);
+
 static void onsignal(int signo)
 {
     if (SIGINT == signo)
     {
-        if (filename[0] != '\0')
-        {
+        if ((filename[0] != '\0') && (0 == mooon::argument::keep->value()))
             remove(filename);
-            exit(1);
-        }
+        exit(1);
     }
 }
 
-int main(int argc, char* argv[])
+static void die(const char* format, ...) __attribute__((format(printf, 1, 2)));
+static void die(const char* format, ...)
 {
-    fprintf(stdout, "please run under DIRECTORY: " PRINT_COLOR_YELLOW"%s" PRINT_COLOR_NONE"\n", mooon::sys::CUtils::get_program_path().c_str());
+    va_list ap;
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
 
-    std::string errmsg;
-    if (!mooon::utils::parse_arguments(argc, argv, &errmsg))
+    if ((filename[0] != '\0') && (0 == mooon::argument::keep->value()))
+        remove(filename);
+    exit(1);
+}
+
+static uint64_t now_nanoseconds()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// 对齐的缓冲区，O_DIRECT要求缓冲区、偏移和长度都按逻辑块大小对齐，
+// 内容填充为随机数，避免带压缩或去重功能的SSD测出虚高的结果
+static char* alloc_buffer(size_t size, uint64_t seed)
+{
+    void* buffer = NULL;
+    if (posix_memalign(&buffer, 4096, size) != 0)
+        die("posix_memalign %zu error\n", size);
+
+    std::mt19937_64 random_engine(seed);
+    for (size_t i=0; i+sizeof(uint64_t)<=size; i+=sizeof(uint64_t))
+        *reinterpret_cast<uint64_t*>(static_cast<char*>(buffer)+i) = random_engine();
+    return static_cast<char*>(buffer);
+}
+
+// 准备测试文件，不足--file_size的部分用顺序写补齐，
+// 不使用fallocate，因为读未写过的块不会访问磁盘
+static void prepare_file()
+{
+    const std::string pattern = mooon::argument::dir->value() + "/disk_benchmark_XXXXXX";
+    if (pattern.size() >= sizeof(filename))
+        die("too long dir: %s\n", mooon::argument::dir->c_value());
+    memcpy(filename, pattern.c_str(), pattern.size()+1);
+
+    int fd = mkstemp(filename);
+    if (-1 == fd)
+        die("mkstemp %s error: %m\n", filename);
+    close(fd);
+
+    fd = open(filename, O_RDWR);
+    if (-1 == fd)
+        die("open %s error: %m\n", filename);
+
+    const size_t chunk_size = mooon::SIZE_1M;
+    char* chunk = alloc_buffer(chunk_size, 0);
+    for (uint64_t offset=0; offset<sg_file_size; offset+=chunk_size)
     {
-        fprintf(stderr, "%s\n", errmsg.c_str());
-        exit(1);
+        const size_t size = static_cast<size_t>(std::min<uint64_t>(chunk_size, sg_file_size-offset));
+        if (pwrite(fd, chunk, size, offset) != static_cast<ssize_t>(size))
+            die("write %s error: %m\n", filename);
     }
+    if (-1 == fdatasync(fd))
+        die("fdatasync %s error: %m\n", filename);
+    free(chunk);
+    close(fd);
 
-    signal(SIGINT, onsignal);
-    memcpy(filename, "disk_benchmark_XXXXXX", sizeof("disk_benchmark_XXXXXX"));
-    int fd = mkstemp(filename);
+    fd = open(filename, (1 == mooon::argument::direct->value())? O_RDWR|O_DIRECT: O_RDWR);
     if (-1 == fd)
+        die("open %s error: %m\n", filename);
+    sg_fd = fd;
+
+    if (ENGINE_MMAP == sg_engine)
     {
-        fprintf(stderr, "open %s error: %m\n", filename);
-        remove(filename);
-        exit(1);
+        void* ptr = mmap(NULL, sg_file_size, PROT_READ|PROT_WRITE, MAP_SHARED, sg_fd, 0);
+        if (MAP_FAILED == ptr)
+            die("mmap %s error: %m\n", filename);
+        sg_mmap = static_cast<char*>(ptr);
     }
+}
 
-    fprintf(stdout, "block size: %u, file: %s\n\n", mooon::argument::block->value(), filename);
-    const std::string buffer(mooon::argument::block->value(), '#');
-    mooon::sys::CStopWatch stop_watch;
-    int64_t total_bytes = 0;
-    ssize_t bytes = 0;
-    for (uint32_t i=0; i<mooon::argument::times->value(); ++i)
+static void drop_caches()
+{
+    // 先刷脏页，否则脏页不会被丢弃
+    sync();
+
+    FILE* fp = fopen("/proc/sys/vm/drop_caches", "w");
+    if ((NULL == fp) || (fputs("1", fp) < 0))
+        fprintf(stderr, "[" PRINT_COLOR_YELLOW"WARN" PRINT_COLOR_NONE"] drop page cache error: %m\n");
+    if (fp != NULL)
+        fclose(fp);
+    if (sg_mmap != NULL)
+        madvise(sg_mmap, sg_file_size, MADV_DONTNEED);
+}
+
+// 按测试项生成每个请求的偏移和读写类型
+class COffsetGenerator
+{
+public:
+    COffsetGenerator(const Workload& workload, uint16_t index)
+        : _workload(workload), _random_engine(now_nanoseconds() + index)
     {
-        bytes = write(fd, buffer.data(), buffer.size());
-        if (bytes != static_cast<ssize_t>(buffer.size()))
+        // 顺序读写时，各线程各自负责文件的一段
+        const uint64_t blocks = sg_file_size / sg_block;
+        _begin = blocks * index / mooon::argument::threads->value();
+        _end = blocks * (index+1) / mooon::argument::threads->value();
+        if (_end == _begin)
+            _end = _begin + 1;
+        _next = _begin;
+    }
+
+    void next(uint64_t* offset, bool* is_read)
+    {
+        if (_workload.random)
         {
-            fprintf(stderr, "write %s error: %m\n", filename);
-            remove(filename);
-            close(fd);
-            exit(1);
+            *offset = (_random_engine() % (sg_file_size/sg_block)) * sg_block;
+        }
+        else
+        {
+            *offset = _next * sg_block;
+            if (++_next == _end)
+                _next = _begin;
+        }
+
+        if (100 == _workload.read_percentage)
+            *is_read = true;
+        else if (0 == _workload.read_percentage)
+            *is_read = false;
+        else
+            *is_read = static_cast<int>(_random_engine() % 100) < _workload.read_percentage;
+    }
+
+private:
+    const Workload& _workload;
+    std::mt19937_64 _random_engine;
+    uint64_t _begin;
+    uint64_t _end;
+    uint64_t _next;
+};
+
+// 记录一次写，并按--fsync_every同步
+static bool after_write(ThreadResult* result, uint64_t* writes)
+{
+    result->write_bytes += sg_block;
+    if ((sg_fsync_every > 0) && (0 == ++*writes % sg_fsync_every))
+    {
+        const uint64_t begin = now_nanoseconds();
+        const int ret = (ENGINE_MMAP == sg_engine)? msync(sg_mmap, sg_file_size, MS_SYNC): fdatasync(sg_fd);
+        if (-1 == ret)
+        {
+            result->errmsg = mooon::utils::CStringUtils::format_string("sync error: %s", strerror(errno));
+            return false;
         }
+        result->sync_latency.record(now_nanoseconds() - begin);
+    }
+    return true;
+}
+
+static void run_sync_thread(const Workload& workload, uint16_t index, uint64_t max_ops, ThreadResult* result)
+{
+    COffsetGenerator generator(workload, index);
+    char* buffer = alloc_buffer(sg_block, index+1);
+    uint64_t writes = 0;
 
-        if (0 == mooon::argument::buffer->value())
+    for (uint64_t i=0; (i<max_ops) && !sg_stop; ++i)
+    {
+        uint64_t offset;
+        bool is_read;
+        generator.next(&offset, &is_read);
+
+        const uint64_t begin = now_nanoseconds();
+        if (ENGINE_MMAP == sg_engine)
+        {
+            if (is_read)
+                memcpy(buffer, sg_mmap+offset, sg_block);
+            else
+                memcpy(sg_mmap+offset, buffer, sg_block);
+        }
+        else
         {
-            if (-1 == fsync(fd))
+            const ssize_t bytes = is_read? pread(sg_fd, buffer, sg_block, offset): pwrite(sg_fd, buffer, sg_block, offset);
+            if (bytes != static_cast<ssize_t>(sg_block))
             {
-                fprintf(stderr, "fsync %s error: %m\n", filename);
-                remove(filename);
-                close(fd);
-                exit(1);
+                result->errmsg = mooon::utils::CStringUtils::format_string("%s at %" PRIu64" error: %s", is_read? "pread": "pwrite", offset, (-1 == bytes)? strerror(errno): "short");
+                break;
             }
         }
 
-        total_bytes += bytes;
+        if (is_read)
+        {
+            result->read_latency.record(now_nanoseconds() - begin);
+            result->read_bytes += sg_block;
+        }
+        else
+        {
+            result->write_latency.record(now_nanoseconds() - begin);
+            if (!after_write(result, &writes))
+                break;
+        }
     }
 
-    unsigned int elapsed_microseconds = stop_watch.get_elapsed_microseconds();
-    unsigned int elapsed_milliseconds = elapsed_microseconds / 1000;
-    unsigned int elapsed_seconds = elapsed_microseconds / 1000000;
-    unsigned int iops = (0 == elapsed_seconds)? mooon::argument::times->value(): mooon::argument::times->value()/elapsed_seconds;
-    double rate =  elapsed_microseconds / mooon::argument::times->value();
-    double total_bytes_k = total_bytes / 1024;
-    double total_bytes_m = total_bytes_k / 1024;
-    double bytes_sec = (0 == elapsed_seconds)? total_bytes_m: total_bytes_m / elapsed_seconds;
-    fprintf(stdout, "[" PRINT_COLOR_YELLOW"WRITE" PRINT_COLOR_NONE"]\n");
-    fprintf(stdout, "bytes: %" PRId64" (%.02fMB, %.02fMB/s), times: %u\n", total_bytes, total_bytes_m, bytes_sec, mooon::argument::times->value());
-    fprintf(stdout, "microseconds: %u, milliseconds: %u, seconds: %u\n", elapsed_microseconds, elapsed_milliseconds, elapsed_seconds);
-    fprintf(stdout, "iops: %u, rate: %0.2fus (%0.2fms)\n", iops, rate, rate/1000);
+    free(buffer);
+}
 
-    close(fd);
-    fprintf(stdout, "\n" PRINT_COLOR_GREEN);
-    fprintf(stdout, "free pagecache: echo 1 > /proc/sys/vm/drop_caches\n");
-    fprintf(stdout, "free dentries and inodes: echo 2 > /proc/sys/vm/drop_caches\n");
-    fprintf(stdout, "free pagecache, dentries and inodes: echo 3 > /proc/sys/vm/drop_caches\n");
-    fprintf(stdout, "press ENTER to continue ...\n" PRINT_COLOR_NONE);
-    getchar();
-
-    fd = open(filename, O_RDONLY);
-    if (-1 == fd)
+// 使用Linux原生AIO，始终保持iodepth个请求在途，
+// 直接使用系统调用，不依赖libaio
+static void run_aio_thread(const Workload& workload, uint16_t index, uint64_t max_ops, ThreadResult* result)
+{
+    const uint16_t iodepth = mooon::argument::iodepth->value();
+    COffsetGenerator generator(workload, index);
+    std::vector<struct iocb> iocbs(iodepth);
+    std::vector<char*> buffers(iodepth);
+    std::vector<uint64_t> submit_nanoseconds(iodepth);
+    std::vector<struct io_event> events(iodepth);
+    aio_context_t context = 0;
+    uint64_t submitted = 0;
+    uint64_t writes = 0;
+    int inflight = 0;
+
+    if (-1 == syscall(SYS_io_setup, iodepth, &context))
     {
-        fprintf(stderr, "open %s error: %m\n", filename);
-        remove(filename);
-        exit(1);
+        result->errmsg = mooon::utils::CStringUtils::format_string("io_setup error: %s", strerror(errno));
+        return;
     }
+    for (uint16_t i=0; i<iodepth; ++i)
+        buffers[i] = alloc_buffer(sg_block, (index+1)*iodepth+i);
+
+    // slot为iocbs的下标，通过aio_data带回
+    std::vector<uint16_t> free_slots;
+    for (uint16_t i=0; i<iodepth; ++i)
+        free_slots.push_back(i);
 
-    total_bytes = 0;
-    stop_watch.restart();
-    for (uint32_t i=0; i<mooon::argument::times->value(); ++i)
+    while (true)
     {
-        bytes = read(fd, const_cast<char*>(buffer.data()), mooon::argument::block->value());
-        if (bytes != static_cast<ssize_t>(buffer.size()))
+        while (!free_slots.empty() && (submitted < max_ops) && !sg_stop)
         {
-            fprintf(stderr, "read %s error: %m\n", filename);
-            remove(filename);
-            close(fd);
-            exit(1);
+            const uint16_t slot = free_slots.back();
+            struct iocb* cb = &iocbs[slot];
+            uint64_t offset;
+            bool is_read;
+
+            generator.next(&offset, &is_read);
+            memset(cb, 0, sizeof(*cb));
+            cb->aio_data = slot;
+            cb->aio_fildes = sg_fd;
+            cb->aio_lio_opcode = is_read? IOCB_CMD_PREAD: IOCB_CMD_PWRITE;
+            cb->aio_buf = reinterpret_cast<uint64_t>(buffers[slot]);
+            cb->aio_nbytes = sg_block;
+            cb->aio_offset = offset;
+
+            submit_nanoseconds[slot] = now_nanoseconds();
+            if (syscall(SYS_io_submit, context, 1, &cb) != 1)
+            {
+                result->errmsg = mooon::utils::CStringUtils::format_string("io_submit error: %s", strerror(errno));
+                sg_stop = true;
+                break;
+            }
+            free_slots.pop_back();
+            ++submitted;
+            ++inflight;
+        }
+        if (0 == inflight)
+            break;
+
+        const int n = static_cast<int>(syscall(SYS_io_getevents, context, 1, iodepth, &events[0], NULL));
+        if (-1 == n)
+        {
+            if (EINTR == errno)
+                continue;
+            result->errmsg = mooon::utils::CStringUtils::format_string("io_getevents error: %s", strerror(errno));
+            break;
+        }
+
+        const uint64_t now = now_nanoseconds();
+        for (int i=0; i<n; ++i)
+        {
+            const uint16_t slot = static_cast<uint16_t>(events[i].data);
+            const bool is_read = (IOCB_CMD_PREAD == iocbs[slot].aio_lio_opcode);
+
+            --inflight;
+            free_slots.push_back(slot);
+            if (events[i].res != static_cast<int64_t>(sg_block))
+            {
+                result->errmsg = mooon::utils::CStringUtils::format_string("aio %s at %" PRIu64" error: %s",
+                    is_read? "read": "write", static_cast<uint64_t>(iocbs[slot].aio_offset), (events[i].res < 0)? strerror(-events[i].res): "short");
+                sg_stop = true;
+            }
+            else if (is_read)
+            {
+                result->read_latency.record(now - submit_nanoseconds[slot]);
+                result->read_bytes += sg_block;
+            }
+            else
+            {
+                result->write_latency.record(now - submit_nanoseconds[slot]);
+                if (!after_write(result, &writes))
+                    sg_stop = true;
+            }
         }
+    }
+
+    syscall(SYS_io_destroy, context);
+    for (uint16_t i=0; i<iodepth; ++i)
+        free(buffers[i]);
+}
 
-        total_bytes += bytes;
+static std::string latency_tostring(const mooon::utils::CLatencyHistogram& latency, bool json)
+{
+    if (json)
+    {
+        return mooon::utils::CStringUtils::format_string(
+            "{\"min\":%.1f,\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+            latency.get_min()/1000.0, latency.get_mean()/1000.0, latency.get_percentile(50.0)/1000.0, latency.get_percentile(90.0)/1000.0,
+            latency.get_percentile(99.0)/1000.0, latency.get_percentile(99.9)/1000.0, latency.get_max()/1000.0);
     }
+    else
+    {
+        return mooon::utils::CStringUtils::format_string(
+            "min=%.1fus, mean=%.1fus, p50=%.1fus, p90=%.1fus, p99=%.1fus, p999=%.1fus, max=%.1fus",
+            latency.get_min()/1000.0, latency.get_mean()/1000.0, latency.get_percentile(50.0)/1000.0, latency.get_percentile(90.0)/1000.0,
+            latency.get_percentile(99.0)/1000.0, latency.get_percentile(99.9)/1000.0, latency.get_max()/1000.0);
+    }
+}
 
-    elapsed_microseconds = stop_watch.get_elapsed_microseconds();
-    elapsed_milliseconds = elapsed_microseconds / 1000;
-    elapsed_seconds = elapsed_microseconds / 1000000;
-    iops = (0 == elapsed_seconds)? mooon::argument::times->value(): mooon::argument::times->value()/elapsed_seconds;
-    rate =  elapsed_microseconds / mooon::argument::times->value();
-    total_bytes_k = total_bytes / 1024;
-    total_bytes_m = total_bytes_k / 1024;
-    bytes_sec = (0 == elapsed_seconds)? total_bytes_m: total_bytes_m / elapsed_seconds;
-    fprintf(stdout, "[" PRINT_COLOR_YELLOW"READ" PRINT_COLOR_NONE"]\n");
-    fprintf(stdout, "bytes: %" PRId64" (%.02fMB/s), times: %u\n", total_bytes, bytes_sec, mooon::argument::times->value());
-    fprintf(stdout, "microseconds: %u, milliseconds: %u, seconds: %u\n", elapsed_microseconds, elapsed_milliseconds, elapsed_seconds);
-    fprintf(stdout, "iops: %u, rate: %0.2fus (%0.2fms)\n", iops, rate, rate/1000);
+static std::string io_tostring(const char* name, uint64_t bytes, const mooon::utils::CLatencyHistogram& latency, double seconds, bool json)
+{
+    const double iops = (seconds > 0)? latency.get_count() / seconds: 0.0;
+    const double bandwidth = (seconds > 0)? bytes / seconds / static_cast<double>(mooon::SIZE_1M): 0.0;
 
-    remove(filename);
-    close(fd);
+    if (json)
+    {
+        return mooon::utils::CStringUtils::format_string(
+            "\"%s\":{\"ops\":%" PRIu64",\"bytes\":%" PRIu64",\"iops\":%.1f,\"bw_mbps\":%.2f,\"lat_us\":%s}",
+            name, latency.get_count(), bytes, iops, bandwidth, latency_tostring(latency, true).c_str());
+    }
+    else
+    {
+        return mooon::utils::CStringUtils::format_string(
+            "%s: ops=%" PRIu64", iops=%.0f, bw=%.2fMB/s\n    lat: %s\n",
+            name, latency.get_count(), iops, bandwidth, latency_tostring(latency, false).c_str());
+    }
+}
+
+// 运行一项测试，返回文本或JSON格式的结果
+static std::string run_workload(const Workload& workload)
+{
+    const uint16_t threads = mooon::argument::threads->value();
+    const uint64_t max_ops = (mooon::argument::duration->value() > 0)? std::numeric_limits<uint64_t>::max(): (mooon::argument::times->value() + threads - 1) / threads;
+    const bool json = (mooon::argument::format->value() == "json");
+    std::vector<ThreadResult> results(threads);
+    std::vector<std::thread> workers;
+
+    if ((1 == mooon::argument::drop_caches->value()) && (workload.read_percentage > 0))
+        drop_caches();
+
+    sg_stop = false;
+    mooon::sys::CStopWatch stop_watch;
+    for (uint16_t i=0; i<threads; ++i)
+    {
+        if (ENGINE_AIO == sg_engine)
+            workers.push_back(std::thread(run_aio_thread, std::cref(workload), i, max_ops, &results[i]));
+        else
+            workers.push_back(std::thread(run_sync_thread, std::cref(workload), i, max_ops, &results[i]));
+    }
+    if (mooon::argument::duration->value() > 0)
+    {
+        const uint64_t end = now_nanoseconds() + static_cast<uint64_t>(mooon::argument::duration->value()) * 1000000000;
+        while (!sg_stop && (now_nanoseconds() < end))
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        sg_stop = true;
+    }
+    for (uint16_t i=0; i<threads; ++i)
+        workers[i].join();
+    const double seconds = stop_watch.get_elapsed_microseconds() / 1000000.0;
+
+    // 合并各线程
+    ThreadResult total;
+    for (uint16_t i=0; i<threads; ++i)
+    {
+        if (!results[i].errmsg.empty())
+            die("%s thread %u: %s\n", workload.name.c_str(), i, results[i].errmsg.c_str());
+        total.read_bytes += results[i].read_bytes;
+        total.write_bytes += results[i].write_bytes;
+        total.read_latency.merge(results[i].read_latency);
+        total.write_latency.merge(results[i].write_latency);
+        total.sync_latency.merge(results[i].sync_latency);
+    }
+
+    std::string str;
+    if (json)
+    {
+        str = mooon::utils::CStringUtils::format_string("{\"name\":\"%s\",\"elapsed_ms\":%.0f", workload.name.c_str(), seconds*1000);
+        if (total.read_latency.get_count() > 0)
+            str += "," + io_tostring("read", total.read_bytes, total.read_latency, seconds, true);
+        if (total.write_latency.get_count() > 0)
+            str += "," + io_tostring("write", total.write_bytes, total.write_latency, seconds, true);
+        if (total.sync_latency.get_count() > 0)
+            str += mooon::utils::CStringUtils::format_string(",\"sync\":{\"ops\":%" PRIu64",\"lat_us\":%s}", total.sync_latency.get_count(), latency_tostring(total.sync_latency, true).c_str());
+        str += "}";
+    }
+    else
+    {
+        str = mooon::utils::CStringUtils::format_string("[" PRINT_COLOR_YELLOW"%s" PRINT_COLOR_NONE"] %.2fs\n", workload.name.c_str(), seconds);
+        if (total.read_latency.get_count() > 0)
+            str += io_tostring("read", total.read_bytes, total.read_latency, seconds, false);
+        if (total.write_latency.get_count() > 0)
+            str += io_tostring("write", total.write_bytes, total.write_latency, seconds, false);
+        if (total.sync_latency.get_count() > 0)
+            str += mooon::utils::CStringUtils::format_string("sync: ops=%" PRIu64"\n    lat: %s\n", total.sync_latency.get_count(), latency_tostring(total.sync_latency, false).c_str());
+    }
+    return str;
+}
+
+static void parse_workloads(std::vector<Workload>* workloads)
+{
+    std::vector<std::string> names;
+    mooon::utils::CTokener::split(&names, mooon::argument::workloads->value(), ",", true);
+
+    for (std::vector<std::string>::size_type i=0; i<names.size(); ++i)
+    {
+        Workload workload;
+        workload.name = names[i];
+        if (names[i] == "seqwrite")
+        {
+            workload.random = false;
+            workload.read_percentage = 0;
+        }
+        else if (names[i] == "seqread")
+        {
+            workload.random = false;
+            workload.read_percentage = 100;
+        }
+        else if (names[i] == "randwrite")
+        {
+            workload.random = true;
+            workload.read_percentage = 0;
+        }
+        else if (names[i] == "randread")
+        {
+            workload.random = true;
+            workload.read_percentage = 100;
+        }
+        else if (names[i] == "randrw")
+        {
+            workload.random = true;
+            workload.read_percentage = mooon::argument::rwmix_read->value();
+        }
+        else
+        {
+            die("unknown workload: %s\n", names[i].c_str());
+        }
+        workloads->push_back(workload);
+    }
+    if (workloads->empty())
+        die("no workload\n");
+}
+
+int main(int argc, char* argv[])
+{
+    std::string errmsg;
+    if (!mooon::utils::parse_arguments(argc, argv, &errmsg))
+    {
+        fprintf(stderr, "%s\n", errmsg.c_str());
+        exit(1);
+    }
+
+    if (mooon::argument::engine->value() == "psync")
+        sg_engine = ENGINE_PSYNC;
+    else if (mooon::argument::engine->value() == "aio")
+        sg_engine = ENGINE_AIO;
+    else if (mooon::argument::engine->value() == "mmap")
+        sg_engine = ENGINE_MMAP;
+    else
+        die("unknown engine: %s\n", mooon::argument::engine->c_value());
+    if ((mooon::argument::format->value() != "text") && (mooon::argument::format->value() != "json"))
+        die("unknown format: %s\n", mooon::argument::format->c_value());
+    if ((ENGINE_MMAP == sg_engine) && (1 == mooon::argument::direct->value()))
+        die("--direct can not be used with mmap\n");
+    if ((1 == mooon::argument::direct->value()) && (mooon::argument::block->value() % 512 != 0))
+        die("--block should be multiple of 512 with --direct\n");
+    if (0 == mooon::argument::buffer->value())
+        sg_fsync_every = 1;
+    else
+        sg_fsync_every = mooon::argument::fsync_every->value();
+
+    std::vector<Workload> workloads;
+    parse_workloads(&workloads);
+
+    sg_block = mooon::argument::block->value();
+    sg_file_size = static_cast<uint64_t>(mooon::argument::file_size->value()) * mooon::SIZE_1M;
+    sg_file_size = sg_file_size / sg_block * sg_block;
+    if (0 == sg_file_size)
+        die("--file_size should not be less than --block\n");
+
+    signal(SIGINT, onsignal);
+    prepare_file();
+
+    const bool json = (mooon::argument::format->value() == "json");
+    if (json)
+    {
+        fprintf(stdout, "{\"file\":\"%s\",\"file_size\":%" PRIu64",\"block\":%u,\"engine\":\"%s\",\"direct\":%d,\"threads\":%u,\"iodepth\":%u,\"fsync_every\":%u,\"jobs\":[",
+                filename, sg_file_size, sg_block, mooon::argument::engine->c_value(), mooon::argument::direct->value(),
+                mooon::argument::threads->value(), (ENGINE_AIO == sg_engine)? mooon::argument::iodepth->value(): 1,
+                sg_fsync_every);
+    }
+    else
+    {
+        fprintf(stdout, "file: %s, size: %" PRIu64"MB, block: %u, engine: %s, direct: %d, threads: %u, iodepth: %u, fsync_every: %u\n\n",
+                filename, sg_file_size/mooon::SIZE_1M, sg_block, mooon::argument::engine->c_value(), mooon::argument::direct->value(),
+                mooon::argument::threads->value(), (ENGINE_AIO == sg_engine)? mooon::argument::iodepth->value(): 1,
+                sg_fsync_every);
+    }
+
+    for (std::vector<Workload>::size_type i=0; i<workloads.size(); ++i)
+    {
+        const std::string result = run_workload(workloads[i]);
+
+        if (json)
+            fprintf(stdout, "%s%s", (0 == i)? "": ",", result.c_str());
+        else
+            fprintf(stdout, "%s\n", result.c_str());
+        fflush(stdout);
+    }
+    if (json)
+        fprintf(stdout, "]}\n");
+
+    if (sg_mmap != NULL)
+        munmap(sg_mmap, sg_file_size);
+    close(sg_fd);
+    if (0 == mooon::argument::keep->value())
+        remove(filename);
     return 0;
 }
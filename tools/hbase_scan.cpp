@@ -19,13 +19,18 @@
 #include "THBaseService.h"
 #include <mooon/net/thrift_helper.h>
 #include <mooon/sys/atomic.h>
+#include <mooon/sys/event_queue.h>
 #include <mooon/sys/safe_logger.h>
 #include <mooon/sys/stop_watch.h>
 #include <mooon/sys/thread_engine.h>
 #include <mooon/sys/utils.h>
 #include <mooon/utils/args_parser.h>
+#include <mooon/utils/array_queue.h>
+#include <mooon/utils/latency_histogram.h>
 #include <mooon/utils/string_utils.h>
 #include <mooon/utils/tokener.h>
+#include <algorithm>
+#include <fstream>
 
 STRING_ARG_DEFINE(hbase_ip, "127.0.0.1", "hbase thrift server IP");
 INTEGER_ARG_DEFINE(uint16_t, hbase_port, 9090, 1000, 65535, "hbase thrift server port");
@@ -39,8 +44,38 @@ INTEGER_ARG_DEFINE(int, timeout, 10, 1, 3600, "timeout seconds of thrift");
 INTEGER_ARG_DEFINE(int, batch_size, 0, 0, 100000, "batch size");
 INTEGER_ARG_DEFINE(int, caching, 0, 0, 100000, "hbase.client.scanner.caching");
 
+// 并行扫描，--parallel大于1或指定了分割点时启用，
+// 此时--parallel_batch为每次getScannerRows取的行数，--batch和--num不起作用，扫描整个[startrow, stoprow)区间，
+// 有区间扫描失败时退出码为非0
+INTEGER_ARG_DEFINE(uint16_t, parallel, 1, 1, 1000, "number of thrift connections to scan in parallel");
+INTEGER_ARG_DEFINE(int, parallel_batch, 1000, 1, 100000, "number of rows per getScannerRows in parallel mode");
+STRING_ARG_DEFINE(splits, "", "split points separated by comma, e.g. region start keys");
+STRING_ARG_DEFINE(splits_file, "", "file of split points, one per line, e.g. region start keys");
+INTEGER_ARG_DEFINE(uint32_t, queue_size, 64, 1, 100000, "max number of batches buffered, memory is bounded by queue_size*parallel_batch rows");
+
 using namespace apache::hadoop;
 
+// 一个扫描区间[startrow, stoprow)，空表示不限
+struct ScanRange
+{
+    std::string startrow;
+    std::string stoprow;
+};
+
+static std::vector<ScanRange> sg_ranges;
+static atomic_t sg_range_index = 0; // 下一个待扫描的区间
+static atomic_t sg_failure_count = 0; // 扫描失败的区间数
+static mooon::utils::CLatencyHistogram* sg_histograms = NULL; // 每个线程一个，getScannerRows的延迟，单位为微秒
+
+// 扫描线程将每批结果放入队列，主线程取出输出，
+// 队列满时扫描线程等待，内存占用不超过queue_size*parallel_batch行，NULL表示一个扫描线程结束
+typedef mooon::sys::CEventQueue<mooon::utils::CArrayQueue<std::vector<hbase::thrift2::TResult>*> > ResultQueue;
+static ResultQueue* sg_result_queue = NULL;
+
+static void print_result(const hbase::thrift2::TResult& result);
+static int parallel_scan();
+static void scan_thread(uint16_t index);
+
 int main(int argc, char* argv[])
 {
     std::string errmsg;
@@ -68,7 +103,8 @@ int main(int argc, char* argv[])
         fprintf(stderr, "%s\n", mooon::utils::g_help_string.c_str());
         exit(1);
     }
-    if (mooon::argument::startrow->value().empty())
+    const bool parallel = (mooon::argument::parallel->value() > 1) || !mooon::argument::splits->value().empty() || !mooon::argument::splits_file->value().empty();
+    if (!parallel && mooon::argument::startrow->value().empty())
     {
         fprintf(stderr, "parameter[--startrow] not set\n");
         fprintf(stderr, "%s\n", mooon::utils::g_help_string.c_str());
@@ -84,12 +120,17 @@ int main(int argc, char* argv[])
         mooon::sys::g_logger->set_single_filesize(1024*1024);
 
         // 输出小量时，日志级别自动降为DEBUG，并且自动打开打屏
-        if ((1 == num) && (batch < 10))
+        if (!parallel && (1 == num) && (batch < 10))
         {
             mooon::sys::g_logger->set_log_level(mooon::sys::LOG_LEVEL_DEBUG);
             mooon::sys::g_logger->enable_screen(true);
         }
 
+        if (parallel)
+        {
+            return (parallel_scan() > 0)? 1: 0;
+        }
+
         int64_t total = 0; // 总的行数
         const std::string& stoprow = mooon::argument::stoprow->value();
         std::string startrow = mooon::argument::startrow->value();
@@ -129,16 +170,7 @@ int main(int argc, char* argv[])
 
                 const hbase::thrift2::TResult& result = results[row];
                 startrow = result.row;
-                MYLOG_DEBUG("ROWKEY[%s] =>\n", startrow.c_str());
-
-                for (std::vector<hbase::thrift2::TColumnValue>::size_type col=0; col<result.columnValues.size(); ++col)
-                {
-                    const hbase::thrift2::TColumnValue& column = result.columnValues[col];
-                    MYLOG_DEBUG("\tfamily => %s\n", column.family.c_str());
-                    MYLOG_DEBUG("\t\tqualifier => %s\n", column.qualifier.c_str());
-                    MYLOG_DEBUG("\t\t\tvalue => %s\n", column.value.c_str());
-                    MYLOG_DEBUG("\t\t\t\ttimestamp => %" PRId64"\n", column.timestamp);
-                }
+                print_result(result);
             }
 
             if (static_cast<int>(results.size()) < batch)
@@ -165,6 +197,387 @@ int main(int argc, char* argv[])
     {
         MYLOG_ERROR("%s\n", ex.what());
     }
+    catch (mooon::sys::CSyscallException& ex)
+    {
+        MYLOG_ERROR("%s\n", ex.str().c_str());
+    }
 
     return 0;
 }
+
+////////////////////////////////////////////////////////////////////////////////
+void print_result(const hbase::thrift2::TResult& result)
+{
+    MYLOG_DEBUG("ROWKEY[%s] =>\n", result.row.c_str());
+
+    for (std::vector<hbase::thrift2::TColumnValue>::size_type col=0; col<result.columnValues.size(); ++col)
+    {
+        const hbase::thrift2::TColumnValue& column = result.columnValues[col];
+        MYLOG_DEBUG("\tfamily => %s\n", column.family.c_str());
+        MYLOG_DEBUG("\t\tqualifier => %s\n", column.qualifier.c_str());
+        MYLOG_DEBUG("\t\t\tvalue => %s\n", column.value.c_str());
+        MYLOG_DEBUG("\t\t\t\ttimestamp => %" PRId64"\n", column.timestamp);
+    }
+}
+
+// 从key的offset处取8个字节，作为大端整数，不足8个字节的补0
+static uint64_t key2integer(const std::string& key, size_t offset)
+{
+    uint64_t n = 0;
+    for (size_t i=0; i<8; ++i)
+    {
+        const size_t pos = offset + i;
+        n = (n << 8) | ((pos < key.size())? static_cast<unsigned char>(key[pos]): 0);
+    }
+    return n;
+}
+
+// key2integer的逆过程，去掉尾部的0
+static std::string integer2key(uint64_t n)
+{
+    std::string key(8, '\0');
+    for (int i=7; i>=0; --i, n>>=8)
+        key[i] = static_cast<char>(n & 0xFF);
+
+    const std::string::size_type pos = key.find_last_not_of('\0');
+    return (std::string::npos == pos)? std::string(): key.substr(0, pos+1);
+}
+
+// 未指定分割点时，按字节值将[startrow, stoprow)均匀分成num_ranges段，
+// 先去掉startrow和stoprow的公共前缀，再对其后的8个字节做线性插值，
+// 适合散列过的行键，行键分布不均匀时应通过--splits或--splits_file指定Region的起始行键
+static void get_even_split_points(const std::string& startrow, const std::string& stoprow, int num_ranges, std::vector<std::string>* split_points)
+{
+    std::string::size_type prefix_length = 0;
+    if (!stoprow.empty())
+    {
+        while ((prefix_length < startrow.size()) && (prefix_length < stoprow.size()) && (startrow[prefix_length] == stoprow[prefix_length]))
+            ++prefix_length;
+    }
+
+    const std::string prefix = startrow.substr(0, prefix_length);
+    const uint64_t begin = key2integer(startrow, prefix_length);
+    const uint64_t end = stoprow.empty()? std::numeric_limits<uint64_t>::max(): key2integer(stoprow, prefix_length);
+    if (end <= begin)
+        return;
+
+    const uint64_t step = (end - begin) / num_ranges;
+    for (int i=1; (step>0) && (i<num_ranges); ++i)
+        split_points->push_back(prefix + integer2key(begin + step*i));
+}
+
+static void get_ranges(std::vector<ScanRange>* ranges)
+{
+    const std::string& startrow = mooon::argument::startrow->value();
+    const std::string& stoprow = mooon::argument::stoprow->value();
+    std::vector<std::string> split_points;
+
+    if (!mooon::argument::splits->value().empty())
+    {
+        mooon::utils::CTokener::split(&split_points, mooon::argument::splits->value(), ",", true);
+    }
+    if (!mooon::argument::splits_file->value().empty())
+    {
+        std::ifstream fs(mooon::argument::splits_file->value().c_str());
+        if (!fs)
+        {
+            THROW_SYSCALL_EXCEPTION(
+                    mooon::utils::CStringUtils::format_string("open file://%s failed: %s",
+                            mooon::argument::splits_file->c_value(), strerror(errno)),
+                    errno, "open");
+        }
+
+        std::string line;
+        while (std::getline(fs, line))
+        {
+            mooon::utils::CStringUtils::trim(line);
+            if (!line.empty())
+                split_points.push_back(line);
+        }
+    }
+    if (split_points.empty())
+    {
+        // 区间数多于线程数，由线程动态领取，以平衡各区间行数的差异
+        get_even_split_points(startrow, stoprow, mooon::argument::parallel->value()*4, &split_points);
+    }
+
+    // 只保留落在(startrow, stoprow)内的分割点
+    std::sort(split_points.begin(), split_points.end());
+    split_points.erase(std::unique(split_points.begin(), split_points.end()), split_points.end());
+
+    ScanRange range;
+    range.startrow = startrow;
+    for (std::vector<std::string>::size_type i=0; i<split_points.size(); ++i)
+    {
+        const std::string& split_point = split_points[i];
+        if (split_point.empty() || (split_point <= startrow))
+            continue;
+        if (!stoprow.empty() && (split_point >= stoprow))
+            break;
+
+        range.stoprow = split_point;
+        ranges->push_back(range);
+        range.startrow = split_point;
+    }
+
+    range.stoprow = stoprow;
+    ranges->push_back(range);
+}
+
+// 队列满时等待主线程取走，从而限制内存
+static void push_results(std::vector<hbase::thrift2::TResult>* results)
+{
+    while (!sg_result_queue->push_back(results));
+}
+
+// 返回扫描失败的区间数
+int parallel_scan()
+{
+    get_ranges(&sg_ranges);
+
+    const uint16_t num_threads = static_cast<uint16_t>(std::min<size_t>(mooon::argument::parallel->value(), sg_ranges.size()));
+    MYLOG_INFO("scan %zd ranges with %u threads\n", sg_ranges.size(), static_cast<unsigned int>(num_threads));
+    for (std::vector<ScanRange>::size_type i=0; i<sg_ranges.size(); ++i)
+        MYLOG_DEBUG("range[%zd]: [%s, %s)\n", i, sg_ranges[i].startrow.c_str(), sg_ranges[i].stoprow.c_str());
+
+    mooon::sys::CStopWatch stop_watch;
+    sg_result_queue = new ResultQueue(mooon::argument::queue_size->value(), 1000, 1000);
+    sg_histograms = new mooon::utils::CLatencyHistogram[num_threads];
+    mooon::sys::CThreadEngine** scan_threads = new mooon::sys::CThreadEngine*[num_threads];
+    for (uint16_t i=0; i<num_threads; ++i)
+        scan_threads[i] = new mooon::sys::CThreadEngine(mooon::sys::bind(scan_thread, i));
+
+    // 各线程的结果交错输出，不保证行键有序
+    int64_t total = 0; // 总的行数
+    for (uint16_t ended_threads=0; ended_threads<num_threads;)
+    {
+        std::vector<hbase::thrift2::TResult>* results = NULL;
+        if (!sg_result_queue->pop_front(results))
+            continue;
+        if (NULL == results)
+        {
+            ++ended_threads;
+            continue;
+        }
+
+        for (std::vector<hbase::thrift2::TResult>::size_type row=0; row<results->size(); ++row)
+        {
+            const hbase::thrift2::TResult& result = (*results)[row];
+            if (0 == ++total%10000)
+            {
+                MYLOG_INFO("[%" PRId64"] %s\n", total, result.row.c_str());
+            }
+            print_result(result);
+        }
+        delete results;
+    }
+
+    mooon::utils::CLatencyHistogram histogram;
+    for (uint16_t i=0; i<num_threads; ++i)
+    {
+        scan_threads[i]->join();
+        delete scan_threads[i];
+        histogram.merge(sg_histograms[i]);
+    }
+    delete []scan_threads;
+    delete []sg_histograms;
+    delete sg_result_queue;
+    sg_histograms = NULL;
+    sg_result_queue = NULL;
+
+    const double seconds = static_cast<double>(stop_watch.get_elapsed_microseconds()) / 1000000;
+    MYLOG_INFO("[FINISH] number of rows: %" PRId64", ranges: %zd, failed ranges: %d, seconds: %.3f, ROWS/s: %.1f\n",
+            total, sg_ranges.size(), static_cast<int>(atomic_read(&sg_failure_count)), seconds, (seconds > 0)? total/seconds: 0.0);
+    MYLOG_INFO("getScannerRows latency(us): count=%" PRIu64", avg=%" PRIu64", p50=%" PRIu64", p99=%" PRIu64", p999=%" PRIu64", max=%" PRIu64"\n",
+            histogram.get_count(), histogram.get_mean(), histogram.get_percentile(50.0),
+            histogram.get_percentile(99.0), histogram.get_percentile(99.9), histogram.get_max());
+    return static_cast<int>(atomic_read(&sg_failure_count));
+}
+
+// 尽力关闭scanner，出错时忽略，未关闭的scanner在租约到期后由HBase回收
+static void close_scanner(mooon::net::CThriftClientHelper<hbase::thrift2::THBaseServiceClient>& hbase, int32_t scanner_id)
+{
+    try
+    {
+        if (hbase.is_connected())
+            hbase->closeScanner(scanner_id);
+    }
+    catch (apache::thrift::TException& ex)
+    {
+        MYLOG_DEBUG("closeScanner(%d) exception(%s): %s\n", scanner_id, hbase.str().c_str(), ex.what());
+    }
+}
+
+// 去掉重新打开scanner后重复取到的列，
+// 指定了--batch_size时一行可被拆成多个TResult，出错时最后一行可能只取到了部分列，
+// 因此从最后一行（含）重新开始，并跳过它已取到的skip_columns列
+static void skip_fetched_columns(std::vector<hbase::thrift2::TResult>* results, const std::string& row, size_t* skip_columns)
+{
+    std::vector<hbase::thrift2::TResult>::iterator iter = results->begin();
+
+    while ((*skip_columns > 0) && (iter != results->end()) && (iter->row == row))
+    {
+        std::vector<hbase::thrift2::TColumnValue>& column_values = iter->columnValues;
+        const size_t n = std::min(*skip_columns, column_values.size());
+
+        column_values.erase(column_values.begin(), column_values.begin()+n);
+        *skip_columns -= n;
+        if (column_values.empty())
+            iter = results->erase(iter);
+        else
+            ++iter;
+    }
+    if ((iter != results->end()) && (iter->row != row))
+        *skip_columns = 0; // 该行已取完
+}
+
+// 扫描一个区间，出错时关闭scanner，从已取到的最后一行之后重新打开，最多重试3次，
+// 指定了--batch_size时从最后一行（含）重新打开，以免丢掉该行未取到的列
+static bool scan_range(mooon::net::CThriftClientHelper<hbase::thrift2::THBaseServiceClient>& hbase, const ScanRange& range, mooon::utils::CLatencyHistogram& histogram)
+{
+    const bool partial_rows = mooon::argument::batch_size->value() > 0;
+    std::string last_row;        // 已取到的最后一行
+    size_t last_row_columns = 0; // 最后一行已取到的列数
+    std::string startrow = range.startrow;
+
+    for (int retries=0; ; ++retries)
+    {
+        int32_t scanner_id = -1;
+
+        try
+        {
+            if (!hbase.is_connected())
+                hbase.connect();
+
+            size_t skip_columns = 0;
+            if (!last_row.empty())
+            {
+                if (partial_rows)
+                {
+                    startrow = last_row;
+                    skip_columns = last_row_columns;
+                }
+                else
+                {
+                    // 最后一行之后紧接的行键
+                    startrow = last_row;
+                    startrow.push_back('\0');
+                }
+            }
+
+            hbase::thrift2::TScan scan;
+            if (!startrow.empty())
+            {
+                scan.__set_startRow(startrow);
+            }
+            if (!range.stoprow.empty())
+            {
+                scan.__set_stopRow(range.stoprow);
+            }
+            if (mooon::argument::caching->value() > 0)
+            {
+                scan.__set_caching(mooon::argument::caching->value());
+            }
+            if (partial_rows)
+            {
+                scan.__set_batchSize(mooon::argument::batch_size->value());
+            }
+
+            scanner_id = hbase->openScanner(mooon::argument::table->value(), scan);
+            while (true)
+            {
+                std::vector<hbase::thrift2::TResult>* results = new std::vector<hbase::thrift2::TResult>;
+                mooon::sys::CStopWatch stop_watch;
+
+                try
+                {
+                    hbase->getScannerRows(*results, scanner_id, mooon::argument::parallel_batch->value());
+                    histogram.record(stop_watch.get_elapsed_microseconds());
+                }
+                catch (...)
+                {
+                    delete results;
+                    throw;
+                }
+                if (results->empty())
+                {
+                    delete results;
+                    break;
+                }
+
+                if (skip_columns > 0)
+                {
+                    skip_fetched_columns(results, last_row, &skip_columns);
+                    if (results->empty())
+                    {
+                        delete results;
+                        continue;
+                    }
+                }
+                for (std::vector<hbase::thrift2::TResult>::size_type row=0; row<results->size(); ++row)
+                {
+                    const hbase::thrift2::TResult& result = (*results)[row];
+                    if (result.row == last_row)
+                    {
+                        last_row_columns += result.columnValues.size();
+                    }
+                    else
+                    {
+                        last_row = result.row;
+                        last_row_columns = result.columnValues.size();
+                    }
+                }
+                push_results(results);
+            }
+
+            hbase->closeScanner(scanner_id);
+            return true;
+        }
+        catch (apache::thrift::transport::TTransportException& ex)
+        {
+            // 连接已不可用，scanner留给HBase在租约到期后回收
+            MYLOG_ERROR("[%s, %s) transport exception(%s): (%d)%s\n", startrow.c_str(), range.stoprow.c_str(), hbase.str().c_str(), ex.getType(), ex.what());
+            hbase.close();
+        }
+        catch (hbase::thrift2::TIOError& ex)
+        {
+            MYLOG_ERROR("[%s, %s) TIOError(%s): %s\n", startrow.c_str(), range.stoprow.c_str(), hbase.str().c_str(), ex.message.c_str());
+            if (scanner_id != -1)
+                close_scanner(hbase, scanner_id);
+        }
+        catch (hbase::thrift2::TIllegalArgument& ex)
+        {
+            // 如scanner租约已过期
+            MYLOG_ERROR("[%s, %s) TIllegalArgument(%s): %s\n", startrow.c_str(), range.stoprow.c_str(), hbase.str().c_str(), ex.message.c_str());
+            if (scanner_id != -1)
+                close_scanner(hbase, scanner_id);
+        }
+        catch (apache::thrift::TException& ex)
+        {
+            MYLOG_ERROR("[%s, %s) thrift exception(%s): %s\n", startrow.c_str(), range.stoprow.c_str(), hbase.str().c_str(), ex.what());
+            if (scanner_id != -1)
+                close_scanner(hbase, scanner_id);
+            hbase.close();
+        }
+
+        if (retries >= 3)
+            return false;
+    }
+}
+
+void scan_thread(uint16_t index)
+{
+    mooon::net::CThriftClientHelper<hbase::thrift2::THBaseServiceClient> hbase(mooon::argument::hbase_ip->value(), mooon::argument::hbase_port->value(), mooon::argument::timeout->value()*1000, mooon::argument::timeout->value()*1000, mooon::argument::timeout->value()*1000);
+
+    while (true)
+    {
+        const int range_index = atomic_add_return(1, &sg_range_index) - 1;
+        if (range_index >= static_cast<int>(sg_ranges.size()))
+            break;
+
+        if (!scan_range(hbase, sg_ranges[range_index], sg_histograms[index]))
+            atomic_inc(&sg_failure_count);
+    }
+
+    push_results(NULL);
+}
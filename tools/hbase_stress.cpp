@@ -24,6 +24,7 @@
 #include <mooon/sys/thread_engine.h>
 #include <mooon/sys/utils.h>
 #include <mooon/utils/args_parser.h>
+#include <mooon/utils/latency_histogram.h>
 #include <mooon/utils/string_utils.h>
 #include <mooon/utils/tokener.h>
 
@@ -36,17 +37,22 @@ INTEGER_ARG_DEFINE(uint8_t, num_columns, 1, 1, std::numeric_limits<uint8_t>::max
 INTEGER_ARG_DEFINE(uint32_t, num_rows, 1, 1, std::numeric_limits<uint32_t>::max(), "number of rows");
 INTEGER_ARG_DEFINE(uint16_t, value_length, 10, 1, std::numeric_limits<uint16_t>::max(), "length of value");
 INTEGER_ARG_DEFINE(uint16_t, timeout, 10, 1, std::numeric_limits<uint16_t>::max(), "timeout seconds of thrift");
-INTEGER_ARG_DEFINE(uint8_t, test, 2, 0, 2, "0: test all, 1: test write only, 2: test read onley");
+INTEGER_ARG_DEFINE(uint8_t, test, 2, 0, 3, "0: test all, 1: test write only, 2: test read onley, 3: bulk write with putMultiple");
+INTEGER_ARG_DEFINE(uint16_t, batch, 100, 1, 10000, "number of rows per putMultiple, only for --test=3");
 
 static atomic_t sg_success_count = 0;
 static atomic_t sg_failure_count = 0;
 static atomic_t sg_empty_count = 0; // 读操作未取到数据的个数
 static atomic_t sg_thread_count = 0; // 当前仍然在工作的线程数
+static atomic_t sg_batch_count = 0; // 批量写成功的putMultiple次数
+static mooon::utils::CLatencyHistogram* sg_histograms = NULL; // 批量写时每个线程一个，单位为微秒
 
 static void test_write(const std::map<std::string, std::string>& hbase_nodes);
 static void test_read(const std::map<std::string, std::string>& hbase_nodes);
+static void test_bulk_write(const std::map<std::string, std::string>& hbase_nodes);
 static void write_thread(uint16_t index, std::string hbase_ip, uint16_t hbase_port);
 static void read_thread(uint16_t index, std::string hbase_ip, uint16_t hbase_port);
+static void bulk_write_thread(uint16_t index, std::string hbase_ip, uint16_t hbase_port);
 
 int main(int argc, char* argv[])
 {
@@ -77,6 +83,10 @@ int main(int argc, char* argv[])
     {
         test_read(hbase_nodes);
     }
+    else if (3 == mooon::argument::test->value())
+    {
+        test_bulk_write(hbase_nodes);
+    }
 
     return 0;
 }
@@ -91,6 +101,22 @@ std::string get_rowkey(uint32_t row, int index)
         return mooon::utils::CStringUtils::format_string("%s_%u%u%d", mooon::argument::prefix->c_value(), random_number, row, index);
 }
 
+void make_put(uint32_t row, int index, apache::hadoop::hbase::thrift2::TPut* put)
+{
+    std::vector<apache::hadoop::hbase::thrift2::TColumnValue> columns_value(mooon::argument::num_columns->value());
+    for (uint8_t col=0; col<mooon::argument::num_columns->value(); ++col)
+    {
+        const std::string column_name = mooon::utils::CStringUtils::format_string("field%d", col);
+        const std::string column_value(mooon::argument::value_length->value(), '#');
+        columns_value[col].__set_family("cf1");
+        columns_value[col].__set_qualifier(column_name);
+        columns_value[col].__set_value(column_value);
+    }
+
+    put->__set_row(get_rowkey(row, index));
+    put->__set_columnValues(columns_value);
+}
+
 void test_write(const std::map<std::string, std::string>& hbase_nodes)
 {
     try
@@ -178,27 +204,67 @@ void test_read(const std::map<std::string, std::string>& hbase_nodes)
     }
 }
 
-void write_thread(uint16_t index, std::string hbase_ip, uint16_t hbase_port)
+// 批量写，每次putMultiple写--batch行，
+// 输出行数吞吐（ROWS/s）、批次吞吐（QPS）以及每次putMultiple的延迟分布
+void test_bulk_write(const std::map<std::string, std::string>& hbase_nodes)
 {
-    mooon::net::CThriftClientHelper<apache::hadoop::hbase::thrift2::THBaseServiceClient> hbase(hbase_ip, hbase_port, mooon::argument::timeout->value()*1000, mooon::argument::timeout->value()*1000, mooon::argument::timeout->value()*1000);
-
-    for (uint32_t row=0; row<mooon::argument::num_rows->value(); ++row)
+    try
     {
-        const std::string rowkey = get_rowkey(row, index);
+        mooon::sys::CStopWatch stop_watch;
+        mooon::sys::CThreadEngine** stress_threads = new mooon::sys::CThreadEngine*[mooon::argument::threads->value()];
+        sg_histograms = new mooon::utils::CLatencyHistogram[mooon::argument::threads->value()];
 
-        std::vector<apache::hadoop::hbase::thrift2::TColumnValue> columns_value(mooon::argument::num_columns->value());
-        for (uint8_t col=0; col<mooon::argument::num_columns->value(); ++col)
+        atomic_set(&sg_thread_count, mooon::argument::threads->value());
+        for (uint16_t i=0,j=0; i<mooon::argument::threads->value(); ++i,++j)
         {
-            const std::string column_name = mooon::utils::CStringUtils::format_string("field%d", col);
-            const std::string column_value(mooon::argument::value_length->value(), '#');
-            columns_value[col].__set_family("cf1");
-            columns_value[col].__set_qualifier(column_name);
-            columns_value[col].__set_value(column_value);
+            if (j >= hbase_nodes.size())
+                j = 0;
+            std::map<std::string, std::string>::const_iterator iter = hbase_nodes.begin();
+            std::advance(iter, j);
+
+            const std::string hbase_ip = iter->first;
+            const uint16_t hbase_port = mooon::utils::CStringUtils::string2int<uint16_t>(iter->second);
+            stress_threads[i] = new mooon::sys::CThreadEngine(mooon::sys::bind(bulk_write_thread, i, hbase_ip, hbase_port));
+        }
+
+        mooon::utils::CLatencyHistogram histogram;
+        for (uint16_t i=0; i<mooon::argument::threads->value(); ++i)
+        {
+            stress_threads[i]->join();
+            delete stress_threads[i];
+            histogram.merge(sg_histograms[i]);
         }
+        delete []stress_threads;
+        delete []sg_histograms;
+        sg_histograms = NULL;
+
+        uint64_t microseconds = stop_watch.get_elapsed_microseconds();
+        uint32_t milliseconds = static_cast<uint32_t>(microseconds / 1000);
+        uint32_t success = static_cast<uint32_t>(atomic_read(&sg_success_count));
+        uint32_t failure = static_cast<uint32_t>(atomic_read(&sg_failure_count));
+        uint32_t batches = static_cast<uint32_t>(atomic_read(&sg_batch_count));
+        const double seconds = static_cast<double>(microseconds) / 1000000;
+        MYLOG_INFO("seconds: %.3f, milliseconds: %u, batch: %u\n", seconds, milliseconds, mooon::argument::batch->value());
+        MYLOG_INFO("SUCCESS ROWS: %u, FAILURE ROWS: %u, BATCHES: %u\n", success, failure, batches);
+        MYLOG_INFO("ROWS/s: %.1f, QPS: %.1f\n", (seconds > 0)? success/seconds: 0.0, (seconds > 0)? batches/seconds: 0.0);
+        MYLOG_INFO("putMultiple latency(us): avg=%" PRIu64", min=%" PRIu64", p50=%" PRIu64", p90=%" PRIu64", p99=%" PRIu64", p999=%" PRIu64", max=%" PRIu64"\n",
+                histogram.get_mean(), histogram.get_min(), histogram.get_percentile(50.0), histogram.get_percentile(90.0),
+                histogram.get_percentile(99.0), histogram.get_percentile(99.9), histogram.get_max());
+    }
+    catch (mooon::sys::CSyscallException& ex)
+    {
+        MYLOG_ERROR("%s\n", ex.str().c_str());
+    }
+}
+
+void write_thread(uint16_t index, std::string hbase_ip, uint16_t hbase_port)
+{
+    mooon::net::CThriftClientHelper<apache::hadoop::hbase::thrift2::THBaseServiceClient> hbase(hbase_ip, hbase_port, mooon::argument::timeout->value()*1000, mooon::argument::timeout->value()*1000, mooon::argument::timeout->value()*1000);
 
+    for (uint32_t row=0; row<mooon::argument::num_rows->value(); ++row)
+    {
         apache::hadoop::hbase::thrift2::TPut put;
-        put.__set_row(rowkey);
-        put.__set_columnValues(columns_value);
+        make_put(row, index, &put);
 
         bool to_continue = true;
         while (true)
@@ -334,3 +400,80 @@ void read_thread(uint16_t index, std::string hbase_ip, uint16_t hbase_port)
     MYLOG_INFO("read thread[%u] ended: %d\n", static_cast<unsigned int>(pthread_self()), static_cast<int>(atomic_read(&sg_thread_count)));
 }
 
+void bulk_write_thread(uint16_t index, std::string hbase_ip, uint16_t hbase_port)
+{
+    mooon::net::CThriftClientHelper<apache::hadoop::hbase::thrift2::THBaseServiceClient> hbase(hbase_ip, hbase_port, mooon::argument::timeout->value()*1000, mooon::argument::timeout->value()*1000, mooon::argument::timeout->value()*1000);
+    mooon::utils::CLatencyHistogram& histogram = sg_histograms[index];
+    std::vector<apache::hadoop::hbase::thrift2::TPut> puts;
+    puts.reserve(mooon::argument::batch->value());
+
+    for (uint32_t row=0; row<mooon::argument::num_rows->value();)
+    {
+        puts.clear();
+        for (; (row<mooon::argument::num_rows->value()) && (puts.size()<mooon::argument::batch->value()); ++row)
+        {
+            puts.push_back(apache::hadoop::hbase::thrift2::TPut());
+            make_put(row, index, &puts.back());
+        }
+
+        const int num_puts = static_cast<int>(puts.size());
+        int retries = 0;
+        bool to_continue = true;
+        while (true)
+        {
+            mooon::sys::CStopWatch stop_watch;
+
+            try
+            {
+                if (!hbase.is_connected())
+                    hbase.connect();
+
+                hbase->putMultiple(mooon::argument::table->value(), puts);
+                histogram.record(stop_watch.get_elapsed_microseconds());
+                atomic_inc(&sg_batch_count);
+
+                const uint32_t success_count = static_cast<uint32_t>(atomic_add_return(num_puts, &sg_success_count));
+                if (success_count/10000 != (success_count-num_puts)/10000)
+                {
+                    MYLOG_INFO("number of write: %u\n", success_count);
+                }
+
+                break;
+            }
+            catch (apache::thrift::transport::TTransportException& ex)
+            {
+                MYLOG_ERROR("(%" PRIu64"us) TransportException(%s): %s\n", stop_watch.get_elapsed_microseconds(), hbase.str().c_str(), ex.what());
+                hbase.close();
+                atomic_add(num_puts, &sg_failure_count);
+            }
+            catch (apache::hadoop::hbase::thrift2::TIOError& ex)
+            {
+                // putMultiple失败时可能已有部分行写入，重试会覆盖写，结果是幂等的，
+                // 连续失败3次则放弃本批，继续下一批
+                MYLOG_ERROR("TIOError(%s): %s\n", hbase.str().c_str(), ex.message.c_str());
+                atomic_add(num_puts, &sg_failure_count);
+                if (++retries >= 3)
+                    break;
+            }
+            catch (apache::thrift::TApplicationException& ex)
+            {
+                MYLOG_ERROR("ApplicationException(%s): %s\n", hbase.str().c_str(), ex.what());
+                atomic_add(num_puts, &sg_failure_count);
+                to_continue = false;
+                break;
+            }
+            catch (apache::thrift::TException& ex)
+            {
+                MYLOG_ERROR("ThriftException(%s): %s\n", hbase.str().c_str(), ex.what());
+                atomic_add(num_puts, &sg_failure_count);
+                to_continue = false;
+                break;
+            }
+        }
+        if (!to_continue)
+            break;
+    }
+
+    atomic_dec(&sg_thread_count);
+    MYLOG_INFO("bulk write thread[%u] ended: %d\n", static_cast<unsigned int>(pthread_self()), static_cast<int>(atomic_read(&sg_thread_count)));
+}
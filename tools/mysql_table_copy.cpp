@@ -8,6 +8,16 @@
 // 失败信息标识为“FAILED”，成功信息标识为“SUCCESS”。
 // 如果数据不为空，则在成功标识“SUCCESS”后紧跟第一个字段的最新值，
 // 如果这是一个自增字段值，则可借助这个值实现增量复制。
+//
+// 指定了“--stable”和“--pk”时为并行模式（不使用“--sql”）：
+// 按整数主键的取值范围切分成多段（每段“--chunk_size”个主键值），
+// 由“--threads”个线程并行复制，每个线程各有一对源和目标连接，
+// 段内按主键分页（每页最多“--hdlimit”行）读取，
+// 写入时将多行合并成一条“INSERT ... VALUES (...),(...)”，大小受目标库max_allowed_packet限制，
+// 或者指定“--load_data=true”以“LOAD DATA LOCAL INFILE”方式流式写入（需目标库开启local_infile）。
+// 运行中每“--progress_interval”秒输出一次进度和预计剩余时间，
+// 出错时输出出错的主键范围，可通过“--pk_begin”和“--pk_end”只复制指定范围，
+// 成功标识“SUCCESS”后紧跟已复制的最大主键值。
 #include <mooon/sys/datetime_utils.h>
 #include <mooon/sys/mysql_db.h>
 #include <mooon/sys/signal_handler.h>
@@ -16,6 +26,11 @@
 #include <mooon/utils/args_parser.h>
 #include <mooon/utils/print_color.h>
 #include <mooon/utils/string_utils.h>
+#include <mysql/errmsg.h>
+#include <mysql/mysql.h>
+#include <atomic>
+#include <memory>
+#include <thread>
 
 // Source database
 STRING_ARG_DEFINE(shost, "127.0.0.1", "Source database host, example: --shost=127.0.0.1");
@@ -51,6 +66,19 @@ BOOL_STRING_ARG_DEFINE(verbose, "false", "Displays runtime details, example: --v
 // 单次查询数据条数硬限制（0表示不限制）
 INTEGER_ARG_DEFINE(int, hdlimit, 10000, 0, std::numeric_limits<int>::max(), "The number of records for a single query, example: --hdlimit=100000");
 
+// 并行模式
+STRING_ARG_DEFINE(stable, "", "Source table for parallel copy, example: --stable=test");
+STRING_ARG_DEFINE(sfields, "*", "Source table fields for parallel copy, example: --sfields=a,b,c,d");
+STRING_ARG_DEFINE(swhere, "", "Additional condition for parallel copy, example: --swhere='f_state=1'");
+STRING_ARG_DEFINE(pk, "", "Integer primary key of source table for parallel copy, example: --pk=f_id");
+STRING_ARG_DEFINE(pk_begin, "", "Copy from this primary key value (including), default is MIN(pk), example: --pk_begin=1");
+STRING_ARG_DEFINE(pk_end, "", "Copy to this primary key value (including), default is MAX(pk), example: --pk_end=300000000");
+INTEGER_ARG_DEFINE(int, threads, 1, 1, 256, "Number of parallel copy threads, each has a pair of connections, example: --threads=8");
+INTEGER_ARG_DEFINE(int64_t, chunk_size, 100000, 1, std::numeric_limits<int64_t>::max(), "Number of primary key values of a chunk, example: --chunk_size=100000");
+INTEGER_ARG_DEFINE(int, batch_bytes, 0, 0, 1024*1024*1024, "Max bytes of a INSERT statement, 0 for 90% of max_allowed_packet of destination, example: --batch_bytes=4194304");
+BOOL_STRING_ARG_DEFINE(load_data, "false", "If true write by LOAD DATA LOCAL INFILE instead of INSERT, example: --load_data=true");
+INTEGER_ARG_DEFINE(int, progress_interval, 10, 1, 3600, "Seconds to print progress, example: --progress_interval=10");
+
 class CTableCopyer
 {
 public:
@@ -67,6 +95,82 @@ private:
     mooon::sys::CMySQLConnection _destination_mysql;
 };
 
+// 并行复制中的单个线程，有自己的源和目标连接
+class CCopyWorker
+{
+public:
+    CCopyWorker(int index, size_t batch_bytes);
+    bool init();
+    void run();
+
+    const std::string& get_errmsg() const { return _errmsg; }
+    uint64_t get_rows() const { return _rows; }
+    uint64_t get_affected_rows() const { return _affected_rows; }
+    int64_t get_max_pk() const { return _max_pk; }
+    bool has_max_pk() const { return _has_max_pk; }
+
+public:
+    // LOAD DATA LOCAL INFILE的回调，从_batch中读取
+    static int local_infile_init(void** ptr, const char* filename, void* userdata);
+    static int local_infile_read(void* ptr, char* buf, unsigned int buf_len);
+    static void local_infile_end(void* ptr);
+    static int local_infile_error(void* ptr, char* error_msg, unsigned int error_msg_len);
+
+private:
+    void copy_chunk(int64_t begin, int64_t end);
+    void append_row(const mooon::sys::DBRow& dbrow);
+    void flush();
+
+private:
+    int _index;
+    size_t _batch_bytes;
+    std::string _insert_prefix;
+    std::string _select_fields; // 主键之后的查询字段
+    std::string _batch;       // INSERT语句或LOAD DATA的数据
+    std::string _insert_sql;  // 完整的INSERT语句，跨flush复用，避免每次重新分配
+    size_t _batch_rows;
+    size_t _batch_offset;     // LOAD DATA已读取的位置
+    std::string _errmsg;
+    uint64_t _rows;
+    uint64_t _affected_rows;
+    int64_t _max_pk;
+    bool _has_max_pk;
+    std::shared_ptr<mooon::sys::CMySQLConnection> _source_mysql;
+    std::shared_ptr<mooon::sys::CMySQLConnection> _destination_mysql;
+};
+
+// 并行复制，按主键范围切分，由多个CCopyWorker并行执行
+class CParallelTableCopyer
+{
+public:
+    int copy();
+
+    // 取下一段，没有时返回false
+    bool get_next_chunk(int64_t* begin, int64_t* end);
+    void finish_chunk(int64_t begin, int64_t end, uint64_t rows);
+    bool is_stopped() const { return _stop; }
+    void stop() { _stop = true; }
+
+private:
+    bool init_range();
+    size_t get_batch_bytes();
+    void print_progress(mooon::sys::CStopWatch& stopwatch);
+    void print_cost(_IO_FILE* stdxxx, mooon::sys::CStopWatch& stopwatch);
+
+private:
+    int64_t _pk_begin;
+    int64_t _pk_end;
+    uint64_t _chunks;
+    std::atomic<uint64_t> _next_chunk;
+    std::atomic<uint64_t> _finished_keys; // 已完成的主键值个数，用于计算进度
+    std::atomic<uint64_t> _rows;
+    std::atomic<bool> _stop;
+};
+
+static CParallelTableCopyer* sg_parallel_copyer = NULL;
+// 用来识别NULL值，以在目标中写入NULL，而不是空字符串
+static const std::string sg_null_value("\x01$NULL$\x01");
+
 static void usage()
 {
     fprintf(stderr, "Exit codes:\n");
@@ -92,6 +196,7 @@ int main(int argc, char* argv[])
         usage();
         return 1;
     }
+    const bool parallel = !mooon::argument::stable->value().empty() || !mooon::argument::pk->value().empty();
 
     // --shost
     if (mooon::argument::shost->value().empty())
@@ -121,8 +226,15 @@ int main(int argc, char* argv[])
         usage();
         return 1;
     }
+    // --stable和--pk
+    if (parallel && (mooon::argument::stable->value().empty() || mooon::argument::pk->value().empty()))
+    {
+        fprintf(stderr, "Parameter[--stable] and parameter[--pk] should be set together.\n\n");
+        usage();
+        return 1;
+    }
     // --sql
-    if (mooon::argument::sql->value().empty())
+    if (!parallel && mooon::argument::sql->value().empty())
     {
         fprintf(stderr, "Parameter[--sql] is not set.\n\n");
         usage();
@@ -167,6 +279,12 @@ int main(int argc, char* argv[])
         return 1;
     }
 
+    if (parallel)
+    {
+        CParallelTableCopyer copyer;
+        sg_parallel_copyer = &copyer;
+        return copyer.copy();
+    }
     return CTableCopyer().copy();
 }
 
@@ -393,3 +511,490 @@ void CTableCopyer::print_cost(_IO_FILE* stdxxx, mooon::sys::CStopWatch& stopwatc
     const double seconds = microseconds / (1000000.0);
     fprintf(stdxxx, "COST: %.3fs (%" PRIu64"us)\n", seconds, microseconds);
 }
+
+////////////////////////////////////////////////////////////////////////////////
+static void init_mysql(mooon::sys::CMySQLConnection* mysql, bool source)
+{
+    if (source)
+    {
+        mysql->set_null_value(sg_null_value);
+        mysql->set_host(mooon::argument::shost->value(), mooon::argument::sport->value());
+        mysql->set_db_name(mooon::argument::sname->value());
+        mysql->set_user(mooon::argument::suser->value(), mooon::argument::spassword->value());
+        mysql->set_connect_timeout_seconds(mooon::argument::sconntimeout->value());
+        mysql->set_read_timeout_seconds(mooon::argument::sreadtimeout->value());
+    }
+    else
+    {
+        mysql->set_host(mooon::argument::dhost->value(), mooon::argument::dport->value());
+        mysql->set_db_name(mooon::argument::dname->value());
+        mysql->set_user(mooon::argument::duser->value(), mooon::argument::dpassword->value());
+        mysql->set_connect_timeout_seconds(mooon::argument::dconntimeout->value());
+        mysql->set_write_timeout_seconds(mooon::argument::dwritetimeout->value());
+        mysql->set_read_timeout_seconds(mooon::argument::dreadtimeout->value());
+    }
+    mysql->enable_auto_reconnect(true);
+    mysql->open();
+}
+
+// 条件部分，不含WHERE
+static std::string get_condition(const char* pk_condition)
+{
+    if (mooon::argument::swhere->value().empty())
+        return pk_condition;
+    else
+        return mooon::utils::CStringUtils::format_string("(%s) AND %s", mooon::argument::swhere->c_value(), pk_condition);
+}
+
+CCopyWorker::CCopyWorker(int index, size_t batch_bytes)
+    : _index(index), _batch_bytes(batch_bytes), _batch_rows(0), _batch_offset(0),
+      _rows(0), _affected_rows(0), _max_pk(0), _has_max_pk(false)
+{
+    const char* ignore_str = mooon::argument::ignore->is_true()? " IGNORE ": " ";
+    const bool all_fields = mooon::argument::dfields->value().empty() || mooon::argument::dfields->value()=="*";
+    const std::string fields_str = all_fields? std::string(""): std::string(" (") + mooon::argument::dfields->value() + std::string(")");
+
+    // 主键总是作为第一列，“SELECT pk,* FROM t”是语法错误，须写成“SELECT pk,t.* FROM t”
+    const std::string sfields = mooon::utils::CStringUtils::trim(mooon::argument::sfields->value());
+    if (sfields.empty() || (sfields == "*"))
+        _select_fields = mooon::argument::stable->value() + std::string(".*");
+    else
+        _select_fields = sfields;
+
+    // LOCAL时重复键只产生告警，相当于总是IGNORE
+    if (mooon::argument::load_data->is_true())
+        _insert_prefix = mooon::utils::CStringUtils::format_string(
+                "LOAD DATA LOCAL INFILE 'mysql_table_copy'%sINTO TABLE %s%s",
+                ignore_str, mooon::argument::dtable->c_value(), fields_str.c_str());
+    else
+        _insert_prefix = mooon::utils::CStringUtils::format_string(
+                "INSERT%sINTO %s%s VALUES ",
+                ignore_str, mooon::argument::dtable->c_value(), fields_str.c_str());
+}
+
+bool CCopyWorker::init()
+{
+    try
+    {
+        _source_mysql.reset(new mooon::sys::CMySQLConnection);
+        init_mysql(_source_mysql.get(), true);
+
+        if (mooon::argument::test->is_false())
+        {
+            // 批量INSERT由update_sql直接执行，不经过update的格式化缓冲区，
+            // 因为update每次调用都会按构造时指定的大小分配缓冲区，所以这里保持默认大小
+            _destination_mysql.reset(new mooon::sys::CMySQLConnection);
+            if (mooon::argument::load_data->is_true())
+                _destination_mysql->enable_local_infile(true); // 须在连接之前
+            init_mysql(_destination_mysql.get(), false);
+
+            if (mooon::argument::load_data->is_true())
+            {
+                // 数据从内存中的批次读取，而不是本地文件，自动重连保留同一个MYSQL对象，不需要重新设置
+                MYSQL* mysql_handle = static_cast<MYSQL*>(_destination_mysql->get_mysql_handle());
+                mysql_set_local_infile_handler(mysql_handle,
+                        local_infile_init, local_infile_read, local_infile_end, local_infile_error, this);
+            }
+        }
+        return true;
+    }
+    catch (mooon::sys::CDBException& ex)
+    {
+        _errmsg = mooon::utils::CStringUtils::format_string("[WORKER-%d] initialize MySQL failed: %s", _index, ex.str().c_str());
+        return false;
+    }
+}
+
+void CCopyWorker::run()
+{
+    int64_t begin = 0;
+    int64_t end = 0;
+
+    while (sg_parallel_copyer->get_next_chunk(&begin, &end))
+    {
+        try
+        {
+            const uint64_t rows = _rows;
+            copy_chunk(begin, end);
+            sg_parallel_copyer->finish_chunk(begin, end, _rows-rows);
+        }
+        catch (mooon::sys::CDBException& ex)
+        {
+            _errmsg = mooon::utils::CStringUtils::format_string(
+                    "[WORKER-%d] copy [%" PRId64", %" PRId64"] failed: %s", _index, begin, end, ex.str().c_str());
+            sg_parallel_copyer->stop();
+            break;
+        }
+    }
+}
+
+// 按主键分页读取[begin, end]，避免单次查询数据量过大，
+// 第一列为主键，用来确定下一页的开始位置，不写入目标
+void CCopyWorker::copy_chunk(int64_t begin, int64_t end)
+{
+    int64_t cursor = begin;
+
+    while (!sg_parallel_copyer->is_stopped())
+    {
+        const std::string pk_condition = mooon::utils::CStringUtils::format_string(
+                "%s>=%" PRId64" AND %s<=%" PRId64,
+                mooon::argument::pk->c_value(), cursor, mooon::argument::pk->c_value(), end);
+        const std::string limit_str = (0 == mooon::argument::hdlimit->value())?
+                std::string(""): mooon::utils::CStringUtils::format_string(" LIMIT %d", mooon::argument::hdlimit->value());
+        mooon::sys::DBTable dbtable;
+
+        _source_mysql->query(dbtable, "SELECT %s,%s FROM %s WHERE %s ORDER BY %s%s",
+                mooon::argument::pk->c_value(), _select_fields.c_str(), mooon::argument::stable->c_value(),
+                get_condition(pk_condition.c_str()).c_str(), mooon::argument::pk->c_value(), limit_str.c_str());
+        if (dbtable.empty())
+            break;
+
+        for (mooon::sys::DBTable::size_type row=0; row<dbtable.size(); ++row)
+            append_row(dbtable[row]);
+
+        int64_t last_pk = 0;
+        if (!mooon::utils::CStringUtils::string2int(dbtable.back()[0].c_str(), last_pk))
+            throw mooon::sys::CDBException(NULL, mooon::utils::CStringUtils::format_string("invalid primary key: %s", dbtable.back()[0].c_str()).c_str(), -1, __FILE__, __LINE__);
+        if (!_has_max_pk || (last_pk > _max_pk))
+        {
+            _max_pk = last_pk;
+            _has_max_pk = true;
+        }
+        if ((0 == mooon::argument::hdlimit->value()) || (static_cast<int>(dbtable.size()) < mooon::argument::hdlimit->value()) || (last_pk >= end))
+            break;
+        cursor = last_pk + 1;
+    }
+
+    flush();
+}
+
+void CCopyWorker::append_row(const mooon::sys::DBRow& dbrow)
+{
+    const bool load_data = mooon::argument::load_data->is_true();
+    std::string row_str;
+
+    if (!load_data)
+        row_str = (0 == _batch_rows)? "(": ",(";
+    for (mooon::sys::DBRow::size_type col=1; col<dbrow.size(); ++col)
+    {
+        const std::string& value = dbrow[col];
+
+        if (load_data)
+        {
+            // LOAD DATA默认的格式：字段以TAB分隔，行以换行结束，反斜杠转义，NULL为\N
+            if (col > 1)
+                row_str += '\t';
+            if (value == sg_null_value)
+            {
+                row_str += "\\N";
+                continue;
+            }
+            for (std::string::size_type i=0; i<value.size(); ++i)
+            {
+                if ('\\' == value[i])
+                    row_str += "\\\\";
+                else if ('\t' == value[i])
+                    row_str += "\\t";
+                else if ('\n' == value[i])
+                    row_str += "\\n";
+                else
+                    row_str += value[i];
+            }
+        }
+        else
+        {
+            if (col > 1)
+                row_str += ',';
+            if (value == sg_null_value)
+            {
+                row_str += "NULL";
+            }
+            else
+            {
+                std::string escaped_value;
+                mooon::sys::CMySQLConnection::escape_string(value, &escaped_value);
+                row_str += '\'';
+                row_str += escaped_value;
+                row_str += '\'';
+            }
+        }
+    }
+    row_str += load_data? "\n": ")";
+
+    // 加上这一行会超过大小限制时，先写入已有的
+    if ((_batch_rows > 0) && (_batch.size()+row_str.size() > _batch_bytes))
+    {
+        flush();
+        if (!load_data)
+            row_str[0] = '(';
+    }
+    _batch += row_str;
+    ++_batch_rows;
+    ++_rows;
+}
+
+void CCopyWorker::flush()
+{
+    if (0 == _batch_rows)
+        return;
+
+    if (mooon::argument::test->is_true() || mooon::argument::verbose->is_true())
+    {
+        if (_batch.size() < mooon::SIZE_4K)
+            fprintf(stdout, "[WORKER-%d][INSERTSQL] %s%s\n", _index, _insert_prefix.c_str(), _batch.c_str());
+        else
+            fprintf(stdout, "[WORKER-%d][INSERTSQL] %s%.*s ... (%zu rows, %zu bytes)\n",
+                    _index, _insert_prefix.c_str(), mooon::SIZE_4K, _batch.c_str(), _batch_rows, _batch.size());
+    }
+    if (mooon::argument::test->is_false())
+    {
+        if (mooon::argument::load_data->is_true())
+        {
+            _batch_offset = 0;
+            _affected_rows += _destination_mysql->update("%s", _insert_prefix.c_str());
+        }
+        else
+        {
+            _insert_sql.assign(_insert_prefix);
+            _insert_sql.append(_batch);
+            _affected_rows += _destination_mysql->update_sql(_insert_sql.data(), _insert_sql.size());
+        }
+    }
+
+    _batch.clear();
+    _batch_rows = 0;
+}
+
+int CCopyWorker::local_infile_init(void** ptr, const char* filename, void* userdata)
+{
+    CCopyWorker* worker = static_cast<CCopyWorker*>(userdata);
+    worker->_batch_offset = 0;
+    *ptr = worker;
+    return 0;
+}
+
+int CCopyWorker::local_infile_read(void* ptr, char* buf, unsigned int buf_len)
+{
+    CCopyWorker* worker = static_cast<CCopyWorker*>(ptr);
+    const size_t bytes = std::min<size_t>(buf_len, worker->_batch.size()-worker->_batch_offset);
+
+    memcpy(buf, worker->_batch.data()+worker->_batch_offset, bytes);
+    worker->_batch_offset += bytes;
+    return static_cast<int>(bytes);
+}
+
+void CCopyWorker::local_infile_end(void* ptr)
+{
+}
+
+int CCopyWorker::local_infile_error(void* ptr, char* error_msg, unsigned int error_msg_len)
+{
+    snprintf(error_msg, error_msg_len, "read local data error");
+    return CR_UNKNOWN_ERROR;
+}
+
+// 返回0成功，
+// 返回1出错，
+// 返回2表示没数据
+int CParallelTableCopyer::copy()
+{
+    mooon::sys::CStopWatch stopwatch;
+    std::vector<std::shared_ptr<CCopyWorker> > workers;
+    std::vector<std::thread> threads;
+    std::atomic<int> running_threads(mooon::argument::threads->value());
+
+    // 多线程使用MySQL，须在创建线程之前调用
+    mooon::sys::CMySQLConnection::library_init();
+    mooon::sys::CSignalHandler::ignore_signal(SIGPIPE);
+    _next_chunk = 0;
+    _finished_keys = 0;
+    _rows = 0;
+    _stop = false;
+
+    try
+    {
+        if (!init_range())
+        {
+            fprintf(stderr, "[%s] NODATA\n", mooon::sys::CDatetimeUtils::get_current_datetime().c_str());
+            return 2;
+        }
+
+        const size_t batch_bytes = get_batch_bytes();
+        fprintf(stdout, "RANGE: [%" PRId64", %" PRId64"], chunks: %" PRIu64", threads: %d, batch bytes: %zu\n",
+                _pk_begin, _pk_end, _chunks, mooon::argument::threads->value(), batch_bytes);
+        for (int i=0; i<mooon::argument::threads->value(); ++i)
+        {
+            workers.push_back(std::shared_ptr<CCopyWorker>(new CCopyWorker(i, batch_bytes)));
+            if (!workers.back()->init())
+            {
+                fprintf(stderr, "%s\n", workers.back()->get_errmsg().c_str());
+                print_cost(stderr, stopwatch);
+                fprintf(stderr, "FAILED\n");
+                return 1;
+            }
+        }
+    }
+    catch (mooon::sys::CDBException& ex)
+    {
+        fprintf(stderr, "%s\n", ex.str().c_str());
+        print_cost(stderr, stopwatch);
+        fprintf(stderr, "FAILED\n");
+        return 1;
+    }
+
+    for (std::vector<std::shared_ptr<CCopyWorker> >::size_type i=0; i<workers.size(); ++i)
+    {
+        CCopyWorker* worker = workers[i].get();
+        threads.push_back(std::thread([worker, &running_threads] { worker->run(); --running_threads; }));
+    }
+    for (int ticks=1; running_threads>0; ++ticks)
+    {
+        mooon::sys::CUtils::millisleep(100);
+        if ((0 == ticks % (mooon::argument::progress_interval->value()*10)) && (running_threads > 0))
+            print_progress(stopwatch);
+    }
+
+    bool failed = false;
+    bool has_max_pk = false;
+    int64_t max_pk = 0;
+    uint64_t affected_rows = 0;
+    for (std::vector<std::shared_ptr<CCopyWorker> >::size_type i=0; i<workers.size(); ++i)
+    {
+        threads[i].join();
+        if (!workers[i]->get_errmsg().empty())
+        {
+            fprintf(stderr, "%s\n", workers[i]->get_errmsg().c_str());
+            failed = true;
+        }
+        if (workers[i]->has_max_pk() && (!has_max_pk || (workers[i]->get_max_pk() > max_pk)))
+        {
+            max_pk = workers[i]->get_max_pk();
+            has_max_pk = true;
+        }
+        affected_rows += workers[i]->get_affected_rows();
+    }
+    if (failed)
+    {
+        print_cost(stderr, stopwatch);
+        fprintf(stderr, "ROW: %" PRIu64"\n", _rows.load());
+        fprintf(stderr, "FAILED\n");
+        return 1;
+    }
+    if (!has_max_pk)
+    {
+        fprintf(stderr, "[%s] NODATA\n", mooon::sys::CDatetimeUtils::get_current_datetime().c_str());
+        return 2;
+    }
+
+    print_cost(stdout, stopwatch);
+    fprintf(stdout, "ROW: %" PRIu64" (affected: %" PRIu64")\n", _rows.load(), affected_rows);
+    fprintf(stdout, "SUCCESS: %" PRId64" (The latest value of the primary key, %s)\n",
+            max_pk, mooon::sys::CDatetimeUtils::get_current_datetime().c_str());
+    return 0;
+}
+
+bool CParallelTableCopyer::get_next_chunk(int64_t* begin, int64_t* end)
+{
+    if (_stop)
+        return false;
+
+    const uint64_t chunk = _next_chunk++;
+    if (chunk >= _chunks)
+        return false;
+
+    const uint64_t chunk_size = static_cast<uint64_t>(mooon::argument::chunk_size->value());
+    const uint64_t offset = chunk * chunk_size;
+    const uint64_t width = static_cast<uint64_t>(_pk_end) - static_cast<uint64_t>(_pk_begin); // 按无符号计算，避免溢出
+    *begin = static_cast<int64_t>(static_cast<uint64_t>(_pk_begin) + offset);
+    *end = (width-offset < chunk_size)? _pk_end: static_cast<int64_t>(static_cast<uint64_t>(*begin) + chunk_size - 1);
+    return true;
+}
+
+void CParallelTableCopyer::finish_chunk(int64_t begin, int64_t end, uint64_t rows)
+{
+    _finished_keys += static_cast<uint64_t>(end) - static_cast<uint64_t>(begin) + 1;
+    _rows += rows;
+}
+
+// 确定主键范围，没有数据时返回false
+bool CParallelTableCopyer::init_range()
+{
+    mooon::sys::CMySQLConnection mysql;
+    mooon::sys::DBRow dbrow;
+
+    init_mysql(&mysql, true);
+    mysql.query(dbrow, "SELECT MIN(%s),MAX(%s) FROM %s%s%s",
+            mooon::argument::pk->c_value(), mooon::argument::pk->c_value(), mooon::argument::stable->c_value(),
+            mooon::argument::swhere->value().empty()? "": " WHERE ", mooon::argument::swhere->c_value());
+    if ((dbrow.size() != 2) || (dbrow[0] == sg_null_value))
+        return false;
+    if (!mooon::utils::CStringUtils::string2int(dbrow[0].c_str(), _pk_begin) ||
+        !mooon::utils::CStringUtils::string2int(dbrow[1].c_str(), _pk_end))
+        throw mooon::sys::CDBException(NULL, mooon::utils::CStringUtils::format_string("primary key %s is not integer", mooon::argument::pk->c_value()).c_str(), -1, __FILE__, __LINE__);
+
+    int64_t pk = 0;
+    if (!mooon::argument::pk_begin->value().empty())
+    {
+        if (!mooon::utils::CStringUtils::string2int(mooon::argument::pk_begin->c_value(), pk))
+            throw mooon::sys::CDBException(NULL, "invalid --pk_begin", -1, __FILE__, __LINE__);
+        _pk_begin = std::max(_pk_begin, pk);
+    }
+    if (!mooon::argument::pk_end->value().empty())
+    {
+        if (!mooon::utils::CStringUtils::string2int(mooon::argument::pk_end->c_value(), pk))
+            throw mooon::sys::CDBException(NULL, "invalid --pk_end", -1, __FILE__, __LINE__);
+        _pk_end = std::min(_pk_end, pk);
+    }
+    if (_pk_begin > _pk_end)
+        return false;
+
+    const uint64_t width = static_cast<uint64_t>(_pk_end) - static_cast<uint64_t>(_pk_begin);
+    _chunks = width / static_cast<uint64_t>(mooon::argument::chunk_size->value()) + 1;
+    return true;
+}
+
+// 单条INSERT的最大字节数，不能超过目标库的max_allowed_packet
+size_t CParallelTableCopyer::get_batch_bytes()
+{
+    size_t batch_bytes = static_cast<size_t>(mooon::argument::batch_bytes->value());
+
+    if (mooon::argument::test->is_false())
+    {
+        mooon::sys::CMySQLConnection mysql;
+        init_mysql(&mysql, false);
+
+        const std::string max_allowed_packet_str = mysql.query("SELECT @@max_allowed_packet");
+        uint64_t max_allowed_packet = 0;
+        if (mooon::utils::CStringUtils::string2int(max_allowed_packet_str.c_str(), max_allowed_packet) && (max_allowed_packet > 0))
+        {
+            // 留出语句前缀等的空间
+            const size_t limit = static_cast<size_t>(std::min<uint64_t>(max_allowed_packet / 10 * 9, mooon::SIZE_1G));
+            if ((0 == batch_bytes) || (batch_bytes > limit))
+                batch_bytes = limit;
+        }
+    }
+    if (0 == batch_bytes)
+        batch_bytes = 4 * mooon::SIZE_1M;
+    return batch_bytes;
+}
+
+void CParallelTableCopyer::print_progress(mooon::sys::CStopWatch& stopwatch)
+{
+    const double seconds = stopwatch.get_elapsed_microseconds() / 1000000.0;
+    const double total_keys = static_cast<double>(static_cast<uint64_t>(_pk_end) - static_cast<uint64_t>(_pk_begin)) + 1;
+    const double finished = _finished_keys / total_keys;
+    const uint64_t rows = _rows;
+    const double eta = (finished > 0)? seconds * (1 - finished) / finished: 0.0;
+
+    fprintf(stdout, "[%s] PROGRESS: %.2f%%, rows: %" PRIu64" (%.0f/s), elapsed: %.0fs, ETA: %.0fs\n",
+            mooon::sys::CDatetimeUtils::get_current_datetime().c_str(),
+            finished*100, rows, (seconds > 0)? rows/seconds: 0.0, seconds, eta);
+    fflush(stdout);
+}
+
+void CParallelTableCopyer::print_cost(_IO_FILE* stdxxx, mooon::sys::CStopWatch& stopwatch)
+{
+    const uint64_t microseconds = stopwatch.get_elapsed_microseconds();
+    const double seconds = microseconds / (1000000.0);
+    fprintf(stdxxx, "COST: %.3fs (%" PRIu64"us)\n", seconds, microseconds);
+}
@@ -1,5 +1,7 @@
 // Writed by yijian on 2021/5/20
 // Load from file to redis list
+#include <mooon/sys/adaptive_batch.h>
+#include <mooon/sys/file_utils.h>
 #include <mooon/sys/main_template.h>
 #include <mooon/sys/mmap.h>
 #include <mooon/sys/safe_logger.h>
@@ -15,6 +17,7 @@
 #include <memory>
 #include <random>
 #include <sstream>
+#include <sys/mman.h>
 #include <system_error>
 #include <thread>
 #include <vector>
@@ -32,8 +35,10 @@ STRING_ARG_DEFINE(redis_key_prefix, "", "Key prefix of redis list.");
 INTEGER_ARG_DEFINE(int, redis_key_count, 1, 1, 2020, "Number of redis list keys with the given prefix.");
 INTEGER_ARG_DEFINE(int, redis_timeout, 60000, 0, 86400000, "Timeout to lpush redis in millisecond.");
 
-// 批量数，即一次批量加载多少
-INTEGER_ARG_DEFINE(int, batch, 1, 1, 100000, "Batch to load from file to redis.");
+// 批量数，即一次批量加载多少，
+// Redis写入顺利时从min_batch逐步增大到batch，出错时减小
+INTEGER_ARG_DEFINE(int, batch, 1, 1, 100000, "Max batch to load from file to redis.");
+INTEGER_ARG_DEFINE(int, min_batch, 1, 1, 100000, "Min batch to load from file to redis.");
 
 // metric 统计间隔（单位：秒）
 INTEGER_ARG_DEFINE(int, interval, 10, 0, 3600, "Interval to count metric in seconds.");
@@ -41,14 +46,34 @@ INTEGER_ARG_DEFINE(int, interval, 10, 0, 3600, "Interval to count metric in seco
 // 分割符合
 STRING_ARG_DEFINE(delimiter, "\n", "Single character separator of logs.");
 
+// 文件按chunk_size（单位：MB）切分成块，块的边界对齐到分隔符，
+// 多个加载线程并行加载，每个线程每次领取一个块
+INTEGER_ARG_DEFINE(int, threads, 1, 1, 64, "Number of threads to load.");
+INTEGER_ARG_DEFINE(int, chunk_size, 64, 1, 10240, "Size of chunk to load by a thread in MB.");
+
+// 断点文件，记录各块已加载到的位置，重启后跳过已加载的部分，为空表示不记录断点，
+// 断点每秒保存一次，因此重启后最多重复加载约1秒的数据
+STRING_ARG_DEFINE(checkpoint, "", "File path to save loading progress for resuming, disabled if empty.");
+
 class CFile2redisLoader;
 
 struct Metric
 {
     std::atomic<uint32_t> push_number;
     std::atomic<uint32_t> redis_exception_number;
+    std::atomic<int> batch; // 最近一次的批量数
 } metric;
 
+// 文件中的一块，[begin, end)，end处为分隔符之后
+struct Chunk
+{
+    size_t begin;
+    size_t end;
+    std::atomic<size_t> offset; // 已加载（已成功lpush）到的位置
+
+    Chunk(size_t begin_, size_t end_): begin(begin_), end(end_), offset(begin_) {}
+};
+
 class CFile2redis: public mooon::sys::CMainHelper
 {
 private:
@@ -58,8 +83,21 @@ private:
     virtual void on_fini();
     virtual void on_terminated();
 
+public:
+    CFile2redis();
+    const char* get_file_addr() const { return (const char*)_file_ptr->addr; }
+    // 领取下一个未加载完的块，没有了返回NULL
+    Chunk* get_next_chunk();
+    // 加载线程退出时调用，最后一个退出时通知进程退出
+    void on_loader_exit();
+
 private:
     bool init_metric_logger();
+    bool init_source_file();
+    void split_chunks();
+    bool load_checkpoint();
+    void save_checkpoint();
+    int64_t get_lag() const;
     bool start_file2redis_movers();
     void stop_file2redis_movers();
     void wait_file2redis_movers();
@@ -67,6 +105,10 @@ private:
 private:
     std::shared_ptr<mooon::sys::CSafeLogger> _metric_logger;
     std::vector<std::shared_ptr<CFile2redisLoader>> _file2redis_loaders;
+    mooon::sys::mmap_t* _file_ptr;
+    std::vector<std::shared_ptr<Chunk>> _chunks;
+    std::atomic<size_t> _next_chunk;
+    std::atomic<int> _running_loaders;
 };
 
 class CFile2redisLoader
@@ -79,12 +121,11 @@ public:
     void wait();
 
 private:
-    bool init_source_file();
     bool init_target_redis();
     void run();
 
 private:
-    bool get_logs(int batch, std::vector<std::string>* logs);
+    size_t get_logs(Chunk* chunk, int batch, std::vector<std::string>* logs);
     bool lpush_logs(const std::vector<std::string>& logs);
     std::string get_target_redis_key();
 
@@ -95,8 +136,6 @@ private:
     std::shared_ptr<std::thread> _load_thread;
     std::shared_ptr<r3c::CRedisClient> _redis;
     std::default_random_engine _random_engine;
-    mooon::sys::mmap_t* _file_ptr;
-    size_t _file_offset;
 };
 
 extern "C"
@@ -107,9 +146,39 @@ int main(int argc, char* argv[])
 }
 
 //
-// CRedis2redis
+// CFile2redis
 //
 
+CFile2redis::CFile2redis()
+    : _file_ptr(NULL), _next_chunk(0), _running_loaders(0)
+{
+}
+
+Chunk* CFile2redis::get_next_chunk()
+{
+    while (true)
+    {
+        const size_t index = _next_chunk++;
+        if (index >= _chunks.size())
+            return NULL;
+
+        // 跳过断点中已加载完的块
+        Chunk* chunk = _chunks[index].get();
+        if (chunk->offset < chunk->end)
+            return chunk;
+    }
+}
+
+void CFile2redis::on_loader_exit()
+{
+    if (0 == --_running_loaders)
+    {
+        // 全部加载完后退出进程
+        MYLOG_INFO("All loaders are exited\n");
+        kill(getpid(), SIGTERM);
+    }
+}
+
 bool CFile2redis::on_check_parameter()
 {
     // --file
@@ -150,12 +219,15 @@ bool CFile2redis::on_check_parameter()
 
 bool CFile2redis::on_init(int argc, char* argv[])
 {
-    if (!init_metric_logger())
+    if (!init_metric_logger() || !init_source_file())
     {
         return false;
     }
     else
     {
+        split_chunks();
+        if (!load_checkpoint())
+            return false;
         return start_file2redis_movers();
     }
 }
@@ -164,28 +236,23 @@ bool CFile2redis::on_run()
 {
     const int interval = mooon::argument::interval->value();
 
-    MYLOG_INFO("Redis2redis is started now\n");
-    if (interval <= 0)
+    MYLOG_INFO("File2redis is started now\n");
+    for (int seconds=1; !this->to_stop(); ++seconds)
     {
-        wait_file2redis_movers();
-    }
-    else
-    {
-        while (!this->to_stop())
+        std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+        save_checkpoint();
+
+        if ((interval > 0) && (0 == seconds%interval) && (metric.push_number > 0))
         {
-            for (int i=0; i<interval&&!this->to_stop(); ++i)
-            {
-                std::this_thread::sleep_for(std::chrono::milliseconds(1000));
-            }
-            if (metric.push_number > 0)
-            {
-                const uint32_t push_number = metric.push_number.exchange(0);
-                const uint32_t redis_exception_number = metric.redis_exception_number.exchange(0);
-                _metric_logger->log_raw("push:%u,redis:%u\n", push_number, redis_exception_number);
-            }
+            const uint32_t push_number = metric.push_number.exchange(0);
+            const uint32_t redis_exception_number = metric.redis_exception_number.exchange(0);
+            const uint32_t tps = push_number / interval;
+            _metric_logger->log_raw("push:%u,redis:%u,tps:%u,batch:%d,lag:%" PRId64"\n",
+                    push_number, redis_exception_number, tps, metric.batch.load(), get_lag());
         }
-        wait_file2redis_movers();
     }
+    wait_file2redis_movers();
+    save_checkpoint();
     return true;
 }
 
@@ -193,6 +260,13 @@ void CFile2redis::on_fini()
 {
     stop_file2redis_movers();
     wait_file2redis_movers();
+    save_checkpoint();
+
+    if (_file_ptr != NULL)
+    {
+        mooon::sys::CMMap::unmap(_file_ptr);
+        _file_ptr = NULL;
+    }
 }
 
 void CFile2redis::on_terminated()
@@ -221,10 +295,155 @@ bool CFile2redis::init_metric_logger()
     }
 }
 
+bool CFile2redis::init_source_file()
+{
+    try
+    {
+        _file_ptr = mooon::sys::CMMap::map_read(mooon::argument::file->c_value());
+        if ((_file_ptr->addr != NULL) && (_file_ptr->len > 0))
+        {
+            // 各线程顺序读各自的块，加大预读
+            madvise(_file_ptr->addr, _file_ptr->len, MADV_SEQUENTIAL);
+        }
+        return true;
+    }
+    catch (mooon::sys::CSyscallException& ex)
+    {
+        MYLOG_ERROR("mmap file://%s failed: %s.\n", mooon::argument::file->c_value(), ex.str().c_str());
+        return false;
+    }
+}
+
+void CFile2redis::split_chunks()
+{
+    const char delimiter = mooon::argument::delimiter->value()[0];
+    const size_t chunk_size = static_cast<size_t>(mooon::argument::chunk_size->value()) * mooon::SIZE_1M;
+    const char* addr = get_file_addr();
+    const size_t len = (NULL == addr)? 0: _file_ptr->len;
+    size_t begin = 0;
+
+    // 块的结束位置从begin+chunk_size处向后找到分隔符，
+    // 因此同一文件和同样的chunk_size总是得到同样的块，断点才能对得上
+    while (begin < len)
+    {
+        size_t end = begin + chunk_size;
+        if (end >= len)
+        {
+            end = len;
+        }
+        else
+        {
+            const char* next = (const char*)memchr(addr+end, delimiter, len-end);
+            end = (NULL == next)? len: (next - addr) + 1;
+        }
+
+        _chunks.push_back(std::shared_ptr<Chunk>(new Chunk(begin, end)));
+        begin = end;
+    }
+
+    MYLOG_INFO("File://%s(%zu) is split into %zu chunks\n", mooon::argument::file->c_value(), len, _chunks.size());
+}
+
+bool CFile2redis::load_checkpoint()
+{
+    const std::string& checkpoint = mooon::argument::checkpoint->value();
+    if (checkpoint.empty())
+        return true;
+
+    FILE* fp = fopen(checkpoint.c_str(), "r");
+    if (NULL == fp)
+    {
+        if (ENOENT == errno)
+            return true;
+        MYLOG_ERROR("Open checkpoint://%s failed: %s\n", checkpoint.c_str(), strerror(errno));
+        return false;
+    }
+
+    // 格式：
+    // 第一行为“文件大小 块大小”，
+    // 之后每行为“块开始位置 已加载到的位置”
+    bool success = false;
+    size_t file_size = 0;
+    size_t chunk_size = 0;
+    if ((2 == fscanf(fp, "%zu %zu", &file_size, &chunk_size))
+     && (file_size == ((NULL == get_file_addr())? 0: _file_ptr->len))
+     && (chunk_size == static_cast<size_t>(mooon::argument::chunk_size->value()) * mooon::SIZE_1M))
+    {
+        size_t begin, offset;
+        success = true;
+
+        for (size_t i=0; i<_chunks.size(); ++i)
+        {
+            if (2 != fscanf(fp, "%zu %zu", &begin, &offset))
+                break;
+
+            Chunk* chunk = _chunks[i].get();
+            if ((begin != chunk->begin) || (offset < chunk->begin) || (offset > chunk->end))
+            {
+                success = false;
+                break;
+            }
+            chunk->offset = offset;
+        }
+    }
+
+    fclose(fp);
+    if (!success)
+    {
+        // 文件或块大小变了，断点已不对应，须人工确认后删除断点文件
+        MYLOG_ERROR("Checkpoint://%s does not match file://%s\n", checkpoint.c_str(), mooon::argument::file->c_value());
+        fprintf(stderr, "Checkpoint://%s does not match file://%s\n", checkpoint.c_str(), mooon::argument::file->c_value());
+    }
+    else
+    {
+        MYLOG_INFO("Resume from checkpoint://%s, lag: %" PRId64"\n", checkpoint.c_str(), get_lag());
+    }
+    return success;
+}
+
+void CFile2redis::save_checkpoint()
+{
+    const std::string& checkpoint = mooon::argument::checkpoint->value();
+    if (checkpoint.empty() || _chunks.empty())
+        return;
+
+    // 先写临时文件再改名，避免写一半时进程退出导致断点损坏
+    const std::string tmp_checkpoint = checkpoint + std::string(".tmp");
+    FILE* fp = fopen(tmp_checkpoint.c_str(), "w");
+    if (NULL == fp)
+    {
+        MYLOG_ERROR("Open checkpoint://%s failed: %s\n", tmp_checkpoint.c_str(), strerror(errno));
+        return;
+    }
+
+    fprintf(fp, "%zu %zu\n", _file_ptr->len, static_cast<size_t>(mooon::argument::chunk_size->value()) * mooon::SIZE_1M);
+    for (size_t i=0; i<_chunks.size(); ++i)
+        fprintf(fp, "%zu %zu\n", _chunks[i]->begin, _chunks[i]->offset.load());
+    if ((fclose(fp) != 0) || (-1 == rename(tmp_checkpoint.c_str(), checkpoint.c_str())))
+        MYLOG_ERROR("Save checkpoint://%s failed: %s\n", checkpoint.c_str(), strerror(errno));
+}
+
+int64_t CFile2redis::get_lag() const
+{
+    int64_t lag = 0;
+    for (size_t i=0; i<_chunks.size(); ++i)
+        lag += static_cast<int64_t>(_chunks[i]->end - _chunks[i]->offset);
+    return lag;
+}
+
 bool CFile2redis::start_file2redis_movers()
 {
     const time_t now = time(NULL);
-    for (int i=0; i<1; ++i)
+    const int threads = mooon::argument::threads->value();
+
+    if (0 == get_lag())
+    {
+        MYLOG_INFO("Nothing to load from file://%s\n", mooon::argument::file->c_value());
+        kill(getpid(), SIGTERM);
+        return true;
+    }
+    _running_loaders = threads;
+    for (int i=0; i<threads; ++i)
     {
         std::shared_ptr<CFile2redisLoader> redis2redis_mover(new CFile2redisLoader(this));
         if (redis2redis_mover->start(now, i))
@@ -233,8 +452,9 @@ bool CFile2redis::start_file2redis_movers()
         }
         else
         {
+            _running_loaders -= threads - i; // 未启动的
             stop_file2redis_movers();
-            break;
+            return false;
         }
     }
     return true;
@@ -260,22 +480,16 @@ void CFile2redis::wait_file2redis_movers()
 }
 
 //
-// CRedis2redisMover
+// CFile2redisLoader
 //
 
 CFile2redisLoader::CFile2redisLoader(CFile2redis* redis2redis)
-    : _index(-1), _file2redis(redis2redis), _stop(false),
-      _file_ptr(NULL), _file_offset(0)
+    : _index(-1), _file2redis(redis2redis), _stop(false)
 {
 }
 
 CFile2redisLoader::~CFile2redisLoader()
 {
-    if (_file_ptr != NULL)
-    {
-        mooon::sys::CMMap::unmap(_file_ptr);
-        _file_ptr = NULL;
-    }
 }
 
 bool CFile2redisLoader::start(time_t now, int index)
@@ -284,7 +498,7 @@ bool CFile2redisLoader::start(time_t now, int index)
     {
         _index = index;
 
-        if (!init_source_file() || !init_target_redis())
+        if (!init_target_redis())
         {
             return false;
         }
@@ -316,20 +530,6 @@ void CFile2redisLoader::wait()
     }
 }
 
-bool CFile2redisLoader::init_source_file()
-{
-    try
-    {
-        _file_ptr = mooon::sys::CMMap::map_read(mooon::argument::file->c_value());
-        return true;
-    }
-    catch (r3c::CRedisException& ex)
-    {
-        MYLOG_ERROR("mmap file://%s failed: %s.\n", mooon::argument::file->c_value(), ex.str().c_str());
-        return false;
-    }
-}
-
 bool CFile2redisLoader::init_target_redis()
 {
     try
@@ -351,25 +551,49 @@ bool CFile2redisLoader::init_target_redis()
 
 void CFile2redisLoader::run()
 {
-    const int batch = mooon::argument::batch->value();
+    mooon::sys::CAdaptiveBatch adaptive_batch(mooon::argument::min_batch->value(), mooon::argument::batch->value());
+    const size_t page_size = static_cast<size_t>(mooon::sys::CUtils::get_page_size());
+    char* addr = const_cast<char*>(_file2redis->get_file_addr());
+    std::vector<std::string> logs;
+    Chunk* chunk = NULL;
 
     while (!_stop)
     {
-        std::vector<std::string> logs;
-        if (!get_logs(batch, &logs))
+        if (NULL == chunk)
         {
-            break;
+            chunk = _file2redis->get_next_chunk();
+            if (NULL == chunk)
+                break; // 全部已领取
+            madvise(addr + (chunk->offset/page_size)*page_size, chunk->end - (chunk->offset/page_size)*page_size, MADV_WILLNEED);
         }
-        else
+
+        const int batch = adaptive_batch.get_batch();
+        const size_t offset = get_logs(chunk, batch, &logs);
+        if (!logs.empty())
         {
             MYLOG_DEBUG("%.*s\n", (int)logs[0].size(), logs[0].c_str());
+            metric.batch = batch;
+            adaptive_batch.on_fetched(static_cast<int>(logs.size()));
 
             while (!_stop) // 重试直到成功
             {
                 if (lpush_logs(logs))
+                {
+                    adaptive_batch.on_success();
                     break;
-                std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+                }
+                mooon::sys::interruptible_millisleep(adaptive_batch.on_error(), _stop);
             }
+            if (_stop)
+                break; // 未成功的不能计入断点
+        }
+
+        chunk->offset = offset;
+        if (offset >= chunk->end)
+        {
+            // 整块已加载，释放其占用的内存页，避免大文件的常驻内存不断增长
+            madvise(addr + (chunk->begin/page_size)*page_size, chunk->end - (chunk->begin/page_size)*page_size, MADV_DONTNEED);
+            chunk = NULL;
         }
     }
     {
@@ -377,41 +601,33 @@ void CFile2redisLoader::run()
         std::stringstream ss;
         ss << std::this_thread::get_id();
         if (_index == 0)
-            MYLOG_INFO("Redis2redisLoader[%d:%s] is exited now\n", _index, ss.str().c_str());
+            MYLOG_INFO("File2redisLoader[%d:%s] is exited now\n", _index, ss.str().c_str());
         else
-            MYLOG_DEBUG("Redis2redisLoader[%d:%s] is exited now\n", _index, ss.str().c_str());
-        kill(getpid(), SIGTERM);
+            MYLOG_DEBUG("File2redisLoader[%d:%s] is exited now\n", _index, ss.str().c_str());
+        _file2redis->on_loader_exit();
     }
 }
 
-bool CFile2redisLoader::get_logs(int batch, std::vector<std::string>* logs)
+// 从chunk->offset开始取最多batch条，返回取完后的位置，
+// 使用memchr查找分隔符（glibc的memchr已按SSE2/AVX2等向量化），且不会越过块的边界
+size_t CFile2redisLoader::get_logs(Chunk* chunk, int batch, std::vector<std::string>* logs)
 {
     const char delimiter = mooon::argument::delimiter->value()[0];
+    const char* addr = _file2redis->get_file_addr();
+    size_t offset = chunk->offset;
 
-    if (_file_offset >= _file_ptr->len)
+    logs->clear();
+    while ((static_cast<int>(logs->size()) < batch) && (offset < chunk->end))
     {
-        return false;
-    }
-    for (int i=0; i<mooon::argument::batch->value(); ++i)
-    {
-        const char* start_addr = (const char*)_file_ptr->addr + _file_offset;
-        const char* next = strchr(start_addr, delimiter);
-        size_t len = 0;
-        if (next == NULL)
-            len = strlen(start_addr);
-        else
-            len = next - start_addr;
+        const char* start_addr = addr + offset;
+        const char* next = (const char*)memchr(start_addr, delimiter, chunk->end - offset);
+        const size_t len = (NULL == next)? chunk->end - offset: next - start_addr;
+
         if (len > 0)
-        {
-            const std::string log(start_addr, (std::string::size_type)(len));
-            logs->push_back(log);
-        }
-        if (next == NULL)
-            break;
-        start_addr += len + 1; // 加 1 跳过换行符
-        _file_offset += len + 1;
+            logs->emplace_back(start_addr, len);
+        offset += len + ((NULL == next)? 0: 1); // 加 1 跳过分隔符
     }
-    return true;
+    return offset;
 }
 
 bool CFile2redisLoader::lpush_logs(const std::vector<std::string>& logs)
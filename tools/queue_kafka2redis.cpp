@@ -1,6 +1,7 @@
 // Writed by yijian on 2021/4/25
 // Consume kafka to redis list
 #include <mooon/net/kafka_consumer.h>
+#include <mooon/sys/adaptive_batch.h>
 #include <mooon/sys/main_template.h>
 #include <mooon/sys/safe_logger.h>
 #include <mooon/sys/signal_handler.h>
@@ -35,8 +36,10 @@ STRING_ARG_DEFINE(redis_key_prefix, "", "Key prefix of redis list.");
 INTEGER_ARG_DEFINE(int, redis_key_count, 1, 1, 2020, "Number of redis list keys with the given prefix.");
 INTEGER_ARG_DEFINE(int, redis_timeout, 60000, 0, 86400000, "Timeout to lpush redis in millisecond.");
 
-// 批量数，即一次批量移动多少
-INTEGER_ARG_DEFINE(int, batch, 1, 1, 100000, "Batch to consume from kafka, and lpush to redis.");
+// 批量数，即一次批量移动多少，
+// 有积压时从min_batch逐步增大到batch，空闲时减小到min_batch
+INTEGER_ARG_DEFINE(int, batch, 1, 1, 100000, "Max batch to consume from kafka, and lpush to redis.");
+INTEGER_ARG_DEFINE(int, min_batch, 1, 1, 100000, "Min batch to consume from kafka, and lpush to redis.");
 
 // metric 统计间隔（单位：秒）
 INTEGER_ARG_DEFINE(int, interval, 10, 0, 3600, "Interval to count metric in seconds.");
@@ -49,6 +52,7 @@ struct Metric
     std::atomic<uint32_t> push_number;
     std::atomic<uint32_t> redis_exception_number;
     std::atomic<uint32_t> kafka_error_number;
+    std::atomic<int> batch; // 最近一次的批量数
 } metric;
 
 class CKafka2redis: public mooon::sys::CMainHelper
@@ -182,7 +186,9 @@ bool CKafka2redis::on_run()
                 const uint32_t push_number = metric.push_number.exchange(0);
                 const uint32_t redis_exception_number = metric.redis_exception_number.exchange(0);
                 const uint32_t kafka_error_number = metric.kafka_error_number.exchange(0);
-                _metric_logger->log_raw("consume:%u,push:%u,redis:%u,kafka:%u\n", consume_number, push_number, redis_exception_number, kafka_error_number);
+                const uint32_t tps = push_number / interval;
+                _metric_logger->log_raw("consume:%u,push:%u,redis:%u,kafka:%u,tps:%u,batch:%d\n",
+                        consume_number, push_number, redis_exception_number, kafka_error_number, tps, metric.batch.load());
             }
         }
         wait_kafka2redis_consumers();
@@ -345,22 +351,35 @@ bool CKafka2redisConsumer::init_kafka_consumer()
 
 void CKafka2redisConsumer::run()
 {
-    const int batch = mooon::argument::batch->value();
+    mooon::sys::CAdaptiveBatch adaptive_batch(mooon::argument::min_batch->value(), mooon::argument::batch->value());
+    mooon::net::CKafkaBatch kafka_batch;
+    std::vector<std::string> logs; // 跨批次复用，assign时复用已有容量，避免每条消息都分配内存
 
     for (uint32_t i=0;!_stop;++i)
     {
         const int n = i % mooon::argument::redis_key_count->value();
         const std::string redis_key = mooon::utils::CStringUtils::format_string("%s:%d", mooon::argument::redis_key_prefix->c_value(), n);
-        std::vector<std::string> logs;
+        const int batch = adaptive_batch.get_batch();
         r3c::Node node;
 
         try
         {
             bool timeout;
 
+            metric.batch = batch;
             if (batch > 1)
             {
-                _kafka_consumer->consume_batch(batch, &logs, mooon::argument::kafka_timeout->value(), NULL, &timeout);
+                // 零拷贝批量消费，消息数据只在复制到logs时复制一次
+                int num_logs = _kafka_consumer->consume_batch(batch, &kafka_batch, mooon::argument::kafka_timeout->value(), &timeout);
+                if (num_logs < 0)
+                {
+                    num_logs = 0;
+                    ++metric.kafka_error_number;
+                }
+                logs.resize(num_logs);
+                for (int j=0; j<num_logs; ++j)
+                    logs[j].assign(kafka_batch[j].payload, kafka_batch[j].len);
+                kafka_batch.clear();
             }
             else
             {
@@ -371,6 +390,7 @@ void CKafka2redisConsumer::run()
                     ++metric.kafka_error_number;
                 }
             }
+            const uint32_t milliseconds = adaptive_batch.on_fetched(static_cast<int>(logs.size()));
             if (!logs.empty())
             {
                 MYLOG_DEBUG("%.*s\n", (int)logs[0].size(), logs[0].c_str());
@@ -379,15 +399,21 @@ void CKafka2redisConsumer::run()
                 while (!_stop) // 重试直到成功
                 {
                     if (lpush_logs(logs))
+                    {
+                        adaptive_batch.on_success();
                         break;
-                    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+                    }
+                    mooon::sys::interruptible_millisleep(adaptive_batch.on_error(), _stop);
                 }
             }
             else
             {
+                // 消费本身已等待了kafka_timeout，超时时不再额外休眠
                 if (!timeout)
+                {
                     ++metric.kafka_error_number;
-                std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+                    mooon::sys::interruptible_millisleep(milliseconds, _stop);
+                }
             }
         }
         catch (r3c::CRedisException& ex)
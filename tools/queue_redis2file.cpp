@@ -1,5 +1,7 @@
 // Writed by yijian on 2021/5/20
 // Move redis list to file
+#include <mooon/sys/adaptive_batch.h>
+#include <mooon/sys/group_commit_file.h>
 #include <mooon/sys/main_template.h>
 #include <mooon/sys/safe_logger.h>
 #include <mooon/sys/signal_handler.h>
@@ -30,8 +32,10 @@ STRING_ARG_DEFINE(redis_password, "", "Password of redis.");
 STRING_ARG_DEFINE(redis_key_prefix, "", "Key prefix of redis list.");
 INTEGER_ARG_DEFINE(int, redis_key_count, 1, 1, 2020, "Number of redis list keys with the given prefix.");
 INTEGER_ARG_DEFINE(int, redis_timeout, 60000, 0, 86400000, "Timeout to lpush redis in millisecond.");
-// 批量数，即一次批量移动多少
-INTEGER_ARG_DEFINE(int, batch, 1, 1, 100000, "Batch to move from redis to file.");
+// 批量数，即一次批量移动多少，
+// 有积压时从min_batch逐步增大到batch
+INTEGER_ARG_DEFINE(int, batch, 1, 1, 100000, "Max batch to move from redis to file.");
+INTEGER_ARG_DEFINE(int, min_batch, 1, 1, 100000, "Min batch to move from redis to file.");
 
 // metric 统计间隔（单位：秒）
 INTEGER_ARG_DEFINE(int, interval, 10, 0, 3600, "Interval to count metric in seconds.");
@@ -39,12 +43,25 @@ INTEGER_ARG_DEFINE(int, interval, 10, 0, 3600, "Interval to count metric in seco
 // 分割符合
 STRING_ARG_DEFINE(delimiter, "\n", "Single character separator of logs.");
 
+// 所有搬运线程的数据合并到block_size（单位：KB）大小的块中，由一个写线程整块写入，
+// direct为1时使用O_DIRECT，不占用页缓存
+INTEGER_ARG_DEFINE(int, block_size, 1024, 4, 65536, "Size of block to write to file in KB.");
+INTEGER_ARG_DEFINE(int, direct, 0, 0, 1, "Write file with O_DIRECT (1) or not (0).");
+INTEGER_ARG_DEFINE(int, flush_interval, 1000, 1, 3600000, "Max interval to write a not full block in millisecond.");
+INTEGER_ARG_DEFINE(int, fsync_interval, 0, 0, 3600000, "Interval to fdatasync file in millisecond, only when rolling and exiting if 0.");
+
+// 文件滚动，为0表示不滚动，滚动后的文件名为“file.年月日时分秒”
+INTEGER_ARG_DEFINE(int, roll_size, 0, 0, 1048576, "Roll file when it's size reaches the given MB.");
+INTEGER_ARG_DEFINE(int, roll_interval, 0, 0, 31536000, "Roll file after the given seconds.");
+
 class CRedis2fileMover;
 
 struct Metric
 {
     std::atomic<uint32_t> pop_number;
     std::atomic<uint32_t> redis_exception_number;
+    std::atomic<int> batch; // 最近一次的批量数
+    std::atomic<int64_t> lag; // 所有源队列的长度之和，即积压数
 } metric;
 
 class CRedis2file: public mooon::sys::CMainHelper
@@ -56,15 +73,24 @@ private:
     virtual void on_fini();
     virtual void on_terminated();
 
+public:
+    CRedis2file();
+    mooon::sys::CGroupCommitFile* get_target_file() const { return _target_file.get(); }
+    // 搬运线程退出时调用，最后一个退出时通知进程退出
+    void on_mover_exit();
+
 private:
     bool init_metric_logger();
+    bool init_target_file();
     bool start_redis2file_movers();
     void stop_redis2file_movers();
     void wait_redis2file_movers();
 
 private:
     std::shared_ptr<mooon::sys::CSafeLogger> _metric_logger;
+    std::shared_ptr<mooon::sys::CGroupCommitFile> _target_file;
     std::vector<std::shared_ptr<CRedis2fileMover>> _redis2file_movers;
+    std::atomic<int> _running_movers;
 };
 
 class CRedis2fileMover
@@ -78,12 +104,11 @@ public:
 
 private:
     bool init_source_redis();
-    bool init_target_file();
     void run();
 
 private:
-    bool rpop_logs(int batch, std::vector<std::string>* logs);
-    bool write_logs(const std::vector<std::string>& logs);
+    int rpop_logs(int batch, std::vector<std::string>* logs);
+    void update_lag();
 
 private:
     int _index;
@@ -93,7 +118,8 @@ private:
     std::shared_ptr<std::thread> _move_thread;
     std::shared_ptr<r3c::CRedisClient> _redis;
     std::default_random_engine _random_engine;
-    int _target_fd;
+    int64_t _lag; // 本线程源队列的长度
+    time_t _lag_time; // 最近一次取源队列长度的时间
 };
 
 extern "C"
@@ -104,11 +130,32 @@ int main(int argc, char* argv[])
 }
 
 //
-// CRedis2redis
+// CRedis2file
 //
 
+CRedis2file::CRedis2file()
+    : _running_movers(0)
+{
+}
+
+void CRedis2file::on_mover_exit()
+{
+    if (0 == --_running_movers)
+    {
+        // 所有队列已空，搬运完成
+        MYLOG_INFO("All movers are exited\n");
+        kill(getpid(), SIGTERM);
+    }
+}
+
 bool CRedis2file::on_check_parameter()
 {
+    // --file
+    if (mooon::argument::file->value().empty())
+    {
+        fprintf(stderr, "Parameter[--file] is not set\n");
+        return false;
+    }
     // --redis_nodes
     if (mooon::argument::redis_nodes->value().empty())
     {
@@ -141,7 +188,7 @@ bool CRedis2file::on_check_parameter()
 
 bool CRedis2file::on_init(int argc, char* argv[])
 {
-    if (!init_metric_logger())
+    if (!init_metric_logger() || !init_target_file())
     {
         return false;
     }
@@ -156,28 +203,28 @@ bool CRedis2file::on_run()
     const int interval = mooon::argument::interval->value();
 
     MYLOG_INFO("Redis2file is started now\n");
-    if (interval <= 0)
+    while (!this->to_stop())
     {
-        wait_redis2file_movers();
-    }
-    else
-    {
-        wait_redis2file_movers();
-        kill(getpid(), SIGTERM);
-        while (!this->to_stop())
+        for (int i=0; (interval<=0||i<interval)&&!this->to_stop(); ++i)
         {
-            for (int i=0; i<interval&&!this->to_stop(); ++i)
-            {
-                std::this_thread::sleep_for(std::chrono::milliseconds(1000));
-            }
-            if (metric.pop_number > 0)
-            {
-                const uint32_t pop_number = metric.pop_number.exchange(0);
-                const uint32_t redis_exception_number = metric.redis_exception_number.exchange(0);
-                _metric_logger->log_raw("pop:%u,redis:%u\n", pop_number, redis_exception_number);
-            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+        }
+        if ((interval > 0) && (metric.pop_number > 0))
+        {
+            // write为写入的字节数，wmax和fmax分别为写入和fdatasync的最大耗时（微秒）
+            mooon::sys::GroupCommitMetrics file_metrics;
+            _target_file->get_metrics(&file_metrics);
+
+            const uint32_t pop_number = metric.pop_number.exchange(0);
+            const uint32_t redis_exception_number = metric.redis_exception_number.exchange(0);
+            const uint32_t tps = pop_number / interval;
+            _metric_logger->log_raw("pop:%u,redis:%u,tps:%u,batch:%d,lag:%" PRId64",write:%" PRIu64",writes:%u,wait:%u,wmax:%u,fsync:%u,fmax:%u,roll:%u\n",
+                    pop_number, redis_exception_number, tps, metric.batch.load(), metric.lag.load(),
+                    file_metrics.written_bytes, file_metrics.write_count, file_metrics.append_waits, file_metrics.max_write_microseconds,
+                    file_metrics.fsync_count, file_metrics.max_fsync_microseconds, file_metrics.rolls);
         }
     }
+    wait_redis2file_movers();
     return true;
 }
 
@@ -185,6 +232,8 @@ void CRedis2file::on_fini()
 {
     stop_redis2file_movers();
     wait_redis2file_movers();
+    if (_target_file.get() != nullptr)
+        _target_file->close();
 }
 
 void CRedis2file::on_terminated()
@@ -213,9 +262,32 @@ bool CRedis2file::init_metric_logger()
     }
 }
 
+bool CRedis2file::init_target_file()
+{
+    try
+    {
+        _target_file.reset(new mooon::sys::CGroupCommitFile(
+                mooon::argument::file->value(),
+                static_cast<uint32_t>(mooon::argument::block_size->value()) * mooon::SIZE_1K,
+                1 == mooon::argument::direct->value()));
+        _target_file->set_flush_interval(mooon::argument::flush_interval->value());
+        _target_file->set_fsync_interval(mooon::argument::fsync_interval->value());
+        _target_file->set_max_file_size(static_cast<uint64_t>(mooon::argument::roll_size->value()) * mooon::SIZE_1M);
+        _target_file->set_roll_seconds(mooon::argument::roll_interval->value());
+        _target_file->open();
+        return true;
+    }
+    catch (mooon::sys::CSyscallException& ex)
+    {
+        MYLOG_ERROR("Open file://%s failed: %s\n", mooon::argument::file->c_value(), ex.str().c_str());
+        return false;
+    }
+}
+
 bool CRedis2file::start_redis2file_movers()
 {
     const time_t now = time(NULL);
+    _running_movers = mooon::argument::redis_key_count->value();
     for (int i=0; i<mooon::argument::redis_key_count->value(); ++i)
     {
         std::shared_ptr<CRedis2fileMover> redis2redis_mover(new CRedis2fileMover(this));
@@ -225,6 +297,7 @@ bool CRedis2file::start_redis2file_movers()
         }
         else
         {
+            _running_movers -= mooon::argument::redis_key_count->value() - i; // 未启动的
             stop_redis2file_movers();
             break;
         }
@@ -252,19 +325,16 @@ void CRedis2file::wait_redis2file_movers()
 }
 
 //
-// CRedis2redisMover
+// CRedis2fileMover
 //
 
 CRedis2fileMover::CRedis2fileMover(CRedis2file* redis2redis)
-    : _index(-1), _redis2file(redis2redis), _stop(false),
-      _target_fd(-1)
+    : _index(-1), _redis2file(redis2redis), _stop(false), _lag(0), _lag_time(0)
 {
 }
 
 CRedis2fileMover::~CRedis2fileMover()
 {
-    if (_target_fd != -1)
-        close(_target_fd);
 }
 
 bool CRedis2fileMover::start(time_t now, int index)
@@ -274,7 +344,7 @@ bool CRedis2fileMover::start(time_t now, int index)
         _index = index;
         _redis_key = mooon::utils::CStringUtils::format_string("%s%d", mooon::argument::redis_key_prefix->c_value(), index);
 
-        if (!init_source_redis() || !init_target_file())
+        if (!init_source_redis())
         {
             return false;
         }
@@ -325,62 +395,53 @@ bool CRedis2fileMover::init_source_redis()
     }
 }
 
-bool CRedis2fileMover::init_target_file()
-{
-    _target_fd = open(mooon::argument::file->c_value(), FILE_DEFAULT_PERM | O_WRONLY | O_APPEND | O_CREAT);
-    if (_target_fd != -1)
-    {
-        return true;
-    }
-    else
-    {
-        if (errno == EEXIST)
-        {
-            _target_fd = open(mooon::argument::file->c_value(), FILE_DEFAULT_PERM | O_WRONLY | O_APPEND);
-        }
-        if (_target_fd != -1)
-        {
-            return true;
-        }
-        else
-        {
-            MYLOG_ERROR("Open file://%s failed: %s\n", mooon::argument::file->c_value(), strerror(errno));
-            return false;
-        }
-    }
-}
-
 void CRedis2fileMover::run()
 {
-    const int batch = mooon::argument::batch->value();
+    mooon::sys::CAdaptiveBatch adaptive_batch(mooon::argument::min_batch->value(), mooon::argument::batch->value());
 
     while (!_stop)
     {
+        const int batch = adaptive_batch.get_batch();
         std::vector<std::string> logs(batch);
-        if (!rpop_logs(batch, &logs))
+        const int n = rpop_logs(batch, &logs);
+
+        metric.batch = batch;
+        update_lag();
+        if (n < 0)
         {
+            // Redis出错时退避后重试
+            mooon::sys::interruptible_millisleep(adaptive_batch.on_error(), _stop);
+        }
+        else if (n == 0)
+        {
+            // 队列已空，搬运完成
             break;
         }
         else
         {
             MYLOG_DEBUG("%.*s\n", (int)logs[0].size(), logs[0].c_str());
+            adaptive_batch.on_fetched(n);
+            adaptive_batch.on_success();
 
-            if (!write_logs(logs))
-                break;
+            // 多个搬运线程的数据在这里合并，不直接写文件
+            logs.resize(n);
+            _redis2file->get_target_file()->append(logs, mooon::argument::delimiter->value()[0]);
         }
     }
     {
-        // 线程退出时记录日志
+        // 线程退出时记录日志，并撤回本线程计入的积压数
+        metric.lag -= _lag;
         std::stringstream ss;
         ss << std::this_thread::get_id();
         if (_index == 0)
             MYLOG_INFO("Redis2fileMover[%d:%s] is exited now\n", _index, ss.str().c_str());
         else
             MYLOG_DEBUG("Redis2fileMover[%d:%s] is exited now\n", _index, ss.str().c_str());
+        _redis2file->on_mover_exit();
     }
 }
 
-bool CRedis2fileMover::rpop_logs(int batch, std::vector<std::string>* logs)
+int CRedis2fileMover::rpop_logs(int batch, std::vector<std::string>* logs)
 {
     r3c::Node node;
 
@@ -399,27 +460,36 @@ bool CRedis2fileMover::rpop_logs(int batch, std::vector<std::string>* logs)
                 n = 1;
         }
         metric.pop_number += n;
-        return n > 0;
+        return n;
     }
     catch (r3c::CRedisException& ex)
     {
         MYLOG_ERROR("Redis rpop by %s failed: %s.\n", r3c::node2string(node).c_str(), ex.str().c_str());
         ++metric.redis_exception_number;
-        return true;
+        return -1;
     }
 }
 
-bool CRedis2fileMover::write_logs(const std::vector<std::string>& logs)
+void CRedis2fileMover::update_lag()
 {
-    for (auto log: logs)
+    const int interval = mooon::argument::interval->value();
+    const time_t now = time(NULL);
+
+    // 每个统计间隔取一次源队列长度
+    if ((interval > 0) && (now - _lag_time >= interval))
     {
-        log.append(mooon::argument::delimiter->c_value());
-        if (write(_target_fd, log.c_str(), log.size()) == -1)
+        r3c::Node node;
+        _lag_time = now;
+
+        try
         {
-            MYLOG_ERROR("Write file://%s failed: %s\n", mooon::argument::file->c_value() , strerror(errno));
-            return false;
+            const int64_t lag = _redis->llen(_redis_key, &node);
+            metric.lag += lag - _lag;
+            _lag = lag;
+        }
+        catch (r3c::CRedisException& ex)
+        {
+            MYLOG_ERROR("Redis llen by %s failed: %s.\n", r3c::node2string(node).c_str(), ex.str().c_str());
         }
     }
-
-    return true;
 }
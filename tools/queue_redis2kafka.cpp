@@ -1,6 +1,7 @@
 // Writed by yijian on 2021/4/25
 // Move redis list to kafka
 #include <mooon/net/kafka_producer.h>
+#include <mooon/sys/adaptive_batch.h>
 #include <mooon/sys/main_template.h>
 #include <mooon/sys/safe_logger.h>
 #include <mooon/sys/signal_handler.h>
@@ -33,8 +34,10 @@ STRING_ARG_DEFINE(kafka_brokers, "", "Brokers list of kafka, e.g., --kafka_broke
 STRING_ARG_DEFINE(kafka_topic, "", "Topic of kafka.");
 INTEGER_ARG_DEFINE(int, kafka_timeout, 60000, 0, 86400000, "Timeout to produce kafka in millisecond.");
 
-// 批量数，即一次批量移动多少
-INTEGER_ARG_DEFINE(int, batch, 1, 1, 100000, "Batch to move from redis to kafka.");
+// 批量数，即一次批量移动多少，
+// 有积压时从min_batch逐步增大到batch，空闲时减小到min_batch
+INTEGER_ARG_DEFINE(int, batch, 1, 1, 100000, "Max batch to move from redis to kafka.");
+INTEGER_ARG_DEFINE(int, min_batch, 1, 1, 100000, "Min batch to move from redis to kafka.");
 
 // metric 统计间隔（单位：秒）
 INTEGER_ARG_DEFINE(int, interval, 10, 0, 3600, "Interval to count metric in seconds.");
@@ -47,6 +50,8 @@ struct Metric
     std::atomic<uint32_t> produce_number;
     std::atomic<uint32_t> redis_exception_number;
     std::atomic<uint32_t> kafka_error_number;
+    std::atomic<int> batch; // 最近一次的批量数
+    std::atomic<int64_t> lag; // 所有Redis队列的长度之和，即积压数
 } metric;
 
 class CRedis2kafka: public mooon::sys::CMainHelper
@@ -81,11 +86,14 @@ private:
     bool init_redis();
     bool init_kafka_producer();
     void run();
-    void kafka_produce(const std::vector<std::string>& logs);
+    void kafka_produce(std::vector<std::string>* logs, mooon::sys::CAdaptiveBatch* adaptive_batch);
+    void update_lag();
 
 private:
     int _index;
     uint32_t _kafka_key;
+    int64_t _lag; // 本线程Redis队列的长度
+    time_t _lag_time; // 最近一次取Redis队列长度的时间
     CRedis2kafka* _redis2kafka;
     std::atomic<bool> _stop;
     std::string _redis_key;
@@ -173,7 +181,10 @@ bool CRedis2kafka::on_run()
                 const uint32_t produce_number = metric.produce_number.exchange(0);
                 const uint32_t redis_exception_number = metric.redis_exception_number.exchange(0);
                 const uint32_t kafka_error_number = metric.kafka_error_number.exchange(0);
-                _metric_logger->log_raw("pop:%u,produce:%u,redis:%u,kafka:%u\n", pop_number, produce_number, redis_exception_number, kafka_error_number);
+                const uint32_t tps = produce_number / interval;
+                _metric_logger->log_raw("pop:%u,produce:%u,redis:%u,kafka:%u,tps:%u,batch:%d,lag:%" PRId64"\n",
+                        pop_number, produce_number, redis_exception_number, kafka_error_number,
+                        tps, metric.batch.load(), metric.lag.load());
             }
         }
         wait_redis2kafka_movers();
@@ -255,7 +266,7 @@ void CRedis2kafka::wait_redis2kafka_movers()
 //
 
 CRedis2kafkaMover::CRedis2kafkaMover(CRedis2kafka* redis2kafka)
-    : _index(-1), _kafka_key(0),
+    : _index(-1), _kafka_key(0), _lag(0), _lag_time(0),
       _redis2kafka(redis2kafka), _stop(false)
 {
 }
@@ -334,10 +345,11 @@ bool CRedis2kafkaMover::init_kafka_producer()
 
 void CRedis2kafkaMover::run()
 {
-    const int batch = mooon::argument::batch->value();
+    mooon::sys::CAdaptiveBatch adaptive_batch(mooon::argument::min_batch->value(), mooon::argument::batch->value());
 
     while (!_stop)
     {
+        const int batch = adaptive_batch.get_batch();
         std::vector<std::string> logs(batch);
         r3c::Node node;
 
@@ -355,18 +367,32 @@ void CRedis2kafkaMover::run()
                 if (_redis->rpop(_redis_key, &logs[0], &node) > 0)
                     n = 1;
             }
+
+            metric.batch = batch;
+            update_lag();
+            const uint32_t milliseconds = adaptive_batch.on_fetched(n);
             if (n > 0)
-                kafka_produce(logs);
+            {
+                logs.resize(n);
+                kafka_produce(&logs, &adaptive_batch);
+            }
             else
-                std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+            {
+                mooon::sys::interruptible_millisleep(milliseconds, _stop);
+            }
         }
         catch (r3c::CRedisException& ex)
         {
             MYLOG_ERROR("Redis rpop by %s failed: %s.\n", r3c::node2string(node).c_str(), ex.str().c_str());
             ++metric.redis_exception_number;
-            std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+            mooon::sys::interruptible_millisleep(adaptive_batch.on_error(), _stop);
         }
     }
+    if (_kafka_producer.get() != NULL)
+    {
+        // 零拷贝入队的消息在递送报告后才释放，退出前等待递送完成
+        _kafka_producer->flush(10000);
+    }
     {
         // 线程退出时记录日志
         std::stringstream ss;
@@ -378,24 +404,33 @@ void CRedis2kafkaMover::run()
     }
 }
 
-void CRedis2kafkaMover::kafka_produce(const std::vector<std::string>& logs)
+void CRedis2kafkaMover::kafka_produce(std::vector<std::string>* logs, mooon::sys::CAdaptiveBatch* adaptive_batch)
 {
     const std::string kafka_key = mooon::utils::CStringUtils::format_string("%u", _kafka_key++);
-    metric.pop_number += logs.size();
+    metric.pop_number += logs->size();
 
-    MYLOG_DEBUG("[%s %.*s\n", kafka_key.c_str(), (int)logs[0].size(), logs[0].c_str());
+    MYLOG_DEBUG("[%s %.*s\n", kafka_key.c_str(), (int)(*logs)[0].size(), (*logs)[0].c_str());
     while (true)
     {
         std::string errmsg;
         int errcode = 0;
 
-        if (logs.size() == 1)
-            _kafka_producer->produce(kafka_key, logs[0], RdKafka::Topic::PARTITION_UA, &errcode, &errmsg);
-        else if (logs.size() > 1)
-            _kafka_producer->produce_batch(kafka_key, logs, RdKafka::Topic::PARTITION_UA, &errcode, &errmsg);
+        // 零拷贝入队，入队成功的从logs中移走，队列满时只重试余下的
+        if (logs->size() == 1)
+        {
+            if (_kafka_producer->produce(kafka_key, std::move((*logs)[0]), RdKafka::Topic::PARTITION_UA, &errcode, &errmsg))
+            {
+                logs->clear();
+                metric.produce_number += 1;
+            }
+        }
+        else if (logs->size() > 1)
+        {
+            metric.produce_number += _kafka_producer->produce_batch(kafka_key, logs, RdKafka::Topic::PARTITION_UA, &errcode, &errmsg);
+        }
         if (errcode == 0)
         {
-            metric.produce_number += logs.size();
+            adaptive_batch->on_success();
             break;
         }
         else
@@ -409,7 +444,32 @@ void CRedis2kafkaMover::kafka_produce(const std::vector<std::string>& logs)
         }
         else
         {
-            std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+            // 发送队列满时，以退避时长等待递送报告，腾出队列后只重试余下的
+            _kafka_producer->timed_poll(static_cast<int>(adaptive_batch->on_error()));
+        }
+    }
+}
+
+void CRedis2kafkaMover::update_lag()
+{
+    const int interval = mooon::argument::interval->value();
+    const time_t now = time(NULL);
+
+    // 每个统计间隔取一次Redis队列长度
+    if ((interval > 0) && (now - _lag_time >= interval))
+    {
+        r3c::Node node;
+        _lag_time = now;
+
+        try
+        {
+            const int64_t lag = _redis->llen(_redis_key, &node);
+            metric.lag += lag - _lag;
+            _lag = lag;
+        }
+        catch (r3c::CRedisException& ex)
+        {
+            MYLOG_ERROR("Redis llen by %s failed: %s.\n", r3c::node2string(node).c_str(), ex.str().c_str());
         }
     }
 }
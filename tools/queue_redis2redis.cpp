@@ -1,6 +1,8 @@
 // Writed by yijian on 2021/4/25
 // Move redis list from one to another
+#include <mooon/net/redis_pipeline.h>
 #include <mooon/sys/main_template.h>
+#include <mooon/sys/pipeline.h>
 #include <mooon/sys/safe_logger.h>
 #include <mooon/sys/signal_handler.h>
 #include <mooon/sys/stop_watch.h>
@@ -35,20 +37,25 @@ STRING_ARG_DEFINE(target_redis_key_prefix, "", "Key prefix of target redis list.
 INTEGER_ARG_DEFINE(int, target_redis_key_count, 1, 1, 2020, "Number of target redis list keys with the given prefix.");
 INTEGER_ARG_DEFINE(int, target_redis_timeout, 60000, 0, 86400000, "Timeout to lpush target redis in millisecond.");
 
-// 批量数，即一次批量移动多少
-INTEGER_ARG_DEFINE(int, batch, 1, 1, 100000, "Batch to move from redis to kafka.");
+// 批量数，即一次批量移动多少，
+// 有积压时从min_batch逐步增大到batch，空闲时减小到min_batch
+INTEGER_ARG_DEFINE(int, batch, 1, 1, 100000, "Max batch to move from redis to redis.");
+INTEGER_ARG_DEFINE(int, min_batch, 1, 1, 100000, "Min batch to move from redis to redis.");
+
+// 每个源队列已取出但未写入目标的最大批数，rpop和lpush重叠进行，
+// 停止时未写入的在drain_timeout内继续写，超时则被rpush回源队列
+INTEGER_ARG_DEFINE(int, max_inflight, 4, 1, 1024, "Max batches popped but not pushed of each source list.");
+INTEGER_ARG_DEFINE(int, drain_timeout, 30000, 0, 3600000, "Max time to push popped logs when stopping in millisecond.");
 
 // metric 统计间隔（单位：秒）
 INTEGER_ARG_DEFINE(int, interval, 10, 0, 3600, "Interval to count metric in seconds.");
 
 class CRedis2redisMover;
 
+// rpop、lpush次数和批量数等由各搬运者的CPipeline统计
 struct Metric
 {
-    std::atomic<uint32_t> pop_number;
-    std::atomic<uint32_t> push_number;
-    std::atomic<uint32_t> source_redis_exception_number;
-    std::atomic<uint32_t> target_redis_exception_number;
+    std::atomic<int64_t> lag; // 所有源队列的长度之和，即积压数
 } metric;
 
 class CRedis2redis: public mooon::sys::CMainHelper
@@ -62,6 +69,7 @@ private:
 
 private:
     bool init_metric_logger();
+    void get_metrics(mooon::sys::PipelineMetrics* metrics) const;
     bool start_redis2redis_movers();
     void stop_redis2redis_movers();
     void wait_redis2redis_movers();
@@ -71,6 +79,40 @@ private:
     std::vector<std::shared_ptr<CRedis2redisMover>> _redis2redis_movers;
 };
 
+// 源，在CRedisListSource基础上每个统计间隔取一次源队列长度
+class CRedis2redisSource: public mooon::net::CRedisListSource
+{
+public:
+    CRedis2redisSource(r3c::CRedisClient* redis, const std::string& key);
+    ~CRedis2redisSource();
+    virtual int fetch(int max_count, mooon::sys::PipelineBatch* batch);
+
+private:
+    void update_lag();
+
+private:
+    r3c::CRedisClient* _redis;
+    std::string _key;
+    int64_t _lag; // 本源队列的长度
+    time_t _lag_time; // 最近一次取源队列长度的时间
+};
+
+// 目标，每批随机写到一个目标队列
+class CRedis2redisSink: public mooon::sys::IPipelineSink
+{
+public:
+    CRedis2redisSink(r3c::CRedisClient* redis, unsigned int seed);
+    virtual bool write(mooon::sys::PipelineBatch* batch);
+
+private:
+    std::string get_target_redis_key();
+
+private:
+    r3c::CRedisClient* _redis;
+    std::default_random_engine _random_engine;
+};
+
+// 搬运一个源队列，rpop、lpush分别在CPipeline的源线程和写线程中进行
 class CRedis2redisMover
 {
 public:
@@ -78,26 +120,21 @@ public:
     bool start(time_t now, int index);
     void stop();
     void wait();
+    void get_metrics(mooon::sys::PipelineMetrics* metrics) const;
 
 private:
     bool init_source_redis();
     bool init_target_redis();
-    void run();
-
-private:
-    bool rpop_logs(int batch, std::vector<std::string>* logs);
-    bool lpush_logs(const std::vector<std::string>& logs);
-    std::string get_target_redis_key();
 
 private:
     int _index;
     CRedis2redis* _redis2redis;
-    std::atomic<bool> _stop;
     std::string _source_redis_key;
-    std::shared_ptr<std::thread> _move_thread;
     std::shared_ptr<r3c::CRedisClient> _source_redis;
     std::shared_ptr<r3c::CRedisClient> _target_redis;
-    std::default_random_engine _random_engine;
+    std::shared_ptr<CRedis2redisSource> _source;
+    std::shared_ptr<CRedis2redisSink> _sink;
+    std::shared_ptr<mooon::sys::CPipeline> _pipeline;
 };
 
 extern "C"
@@ -167,20 +204,30 @@ bool CRedis2redis::on_run()
     }
     else
     {
+        // CPipeline的统计为累计值，输出的是本间隔的增量
+        mooon::sys::PipelineMetrics last_metrics;
+
         while (!this->to_stop())
         {
             for (int i=0; i<interval&&!this->to_stop(); ++i)
             {
                 std::this_thread::sleep_for(std::chrono::milliseconds(1000));
             }
-            if (metric.pop_number > 0)
+
+            mooon::sys::PipelineMetrics metrics;
+            get_metrics(&metrics);
+            if (metrics.fetched_messages > last_metrics.fetched_messages)
             {
-                const uint32_t pop_number = metric.pop_number.exchange(0);
-                const uint32_t push_number = metric.push_number.exchange(0);
-                const uint32_t source_redis_exception_number = metric.source_redis_exception_number.exchange(0);
-                const uint32_t target_redis_exception_number = metric.target_redis_exception_number.exchange(0);
-                _metric_logger->log_raw("pop:%u,push:%u,source:%u,target:%u\n", pop_number, push_number, source_redis_exception_number, target_redis_exception_number);
+                const uint32_t pop_number = static_cast<uint32_t>(metrics.fetched_messages - last_metrics.fetched_messages);
+                const uint32_t push_number = static_cast<uint32_t>(metrics.written_messages - last_metrics.written_messages);
+                const uint32_t source_redis_exception_number = static_cast<uint32_t>(metrics.source_errors - last_metrics.source_errors);
+                const uint32_t target_redis_exception_number = static_cast<uint32_t>(metrics.sink_errors - last_metrics.sink_errors);
+                const uint32_t tps = push_number / interval;
+                _metric_logger->log_raw("pop:%u,push:%u,source:%u,target:%u,tps:%u,batch:%d,inflight:%u,lag:%" PRId64"\n",
+                        pop_number, push_number, source_redis_exception_number, target_redis_exception_number,
+                        tps, metrics.batch, metrics.inflight_batches, metric.lag.load());
             }
+            last_metrics = metrics;
         }
         wait_redis2redis_movers();
     }
@@ -219,6 +266,24 @@ bool CRedis2redis::init_metric_logger()
     }
 }
 
+// 汇总各搬运者的统计，batch取最大的
+void CRedis2redis::get_metrics(mooon::sys::PipelineMetrics* metrics) const
+{
+    for (auto redis2redis_mover: _redis2redis_movers)
+    {
+        mooon::sys::PipelineMetrics mover_metrics;
+        redis2redis_mover->get_metrics(&mover_metrics);
+        metrics->fetched_messages += mover_metrics.fetched_messages;
+        metrics->written_messages += mover_metrics.written_messages;
+        metrics->acked_batches += mover_metrics.acked_batches;
+        metrics->source_errors += mover_metrics.source_errors;
+        metrics->sink_errors += mover_metrics.sink_errors;
+        metrics->inflight_batches += mover_metrics.inflight_batches;
+        if (mover_metrics.batch > metrics->batch)
+            metrics->batch = mover_metrics.batch;
+    }
+}
+
 bool CRedis2redis::start_redis2redis_movers()
 {
     const time_t now = time(NULL);
@@ -262,49 +327,72 @@ void CRedis2redis::wait_redis2redis_movers()
 //
 
 CRedis2redisMover::CRedis2redisMover(CRedis2redis* redis2redis)
-    : _index(-1), _redis2redis(redis2redis), _stop(false)
+    : _index(-1), _redis2redis(redis2redis)
 {
 }
 
 bool CRedis2redisMover::start(time_t now, int index)
 {
-    try
-    {
-        _index = index;
-        _source_redis_key = mooon::utils::CStringUtils::format_string("%s%d", mooon::argument::source_redis_key_prefix->c_value(), index);
+    _index = index;
+    _source_redis_key = mooon::utils::CStringUtils::format_string("%s%d", mooon::argument::source_redis_key_prefix->c_value(), index);
 
-        if (!init_source_redis() || !init_target_redis())
+    if (!init_source_redis() || !init_target_redis())
+    {
+        return false;
+    }
+    else
+    {
+        std::vector<mooon::sys::IPipelineSink*> sinks;
+        _source.reset(new CRedis2redisSource(_source_redis.get(), _source_redis_key));
+        _sink.reset(new CRedis2redisSink(_target_redis.get(), static_cast<unsigned int>(now+index)));
+        sinks.push_back(_sink.get());
+
+        // 空闲和出错时的退避由CPipeline按CAdaptiveBatch处理
+        _pipeline.reset(new mooon::sys::CPipeline(_source.get(), sinks));
+        _pipeline->set_batch(mooon::argument::min_batch->value(), mooon::argument::batch->value());
+        _pipeline->set_max_inflight(mooon::argument::max_inflight->value());
+        _pipeline->set_drain_milliseconds(mooon::argument::drain_timeout->value());
+        if (!_pipeline->start())
         {
+            MYLOG_ERROR("Start pipeline(%d) failed\n", index);
             return false;
         }
+
+        if (_index == 0)
+            MYLOG_INFO("Redis2redisMover[%d:%s] is started now\n", _index, _source_redis_key.c_str());
         else
-        {
-            _move_thread.reset(new std::thread(&CRedis2redisMover::run, this));
-            _random_engine.seed(now+index);
-            return true;
-        }
-    }
-    catch (std::system_error& ex)
-    {
-        MYLOG_ERROR("Start move thread(%d) failed: %s\n", index, ex.what());
-        return false;
+            MYLOG_DEBUG("Redis2redisMover[%d:%s] is started now\n", _index, _source_redis_key.c_str());
+        return true;
     }
 }
 
 void CRedis2redisMover::stop()
 {
-    _stop = true;
+    if (_pipeline.get() != nullptr)
+        _pipeline->stop();
 }
 
 void CRedis2redisMover::wait()
 {
-    if (_move_thread.get() != nullptr && _move_thread->joinable())
+    if (_pipeline.get() != nullptr)
     {
-        _move_thread->join();
-        _move_thread.reset();
+        // 返回时已取出的都已写入目标，或超时后被rpush回源队列
+        _pipeline->wait();
+        _pipeline.reset();
+
+        if (_index == 0)
+            MYLOG_INFO("Redis2redisMover[%d:%s] is exited now\n", _index, _source_redis_key.c_str());
+        else
+            MYLOG_DEBUG("Redis2redisMover[%d:%s] is exited now\n", _index, _source_redis_key.c_str());
     }
 }
 
+void CRedis2redisMover::get_metrics(mooon::sys::PipelineMetrics* metrics) const
+{
+    if (_pipeline.get() != nullptr)
+        _pipeline->get_metrics(metrics);
+}
+
 bool CRedis2redisMover::init_source_redis()
 {
     try
@@ -343,90 +431,83 @@ bool CRedis2redisMover::init_target_redis()
     }
 }
 
-void CRedis2redisMover::run()
+//
+// CRedis2redisSource
+//
+
+CRedis2redisSource::CRedis2redisSource(r3c::CRedisClient* redis, const std::string& key)
+    : mooon::net::CRedisListSource(redis, key), _redis(redis), _key(key), _lag(0), _lag_time(0)
 {
-    const int batch = mooon::argument::batch->value();
+}
 
-    while (!_stop)
-    {
-        std::vector<std::string> logs(batch);
-        if (!rpop_logs(batch, &logs))
-        {
-            std::this_thread::sleep_for(std::chrono::milliseconds(1000));
-        }
-        else
-        {
-            MYLOG_DEBUG("%.*s\n", (int)logs[0].size(), logs[0].c_str());
+CRedis2redisSource::~CRedis2redisSource()
+{
+    // 撤回本源队列计入的积压数
+    metric.lag -= _lag;
+}
 
-            while (!_stop) // 重试直到成功
-            {
-                if (lpush_logs(logs))
-                    break;
-                std::this_thread::sleep_for(std::chrono::milliseconds(1000));
-            }
-        }
-    }
-    {
-        // 线程退出时记录日志
-        std::stringstream ss;
-        ss << std::this_thread::get_id();
-        if (_index == 0)
-            MYLOG_INFO("Redis2redisMover[%d:%s] is exited now\n", _index, ss.str().c_str());
-        else
-            MYLOG_DEBUG("Redis2redisMover[%d:%s] is exited now\n", _index, ss.str().c_str());
-    }
+int CRedis2redisSource::fetch(int max_count, mooon::sys::PipelineBatch* batch)
+{
+    update_lag();
+    return mooon::net::CRedisListSource::fetch(max_count, batch);
 }
 
-bool CRedis2redisMover::rpop_logs(int batch, std::vector<std::string>* logs)
+void CRedis2redisSource::update_lag()
 {
-    r3c::Node node;
+    const int interval = mooon::argument::interval->value();
+    const time_t now = time(NULL);
 
-    try
+    // 每个统计间隔取一次源队列长度
+    if ((interval > 0) && (now - _lag_time >= interval))
     {
-        int n = 0;
+        r3c::Node node;
+        _lag_time = now;
 
-        // 左进右出
-        if (batch > 1)
+        try
         {
-            n = _source_redis->rpop(_source_redis_key, logs, batch, &node);
+            const int64_t lag = _redis->llen(_key, &node);
+            metric.lag += lag - _lag;
+            _lag = lag;
         }
-        else
+        catch (r3c::CRedisException& ex)
         {
-            if (_source_redis->rpop(_source_redis_key, &(*logs)[0], &node))
-                n = 1;
+            MYLOG_ERROR("Redis llen by %s failed: %s.\n", r3c::node2string(node).c_str(), ex.str().c_str());
         }
-        metric.pop_number += n;
-        return n > 0;
-    }
-    catch (r3c::CRedisException& ex)
-    {
-        MYLOG_ERROR("Redis rpop by %s failed: %s.\n", r3c::node2string(node).c_str(), ex.str().c_str());
-        ++metric.source_redis_exception_number;
-        return true;
     }
 }
 
-bool CRedis2redisMover::lpush_logs(const std::vector<std::string>& logs)
+//
+// CRedis2redisSink
+//
+
+CRedis2redisSink::CRedis2redisSink(r3c::CRedisClient* redis, unsigned int seed)
+    : _redis(redis), _random_engine(seed)
+{
+}
+
+bool CRedis2redisSink::write(mooon::sys::PipelineBatch* batch)
 {
     const std::string target_redis_key = get_target_redis_key();
     r3c::Node node;
 
+    if (batch->messages.empty())
+        return true;
     try
     {
         // 左进右出
-        _target_redis->lpush(target_redis_key, logs, &node);
-        metric.push_number += logs.size();
+        MYLOG_DEBUG("%.*s\n", (int)batch->messages[0].size(), batch->messages[0].c_str());
+        _redis->lpush(target_redis_key, batch->messages, &node);
         return true;
     }
     catch (r3c::CRedisException& ex)
     {
+        // 返回false后由CPipeline退避重试
         MYLOG_ERROR("Redis lpush by %s failed: %s.\n", r3c::node2string(node).c_str(), ex.str().c_str());
-        ++metric.target_redis_exception_number;
         return false;
     }
 }
 
-std::string CRedis2redisMover::get_target_redis_key()
+std::string CRedis2redisSink::get_target_redis_key()
 {
     std::uniform_int_distribution<int> u(0, mooon::argument::target_redis_key_count->value()-1);
     const int n = u(_random_engine) % mooon::argument::target_redis_key_count->value();
@@ -20,13 +20,26 @@
 //
 // 运行示例：
 // r3c_stress --redis=192.168.0.88:6379 --requests=100000 --threads=20
+//
+// 指定--mix时为负载模式，按指定的命令比例和目标QPS持续施压，定时输出各命令的延迟分布：
+// r3c_stress --redis=192.168.0.88:6379 --mix=get:80,set:20 --qps=50000 --duration=60 --threads=8 --distribution=zipf
 #include <r3c/r3c.h>
+#include <hiredis/hiredis.h>
 #include <mooon/sys/atomic.h>
 #include <mooon/sys/stop_watch.h>
 #include <mooon/sys/thread_engine.h>
 #include <mooon/sys/utils.h>
 #include <mooon/utils/args_parser.h>
+#include <mooon/utils/latency_histogram.h>
 #include <mooon/utils/string_utils.h>
+#include <mooon/utils/tokener.h>
+#include <math.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
 
 // 运行模式，如果是清理，需要保持参数和测试时相同
 INTEGER_ARG_DEFINE(uint8_t, test, 1, 0, 1, "1: test, 0: clean test data");
@@ -40,6 +53,17 @@ INTEGER_ARG_DEFINE(uint8_t, verbose, 0, 0, 1, "print error");
 INTEGER_ARG_DEFINE(uint8_t, increments, 10, 1, 100, "number of increments for hmincrby");
 INTEGER_ARG_DEFINE(uint16_t, value_length, 10, 1, std::numeric_limits<uint16_t>::max(), "length of value");
 
+// 负载模式
+// 命令及权重，可用的命令有：get、set、setex、hget、hset、lpush和rpop，如：get:80,set:20
+STRING_ARG_DEFINE(mix, "", "command mix of load mode, e.g. get:80,set:20");
+INTEGER_ARG_DEFINE(uint32_t, qps, 0, 0, 100000000, "target qps of all threads, 0 for as fast as possible");
+INTEGER_ARG_DEFINE(uint32_t, duration, 0, 0, 86400, "seconds to run, 0 for running number of requests");
+INTEGER_ARG_DEFINE(uint32_t, keys, 100000, 1, 1000000000, "number of keys");
+STRING_ARG_DEFINE(distribution, "uniform", "key distribution: uniform or zipf");
+DOUBLE_ARG_DEFINE(zipf_theta, 0.99, 0.01, 0.999, "skew of zipf distribution");
+INTEGER_ARG_DEFINE(uint16_t, pipeline, 1, 1, 1000, "pipeline depth, only for single redis node if greater than 1");
+INTEGER_ARG_DEFINE(uint16_t, report_interval, 1, 1, 3600, "interval to report in seconds");
+
 static atomic_t sg_success = 0;
 static atomic_t sg_failure = 0;
 static atomic_t sg_not_exists = 0;
@@ -69,6 +93,8 @@ static void hmincrby_stress_thread(uint8_t index);
 static void lpush_stress_thread(uint8_t index);
 static void rpop_stress_thread(uint8_t index);
 
+static int load_main();
+
 int main(int argc, char* argv[])
 {
     std::string errmsg;
@@ -81,6 +107,11 @@ int main(int argc, char* argv[])
         exit(1);
     }
 
+    if (!mooon::argument::mix->value().empty())
+    {
+        return load_main();
+    }
+
     try
     {
         // KV
@@ -807,3 +838,564 @@ void rpop_stress_thread(uint8_t index)
         fprintf(stderr, "[%s] %s\n", __FUNCTION__, ex.str().c_str());
     }
 }
+
+////////////////////////////////////////////////////////////////////////////////
+// 负载模式
+//
+// 开环（open-loop）压测：按--qps给每个请求定好计划发送时间，延迟从计划时间开始算，
+// 服务端变慢导致请求排队时，排队的时间也计入延迟，避免“协调遗漏”（coordinated omission）使延迟被严重低估；
+// 不指定--qps时为闭环，尽可能快地发送，延迟从实际发送时间开始算。
+//
+// --pipeline大于1时直接使用hiredis的管道（一次发送多个请求再依次读取响应），
+// 因为r3c是同步接口，这时--redis只能是单个节点，对于集群会收到MOVED错误。
+
+enum LoadCommand
+{
+    LC_GET,
+    LC_SET,
+    LC_SETEX,
+    LC_HGET,
+    LC_HSET,
+    LC_LPUSH,
+    LC_RPOP,
+    LC_MAX
+};
+
+static const char* sg_command_names[LC_MAX] = { "get", "set", "setex", "hget", "hset", "lpush", "rpop" };
+
+struct CommandStat
+{
+    std::atomic<uint64_t> success;
+    std::atomic<uint64_t> not_found; // 读到空值
+    std::atomic<uint64_t> failure;
+};
+
+// 每个线程的每个命令一个直方图，由汇报线程加锁合并，
+// 工作线程之间不共享，锁几乎没有竞争
+struct ThreadHistograms
+{
+    std::mutex lock;
+    mooon::utils::CLatencyHistogram histograms[LC_MAX];
+};
+
+static CommandStat sg_command_stats[LC_MAX];
+static std::vector<std::pair<int, LoadCommand> > sg_mix; // 累计权重和命令
+static int sg_mix_total = 0;
+static std::atomic<bool> sg_load_stop(false);
+
+// YCSB的Zipf生成器（Gray等，Quickly Generating Billion-Record Synthetic Databases），
+// 构造时需O(n)计算zeta，之后next为常数时间，构造后只读，可多线程共用
+class CZipfGenerator
+{
+public:
+    CZipfGenerator(uint64_t n, double theta)
+        : _n(n), _theta(theta)
+    {
+        const double zeta2 = zeta(2, theta);
+        _zetan = zeta(n, theta);
+        _alpha = 1.0 / (1.0 - theta);
+        _eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / _zetan);
+        _half_pow_theta = 1.0 + pow(0.5, theta);
+    }
+
+    // u为[0, 1)之间的均匀随机数，返回[0, n)，越小的值越热
+    uint64_t next(double u) const
+    {
+        const double uz = u * _zetan;
+        if (uz < 1.0)
+            return 0;
+        if (uz < _half_pow_theta)
+            return 1;
+
+        const uint64_t value = static_cast<uint64_t>(_n * pow(_eta*u - _eta + 1.0, _alpha));
+        return (value >= _n)? _n-1: value;
+    }
+
+private:
+    static double zeta(uint64_t n, double theta)
+    {
+        double sum = 0.0;
+        for (uint64_t i=1; i<=n; ++i)
+            sum += 1.0 / pow(static_cast<double>(i), theta);
+        return sum;
+    }
+
+private:
+    uint64_t _n;
+    double _theta;
+    double _zetan;
+    double _alpha;
+    double _eta;
+    double _half_pow_theta;
+};
+
+static std::shared_ptr<CZipfGenerator> sg_zipf;
+
+static uint64_t now_nanoseconds()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+static bool parse_mix()
+{
+    std::vector<std::string> tokens;
+    mooon::utils::CTokener::split(&tokens, mooon::argument::mix->value(), ",", true);
+
+    for (std::vector<std::string>::size_type i=0; i<tokens.size(); ++i)
+    {
+        const std::string::size_type pos = tokens[i].find(':');
+        const std::string name = tokens[i].substr(0, pos);
+        int weight = 1;
+        int command = 0;
+
+        if ((pos != std::string::npos) && (!mooon::utils::CStringUtils::string2int(tokens[i].substr(pos+1).c_str(), weight) || (weight < 0)))
+        {
+            fprintf(stderr, "invalid weight: %s\n", tokens[i].c_str());
+            return false;
+        }
+        for (; command<LC_MAX; ++command)
+        {
+            if (name == sg_command_names[command])
+                break;
+        }
+        if (LC_MAX == command)
+        {
+            fprintf(stderr, "unknown command: %s\n", name.c_str());
+            return false;
+        }
+        if (weight > 0)
+        {
+            sg_mix_total += weight;
+            sg_mix.push_back(std::make_pair(sg_mix_total, static_cast<LoadCommand>(command)));
+        }
+    }
+
+    if (0 == sg_mix_total)
+    {
+        fprintf(stderr, "empty mix: %s\n", mooon::argument::mix->c_value());
+        return false;
+    }
+    return true;
+}
+
+// 生成一个请求的参数（第一个为命令名）
+static void make_load_request(LoadCommand command, uint64_t key_index, const std::string& value, std::vector<std::string>* args)
+{
+    const char* prefix = mooon::argument::prefix->c_value();
+
+    args->clear();
+    switch (command)
+    {
+    case LC_GET:
+        args->push_back("GET");
+        args->push_back(mooon::utils::CStringUtils::format_string("%s_%" PRIu64, prefix, key_index));
+        break;
+    case LC_SET:
+        args->push_back("SET");
+        args->push_back(mooon::utils::CStringUtils::format_string("%s_%" PRIu64, prefix, key_index));
+        args->push_back(value);
+        break;
+    case LC_SETEX:
+        args->push_back("SETEX");
+        args->push_back(mooon::utils::CStringUtils::format_string("%s_%" PRIu64, prefix, key_index));
+        args->push_back(mooon::utils::CStringUtils::int_tostring(mooon::argument::expire->value()));
+        args->push_back(value);
+        break;
+    case LC_HGET: // 每个哈希100个字段
+        args->push_back("HGET");
+        args->push_back(mooon::utils::CStringUtils::format_string("%s_hash_%" PRIu64, prefix, key_index/100));
+        args->push_back(mooon::utils::CStringUtils::int_tostring(key_index%100));
+        break;
+    case LC_HSET:
+        args->push_back("HSET");
+        args->push_back(mooon::utils::CStringUtils::format_string("%s_hash_%" PRIu64, prefix, key_index/100));
+        args->push_back(mooon::utils::CStringUtils::int_tostring(key_index%100));
+        args->push_back(value);
+        break;
+    case LC_LPUSH: // 共16个队列
+        args->push_back("LPUSH");
+        args->push_back(mooon::utils::CStringUtils::format_string("%s_queue_%" PRIu64, prefix, key_index%16));
+        args->push_back(value);
+        break;
+    default:
+        args->push_back("RPOP");
+        args->push_back(mooon::utils::CStringUtils::format_string("%s_queue_%" PRIu64, prefix, key_index%16));
+        break;
+    }
+}
+
+// 通过r3c执行，返回false表示读到空值，出错抛出CRedisException
+static bool execute_by_r3c(r3c::CRedisClient* redis, LoadCommand command, const std::vector<std::string>& args)
+{
+    std::string value;
+
+    switch (command)
+    {
+    case LC_GET:
+        return redis->get(args[1], &value);
+    case LC_SET:
+        redis->set(args[1], args[2]);
+        return true;
+    case LC_SETEX:
+        redis->setex(args[1], args[3], mooon::argument::expire->value());
+        return true;
+    case LC_HGET:
+        return redis->hget(args[1], args[2], &value);
+    case LC_HSET:
+        redis->hset(args[1], args[2], args[3]);
+        return true;
+    case LC_LPUSH:
+        redis->lpush(args[1], args[2]);
+        return true;
+    default:
+        return redis->rpop(args[1], &value);
+    }
+}
+
+class CLoadThread
+{
+public:
+    CLoadThread(uint8_t index)
+        : _index(index), _redis_context(NULL), _failed(false)
+    {
+    }
+
+    ~CLoadThread()
+    {
+        if (_redis_context != NULL)
+            redisFree(_redis_context);
+    }
+
+    ThreadHistograms* get_histograms() { return &_histograms; }
+    // 连接失败或管道连接不可用时，本线程提前结束
+    bool is_failed() const { return _failed; }
+
+    void run();
+
+private:
+    LoadCommand next_command(std::mt19937_64& random_engine);
+    uint64_t next_key(std::mt19937_64& random_engine);
+    bool connect_redis();
+    // 以管道方式发送requests中的请求，并读取响应，连接不可用时返回false
+    bool pipeline_execute(int count, const uint64_t* intended_nanoseconds);
+    void record(LoadCommand command, uint64_t intended_nanoseconds, int result);
+
+private:
+    uint8_t _index;
+    std::shared_ptr<r3c::CRedisClient> _redis;
+    redisContext* _redis_context;
+    std::vector<LoadCommand> _commands;
+    std::vector<std::vector<std::string> > _requests;
+    ThreadHistograms _histograms;
+    bool _failed;
+};
+
+void CLoadThread::run()
+{
+    const uint32_t qps = mooon::argument::qps->value();
+    const uint16_t depth = mooon::argument::pipeline->value();
+    const uint64_t interval_nanoseconds = (0 == qps)? 0: static_cast<uint64_t>(1000000000.0 * mooon::argument::threads->value() / qps);
+    const uint64_t max_requests = (mooon::argument::duration->value() > 0)? std::numeric_limits<uint64_t>::max(): mooon::argument::requests->value();
+    const std::string value(mooon::argument::value_length->value(), '*');
+    std::mt19937_64 random_engine(now_nanoseconds() + _index);
+    std::vector<uint64_t> intended_nanoseconds(depth);
+    uint64_t next_nanoseconds = now_nanoseconds() + (interval_nanoseconds * _index) / mooon::argument::threads->value(); // 错开各线程
+    uint64_t requests = 0;
+
+    if (!connect_redis())
+    {
+        _failed = true;
+        return;
+    }
+
+    _commands.resize(depth);
+    _requests.resize(depth);
+    while (!sg_load_stop && (requests < max_requests))
+    {
+        if ((interval_nanoseconds > 0) && (next_nanoseconds > now_nanoseconds()))
+            std::this_thread::sleep_for(std::chrono::nanoseconds(next_nanoseconds - now_nanoseconds()));
+
+        // 取出已到计划发送时间的请求，最多depth个，落后于计划时立即发送
+        int count = 0;
+        const uint64_t now = now_nanoseconds();
+        while ((count < depth) && (requests < max_requests))
+        {
+            if (interval_nanoseconds > 0)
+            {
+                if ((count > 0) && (next_nanoseconds > now))
+                    break;
+                intended_nanoseconds[count] = next_nanoseconds;
+                next_nanoseconds += interval_nanoseconds;
+            }
+            else
+            {
+                intended_nanoseconds[count] = now;
+            }
+
+            _commands[count] = next_command(random_engine);
+            make_load_request(_commands[count], next_key(random_engine), value, &_requests[count]);
+            ++count;
+            ++requests;
+        }
+
+        if (_redis_context != NULL)
+        {
+            // 只结束本线程，其它线程继续压测
+            if (!pipeline_execute(count, &intended_nanoseconds[0]))
+            {
+                _failed = true;
+                break;
+            }
+        }
+        else
+        {
+            try
+            {
+                const bool found = execute_by_r3c(_redis.get(), _commands[0], _requests[0]);
+                record(_commands[0], intended_nanoseconds[0], found? 1: 0);
+            }
+            catch (r3c::CRedisException& ex)
+            {
+                record(_commands[0], intended_nanoseconds[0], -1);
+                if (1 == mooon::argument::verbose->value())
+                    fprintf(stderr, "%s [%s] ERROR: %s\n", sg_command_names[_commands[0]], _requests[0][1].c_str(), ex.str().c_str());
+            }
+        }
+    }
+}
+
+LoadCommand CLoadThread::next_command(std::mt19937_64& random_engine)
+{
+    const int n = static_cast<int>(random_engine() % sg_mix_total);
+    for (std::vector<std::pair<int, LoadCommand> >::size_type i=0; i<sg_mix.size(); ++i)
+    {
+        if (n < sg_mix[i].first)
+            return sg_mix[i].second;
+    }
+    return sg_mix.back().second;
+}
+
+uint64_t CLoadThread::next_key(std::mt19937_64& random_engine)
+{
+    if (sg_zipf.get() != NULL)
+        return sg_zipf->next(std::uniform_real_distribution<double>(0.0, 1.0)(random_engine));
+    else
+        return random_engine() % mooon::argument::keys->value();
+}
+
+bool CLoadThread::connect_redis()
+{
+    try
+    {
+        if (1 == mooon::argument::pipeline->value())
+        {
+            _redis.reset(new r3c::CRedisClient(mooon::argument::redis->value()));
+            return true;
+        }
+
+        const std::string& node = mooon::argument::redis->value();
+        const std::string::size_type pos = node.find(':');
+        struct timeval timeout = { 2, 0 };
+        int port = 6379;
+
+        if ((pos != std::string::npos) && !mooon::utils::CStringUtils::string2int(node.substr(pos+1).c_str(), port))
+        {
+            fprintf(stderr, "invalid redis node: %s\n", node.c_str());
+            return false;
+        }
+        _redis_context = redisConnectWithTimeout(node.substr(0, pos).c_str(), port, timeout);
+        if ((NULL == _redis_context) || (_redis_context->err != 0))
+        {
+            fprintf(stderr, "connect %s failed: %s\n", node.c_str(), (NULL == _redis_context)? "no memory": _redis_context->errstr);
+            return false;
+        }
+        return true;
+    }
+    catch (r3c::CRedisException& ex)
+    {
+        fprintf(stderr, "[%s] %s\n", __FUNCTION__, ex.str().c_str());
+        return false;
+    }
+}
+
+bool CLoadThread::pipeline_execute(int count, const uint64_t* intended_nanoseconds)
+{
+    for (int i=0; i<count; ++i)
+    {
+        const std::vector<std::string>& args = _requests[i];
+        const char* argv[4];
+        size_t argvlen[4];
+
+        for (std::vector<std::string>::size_type j=0; j<args.size(); ++j)
+        {
+            argv[j] = args[j].data();
+            argvlen[j] = args[j].size();
+        }
+        redisAppendCommandArgv(_redis_context, static_cast<int>(args.size()), argv, argvlen);
+    }
+
+    for (int i=0; i<count; ++i)
+    {
+        void* reply = NULL;
+
+        if (redisGetReply(_redis_context, &reply) != REDIS_OK)
+        {
+            // 连接已不可用，余下的都算失败
+            for (; i<count; ++i)
+                record(_commands[i], intended_nanoseconds[i], -1);
+            fprintf(stderr, "[LOAD-%d] pipeline ERROR: %s\n", _index, _redis_context->errstr);
+            return false;
+        }
+
+        const redisReply* redis_reply = static_cast<const redisReply*>(reply);
+        if (REDIS_REPLY_ERROR == redis_reply->type)
+        {
+            record(_commands[i], intended_nanoseconds[i], -1);
+            if (1 == mooon::argument::verbose->value())
+                fprintf(stderr, "%s [%s] ERROR: %.*s\n", sg_command_names[_commands[i]], _requests[i][1].c_str(), static_cast<int>(redis_reply->len), redis_reply->str);
+        }
+        else
+        {
+            record(_commands[i], intended_nanoseconds[i], (REDIS_REPLY_NIL == redis_reply->type)? 0: 1);
+        }
+        freeReplyObject(reply);
+    }
+    return true;
+}
+
+// result为1表示成功，为0表示读到空值，为-1表示出错
+void CLoadThread::record(LoadCommand command, uint64_t intended_nanoseconds, int result)
+{
+    const uint64_t now = now_nanoseconds();
+    const uint64_t latency_microseconds = (now > intended_nanoseconds)? (now - intended_nanoseconds) / 1000: 0;
+
+    if (1 == result)
+        ++sg_command_stats[command].success;
+    else if (0 == result)
+        ++sg_command_stats[command].not_found;
+    else
+        ++sg_command_stats[command].failure;
+
+    std::unique_lock<std::mutex> lock(_histograms.lock);
+    _histograms.histograms[command].record(latency_microseconds);
+}
+
+// 合并各线程的直方图，并清零它们
+static void collect_histograms(std::vector<std::shared_ptr<CLoadThread> >& load_threads, mooon::utils::CLatencyHistogram* histograms)
+{
+    for (std::vector<std::shared_ptr<CLoadThread> >::size_type i=0; i<load_threads.size(); ++i)
+    {
+        ThreadHistograms* thread_histograms = load_threads[i]->get_histograms();
+        std::unique_lock<std::mutex> lock(thread_histograms->lock);
+
+        for (int command=0; command<LC_MAX; ++command)
+        {
+            histograms[command].merge(thread_histograms->histograms[command]);
+            thread_histograms->histograms[command].reset();
+        }
+    }
+}
+
+static void print_histogram(const char* title, const char* command_name, const mooon::utils::CLatencyHistogram& histogram, double seconds, uint64_t not_found, uint64_t failure)
+{
+    fprintf(stdout, "%s %s: ops=%" PRIu64", qps=%.0f, mean=%" PRIu64"us, p50=%" PRIu64"us, p90=%" PRIu64"us, p99=%" PRIu64"us, p999=%" PRIu64"us, max=%" PRIu64"us, not_found=%" PRIu64", failure=%" PRIu64"\n",
+            title, command_name, histogram.get_count(), (seconds > 0)? histogram.get_count() / seconds: 0.0,
+            histogram.get_mean(), histogram.get_percentile(50.0), histogram.get_percentile(90.0),
+            histogram.get_percentile(99.0), histogram.get_percentile(99.9), histogram.get_max(),
+            not_found, failure);
+}
+
+int load_main()
+{
+    if (!parse_mix())
+        exit(1);
+    if ((mooon::argument::pipeline->value() > 1) && (mooon::argument::redis->value().find(',') != std::string::npos))
+    {
+        fprintf(stderr, "--pipeline only supports single redis node\n");
+        exit(1);
+    }
+    if (mooon::argument::distribution->value() == "zipf")
+    {
+        sg_zipf.reset(new CZipfGenerator(mooon::argument::keys->value(), mooon::argument::zipf_theta->value()));
+    }
+    else if (mooon::argument::distribution->value() != "uniform")
+    {
+        fprintf(stderr, "unknown distribution: %s\n", mooon::argument::distribution->c_value());
+        exit(1);
+    }
+
+    std::vector<std::shared_ptr<CLoadThread> > load_threads;
+    std::vector<std::thread> threads;
+    std::atomic<int> running_threads(mooon::argument::threads->value());
+    for (uint8_t i=0; i<mooon::argument::threads->value(); ++i)
+    {
+        load_threads.push_back(std::shared_ptr<CLoadThread>(new CLoadThread(i)));
+        CLoadThread* load_thread = load_threads.back().get();
+        threads.push_back(std::thread([load_thread, &running_threads] { load_thread->run(); --running_threads; }));
+    }
+
+    // 定时输出本周期的延迟分布，结束后输出总的
+    const uint64_t begin_nanoseconds = now_nanoseconds();
+    const uint64_t end_nanoseconds = begin_nanoseconds + static_cast<uint64_t>(mooon::argument::duration->value()) * 1000000000;
+    mooon::utils::CLatencyHistogram total_histograms[LC_MAX];
+    uint64_t last_not_found[LC_MAX] = { 0 };
+    uint64_t last_failure[LC_MAX] = { 0 };
+    uint64_t last_nanoseconds = begin_nanoseconds;
+    while (running_threads > 0)
+    {
+        for (int i=0; (i<mooon::argument::report_interval->value()*10) && (running_threads>0); ++i)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            if ((mooon::argument::duration->value() > 0) && (now_nanoseconds() >= end_nanoseconds))
+                sg_load_stop = true;
+        }
+        if (sg_load_stop)
+            break; // 剩余的计入总的
+
+        const uint64_t now = now_nanoseconds();
+        const double seconds = (now - last_nanoseconds) / 1000000000.0;
+        const std::string title = mooon::utils::CStringUtils::format_string("[%.0fs]", (now - begin_nanoseconds) / 1000000000.0);
+        mooon::utils::CLatencyHistogram histograms[LC_MAX];
+
+        last_nanoseconds = now;
+        collect_histograms(load_threads, histograms);
+        for (int command=0; command<LC_MAX; ++command)
+        {
+            if (histograms[command].get_count() > 0)
+            {
+                const uint64_t not_found = sg_command_stats[command].not_found;
+                const uint64_t failure = sg_command_stats[command].failure;
+                print_histogram(title.c_str(), sg_command_names[command], histograms[command], seconds, not_found-last_not_found[command], failure-last_failure[command]);
+                last_not_found[command] = not_found;
+                last_failure[command] = failure;
+                total_histograms[command].merge(histograms[command]);
+            }
+        }
+        fflush(stdout);
+    }
+
+    for (std::vector<std::thread>::size_type i=0; i<threads.size(); ++i)
+        threads[i].join();
+
+    const double seconds = (now_nanoseconds() - begin_nanoseconds) / 1000000000.0;
+    collect_histograms(load_threads, total_histograms);
+    fprintf(stdout, "\n");
+    for (int command=0; command<LC_MAX; ++command)
+    {
+        if (total_histograms[command].get_count() > 0)
+            print_histogram("[total]", sg_command_names[command], total_histograms[command], seconds, sg_command_stats[command].not_found, sg_command_stats[command].failure);
+    }
+
+    int failed_threads = 0;
+    for (std::vector<std::shared_ptr<CLoadThread> >::size_type i=0; i<load_threads.size(); ++i)
+    {
+        if (load_threads[i]->is_failed())
+            ++failed_threads;
+    }
+    if (failed_threads > 0)
+    {
+        fprintf(stderr, "%d/%d load threads failed\n", failed_threads, static_cast<int>(load_threads.size()));
+        return 1;
+    }
+    return 0;
+}